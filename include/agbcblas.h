@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #ifndef AGBCBLAS_H //header guard
 #define AGBCBLAS_H
+#include <pthread.h>
 
 float agb_cblas_sdot11(int n,float *x,float*y);
 float agb_cblas_sasum1(int n,float *x);
@@ -29,6 +30,22 @@ void agb_cblas_saxpym11(int n,float a,float *x,float *y);
 void agb_cblas_saxpy1(int n,float a,float *x,int incx,float *y);
 void agb_cblas_sgemvRowNN1N101(int n, float *a, float *x,float *y);
 void agb_cblas_sgemvColMN1M111(int m, int n, float *a,float *x,float *y);
+void agb_cblas_sgemvColMN1M111Tiled(int m, int n, float *a,float *x,float *y);
+void agb_cblas_mvmInit(void);
+int agb_cblas_mvmBatchCols(void);
+//storage formats for agb_cblas_sgemvColMN1M111TiledLP
+#define AGBMVM_FP32 0
+#define AGBMVM_BF16 1
+#define AGBMVM_FP16 2
+#define AGBMVM_INT8 3
+int agb_cblas_mvmElSize(int fmt);
+int agb_cblas_mvmConvert(int fmt,int m,int n,float *a,void *out,float *scale);
+void agb_cblas_sgemvColMN1M111TiledLP(int fmt,int m,int n,void *a,float *scale,float *x,float *y);
+//block sparse column storage, for agb_cblas_sgemvColMN1M111BSC
+#define AGBBSC_ROWS 16
+int agb_cblas_bscFromDense(int m,int n,float *a,float thresh,int *colptr,int *rowblk,float *val);
+int agb_cblas_bscFromCsc(int m,int n,int *csc,long size,int *colptr,int *rowblk,float *val);
+void agb_cblas_sgemvColMN1M111BSC(int m,int n,int *colptr,int *rowblk,float *val,float *x,float *y);
 void agb_cblas_sgemvColMN1M101(int m, int n, float *a,float *x,float *y);
 void agb_cblas_sgemvRowMNm1N111(int m,int n, float *a,float *x,float *y);
 void agb_cblas_sgemvRowMN1N1m11(int m,int n, float *a, float *x,float *y);
@@ -36,7 +53,37 @@ void agb_cblas_sgemvRowMN1N101(int m,int n, float *a, float *x,float *y);
 void agb_cblas_sgemvRowMN1N111(int m, int n, float *a,float *x,float *y);
 void agb_cblas_sgemvRowMN1L101(int m, int n, float *a,int l,float*x,float*y);
 void agb_cblas_sgemvRowMN1L111(int m, int n, float *a,int l,float*x,float*y);
+void agb_cblas_sgemvRowMNL(int m,int n,float alpha,float *a,int l,float *x,float beta,float *y);
 void agb_cblas_sparse_csr_sgemvRowMN1N101(int m,int n, int *a, float *x,float *y);
+void agb_cblas_sparse_csrpair_sgemvRowMN1N101(int m,int *indptr,int *pairs,float *x,float *y);
+void agb_cblas_sparse_cscpair_sgemvColMN1M111(int n,int *indptr,int *pairs,float *x,float *y);
+//A team of helper threads which, with the calling thread (member 0), run fn for each job, e.g. for reconpcg and reconneural.
+typedef void (*agbTeamFn)(void *data,int w,int *sense);
+typedef struct agbTeamHelper agbTeamHelper;
+typedef struct{
+  char *name;//for messages.
+  agbTeamFn fn;
+  void *data;
+  int nHelpersReq;//as last requested.
+  int nHelpers;//number running.
+  unsigned int *helperAffin;//copy of the affinity they were started with.
+  int helperAffinSize;
+  int started;
+  agbTeamHelper *helper;
+  int teamGen;
+  int teamQuit;
+  int teamSleeping;
+  int barCount;
+  int barSense;
+  int sense;//barrier sense of the calling thread.
+  pthread_mutex_t teamMutex;
+  pthread_cond_t teamCond;
+}agbTeam;
+int agb_cblas_teamInit(agbTeam *team,char *name,agbTeamFn fn,void *data);
+void agb_cblas_teamFree(agbTeam *team);
+int agb_cblas_teamCheck(agbTeam *team,int nHelpers,unsigned int *affin,int affinElSize);
+void agb_cblas_teamRun(agbTeam *team);
+void agb_cblas_teamBarrier(agbTeam *team,int *sense);
 #ifdef USEICC
 inline void agb_cblas_32sgemvColMN1M111(int m, int n, void *a, float *x, float *y);
 inline void agb_cblas_16sgemvColMN1M111(int m, int n, void *a, float *x, float *y);
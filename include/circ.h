@@ -39,7 +39,9 @@ sizeof(darc_futex_t) bytes FUTEX(cb) (((darc_futex_t*)(&cb->mem[64])))
 
 
 The data then uysed to be frame number array, time array, data array.
-This has changed to: 4 bytes of size, 4 bytes of frameno, 8 bytes of time, 1 bytes dtype, 15 bytes spare then the data, this is repeated for each circular buffer entry - ie they all have a mini header... makes it easier for moving a raw frame about... 
+This has changed to: 4 bytes of size, 4 bytes of frameno, 8 bytes of time, 1 bytes dtype, 3 bytes spare, 4 bytes sequence, 8 bytes spare then the data, this is repeated for each circular buffer entry - ie they all have a mini header... makes it easier for moving a raw frame about... 
+
+The sequence CIRCSEQ(cb,indx) is a seqlock for the entry: it is odd while the writer is filling the entry, and 2*n when it holds the nth entry written.  So a reader can check that an entry wasn't overwritten while it was reading it (circCheckFrame, circCopyFrame), and how many entries it has missed.  It is 0 if the writer doesn't maintain it, in which case no checking is done.  The python Circular class maintains it too, continuing from the sequence of the last entry written, and readers also check the frame number, in case an entry has been rewritten without its sequence changing.
 
 Then, if LATESTBUFOFFSET(cb)!=0, at this many bytes into the circular buffer, we start another circular buffer for the header data.  This commences with a mini header: the size, lastwritten, nstore, 
 */
@@ -73,6 +75,9 @@ typedef struct {
   char dtypeSave;//only used when a reader
   int addRequired;
   darc_futex_t *futex;
+  unsigned int nwritten;//only used by the owner - the number of entries written, for CIRCSEQ.
+  unsigned int lastReceivedSeq;//used when a reader - CIRCSEQ of the entry last received.
+  int nOverrun;//used when a reader - number of entries missed because the writer overtook us.
 }circBuf;
 #define BUFSIZE(cb) (*((long*)cb->mem))
 #define LASTWRITTEN(cb) (*((int*)&(cb->mem[8])))
@@ -94,9 +99,11 @@ typedef struct {
 
 #define CIRCFRAMENO(cb,indx) *((int*)(&(((char*)cb->data)[indx*cb->frameSize+4])))
 #define CIRCDATASIZE(cb,indx) *((int*)(&(((char*)cb->data)[indx*cb->frameSize])))
+#define CIRCSEQ(cb,indx) *((unsigned int*)(&(((char*)cb->data)[indx*cb->frameSize+20])))
 
 #define MSGDEC 1//used for receiver sending new decimation
 #define MSGCONTIG 2//or contiguous value to sender.
+#define MSGCODEC 3//or the compression stages accepted (see telcodec.h).
 
 #define ALIGN 8
 #define HSIZE 32 //NOW DEPRECIATED - USE CIRCHSIZE INSTEAD.
@@ -114,11 +121,19 @@ int circAddSize(circBuf *cb,void *data,int size,int setzero,double timestamp,int
 int circAddSizeForce(circBuf *cb,void *data,int size,int setzero,double timestamp,int frameno);//adds data (size-bytes) to a buffer, whether requested or not, and publishes.
 int circInsert(circBuf *cb,void* data,int size, int offset);//inserts data of size-bytes into a buffer, at offset, but doesn't publish (a subsequent call to circAddSize should then be made to publish - potentially with a size of 0).
 void *circGetNextFrame(circBuf *cb,float ftimeout,int retry);
+int circCheckFrame(circBuf *cb);//0 if the entry last received hasn't since been overwritten, otherwise the number of entries it has been overrun by.
+int circCopyFrame(circBuf *cb,void *dest,int size);//copies the entry last received (with its mini header) and checks it - returns as circCheckFrame.
+void circSeqBegin(circBuf *cb,int indx);//for writers that fill an entry themselves, rather than with circAdd.
+void *circReserveSlot(circBuf *cb);//zero copy add: returns the data of the next entry, for the caller to fill...
+int circCommitSlot(circBuf *cb,double timestamp,int frameno);//...and then publish it.
+void circSeqEnd(circBuf *cb,int indx);
 int circHeaderUpdated(circBuf *cb);
 void *circGetLatestFrame(circBuf *cb);
 void *circGetFrame(circBuf *cb,int indx);
 circBuf* circOpenBufReader(char *name);
 circBuf* openCircBuf(char *name,int nd,int *dims,char dtype,int nstore);
+void circSetShmPlacement(int huge,int numaNode);//huge pages/numa node for shared memory subsequently opened (numaNode -1 for default).
+int circShmPrepare(char *name,char *buf,long size,int numaNode);//places (as above) and clears a new shared memory mapping.
 void circClose(circBuf *cb);//should be called by the owner (writer) of the buf
 int circCloseBufReader(circBuf *cb);//called on value returned from circOpenBufReader();
 int circCalcHdrSize();
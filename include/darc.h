@@ -154,6 +154,33 @@ typedef struct{
   PostComputeData post;
 }PreComputeData;
 
+#define TELEMETRYNSTREAM 10 //one for each of the circAddFlags bits.
+#define TELEMETRYNBUF 4 //entries that can be waiting, per stream.
+/**
+   A telemetry stream whose circular buffer is written by the telemetry thread (telemetryDefer), rather than in the frame path.  The RTC copies each entry into the next of a small ring of private buffers, and the telemetry thread then publishes it.
+*/
+typedef struct{
+  circBuf *cb[TELEMETRYNBUF];//the buffer that each entry is for.
+  void *data[TELEMETRYNBUF];
+  int memsize[TELEMETRYNBUF];
+  int size[TELEMETRYNBUF];
+  double timestamp[TELEMETRYNBUF];
+  int frameno[TELEMETRYNBUF];
+  int ready[TELEMETRYNBUF];//set by the RTC when an entry is filled, cleared by the telemetry thread once published.
+  int head;//next entry to be filled (RTC)
+  int tail;//next entry to be published (telemetry thread)
+  int ndropped;//entries dropped because the telemetry thread was behind.
+}TelemetryStream;
+
+typedef struct{
+  TelemetryStream stream[TELEMETRYNSTREAM];
+  pthread_mutex_t mutex;//held by the telemetry thread while publishing, and by the RTC when it needs the circular buffers to itself (priority inheritance).
+  darc_futex_t futex;//incremented to wake the telemetry thread.
+  int waiting;//the telemetry thread is (about to be) asleep.
+  int go;
+  pthread_t threadid;
+}TelemetryWriter;
+
 
 /**
    holds info relevent for one camera (ie one frame grabber), common to all the threads processing for this camera
@@ -193,6 +220,10 @@ typedef struct{//one array for each camera, double buffered...
   darc_mutex_t startInfoMutex;//mutex obtained during buffer swap
   int threadInfoCount;//used during buffer swap to determine if this is the first thread for this camera.
   int frameFinished;//[2];
+  int *chunkList;//used if subapScheduling!=0: 5 ints per chunk of subaps (cursubindx,nsubapsProcessing,nsubapsDoing,centindx,pxlCnt), computed at buffer swap.
+  int nchunks;//number of chunks in chunkList.
+  int chunkListSize;//allocated size of chunkList (in chunks).
+  volatile int chunkCursor;//next chunk to be claimed - incremented atomically, reset at end of frame.
   int *subapLocation;//either points to realSubapLocation or is own array, when using adaptive windowing.
   //float *centWeighting;
   //float *dmCommand;//this is float here, but converted to int for actsSent.
@@ -289,6 +320,7 @@ typedef struct{//info shared between all threads.
   int threadCount;//[2];
   int threadCountFinished;//[2];
   arrayStruct *arrays;//[2];
+  float *calpxlbufMem;//the calibrated pixel array, when arrays->calpxlbuf isn't an rtcCalPxlBuf entry.
   int niters;
   paramBuf *buffer[2];//the SHM buffer containing all the config data.
   int curBuf;
@@ -381,6 +413,8 @@ typedef struct{//info shared between all threads.
   int (*camNewFrameSyncFn)(CAMNEWFRAMESYNCARGS);
   int (*camWaitPixelsFn)(CAMWAITPIXELSARGS);
   int (*camComputePixelsFn)(CAMCOMPUTEPIXELSARGS);
+  int (*camPixelsReadyFn)(CAMPIXELSREADYARGS);
+  volatile int *camPxlsReady;//array of ncam pixel counters owned by the camera library, or NULL.
   int (*camNewParamFn)(CAMNEWPARAMARGS);
   int (*camStartFrameFn)(CAMSTARTFRAMEARGS);
   int (*camEndFrameFn)(CAMENDFRAMEARGS);
@@ -409,6 +443,7 @@ typedef struct{//info shared between all threads.
   int (*centNewFrameSyncFn)(SLOPENEWFRAMESYNCARGS);
   int (*centStartFrameFn)(SLOPESTARTFRAMEARGS);
   int (*centCalcSlopeFn)(SLOPECALCSLOPEARGS);
+  int (*centCalcSlopeBatchFn)(SLOPECALCSLOPEBATCHARGS);
   int (*centEndFrameFn)(SLOPEENDFRAMEARGS);
   int (*centFrameFinishedSyncFn)(SLOPEFRAMEFINISHEDSYNCARGS);
   int (*centFrameFinishedFn)(SLOPEFRAMEFINISHEDARGS);
@@ -425,6 +460,7 @@ typedef struct{//info shared between all threads.
   int (*calibrateNewFrameFn)(CALIBRATENEWFRAMEARGS);//void *calibrateHandle,unsigned int frameno);
   int (*calibrateNewFrameSyncFn)(CALIBRATENEWFRAMESYNCARGS);//void *calibrateHandle,unsigned int frameno);//subap thread (once/iter).
   int (*calibrateStartFrameFn)(CALIBRATESTARTFRAMEARGS);//void *calibrateHandle,int cam,int threadno);
+  int (*calibrateNewSubapBatchFn)(CALIBRATENEWSUBAPBATCHARGS);
   int (*calibrateNewSubapFn)(CALIBRATENEWSUBAPARGS);//void *calibrateHandle,int cam,int threadno,int cursubindx,float **subap, int *subapSize,int *curnpxlx,int *curnpxly);
   int (*calibrateEndFrameFn)(CALIBRATEENDFRAMEARGS);//void *calibrateHandle,int cam,int threadno,int err);
   int (*calibrateFrameFinishedSyncFn)(CALIBRATEFRAMEFINISHEDSYNCARGS);//void *calibrateHandle,int err);
@@ -511,9 +547,12 @@ typedef struct{//info shared between all threads.
   darc_futex_t frameRunningFutex;
   char *mainGITID;
   int *subapAllocationArr;
+  int subapScheduling;//0 for mutex queue, 1 for atomic chunk dispatch, 2 for dispatch in order of pixel arrival (ignored if subapAllocation set).
   int *adapWinShiftCnt;
   int resetAdaptiveWin;
   int circAddFlags;
+  int telemetryDeferFlags;//streams (circAddFlags bits) published by the telemetry thread.
+  TelemetryWriter *telemetry;
   int forceWriteAll;
   int rtcErrorBufNStore;
   int rtcPxlBufNStore;
@@ -579,6 +618,8 @@ typedef struct{
   int nsubs;//number of subapertures that must arrived before the centroiding livbrary can continue.
   int frameFinished;
   int err;//an error has occurred during processing.
+  int *batchIndx;//for the batch calls: subap indices, slope indices and subapInfo (3 per subap), each part batchSize long.
+  int batchSize;
 }threadStruct;
 
 
@@ -593,6 +634,7 @@ int getSwitchRequested(globalStruct *globals);
 int prepareActuators(globalStruct *glob);
 int processFrame(threadStruct *threadInfo);
 int figureThread(PostComputeData *p);
+void *telemetryThread(void *glob);
 void setGITID(globalStruct *glob);
 int openLibraries(globalStruct *glob,int getlock);
 
@@ -105,8 +105,10 @@ typedef enum{
     SUBAPFLAG,
     SUBAPLOCTYPE,
     SUBAPLOCATION,
+    SUBAPSCHEDULING,
     SWITCHREQUESTED,
     SWITCHTIME,//readonly - the time at which the param buffer was last swapped - useful for saving status.
+    TELEMETRYDEFER,//telemetry streams written by the telemetry thread rather than in the frame path.
     THREADAFFELSIZE,
     THREADAFFINITY,
     THREADPRIORITY,
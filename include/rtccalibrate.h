@@ -35,6 +35,8 @@ int calibrateNewFrameSync(CALIBRATENEWFRAMESYNCARGS);//subap thread (once).  Cal
 int calibrateStartFrame(CALIBRATESTARTFRAMEARGS);//subap thread (once per thread).  May be called before or after calibrateNewFrame, depending on how threads get scheduled.  Always called after calibrateNewFrameSync.
 #define CALIBRATENEWSUBAPARGS void *calibrateHandle,int cam,int threadno,int cursubindx,float **subap,int *subapSize,int *curnpxlx,int *curnpxly
 int calibrateNewSubap(CALIBRATENEWSUBAPARGS);//subap thread
+#define CALIBRATENEWSUBAPBATCHARGS void *calibrateHandle,int cam,int threadno,int nsubaps,int *subapIndx,float **subap,int *subapSize,int *subapInfo
+int calibrateNewSubapBatch(CALIBRATENEWSUBAPBATCHARGS);//subap thread.  Optional.  Calibrates the nsubaps valid subaps listed in subapIndx into *subap (reallocating if too small), and fills subapInfo with offset,npxly,npxlx for each.  Used instead of calibrateNewSubap if the slope library has slopeCalcSlopeBatch.
 #define CALIBRATEENDFRAMEARGS void *calibrateHandle,int cam,int threadno,int err
 int calibrateEndFrame(CALIBRATEENDFRAMEARGS);//subap thread (once per thread)
 #define CALIBRATEFRAMEFINISHEDSYNCARGS void *calibrateHandle,int err,int forcewrite
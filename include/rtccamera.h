@@ -138,5 +138,15 @@ extern "C"
 #endif
 int camComputePixels(CAMCOMPUTEPIXELSARGS);//subap thread (lots of times) - can compute number of pixels required.
 
+/**
+   Optional.  Called once after camOpen.  Should set *pxlsReady to an array (of size ncam) owned by the library, each entry of which holds the number of pixels of the current frame that have arrived for that camera.  These should be reset to zero in camNewFrameSync, and should only increase during a frame.  If an error occurs, the entry can be set to the number of pixels for that camera.
+   When subapScheduling==2, darc spins on these until the pixels it needs have arrived, and then calls camWaitPixels (which should then not block) to do the transfer.  So the values are advisory - camWaitPixels must still behave correctly if it is called early.
+*/
+#define CAMPIXELSREADYARGS void *camHandle,volatile int **pxlsReady
+#ifdef __cplusplus
+extern "C"
+#endif
+int camPixelsReady(CAMPIXELSREADYARGS);//called once after opening.
+
 
 #endif //header guard
\ No newline at end of file
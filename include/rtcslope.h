@@ -67,6 +67,11 @@ int slopeStartFrame(SLOPESTARTFRAMEARGS);
 */
 #define SLOPECALCSLOPEARGS void *slopeHandle,int cam,int threadno,int nsubs,float *subap, int subapSize,int subindx,int slopeindx,int curnpxlx,int curnpxly
 int slopeCalcSlope(SLOPECALCSLOPEARGS);//subap thread
+/**
+   Optional batch version of slopeCalcSlope, used with calibrateNewSubapBatch.  The nsubaps subaps in subapIndx should have their slopes placed at slopeIndx.  subapInfo holds the offset into subap, npxly and npxlx of each.
+*/
+#define SLOPECALCSLOPEBATCHARGS void *slopeHandle,int cam,int threadno,int nsubs,int nsubaps,int *subapIndx,int *slopeIndx,float *subap,int subapSize,int *subapInfo
+int slopeCalcSlopeBatch(SLOPECALCSLOPEBATCHARGS);//subap thread
 #define SLOPEENDFRAMEARGS void *slopeHandle,int cam,int threadno,int err
 int slopeEndFrame(SLOPEENDFRAMEARGS);//subap thread (once per thread)
 #define SLOPEFRAMEFINISHEDSYNCARGS void *slopeHandle,int err,int forcewrite
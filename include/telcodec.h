@@ -0,0 +1,53 @@
+/*
+darc, the Durham Adaptive optics Real-time Controller.
+Copyright (C) 2010 Alastair Basden.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+Lossless compression of telemetry frames, used between sender and receiver.
+A codec is a combination of stages, applied in this order when encoding:
+delta:   difference with the previous frame sent (zigzag encoded integer subtraction, or xor for floating point types).
+pack16:  4 byte integers stored as 16 bits (only used for frames where every value fits).
+shuffle: bitshuffle - bit planes of the elements stored contiguously, so that constant bits become runs of zero bytes.
+rle:     zero run length encoding.
+A stage that can't be applied to a given frame (e.g. delta for the first frame) is skipped, and the stages used are sent with each frame.
+*/
+#ifndef TELCODEC_H
+#define TELCODEC_H
+
+#define CODECDELTA 1
+#define CODECPACK16 2
+#define CODECSHUFFLE 4
+#define CODECRLE 8
+#define CODECALL 15//all the stages supported by this version.
+#define CODECDEFAULT (CODECDELTA|CODECSHUFFLE|CODECRLE)
+
+typedef struct{
+  char *prev;//the previous frame (for delta).
+  int prevSize;//its size, or 0 if not valid (the next frame is a key frame).
+  int prevSizeMem;
+  char *tmp[2];//workspace.
+  int tmpSize;
+}codecState;
+
+int codecParse(char *str);//comma separated stage names to flags, or -1 on error.
+char *codecName(int codec,char *buf,int n);//flags to names.
+int codecMaxSize(int nbytes);//max size of an encoded frame.
+int codecEncode(codecState *cs,int codec,char dtype,char *data,int nbytes,char *out,int *outsize);//returns the stages actually used, and the encoded size in outsize.  Updates the previous frame.
+int codecDecode(codecState *cs,int codec,char dtype,char *in,int insize,char *data,int nbytes);//codec is the stages used by codecEncode.  Returns 0 on success.  Updates the previous frame.
+int codecKeep(codecState *cs,char *data,int nbytes);//for frames sent uncompressed - just updates the previous frame.
+void codecReset(codecState *cs);//the next frame is a key frame.
+void codecFree(codecState *cs);
+#endif
@@ -100,7 +100,7 @@ class Check:
         elif label in ["cameraName","mirrorName","comment","slopeName","figureName","version","configfile"]:
             if type(val)!=type(""):
                 raise Exception(label)
-        elif label in ["reconName","calibrateName","bufferName"]:
+        elif label in ["reconName","calibrateName","bufferName","telemetryDefer"]:
             if type(val) not in [type(""),type(None)]:
                 raise Exception(label)
         elif label=="centroidMode":
@@ -127,7 +127,7 @@ class Check:
             if type(val)!=type(None) and type(val)!=numpy.ndarray:
                 print "ERROR in val for %s: %s"%(label,str(val))
                 raise Exception(label)
-        elif label in ["closeLoop","nacts","thresholdAlgo","delay","maxClipped","camerasFraming","camerasOpen","mirrorOpen","clearErrors","frameno","corrThreshType","nsubapsTogether","nsteps","addActuators","recordCents","averageImg","averageCent","kalmanPhaseSize","figureOpen","printUnused","reconlibOpen","currentErrors","xenicsExposure","calibrateOpen","iterSource","bufferOpen","bufferUseSeq","subapLocType","noPrePostThread","asyncReset","openLoopIfClip","threadAffElSize","mirrorStep","mirrorUpdate","mirrorReset","mirrorGetPos","mirrorDoMidRange","lqgPhaseSize","lqgActSize"]:
+        elif label in ["closeLoop","nacts","thresholdAlgo","delay","maxClipped","camerasFraming","camerasOpen","mirrorOpen","clearErrors","frameno","corrThreshType","corrFFTPlan","reconPipeline","reconmxBatch","reconmxFormat","reconmxNuma","reconmxSparse","reconmxValidate","nsubapsTogether","nsteps","addActuators","recordCents","averageImg","averageCent","kalmanPhaseSize","figureOpen","printUnused","reconlibOpen","currentErrors","xenicsExposure","calibrateOpen","iterSource","bufferOpen","bufferUseSeq","subapLocType","subapScheduling","noPrePostThread","asyncReset","openLoopIfClip","threadAffElSize","mirrorStep","mirrorUpdate","mirrorReset","mirrorGetPos","mirrorDoMidRange","lqgPhaseSize","lqgActSize","pcgFixedIter","pcgNThreads","pcgPipelined","annFormat","annNThreads","dicureNStrips"]:
             val=int(val)
         elif label in ["dmDescription"]:
             if val.dtype.char!="h":
@@ -242,7 +242,7 @@ class Check:
                     print "maxAdapOffset",val
                     print "maxAdapOffset should be int or array of ints of size equal to number of valid subaps %s"%str(type(val))
                     raise
-        elif label in ["powerFactor","adaptiveWinGain","corrThresh","figureGain","uEyeFrameRate","uEyeExpTime"]:
+        elif label in ["powerFactor","adaptiveWinGain","corrThresh","figureGain","uEyeFrameRate","uEyeExpTime","reconmxSpThresh"]:
             val=float(val)
         elif label=="bleedGain":
             if type(val)==numpy.ndarray:
@@ -250,6 +250,11 @@ class Check:
                     val=val.astype('f')
             else:
                 val=float(val)
+        elif label=="dicureGain":
+            if type(val)==numpy.ndarray:
+                val=self.checkArray(val,buf.get("nacts"),"f")
+            else:
+                val=float(val)
         elif label=="bleedGroups":
             val=self.checkNoneOrArray(val,buf.get("nacts"),"i")
         elif label in ["switchTime"]:
@@ -257,7 +262,10 @@ class Check:
         elif label in ["fakeCCDImage"]:
             val=self.checkNoneOrArray(val,(buf.get("npxlx")*buf.get("npxly")).sum(),"f")
         elif label in ["centroidWeight"]:
-            val=self.checkNoneOrFloat(val)
+            if type(val)==numpy.ndarray:
+                val=self.checkNoneOrArray(val,(buf.get("npxlx")*buf.get("npxly")).sum(),"f")
+            else:
+                val=self.checkNoneOrFloat(val)
         elif label in ["gainE","E"]:
             if val is None:
                 pass
@@ -270,7 +278,17 @@ class Check:
                 else:#lazy - this doesn't check for nslopes,nacts...
                     val=self.checkArray(val,(buf.get("nacts"),buf.get("nacts")),"f")
         elif label in ["gainReconmxT"]:
-            val=self.checkArray(val,(buf.get("subapFlag").sum()*2,buf.get("nacts")),"f")
+            nslopes=buf.get("subapFlag").sum()*2
+            if type(val)==numpy.ndarray and len(val.shape)==1 and val.dtype==numpy.float32 and val.size!=nslopes*buf.get("nacts"):
+                #sparse: indptr (nslopes+1), then (index,value) pairs, as pcgB in reconpcg.
+                indptr=val[:nslopes+1].view(numpy.int32) if val.size>nslopes else None
+                if indptr is None or indptr[0]!=0 or numpy.any(numpy.diff(indptr)<0) or val.size!=nslopes+1+2*indptr[-1]:
+                    raise Exception("gainReconmxT should be shape (nslopes,nacts), or sparse with indptr of size nslopes+1 followed by 2*nnz values")
+                indx=val[nslopes+1::2].view(numpy.int32)
+                if indx.size>0 and (indx.min()<0 or indx.max()>=buf.get("nacts")):
+                    raise Exception("gainReconmxT sparse indices out of range")
+            else:
+                val=self.checkArray(val,(buf.get("subapFlag").sum()*2,buf.get("nacts")),"f")
         elif label in ["kalmanAtur"]:
             val=self.checkArray(val,(buf.get("kalmanPhaseSize"),buf.get("kalmanPhaseSize")),"f")
         elif label in ["kalmanInvN"]:
@@ -318,8 +336,14 @@ class Check:
             val=self.checkNoneOrArray(val,None,"i")
         elif label in ["decayFactor"]:
             val=self.checkNoneOrArray(val,buf.get("nacts"),"f")
+        elif label in ["dicureGrid"]:
+            val=self.checkArray(val,2,"i")
+        elif label in ["dicureSubapLoc"]:
+            val=self.checkArray(val,buf.get("subapFlag").sum(),"i")
+        elif label in ["dicureActMap"]:
+            val=self.checkArray(val,buf.get("nacts"),"i")
         elif label in ["rmx"]:
-            if val is None and buf.get("reconName") not in ["libreconpcg.so","libreconneural.so","libreconLQG.so","libreconcure.so"]:
+            if val is None and buf.get("reconName") not in ["libreconpcg.so","libreconneural.so","libreconLQG.so","libreconcure.so","librecondicure.so"]:
                 raise Exception("rmx is None")
             elif val is not None:
                 val=self.checkArray(val,(buf.get("nacts"),buf.get("subapFlag").sum()*2),"f",raiseShape=1)
@@ -345,6 +369,14 @@ class Check:
                     raise Exception("threadAffinity error (size not multiple of %d)"%(buf.get("ncamThreads").sum()+1))
             else:
                 raise Exception("threadAffinity error (should be an array, or None)")
+        elif label in ["pcgThreadAffin","annThreadAffin"]:
+            if val is None:
+                pass
+            elif type(val)==numpy.ndarray:
+                if val.dtype!="i":
+                    val=val.astype("i")
+            else:
+                raise Exception("%s error (should be an array, or None)"%label)
         elif label in ["threadPriority"]:
             val=self.checkNoneOrArray(val,buf.get("ncamThreads").sum()+1,"i")
         elif label in ["corrFFTPattern","corrPSF"]:
@@ -689,6 +721,14 @@ class Check:
         self.checkAdd(c,"corrThreshType",0,comments)
         self.checkAdd(c,"corrThresh",0,comments)
         self.checkAdd(c,"corrFFTPattern",None,comments)
+        self.checkAdd(c,"corrFFTPlan",1,comments)
+        self.checkAdd(c,"reconPipeline",0,comments)
+        self.checkAdd(c,"reconmxBatch",0,comments)
+        self.checkAdd(c,"reconmxFormat",0,comments)
+        self.checkAdd(c,"reconmxNuma",0,comments)
+        self.checkAdd(c,"reconmxSparse",1,comments)
+        self.checkAdd(c,"reconmxSpThresh",0.,comments)
+        self.checkAdd(c,"reconmxValidate",0,comments)
         #self.checkAdd(c,"nsubapsTogether",1,comments)
         self.checkAdd(c,"nsteps",0,comments)
         self.checkAdd(c,"closeLoop",1,comments)
@@ -738,6 +778,8 @@ class Check:
         self.checkAdd(c,"bufferUseSeq",0,comments)
         self.checkAdd(c,"noPrePostThread",0,comments)
         self.checkAdd(c,"subapAllocation",None,comments)
+        self.checkAdd(c,"subapScheduling",0,comments)
+        self.checkAdd(c,"telemetryDefer",None,comments)
         self.checkAdd(c,"decayFactor",None,comments)
         self.checkAdd(c,"openLoopIfClip",0,comments)
         self.checkAdd(c,"adapWinShiftCnt",None,comments)
@@ -650,6 +650,7 @@ class Circular:
         self.raw=raw
         self.lastReceived=-1#last frame received...
         self.lastReceivedFrame=-1
+        self.nwritten=0#number of entries written, for the entry sequence (CIRCSEQ in circ.h).
         if owner==1:
             self.hdrsize=getCircHeaderSize()
             if dims==None or dtype==None or nstore==None:
@@ -770,14 +771,21 @@ class Circular:
         if (self.freq[0]>0 and frameno%self.freq[0]==0) or self.forcewrite[0]!=0:#add to the buffer
             if self.forcewrite[0]>0:
                 self.forcewrite[0]-=1
-            indx=self.lastWritten[0]+1
+            lw=self.lastWritten[0]
+            indx=lw+1
             if(indx>=self.nstore[0]):
                 indx=0
+            #Keep the entry sequence as the C writers do (odd while writing, then even), carrying on from the last entry, in case that was written by C.
+            if lw>=0 and lw<self.nstore[0]:
+                self.nwritten=max(self.nwritten,int(self.seq[lw])//2)
+            self.nwritten=self.nwritten%0x7fffffff+1
+            self.seq[indx]=2*self.nwritten-1
             self.data[indx]=data.view(self.data.dtype.char)
             self.datasizearr[indx]=self.datasize*self.elsize+32-4
             self.frameNo[indx]=frameno
             self.timestamp[indx]=timestamp
             self.datatype[indx]=data.dtype.char
+            self.seq[indx]=2*self.nwritten
             self.lastWritten[0]=indx
             utils.darc_futex_broadcast(self.futex)
         return 0
@@ -863,6 +871,9 @@ class Circular:
             f=d.view("i")
             f.shape=self.nstore[0],f.shape[0]/self.nstore[0]
             self.frameNo=f[:,1]
+            q=d.view("I")
+            q.shape=self.nstore[0],q.shape[0]/self.nstore[0]
+            self.seq=q[:,5]
             d=d.view(self.dtype[0])
             d.shape=self.nstore[0],d.shape[0]/self.nstore[0]
             start=32/d.itemsize
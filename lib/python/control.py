@@ -80,6 +80,8 @@ class Control:
         self.bufsize=None
         self.nhdr=None
         self.numaSize=0
+        self.shmHuge=0
+        self.shmNode=None
         self.circBufMaxMemSize=None
         self.nstoreDict={}
         affin=0x7fffffff
@@ -119,6 +121,10 @@ class Control:
                 self.circBufMaxMemSize=eval(options.circBufMemSize)
             if options.numaSize!=None:
                 self.numaSize=eval(options.numaSize)
+            if options.shmHuge:
+                self.shmHuge=1
+            if options.shmNode!=None:
+                self.shmNode=int(options.shmNode)
             self.configFile = options.configfile
 
         if self.redirectcontrol:
@@ -261,6 +267,10 @@ class Control:
                         plist.append("-s%s"%self.shmPrefix)
                     if self.numaSize!=0:
                         plist.append("-N%d"%self.numaSize)
+                    if self.shmHuge:
+                        plist.append("-H")
+                    if self.shmNode!=None:
+                        plist.append("-M%d"%self.shmNode)
                     for st in self.nstoreDict.keys():#circular buffer sizes
                         plist+=["-c",st,"%d"%self.nstoreDict[st]]
                     try:
@@ -2132,6 +2142,8 @@ if __name__=="__main__":
     parser.add_argument('-m', '--circBufMemSize', dest='circBufMemSize', type=str, help='Memory for circular buffers', default=None)
     parser.add_argument('-C', '--cleanstart', dest='cleanStart', action='store_true', help='Remove /dev/shm/*rtcParam[1,2] befpre starting', default=False)
     parser.add_argument('-N', '--numaSize', dest='numaSize', type=str,help='numa memory buffer size',default=None)
+    parser.add_argument('--hugepages', dest='shmHuge', action='store_true', help='Use huge pages for the parameter and circular buffers', default=False)
+    parser.add_argument('--shmNode', dest='shmNode', type=str, help='NUMA node for the parameter and circular buffers', default=None)
     (options, unknown) = parser.parse_known_args()
     controlName="Control"
 
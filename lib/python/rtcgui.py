@@ -301,7 +301,7 @@ class RtcGui:
                            "Centroid mode":"Source of centroids",
                            "slopeName":"Name in centroid .so library",
                            "slopeParams":"Parameters to send to centroid .so library",
-                           "centroidWeight":"Weighting factor to apply to each pixel (currently does nothing)",
+                           "centroidWeight":"Weighting image to apply to each pixel for a weighted CoG, or None",
                            "Centroid window mode":"Fixed or Adaptive (moving windows)",
                            "clearErrors":"Used by GUI to remove errors in RTC",
                            "comment":"Optional comment to be saved with RTC buffer",
@@ -313,6 +313,26 @@ class RtcGui:
                            "E":"Matrix used in the tomographic open loop reconstruction algorithm",
                            "fakeCCDImage":"A fake image that can be specified, for testing purposes",
                            "corrFFTPattern":"Correlation pattern for spot images when using correlation centroiding (see correlation.py to get in correct format)",
+                           "corrFFTPlan":"FFTW planning effort for correlation: 0 estimate, 1 measure, 2 patient",
+                           "reconPipeline":"If >0, threads add their partial DM command into dmCommand after this many slopes, overlapping with readout",
+                           "reconmxBatch":"If >0, reconmvm gathers this many slopes before doing the MVM (-1 to suit the kernel)",
+                           "reconmxFormat":"Storage of gainReconmxT for the MVM: 0 fp32, 1 bf16, 2 fp16, 3 int8",
+                           "reconmxNuma":"If 1, reconmvm copies each thread's part of gainReconmxT to the thread's numa node",
+                           "reconmxSparse":"Block sparse gainReconmxT: 0 never, 1 if it streams less data, 2 always",
+                           "reconmxSpThresh":"Blocks of gainReconmxT no larger than this are treated as zero by reconmxSparse",
+                           "pcgFixedIter":"If >0, reconpcg does exactly this many iterations each frame",
+                           "pcgNThreads":"Number of helper threads for the reconpcg iterations",
+                           "pcgPipelined":"If 1, reconpcg uses pipelined pcg, with one synchronisation per iteration",
+                           "pcgThreadAffin":"Affinity of the reconpcg helper threads, shape pcgNThreads,n",
+                           "annFormat":"Storage of annWeights for reconneural: 0 fp32, 1 bf16, 2 fp16, 3 int8",
+                           "annNThreads":"Number of helper threads for the reconneural layers",
+                           "annThreadAffin":"Affinity of the reconneural helper threads, shape annNThreads,n",
+                           "dicureActMap":"Subaperture corner (row*(nx+1)+col) of each actuator for recondicure, or -1",
+                           "dicureGain":"Gain applied to the recondicure phase, scalar or per actuator",
+                           "dicureGrid":"Subaperture grid ny,nx for recondicure",
+                           "dicureNStrips":"Number of strips integrated in parallel by recondicure (default number of threads)",
+                           "dicureSubapLoc":"Grid position (row*nx+col) of each subaperture for recondicure, or -1",
+                           "reconmxValidate":"If >0, print the DM error due to reconmxFormat every this many frames",
                            "flatField":"The flat field image",
                            "frameno":"The frame number that the buffer was last swapped over in the RTC",
                            "gain":"The gain for each actuator, shape nacts",
@@ -337,7 +357,9 @@ class RtcGui:
                            "subapFlag":"An array containing the flags to decide which subaperture should be used",
                            "subapAllocation":"Array determining which threads process which subaps (or None)",
                            "subapLocation":"Array determining which pixels are assigned to a given subap",
+                           "subapScheduling":"0 to hand out subaps to threads in turn (using a mutex), 1 to let threads claim precomputed chunks of subaps atomically, 2 to do this in order of pixel arrival.  Ignored if subapAllocation is set.",
                            "switchTime":"Time at which RTC last switched buffer",
+                           "telemetryDefer":"Names of telemetry streams (e.g. \"rtcCentBuf rtcStatusBuf\") written by a separate telemetry thread rather than in the frame path, or None",
                            "threadAffinity":"array of thread affinity (which threads run on which processors",
                            "threadPriority":"Array of thread priority (usually only works if run by root)",
                            "thresholdAlgo":"To determine which threshold algorithm is used",
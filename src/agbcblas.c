@@ -18,8 +18,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //Important for performance - compile with -O3 and -funroll-loops andmaybe -msse2 and -mfpmath=sse or -mfpmath=both (experimental gcc option - seems to give slightly different results - different rounding or something) -march=native
 //gcc -Wall -O3 -c -o agbcblas.o agbcblas.c -lgslcblas -funroll-loops -msse2 -mfpmath=sse -march=native
 //#include <string.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //for pthread_setaffinity_np
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 #include "agbcblas.h"
-#ifdef USEICC
+#if (defined(__x86_64__)||defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define AGBMVMSIMD
+#endif
+#if defined(USEICC) || defined(AGBMVMSIMD)
 #include <immintrin.h>
 #endif
 
@@ -312,6 +325,830 @@ inline void agb_cblas_sgemvRowMN1L111(int m, int n, float *a,int l,float*x,float
 }
 
 
+//Register blocked, cache tiled version of agb_cblas_sgemvColMN1M111.
+//The actuator (row) dimension is cut into tiles small enough that the
+//partial y stays in L1, and within a tile MVMCOLS columns are accumulated
+//in registers before y is written back, so y is touched once per MVMCOLS
+//columns rather than once per column.  Each element of y still sees the
+//columns in order, using fma, so the scalar/AVX2/AVX-512 versions agree.
+#define MVMCOLS 8
+static int agbMvmRows=0;//row tile, set by agb_cblas_mvmInit().
+static int agbMvmCols=MVMCOLS;
+static void (*agbMvmFn)(int m,int n,int lda,const float *a,const float *x,float *y);
+static const char *agbMvmName="scalar";
+static void (*agbMvmLPFn[4])(int m,int n,int lda,const void *a,const float *scale,const float *x,float *y);
+static void (*agbBscFn)(int m,int np,const int *colptr,const int *rowblk,const float *val,const float *x,float *y);
+
+static void mvmTileScalar(int m,int n,int lda,const float *a,const float *x,float *y){
+  int i,j,k,nc;
+  float tmp;
+  const float *aj;
+  for(j=0;j<n;j+=MVMCOLS){
+    nc=n-j<MVMCOLS?n-j:MVMCOLS;
+    aj=&a[(long)j*lda];
+    for(i=0;i<m;i++){
+      tmp=y[i];
+      for(k=0;k<nc;k++)
+	tmp+=aj[(long)k*lda+i]*x[j+k];
+      y[i]=tmp;
+    }
+  }
+}
+
+#ifdef AGBMVMSIMD
+__attribute__((target("avx2,fma"))) static void mvmTileAvx2(int m,int n,int lda,const float *a,const float *x,float *y){
+  int i,j,k,nc;
+  const float *aj;
+  __m256 xv[MVMCOLS],acc0,acc1;
+  __m256i mask;
+  for(j=0;j<n;j+=MVMCOLS){
+    nc=n-j<MVMCOLS?n-j:MVMCOLS;
+    aj=&a[(long)j*lda];
+    for(k=0;k<nc;k++)
+      xv[k]=_mm256_set1_ps(x[j+k]);
+    if(nc==MVMCOLS){
+      for(i=0;i+16<=m;i+=16){
+	acc0=_mm256_loadu_ps(&y[i]);
+	acc1=_mm256_loadu_ps(&y[i+8]);
+	for(k=0;k<MVMCOLS;k++){
+	  acc0=_mm256_fmadd_ps(_mm256_loadu_ps(&aj[(long)k*lda+i]),xv[k],acc0);
+	  acc1=_mm256_fmadd_ps(_mm256_loadu_ps(&aj[(long)k*lda+i+8]),xv[k],acc1);
+	}
+	_mm256_storeu_ps(&y[i],acc0);
+	_mm256_storeu_ps(&y[i+8],acc1);
+      }
+    }else
+      i=0;
+    for(;i<m;i+=8){
+      mask=_mm256_cmpgt_epi32(_mm256_set1_epi32(m-i),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+      acc0=_mm256_maskload_ps(&y[i],mask);
+      for(k=0;k<nc;k++)
+	acc0=_mm256_fmadd_ps(_mm256_maskload_ps(&aj[(long)k*lda+i],mask),xv[k],acc0);
+      _mm256_maskstore_ps(&y[i],mask,acc0);
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void mvmTileAvx512(int m,int n,int lda,const float *a,const float *x,float *y){
+  int i,j,k,nc;
+  const float *aj;
+  __m512 xv[MVMCOLS],acc0,acc1;
+  __mmask16 mask;
+  for(j=0;j<n;j+=MVMCOLS){
+    nc=n-j<MVMCOLS?n-j:MVMCOLS;
+    aj=&a[(long)j*lda];
+    for(k=0;k<nc;k++)
+      xv[k]=_mm512_set1_ps(x[j+k]);
+    if(nc==MVMCOLS){
+      for(i=0;i+32<=m;i+=32){
+	acc0=_mm512_loadu_ps(&y[i]);
+	acc1=_mm512_loadu_ps(&y[i+16]);
+	for(k=0;k<MVMCOLS;k++){
+	  acc0=_mm512_fmadd_ps(_mm512_loadu_ps(&aj[(long)k*lda+i]),xv[k],acc0);
+	  acc1=_mm512_fmadd_ps(_mm512_loadu_ps(&aj[(long)k*lda+i+16]),xv[k],acc1);
+	}
+	_mm512_storeu_ps(&y[i],acc0);
+	_mm512_storeu_ps(&y[i+16],acc1);
+      }
+    }else
+      i=0;
+    for(;i<m;i+=16){
+      mask=m-i>=16?0xffff:(__mmask16)((1<<(m-i))-1);
+      acc0=_mm512_maskz_loadu_ps(mask,&y[i]);
+      for(k=0;k<nc;k++)
+	acc0=_mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask,&aj[(long)k*lda+i]),xv[k],acc0);
+      _mm512_mask_storeu_ps(&y[i],mask,acc0);
+    }
+  }
+}
+#endif
+
+//Reduced precision storage of a column major matrix, for the bandwidth
+//bound MVM.  bf16 and fp16 are stored as 16 bit values and widened to float
+//in registers.  int8 has a scale per column, which is folded into x.
+static inline float bf16ToFloat(unsigned short h){
+  union{unsigned int u;float f;}v;
+  v.u=((unsigned int)h)<<16;
+  return v.f;
+}
+static inline unsigned short floatToBf16(float f){
+  union{unsigned int u;float f;}v;
+  v.f=f;
+  if((v.u&0x7fffffff)>0x7f800000)//nan
+    return (v.u>>16)|0x40;
+  v.u+=0x7fff+((v.u>>16)&1);//round to nearest even
+  return v.u>>16;
+}
+static inline float halfToFloat(unsigned short h){
+  union{unsigned int u;float f;}v;
+  unsigned int sign=((unsigned int)(h&0x8000))<<16;
+  unsigned int ex=(h>>10)&0x1f;
+  unsigned int man=h&0x3ff;
+  if(ex==0){//zero or subnormal
+    v.f=(float)man*(1.f/16777216.f);//man*2^-24
+    v.u|=sign;
+  }else if(ex==31){
+    v.u=sign|0x7f800000|(man<<13);
+  }else{
+    v.u=sign|((ex+112)<<23)|(man<<13);
+  }
+  return v.f;
+}
+static inline unsigned short floatToHalf(float f){
+  union{unsigned int u;float f;}v;
+  unsigned int sign,ex,man,half,rem;
+  v.f=f;
+  sign=(v.u>>16)&0x8000;
+  ex=(v.u>>23)&0xff;
+  man=v.u&0x7fffff;
+  if(ex==0xff)//inf or nan
+    return sign|0x7c00|(man!=0?0x200:0);
+  if(ex>142)//overflow
+    return sign|0x7c00;
+  if(ex<113){//subnormal half, or zero.
+    if(ex<102)
+      return sign;
+    man|=0x800000;
+    half=man>>(126-ex);
+    rem=man&((1u<<(126-ex))-1);
+    if(rem>(1u<<(125-ex)) || (rem==(1u<<(125-ex)) && (half&1)))
+      half++;
+    return sign|half;
+  }
+  half=((ex-112)<<10)|(man>>13);
+  rem=man&0x1fff;
+  if(rem>0x1000 || (rem==0x1000 && (half&1)))
+    half++;//may carry into the exponent, which is correct.
+  return sign|half;
+}
+
+int agb_cblas_mvmElSize(int fmt){
+  switch(fmt){
+  case AGBMVM_BF16:
+  case AGBMVM_FP16:
+    return 2;
+  case AGBMVM_INT8:
+    return 1;
+  default:
+    return 4;
+  }
+}
+
+int agb_cblas_mvmConvert(int fmt,int m,int n,float *a,void *out,float *scale){
+  /*Convert column major a (m by n, lda==m) to fmt, into out.
+    For AGBMVM_INT8, scale (size n) is set to the per-column scale.
+    Returns the number of values that overflowed (fp16 only).
+  */
+  int i,j;
+  long pos;
+  int noverflow=0;
+  float mx,inv;
+  unsigned short *o16=(unsigned short*)out;
+  signed char *o8=(signed char*)out;
+  long q;
+  for(j=0;j<n;j++){
+    pos=(long)j*m;
+    switch(fmt){
+    case AGBMVM_BF16:
+      for(i=0;i<m;i++)
+	o16[pos+i]=floatToBf16(a[pos+i]);
+      break;
+    case AGBMVM_FP16:
+      for(i=0;i<m;i++){
+	o16[pos+i]=floatToHalf(a[pos+i]);
+	if((o16[pos+i]&0x7c00)==0x7c00 && fabsf(a[pos+i])<INFINITY)
+	  noverflow++;
+      }
+      break;
+    case AGBMVM_INT8:
+      mx=0;
+      for(i=0;i<m;i++){
+	if(fabsf(a[pos+i])>mx)
+	  mx=fabsf(a[pos+i]);
+      }
+      scale[j]=mx/127.;
+      inv=mx>0?127./mx:0;
+      for(i=0;i<m;i++){
+	q=(long)(a[pos+i]*inv+(a[pos+i]<0?-.5f:.5f));//round, without needing libm.
+	o8[pos+i]=q>127?127:(q<-127?-127:q);
+      }
+      break;
+    default:
+      memcpy(&((float*)out)[pos],&a[pos],sizeof(float)*m);
+      break;
+    }
+  }
+  return noverflow;
+}
+
+//Tile kernels for the reduced precision formats.  Full vectors are done
+//with SIMD, and the last few rows with fmaf, which gives the same rounding.
+#define MVMLPSCALAR(NAME,T,WIDEN)					\
+  static void NAME(int m,int n,int lda,const void *av,const float *scale,const float *x,float *y){ \
+    const T *a=(const T*)av;						\
+    const T *aj;							\
+    int i,j,k,nc;							\
+    float xs[MVMCOLS],tmp;						\
+    for(j=0;j<n;j+=MVMCOLS){						\
+      nc=n-j<MVMCOLS?n-j:MVMCOLS;					\
+      aj=&a[(long)j*lda];						\
+      for(k=0;k<nc;k++)							\
+	xs[k]=scale==NULL?x[j+k]:x[j+k]*scale[j+k];			\
+      for(i=0;i<m;i++){							\
+	tmp=y[i];							\
+	for(k=0;k<nc;k++)						\
+	  tmp+=WIDEN(aj[(long)k*lda+i])*xs[k];				\
+	y[i]=tmp;							\
+      }									\
+    }									\
+  }
+#define I8TOF(v) ((float)(v))
+MVMLPSCALAR(mvmTileBf16Scalar,unsigned short,bf16ToFloat)
+MVMLPSCALAR(mvmTileFp16Scalar,unsigned short,halfToFloat)
+MVMLPSCALAR(mvmTileInt8Scalar,signed char,I8TOF)
+
+#ifdef AGBMVMSIMD
+#define MVMLPSIMD(NAME,TARGET,T,VEC,W,SET1,LOADY,STOREY,FMADD,LOADW,WIDEN) \
+  __attribute__((target(TARGET))) static void NAME(int m,int n,int lda,const void *av,const float *scale,const float *x,float *y){ \
+    const T *a=(const T*)av;						\
+    const T *aj;							\
+    int i,j,k,nc;							\
+    float xs[MVMCOLS],tmp;						\
+    VEC xv[MVMCOLS],acc0,acc1;						\
+    for(j=0;j<n;j+=MVMCOLS){						\
+      nc=n-j<MVMCOLS?n-j:MVMCOLS;					\
+      aj=&a[(long)j*lda];						\
+      for(k=0;k<nc;k++){						\
+	xs[k]=scale==NULL?x[j+k]:x[j+k]*scale[j+k];			\
+	xv[k]=SET1(xs[k]);						\
+      }									\
+      i=0;								\
+      if(nc==MVMCOLS){							\
+	for(;i+2*W<=m;i+=2*W){						\
+	  acc0=LOADY(&y[i]);						\
+	  acc1=LOADY(&y[i+W]);						\
+	  for(k=0;k<MVMCOLS;k++){					\
+	    acc0=FMADD(LOADW(&aj[(long)k*lda+i]),xv[k],acc0);		\
+	    acc1=FMADD(LOADW(&aj[(long)k*lda+i+W]),xv[k],acc1);	\
+	  }								\
+	  STOREY(&y[i],acc0);						\
+	  STOREY(&y[i+W],acc1);						\
+	}								\
+      }									\
+      for(;i+W<=m;i+=W){						\
+	acc0=LOADY(&y[i]);						\
+	for(k=0;k<nc;k++)						\
+	  acc0=FMADD(LOADW(&aj[(long)k*lda+i]),xv[k],acc0);		\
+	STOREY(&y[i],acc0);						\
+      }									\
+      for(;i<m;i++){							\
+	tmp=y[i];							\
+	for(k=0;k<nc;k++)						\
+	  tmp=fmaf(WIDEN(aj[(long)k*lda+i]),xs[k],tmp);			\
+	y[i]=tmp;							\
+      }									\
+    }									\
+  }
+#define LDBF16X8(p) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p))),16))
+#define LDFP16X8(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(p)))
+#define LDINT8X8(p) _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(p))))
+#define LDBF16X16(p) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p))),16))
+#define LDFP16X16(p) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(p)))
+#define LDINT8X16(p) _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(p))))
+MVMLPSIMD(mvmTileBf16Avx2,"avx2,fma",unsigned short,__m256,8,_mm256_set1_ps,_mm256_loadu_ps,_mm256_storeu_ps,_mm256_fmadd_ps,LDBF16X8,bf16ToFloat)
+MVMLPSIMD(mvmTileFp16Avx2,"avx2,fma,f16c",unsigned short,__m256,8,_mm256_set1_ps,_mm256_loadu_ps,_mm256_storeu_ps,_mm256_fmadd_ps,LDFP16X8,halfToFloat)
+MVMLPSIMD(mvmTileInt8Avx2,"avx2,fma",signed char,__m256,8,_mm256_set1_ps,_mm256_loadu_ps,_mm256_storeu_ps,_mm256_fmadd_ps,LDINT8X8,I8TOF)
+MVMLPSIMD(mvmTileBf16Avx512,"avx512f",unsigned short,__m512,16,_mm512_set1_ps,_mm512_loadu_ps,_mm512_storeu_ps,_mm512_fmadd_ps,LDBF16X16,bf16ToFloat)
+MVMLPSIMD(mvmTileFp16Avx512,"avx512f",unsigned short,__m512,16,_mm512_set1_ps,_mm512_loadu_ps,_mm512_storeu_ps,_mm512_fmadd_ps,LDFP16X16,halfToFloat)
+MVMLPSIMD(mvmTileInt8Avx512,"avx512f",signed char,__m512,16,_mm512_set1_ps,_mm512_loadu_ps,_mm512_storeu_ps,_mm512_fmadd_ps,LDINT8X16,I8TOF)
+#endif
+
+//Block sparse column storage (BSC) of a column major matrix, for
+//reconstructors that are mostly zeros.  Columns are taken in pairs (the x
+//and y slopes of a subap) and split into blocks of AGBBSC_ROWS rows, and
+//only blocks that aren't zero are kept: colptr[p]..colptr[p+1] are the
+//blocks for column pair p, rowblk[b] is the row block of block b, and
+//val[b*2*AGBBSC_ROWS] holds its AGBBSC_ROWS values for the first column
+//then for the second.  Each y element sees the columns in the same order,
+//with fma, as the dense kernels, so the result is the same.
+static void bscScalar(int m,int np,const int *colptr,const int *rowblk,const float *val,const float *x,float *y){
+  int p,b,i,r,nr;
+  float x0,x1,tmp;
+  const float *v;
+  for(p=0;p<np;p++){
+    x0=x[2*p];
+    x1=x[2*p+1];
+    for(b=colptr[p];b<colptr[p+1];b++){
+      r=rowblk[b]*AGBBSC_ROWS;
+      nr=m-r<AGBBSC_ROWS?m-r:AGBBSC_ROWS;
+      v=&val[(long)b*2*AGBBSC_ROWS];
+      for(i=0;i<nr;i++){
+	tmp=y[r+i];
+	tmp+=v[i]*x0;
+	tmp+=v[AGBBSC_ROWS+i]*x1;
+	y[r+i]=tmp;
+      }
+    }
+  }
+}
+
+#ifdef AGBMVMSIMD
+__attribute__((target("avx2,fma"))) static void bscAvx2(int m,int np,const int *colptr,const int *rowblk,const float *val,const float *x,float *y){
+  int p,b,r;
+  __m256 x0,x1,acc0,acc1;
+  __m256i mask0,mask1;
+  const float *v;
+  for(p=0;p<np;p++){
+    x0=_mm256_set1_ps(x[2*p]);
+    x1=_mm256_set1_ps(x[2*p+1]);
+    for(b=colptr[p];b<colptr[p+1];b++){
+      r=rowblk[b]*AGBBSC_ROWS;
+      v=&val[(long)b*2*AGBBSC_ROWS];
+      if(r+AGBBSC_ROWS<=m){
+	acc0=_mm256_loadu_ps(&y[r]);
+	acc1=_mm256_loadu_ps(&y[r+8]);
+	acc0=_mm256_fmadd_ps(_mm256_load_ps(v),x0,acc0);
+	acc1=_mm256_fmadd_ps(_mm256_load_ps(&v[8]),x0,acc1);
+	acc0=_mm256_fmadd_ps(_mm256_load_ps(&v[AGBBSC_ROWS]),x1,acc0);
+	acc1=_mm256_fmadd_ps(_mm256_load_ps(&v[AGBBSC_ROWS+8]),x1,acc1);
+	_mm256_storeu_ps(&y[r],acc0);
+	_mm256_storeu_ps(&y[r+8],acc1);
+      }else{//last row block, partly beyond m.
+	mask0=_mm256_cmpgt_epi32(_mm256_set1_epi32(m-r),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+	mask1=_mm256_cmpgt_epi32(_mm256_set1_epi32(m-r-8),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+	acc0=_mm256_maskload_ps(&y[r],mask0);
+	acc1=_mm256_maskload_ps(&y[r+8],mask1);
+	acc0=_mm256_fmadd_ps(_mm256_load_ps(v),x0,acc0);
+	acc1=_mm256_fmadd_ps(_mm256_load_ps(&v[8]),x0,acc1);
+	acc0=_mm256_fmadd_ps(_mm256_load_ps(&v[AGBBSC_ROWS]),x1,acc0);
+	acc1=_mm256_fmadd_ps(_mm256_load_ps(&v[AGBBSC_ROWS+8]),x1,acc1);
+	_mm256_maskstore_ps(&y[r],mask0,acc0);
+	_mm256_maskstore_ps(&y[r+8],mask1,acc1);
+      }
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void bscAvx512(int m,int np,const int *colptr,const int *rowblk,const float *val,const float *x,float *y){
+  int p,b,r;
+  __m512 x0,x1,acc;
+  __mmask16 mask;
+  const float *v;
+  for(p=0;p<np;p++){
+    x0=_mm512_set1_ps(x[2*p]);
+    x1=_mm512_set1_ps(x[2*p+1]);
+    for(b=colptr[p];b<colptr[p+1];b++){
+      r=rowblk[b]*AGBBSC_ROWS;
+      v=&val[(long)b*2*AGBBSC_ROWS];
+      mask=m-r>=AGBBSC_ROWS?0xffff:(__mmask16)((1<<(m-r))-1);
+      acc=_mm512_maskz_loadu_ps(mask,&y[r]);
+      acc=_mm512_fmadd_ps(_mm512_load_ps(v),x0,acc);
+      acc=_mm512_fmadd_ps(_mm512_load_ps(&v[AGBBSC_ROWS]),x1,acc);
+      _mm512_mask_storeu_ps(&y[r],mask,acc);
+    }
+  }
+}
+#endif
+
+//Row major (dot product) sgemv, used for the kalman/LQG state
+//propagation.  ROWDOTS rows are dotted with x together so that x is read
+//once per ROWDOTS rows, each row keeping a vector of partial sums that is
+//reduced at the end.  y=alpha*a.x+beta*y, with y not read if beta==0.
+#define ROWDOTS 4
+static void (*agbRowFn)(int m,int n,int lda,const float *a,const float *x,float alpha,float beta,float *y);
+
+static void rowScalar(int m,int n,int lda,const float *a,const float *x,float alpha,float beta,float *y){
+  int i,j;
+  float tmp;
+  const float *ai;
+  for(i=0;i<m;i++){
+    ai=&a[(long)i*lda];
+    tmp=0.;
+    for(j=0;j<n;j++)
+      tmp+=ai[j]*x[j];
+    y[i]=(beta==0.)?alpha*tmp:alpha*tmp+beta*y[i];
+  }
+}
+
+#ifdef AGBMVMSIMD
+__attribute__((target("avx2,fma"))) static inline float hsumAvx2(__m256 v){
+  __m128 s=_mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s=_mm_add_ps(s,_mm_movehl_ps(s,s));
+  s=_mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) static void rowAvx2(int m,int n,int lda,const float *a,const float *x,float alpha,float beta,float *y){
+  int i,j,k,nr;
+  __m256 acc[ROWDOTS],xv;
+  __m256i mask;
+  const float *ai;
+  float tmp;
+  mask=_mm256_cmpgt_epi32(_mm256_set1_epi32(n&7),_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+  for(i=0;i<m;i+=ROWDOTS){
+    nr=m-i<ROWDOTS?m-i:ROWDOTS;
+    ai=&a[(long)i*lda];
+    for(k=0;k<nr;k++)
+      acc[k]=_mm256_setzero_ps();
+    for(j=0;j+8<=n;j+=8){
+      xv=_mm256_loadu_ps(&x[j]);
+      for(k=0;k<nr;k++)
+	acc[k]=_mm256_fmadd_ps(_mm256_loadu_ps(&ai[(long)k*lda+j]),xv,acc[k]);
+    }
+    if(j<n){
+      xv=_mm256_maskload_ps(&x[j],mask);
+      for(k=0;k<nr;k++)
+	acc[k]=_mm256_fmadd_ps(_mm256_maskload_ps(&ai[(long)k*lda+j],mask),xv,acc[k]);
+    }
+    for(k=0;k<nr;k++){
+      tmp=hsumAvx2(acc[k]);
+      y[i+k]=(beta==0.)?alpha*tmp:alpha*tmp+beta*y[i+k];
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void rowAvx512(int m,int n,int lda,const float *a,const float *x,float alpha,float beta,float *y){
+  int i,j,k,nr;
+  __m512 acc[ROWDOTS],xv;
+  __mmask16 mask=(__mmask16)((1<<(n&15))-1);
+  const float *ai;
+  float tmp;
+  for(i=0;i<m;i+=ROWDOTS){
+    nr=m-i<ROWDOTS?m-i:ROWDOTS;
+    ai=&a[(long)i*lda];
+    for(k=0;k<nr;k++)
+      acc[k]=_mm512_setzero_ps();
+    for(j=0;j+16<=n;j+=16){
+      xv=_mm512_loadu_ps(&x[j]);
+      for(k=0;k<nr;k++)
+	acc[k]=_mm512_fmadd_ps(_mm512_loadu_ps(&ai[(long)k*lda+j]),xv,acc[k]);
+    }
+    if(j<n){
+      xv=_mm512_maskz_loadu_ps(mask,&x[j]);
+      for(k=0;k<nr;k++)
+	acc[k]=_mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask,&ai[(long)k*lda+j]),xv,acc[k]);
+    }
+    for(k=0;k<nr;k++){
+      tmp=_mm512_reduce_add_ps(acc[k]);
+      y[i+k]=(beta==0.)?alpha*tmp:alpha*tmp+beta*y[i+k];
+    }
+  }
+}
+#endif
+
+//Sparse matrices stored as in reconpcg: indptr (one entry per row or
+//column, plus one) then (index,value) pairs, the value being the float bit
+//pattern.  Entry j is at pairs[2*j],pairs[2*j+1].
+static void (*agbPairRowFn)(int m,const int *indptr,const int *pairs,const float *x,float *y);
+static void (*agbPairColFn)(int n,const int *indptr,const int *pairs,const float *x,float *y);
+
+static void pairRowScalar(int m,const int *indptr,const int *pairs,const float *x,float *y){
+  int i,j;
+  float tmp;
+  const float *val=(const float*)pairs;
+  for(i=0;i<m;i++){
+    tmp=0.;
+    for(j=indptr[i];j<indptr[i+1];j++)
+      tmp+=val[2*j+1]*x[pairs[2*j]];
+    y[i]=tmp;
+  }
+}
+
+static void pairColScalar(int n,const int *indptr,const int *pairs,const float *x,float *y){
+  int i,j;
+  float xi;
+  const float *val=(const float*)pairs;
+  for(i=0;i<n;i++){
+    xi=x[i];
+    for(j=indptr[i];j<indptr[i+1];j++)
+      y[pairs[2*j]]+=val[2*j+1]*xi;
+  }
+}
+
+#ifdef AGBMVMSIMD
+__attribute__((target("avx2,fma"))) static void pairRowAvx2(int m,const int *indptr,const int *pairs,const float *x,float *y){
+  int i,j,e;
+  __m256i lo,hi,idx;
+  __m256 acc;
+  const __m256i sel=_mm256_setr_epi32(0,2,4,6,1,3,5,7);
+  const float *val=(const float*)pairs;
+  float tmp;
+  for(i=0;i<m;i++){
+    acc=_mm256_setzero_ps();
+    e=indptr[i+1];
+    for(j=indptr[i];j+8<=e;j+=8){
+      //deinterleave 8 (index,value) pairs.
+      lo=_mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)&pairs[2*j]),sel);
+      hi=_mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)&pairs[2*j+8]),sel);
+      idx=_mm256_permute2x128_si256(lo,hi,0x20);
+      acc=_mm256_fmadd_ps(_mm256_castsi256_ps(_mm256_permute2x128_si256(lo,hi,0x31)),_mm256_i32gather_ps(x,idx,4),acc);
+    }
+    tmp=hsumAvx2(acc);
+    for(;j<e;j++)
+      tmp+=val[2*j+1]*x[pairs[2*j]];
+    y[i]=tmp;
+  }
+}
+
+__attribute__((target("avx512f"))) static void pairRowAvx512(int m,const int *indptr,const int *pairs,const float *x,float *y){
+  int i,j,e,r;
+  __m512i lo,hi;
+  __m512 acc;
+  __mmask16 mlo,mhi;
+  const __m512i even=_mm512_setr_epi32(0,2,4,6,8,10,12,14,16,18,20,22,24,26,28,30);
+  const __m512i odd=_mm512_setr_epi32(1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31);
+  for(i=0;i<m;i++){
+    acc=_mm512_setzero_ps();
+    e=indptr[i+1];
+    for(j=indptr[i];j+16<=e;j+=16){
+      lo=_mm512_loadu_si512(&pairs[2*j]);
+      hi=_mm512_loadu_si512(&pairs[2*j+16]);
+      acc=_mm512_fmadd_ps(_mm512_castsi512_ps(_mm512_permutex2var_epi32(lo,odd,hi)),_mm512_i32gather_ps(_mm512_permutex2var_epi32(lo,even,hi),x,4),acc);
+    }
+    if(j<e){//remaining r<16 pairs, 2*r ints.
+      r=e-j;
+      mlo=r>=8?0xffff:(__mmask16)((1<<(2*r))-1);
+      mhi=r>8?(__mmask16)((1<<(2*r-16))-1):0;
+      lo=_mm512_maskz_loadu_epi32(mlo,&pairs[2*j]);
+      hi=_mm512_maskz_loadu_epi32(mhi,&pairs[2*j+16]);
+      acc=_mm512_fmadd_ps(_mm512_castsi512_ps(_mm512_permutex2var_epi32(lo,odd,hi)),_mm512_mask_i32gather_ps(_mm512_setzero_ps(),(__mmask16)((1<<r)-1),_mm512_permutex2var_epi32(lo,even,hi),x,4),acc);
+    }
+    y[i]=_mm512_reduce_add_ps(acc);
+  }
+}
+
+//Indices within a column are distinct, so the gather/scatter of y is safe.
+__attribute__((target("avx512f"))) static void pairColAvx512(int n,const int *indptr,const int *pairs,const float *x,float *y){
+  int i,j,e,r;
+  __m512i lo,hi,idx;
+  __m512 xi,yv;
+  __mmask16 mlo,mhi,mask;
+  const __m512i even=_mm512_setr_epi32(0,2,4,6,8,10,12,14,16,18,20,22,24,26,28,30);
+  const __m512i odd=_mm512_setr_epi32(1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31);
+  for(i=0;i<n;i++){
+    xi=_mm512_set1_ps(x[i]);
+    e=indptr[i+1];
+    for(j=indptr[i];j<e;j+=16){
+      r=e-j;
+      if(r>=16){
+	mask=0xffff;
+	lo=_mm512_loadu_si512(&pairs[2*j]);
+	hi=_mm512_loadu_si512(&pairs[2*j+16]);
+      }else{
+	mask=(__mmask16)((1<<r)-1);
+	mlo=r>=8?0xffff:(__mmask16)((1<<(2*r))-1);
+	mhi=r>8?(__mmask16)((1<<(2*r-16))-1):0;
+	lo=_mm512_maskz_loadu_epi32(mlo,&pairs[2*j]);
+	hi=_mm512_maskz_loadu_epi32(mhi,&pairs[2*j+16]);
+      }
+      idx=_mm512_permutex2var_epi32(lo,even,hi);
+      yv=_mm512_mask_i32gather_ps(_mm512_setzero_ps(),mask,idx,y,4);
+      yv=_mm512_fmadd_ps(_mm512_castsi512_ps(_mm512_permutex2var_epi32(lo,odd,hi)),xi,yv);
+      _mm512_mask_i32scatter_ps(y,mask,idx,yv,4);
+    }
+  }
+}
+#endif
+
+void agb_cblas_mvmInit(void){
+  /*Choose the MVM kernel and row tile for this host.  The row tile is a
+    quarter of L1d, leaving the rest for the matrix columns being streamed.
+    Safe to call more than once.
+  */
+  long l1=sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  int rows;
+  if(agbMvmRows!=0)
+    return;
+  if(l1<=0)
+    l1=32768;
+  rows=(int)(l1/4/sizeof(float))&~31;
+  if(rows<256)
+    rows=256;
+  agbMvmFn=mvmTileScalar;
+  agbBscFn=bscScalar;
+  agbRowFn=rowScalar;
+  agbPairRowFn=pairRowScalar;
+  agbPairColFn=pairColScalar;
+  agbMvmLPFn[AGBMVM_BF16]=mvmTileBf16Scalar;
+  agbMvmLPFn[AGBMVM_FP16]=mvmTileFp16Scalar;
+  agbMvmLPFn[AGBMVM_INT8]=mvmTileInt8Scalar;
+  agbMvmName="scalar";
+  agbMvmCols=MVMCOLS;
+#ifdef AGBMVMSIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    agbMvmFn=mvmTileAvx512;
+    agbBscFn=bscAvx512;
+    agbRowFn=rowAvx512;
+    agbPairRowFn=pairRowAvx512;
+    agbPairColFn=pairColAvx512;
+    agbMvmLPFn[AGBMVM_BF16]=mvmTileBf16Avx512;
+    agbMvmLPFn[AGBMVM_FP16]=mvmTileFp16Avx512;
+    agbMvmLPFn[AGBMVM_INT8]=mvmTileInt8Avx512;
+    agbMvmName="avx512";
+  }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    agbMvmFn=mvmTileAvx2;
+    agbBscFn=bscAvx2;
+    agbRowFn=rowAvx2;
+    agbPairRowFn=pairRowAvx2;
+    agbMvmLPFn[AGBMVM_BF16]=mvmTileBf16Avx2;
+    agbMvmLPFn[AGBMVM_INT8]=mvmTileInt8Avx2;
+    if(__builtin_cpu_supports("f16c"))
+      agbMvmLPFn[AGBMVM_FP16]=mvmTileFp16Avx2;
+    agbMvmName="avx2";
+  }
+#endif
+  __sync_synchronize();
+  agbMvmRows=rows;
+  printf("agbcblas: %s MVM kernel, %d row tile, %d column block\n",agbMvmName,agbMvmRows,agbMvmCols);
+}
+
+int agb_cblas_mvmBatchCols(void){
+  /*Number of columns worth accumulating before calling
+    agb_cblas_sgemvColMN1M111Tiled, so that partial column blocks are rare.*/
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  return 4*agbMvmCols;
+}
+
+void agb_cblas_sgemvColMN1M111Tiled(int m, int n, float *a,float *x,float *y){
+  /*perform sgemv with lda==m, alpha=1, beta=1 and inc=1.
+    Col major format, no transpose.
+    Does y+=a.x
+    cblas_sgemv(CblasColMajor,CblasNoTrans,m,n,1.,a,m,x,1,1.,y,1);
+    Same as agb_cblas_sgemvColMN1M111, but register blocked and tiled.
+  */
+  int r,nr;
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  for(r=0;r<m;r+=agbMvmRows){
+    nr=m-r<agbMvmRows?m-r:agbMvmRows;
+    agbMvmFn(nr,n,m,&a[r],x,&y[r]);
+  }
+}
+
+
+void agb_cblas_sgemvColMN1M111TiledLP(int fmt,int m,int n,void *a,float *scale,float *x,float *y){
+  /*As agb_cblas_sgemvColMN1M111Tiled, but with a stored as fmt (converted
+    using agb_cblas_mvmConvert).  scale is the per-column scale for
+    AGBMVM_INT8, and is ignored otherwise.
+  */
+  int r,nr;
+  int elsize=agb_cblas_mvmElSize(fmt);
+  void (*fn)(int m,int n,int lda,const void *av,const float *scale,const float *x,float *y);
+  if(fmt==AGBMVM_FP32){
+    agb_cblas_sgemvColMN1M111Tiled(m,n,(float*)a,x,y);
+    return;
+  }
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  fn=agbMvmLPFn[fmt];
+  if(fmt!=AGBMVM_INT8)
+    scale=NULL;
+  for(r=0;r<m;r+=agbMvmRows){
+    nr=m-r<agbMvmRows?m-r:agbMvmRows;
+    fn(nr,n,m,(char*)a+(long)r*elsize,scale,x,&y[r]);
+  }
+}
+
+
+static int bscBlockUsed(int m,int r,const float *a0,const float *a1,float thresh){
+  //Whether rows r to r+AGBBSC_ROWS of this column pair have anything larger than thresh (or NaN).
+  int i;
+  float v;
+  for(i=r;i<r+AGBBSC_ROWS && i<m;i++){
+    v=a0[i];
+    if(v>thresh || v< -thresh || v!=v)
+      return 1;
+    v=a1[i];
+    if(v>thresh || v< -thresh || v!=v)
+      return 1;
+  }
+  return 0;
+}
+
+static int bscFromPair(int m,const float *a0,const float *a1,float thresh,int nb,int *rowblk,float *val){
+  //Add the used blocks of one column pair, starting at block nb.  Returns the new block count.
+  int r,i;
+  float *v;
+  for(r=0;r<m;r+=AGBBSC_ROWS){
+    if(bscBlockUsed(m,r,a0,a1,thresh)){
+      if(rowblk!=NULL){
+	rowblk[nb]=r/AGBBSC_ROWS;
+	v=&val[(long)nb*2*AGBBSC_ROWS];
+	for(i=0;i<AGBBSC_ROWS;i++){
+	  v[i]=r+i<m?a0[r+i]:0.;
+	  v[AGBBSC_ROWS+i]=r+i<m?a1[r+i]:0.;
+	}
+      }
+      nb++;
+    }
+  }
+  return nb;
+}
+
+int agb_cblas_bscFromDense(int m,int n,float *a,float thresh,int *colptr,int *rowblk,float *val){
+  /*Convert column major a (m rows, n columns, n even) to block sparse
+    column storage, dropping blocks with no value larger than thresh.
+    colptr has n/2+1 elements.  If rowblk is NULL, only colptr is filled,
+    so that rowblk (nblocks ints) and val (nblocks*2*AGBBSC_ROWS floats,
+    64 byte aligned) can be allocated.  Returns the number of blocks.
+  */
+  int p,nb=0;
+  colptr[0]=0;
+  for(p=0;p<n/2;p++){
+    nb=bscFromPair(m,&a[(long)2*p*m],&a[(long)(2*p+1)*m],thresh,nb,rowblk,val);
+    colptr[p+1]=nb;
+  }
+  return nb;
+}
+
+int agb_cblas_bscFromCsc(int m,int n,int *csc,long size,int *colptr,int *rowblk,float *val){
+  /*As agb_cblas_bscFromDense, but from a sparse matrix stored as for
+    reconpcg pcgB: indptr (n+1), then nnz interleaved (row index, value)
+    pairs, the value being a float.  size is the number of ints in csc.
+    Returns -1 if indptr or an index is inconsistent with m, n and size,
+    or memory can't be allocated.
+  */
+  int *indptr=csc;
+  int *pairs=&csc[n+1];
+  float *tmp;
+  int p,c,j,nb=0;
+  if(size<n+1 || indptr[0]!=0 || size!=n+1+2*(long)indptr[n])
+    return -1;
+  for(p=0;p<n;p++){
+    if(indptr[p+1]<indptr[p])
+      return -1;
+  }
+  if((tmp=calloc(sizeof(float),2*(long)m))==NULL)
+    return -1;
+  colptr[0]=0;
+  for(p=0;p<n/2;p++){
+    for(c=0;c<2;c++){
+      for(j=indptr[2*p+c];j<indptr[2*p+c+1];j++){
+	if(pairs[2*j]<0 || pairs[2*j]>=m){
+	  free(tmp);
+	  return -1;
+	}
+	tmp[c*m+pairs[2*j]]+=((float*)pairs)[2*j+1];
+      }
+    }
+    nb=bscFromPair(m,tmp,&tmp[m],0.,nb,rowblk,val);
+    colptr[p+1]=nb;
+    for(c=0;c<2;c++){
+      for(j=indptr[2*p+c];j<indptr[2*p+c+1];j++)
+	tmp[c*m+pairs[2*j]]=0;
+    }
+  }
+  free(tmp);
+  return nb;
+}
+
+void agb_cblas_sgemvColMN1M111BSC(int m,int n,int *colptr,int *rowblk,float *val,float *x,float *y){
+  /*y+=a.x, for the n columns (n even) of a stored by agb_cblas_bscFromDense
+    or agb_cblas_bscFromCsc.  colptr should point to the entry for the first
+    column pair used, and x to the first column's element.
+  */
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  agbBscFn(m,n/2,colptr,rowblk,val,x,y);
+}
+
+
+void agb_cblas_sgemvRowMNL(int m,int n,float alpha,float *a,int l,float *x,float beta,float *y){
+  /*perform sgemv with lda==l and inc=1.
+    Row major format, no transpose.
+    Does y=alpha*a.x+beta*y, y not being read if beta==0.
+    cblas_sgemv(CblasRowMajor,CblasNoTrans,m,n,alpha,a,l,x,1,beta,y,1);
+    Vectorised version of agb_cblas_sgemvRowMN1L101 and friends.
+  */
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  agbRowFn(m,n,l,a,x,alpha,beta,y);
+}
+
+
+void agb_cblas_sparse_csrpair_sgemvRowMN1N101(int m,int *indptr,int *pairs,float *x,float *y){
+  /*y=a.x for m rows of a csr matrix stored as for reconpcg pcgA, with
+    the (index,value) pairs interleaved.  indptr points to the first row's
+    entry, and pairs to the start of the pair list.
+  */
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  agbPairRowFn(m,indptr,pairs,x,y);
+}
+
+void agb_cblas_sparse_cscpair_sgemvColMN1M111(int n,int *indptr,int *pairs,float *x,float *y){
+  /*y+=a.x for n columns of a csc matrix stored as for reconpcg pcgB.
+    indptr points to the first column's entry, x to its element, and
+    pairs to the start of the pair list.
+  */
+  if(agbMvmRows==0)
+    agb_cblas_mvmInit();
+  agbPairColFn(n,indptr,pairs,x,y);
+}
+
+
 //sparse stuff
 inline void agb_cblas_sparse_csr_sgemvRowMN1N101(int m,int n, int *a, float *x,float *y){
   /*perform sgemv with lda==n, alpha=1, beta=0 and inc=1.
@@ -494,3 +1331,199 @@ inline void agb_cblas_16sgemvColMN1M111(int m, int n, void *a, float *x, float *
     }
 }
 #endif
+
+
+//Helper thread team.
+#define AGBTEAMSPIN 100000//pause loops a helper spins for between jobs before sleeping.
+#define AGBTEAMYIELD 1023//spinning threads yield every this+1 pauses, in case cpus are shared.
+#if defined(__x86_64__) || defined(__i386__)
+#define AGBTEAMPAUSE() __builtin_ia32_pause()
+#else
+#define AGBTEAMPAUSE()
+#endif
+
+struct agbTeamHelper{
+  agbTeam *team;
+  int id;//1 to nHelpers, the calling thread being 0.
+  int sense;
+  int gen;//last job generation seen.
+  pthread_t thread;
+};
+
+int agb_cblas_teamInit(agbTeam *team,char *name,agbTeamFn fn,void *data){
+  /*Initialise a team with no helpers - agb_cblas_teamCheck starts them.
+    fn(data,w,&sense) is run by each member w (0 to nHelpers) for each job.
+    Returns 0 on success.
+  */
+  memset(team,0,sizeof(agbTeam));
+  team->name=name;
+  team->fn=fn;
+  team->data=data;
+  if(pthread_mutex_init(&team->teamMutex,NULL)!=0)
+    return 1;
+  if(pthread_cond_init(&team->teamCond,NULL)!=0){
+    pthread_mutex_destroy(&team->teamMutex);
+    return 1;
+  }
+  return 0;
+}
+
+void agb_cblas_teamBarrier(agbTeam *team,int *sense){
+  /*Spin barrier for all members of the team.  sense is the member's own.
+  */
+  int spin=0;
+  if(team->nHelpers==0)
+    return;
+  *sense=1-*sense;
+  if(__atomic_add_fetch(&team->barCount,1,__ATOMIC_ACQ_REL)==team->nHelpers+1){
+    __atomic_store_n(&team->barCount,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&team->barSense,*sense,__ATOMIC_RELEASE);
+  }else{
+    while(__atomic_load_n(&team->barSense,__ATOMIC_ACQUIRE)!=*sense){
+      if((++spin&AGBTEAMYIELD)==0)
+	sched_yield();
+      else
+	AGBTEAMPAUSE();
+    }
+  }
+}
+
+static void *agbTeamWorker(void *helperHandle){
+  agbTeamHelper *helper=(agbTeamHelper*)helperHandle;
+  agbTeam *team=helper->team;
+  int gen=helper->gen;
+  int spin;
+  while(1){
+    //spin for a while (typically longer than a frame), then sleep.
+    for(spin=0;spin<AGBTEAMSPIN;spin++){
+      if(__atomic_load_n(&team->teamGen,__ATOMIC_ACQUIRE)!=gen || __atomic_load_n(&team->teamQuit,__ATOMIC_ACQUIRE))
+	break;
+      if((spin&AGBTEAMYIELD)==AGBTEAMYIELD)
+	sched_yield();
+      else
+	AGBTEAMPAUSE();
+    }
+    if(spin==AGBTEAMSPIN){
+      pthread_mutex_lock(&team->teamMutex);
+      __atomic_add_fetch(&team->teamSleeping,1,__ATOMIC_SEQ_CST);
+      while(__atomic_load_n(&team->teamGen,__ATOMIC_SEQ_CST)==gen && team->teamQuit==0)
+	pthread_cond_wait(&team->teamCond,&team->teamMutex);
+      __atomic_sub_fetch(&team->teamSleeping,1,__ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&team->teamMutex);
+    }
+    if(__atomic_load_n(&team->teamQuit,__ATOMIC_ACQUIRE))
+      break;
+    gen=__atomic_load_n(&team->teamGen,__ATOMIC_ACQUIRE);
+    team->fn(team->data,helper->id,&helper->sense);
+  }
+  return NULL;
+}
+
+static void agbTeamStop(agbTeam *team){
+  int i;
+  if(team->helper!=NULL){
+    __atomic_store_n(&team->teamQuit,1,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&team->teamMutex);
+    pthread_cond_broadcast(&team->teamCond);
+    pthread_mutex_unlock(&team->teamMutex);
+    for(i=0;i<team->nHelpers;i++)
+      pthread_join(team->helper[i].thread,NULL);
+    free(team->helper);
+    team->helper=NULL;
+  }
+  team->nHelpers=0;
+  team->teamQuit=0;
+}
+
+void agb_cblas_teamFree(agbTeam *team){
+  /*Stop the helpers and free the team (but not the agbTeam itself).
+  */
+  agbTeamStop(team);
+  pthread_mutex_destroy(&team->teamMutex);
+  pthread_cond_destroy(&team->teamCond);
+  if(team->helperAffin!=NULL)
+    free(team->helperAffin);
+  team->helperAffin=NULL;
+  team->helperAffinSize=0;
+}
+
+int agb_cblas_teamCheck(agbTeam *team,int nHelpers,unsigned int *affin,int affinElSize){
+  /*Called by member 0: (re)start the helpers if nHelpers or their affinity
+    (affinElSize ints per helper, or NULL for any cpu) have changed.  They get
+    the same scheduling policy and priority as the calling thread.
+    Returns 1 if the team was (re)started, in which case per member arrays
+    (for up to nHelpers+1 members) should be remade, or 0 if unchanged.
+    Fewer helpers than requested may be running (team->nHelpers).
+  */
+  int i,j,ncpu,policy,rv;
+  int affinSize=affin==NULL?0:sizeof(unsigned int)*affinElSize*nHelpers;
+  struct sched_param param;
+  cpu_set_t mask;
+  if(team->started && nHelpers==team->nHelpersReq && affinSize==team->helperAffinSize && (affinSize==0 || memcmp(affin,team->helperAffin,affinSize)==0))
+    return 0;
+  agbTeamStop(team);
+  team->started=1;
+  team->nHelpersReq=nHelpers;
+  if(team->helperAffin!=NULL)
+    free(team->helperAffin);
+  team->helperAffin=NULL;
+  team->helperAffinSize=0;
+  if(nHelpers==0)
+    return 1;
+  if(affinSize>0){
+    if((team->helperAffin=malloc(affinSize))==NULL){
+      printf("Error allocating %s helperAffin\n",team->name);
+      return 1;
+    }
+    memcpy(team->helperAffin,affin,affinSize);
+    team->helperAffinSize=affinSize;
+  }
+  if((team->helper=calloc(sizeof(agbTeamHelper),nHelpers))==NULL){
+    printf("Error allocating %s helpers\n",team->name);
+    return 1;
+  }
+  team->barCount=0;
+  team->barSense=0;
+  team->sense=0;
+  if(pthread_getschedparam(pthread_self(),&policy,&param)){
+    policy=SCHED_OTHER;
+    param.sched_priority=0;
+  }
+  ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+  for(i=0;i<nHelpers;i++){
+    team->helper[i].team=team;
+    team->helper[i].id=i+1;
+    team->helper[i].gen=team->teamGen;
+    if((rv=pthread_create(&team->helper[i].thread,NULL,agbTeamWorker,&team->helper[i]))!=0){
+      printf("Unable to create %s helper thread %d (%s) - using %d\n",team->name,i,strerror(rv),i);
+      break;
+    }
+    CPU_ZERO(&mask);
+    for(j=0;j<ncpu;j++){
+      if(affin==NULL || (j<affinElSize*32 && ((affin[i*affinElSize+j/32]>>(j%32))&1)))
+	CPU_SET(j,&mask);
+    }
+    if((rv=pthread_setaffinity_np(team->helper[i].thread,sizeof(cpu_set_t),&mask))!=0)
+      printf("Error in pthread_setaffinity_np for %s helper %d: %s\n",team->name,i,strerror(rv));
+    if(policy!=SCHED_OTHER && (rv=pthread_setschedparam(team->helper[i].thread,policy,&param))!=0)
+      printf("Error in pthread_setschedparam for %s helper %d: %s\n",team->name,i,strerror(rv));
+  }
+  team->nHelpers=i;
+  return 1;
+}
+
+void agb_cblas_teamRun(agbTeam *team){
+  /*Called by member 0: wake the helpers, and run the job as member 0,
+    returning once fn does (fn should end with agb_cblas_teamBarrier if the
+    caller needs all members to have finished).
+  */
+  if(team->nHelpers>0){//wake the helpers.
+    __atomic_add_fetch(&team->teamGen,1,__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&team->teamSleeping,__ATOMIC_SEQ_CST)>0){
+      pthread_mutex_lock(&team->teamMutex);
+      pthread_cond_broadcast(&team->teamCond);
+      pthread_mutex_unlock(&team->teamMutex);
+    }
+  }
+  team->fn(team->data,0,&team->sense);
+}
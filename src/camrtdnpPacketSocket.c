@@ -119,6 +119,7 @@ typedef struct{
   unsigned short *componentId;
   short *applicationTag;
   volatile int *pxlcnt;//NBUF*ncam
+  volatile int *pxlsReady;//ncam - pixels available for the frame darc is reading, published via camPixelsReady.
   volatile unsigned int *curSampleId;//NBUF*ncam;
   int *port;
   int *host;
@@ -159,6 +160,7 @@ void dofree(CamStruct *camstr){
     safefree(camstr->blocksize);
     safefree((void*)camstr->newframe);
     safefree((void*)camstr->pxlsTransferred);
+    safefree((void*)camstr->pxlsReady);
     safefree(camstr->thrStruct);
     safefree(camstr->threadPriority);
     safefree(camstr->threadAffinity);
@@ -439,6 +441,8 @@ void* camWorker(void *thrstrv){
 		  pxlcnt+=numPixelsInPacket;
 		  //todo: Can we remove this mutex somehow?
 		  camstr->pxlcnt[NBUF*cam+bufindx]=pxlcnt;
+		  if(bufindx==camstr->rtcReading[cam])
+		    camstr->pxlsReady[cam]=pxlcnt;
 		  if(pxlcnt>=camstr->npxlsArr[cam]){//all pixels have arrived...
 		    darc_mutex_lock(&camstr->camMutexWorker[cam]);
 		    if(camstr->mostRecentFilled[cam]!=-1)
@@ -461,6 +465,7 @@ void* camWorker(void *thrstrv){
 		  camstr->currentFilling[cam]=-1;
 		  camstr->newframe[cam]=1;
 		  camstr->camErr[NBUF*cam+bufindx]=1;
+		  camstr->pxlsReady[cam]=camstr->npxlsArr[cam];//let darc into camWaitPixels to see the error.
 		}
 	      }else if(type==0x4){//header packet
 		curMsgId=1;
@@ -492,6 +497,7 @@ void* camWorker(void *thrstrv){
 		  camstr->camErr[NBUF*cam+bufindx]=1;
 		  camstr->currentFilling[cam]=-1;
 		  camstr->newframe[cam]=1;
+		  camstr->pxlsReady[cam]=camstr->npxlsArr[cam];
 		}
 	      }else if(type!=0){
 		printf("Unrecognised rtdnp packet type %d\n",type);
@@ -611,6 +617,7 @@ int camOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,char
   TEST(camstr->blocksize=calloc(ncam,sizeof(int)));
   TEST(camstr->newframe=calloc(ncam,sizeof(int)));
   TEST(camstr->pxlsTransferred=calloc(ncam,sizeof(int)));
+  TEST(camstr->pxlsReady=calloc(ncam,sizeof(int)));
   TEST(camstr->thrStruct=calloc(ncam,sizeof(ThreadStruct)));
   TEST(camstr->camMutex=calloc(ncam,sizeof(darc_mutex_t)));
   TEST(camstr->camMutexWorker=calloc(ncam,sizeof(darc_mutex_t)));
@@ -972,8 +979,10 @@ inline int camNewFrameSync(void *camHandle,unsigned int thisiter,double starttim
     return 1;
   }
   camstr->thisiter=thisiter;
-  for(i=0;i<camstr->ncam; i++)
+  for(i=0;i<camstr->ncam; i++){
     camstr->newframe[i]=1;
+    camstr->pxlsReady[i]=0;
+  }
   return 0;
 }
 
@@ -1041,6 +1050,7 @@ inline int camWaitPixels(int n,int cam,void *camHandle){
     //wake the other threads for this camera that are waiting.
     if(rt==0){
       camstr->userFrameNo[cam*3]=camstr->curSampleId[NBUF*cam+camstr->rtcReading[cam]];
+      camstr->pxlsReady[cam]=camstr->pxlcnt[NBUF*cam+camstr->rtcReading[cam]];
     }
     camstr->frameReady[cam]=1;
     darc_mutex_unlock(&camstr->camMutexWorker[cam]);
@@ -1169,6 +1179,17 @@ inline int camWaitPixels(int n,int cam,void *camHandle){
   return rt;
 }
 
+/**
+   Publish the pixel counters, so that darc can wait for pixels without taking the camera mutex.
+*/
+int camPixelsReady(void *camHandle,volatile int **pxlsReady){
+  CamStruct *camstr=(CamStruct*)camHandle;
+  if(camHandle==NULL)
+    return 1;
+  *pxlsReady=camstr->pxlsReady;
+  return 0;
+}
+
 inline int camFrameFinishedSync(void *camHandle,int err,int forcewrite){//subap thread (once)
   int i;
   int bufindx;
@@ -73,6 +73,7 @@ typedef struct{
   unsigned int thisiter;
   unsigned short *imgdata;
   int *pxlsTransferred;//number of pixels copied into the RTC memory.
+  volatile int *pxlsReady;//number of pixels available for the frame being transferred - published to darc via camPixelsReady.
   pthread_t *threadid;
   int *port;//the port number to bind to
   unsigned int *userFrameNo;//pointer to the RTC frame number... to be updated for new frame.
@@ -152,6 +153,7 @@ void dofree(CamStruct *camstr){
     safefree((void*)camstr->waiting);
     safefree((void*)camstr->newframe);
     safefree(camstr->pxlsTransferred);
+    safefree((void*)camstr->pxlsReady);
     safefree(camstr->setFrameNo);
     safefree(camstr->port);
     safefree(camstr->thrStruct);
@@ -301,6 +303,8 @@ void* worker(void *thrstrv){
 	      pthread_mutex_lock(&camstr->m);
 	      camstr->err[NBUF*cam+(camstr->curframe&BUFMASK)]=err;
 	      camstr->pxlcnt[NBUF*cam+(camstr->curframe&BUFMASK)]=totLen/2;
+	      if(camstr->newframe[cam]==0 && camstr->frameReady[cam]==1 && camstr->transferframe==camstr->curframe)
+		camstr->pxlsReady[cam]=totLen/2;
 	      if(camstr->waiting[cam]==1){
 		//rtc waiting for pixels, so wake it up
 		camstr->waiting[cam]=0;
@@ -339,6 +343,8 @@ void* worker(void *thrstrv){
       }
     }
     camstr->err[NBUF*cam+(camstr->curframe&BUFMASK)]=err;
+    if(err && camstr->transferframe==camstr->curframe)
+      camstr->pxlsReady[cam]=camstr->npxlsArr[cam];//so that darc calls camWaitPixels and gets the error.
     if(err && camstr->waiting[cam]){//the rtc is waiting for newest pixels, so wake it up but an error has occurred.
       camstr->waiting[cam]=0;
       pthread_cond_broadcast(&camstr->cond[cam]);
@@ -448,6 +454,7 @@ int camOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,char
   TEST(camstr->waiting=calloc(ncam,sizeof(int)));
   TEST(camstr->newframe=calloc(ncam,sizeof(int)));
   TEST(camstr->pxlsTransferred=calloc(ncam,sizeof(int)));
+  TEST(camstr->pxlsReady=calloc(ncam,sizeof(int)));
   TEST(camstr->setFrameNo=calloc(ncam,sizeof(int)));
   TEST(camstr->port=calloc(ncam,sizeof(int)));
   TEST(camstr->err=calloc(ncam*NBUF,sizeof(int)));
@@ -757,8 +764,10 @@ int camNewFrameSync(void *camHandle,unsigned int thisiter,double starttime){
   camstr->thisiter=thisiter;
   //printf("New frame\n");
   camstr->newframeAll=1;
-  for(i=0;i<camstr->ncam; i++)
+  for(i=0;i<camstr->ncam; i++){
     camstr->newframe[i]=1;
+    camstr->pxlsReady[i]=0;
+  }
   camstr->last=camstr->transferframe;
   //printf("newframe\n");
   if(camstr->resync){//want to try to resynchronise cameras if get out of sync.
@@ -832,6 +841,10 @@ int camWaitPixels(int n,int cam,void *camHandle){
       camstr->newframeAll=0;
     }
     camstr->frameReady[cam]=1;
+    if(camstr->transferframe==camstr->curframe)
+      camstr->pxlsReady[cam]=camstr->pxlcnt[NBUF*cam+(camstr->transferframe&BUFMASK)];
+    else//a whole frame already here.
+      camstr->pxlsReady[cam]=camstr->npxlsArr[cam];
     pthread_cond_broadcast(&camstr->cond2[cam]);
   }else{
     //need to wait until camstr->last!=camstr->curframe, i.e. a new frame has started to be read.  Infact, wait until transferframe has been set.
@@ -931,6 +944,16 @@ int camWaitPixels(int n,int cam,void *camHandle){
   pthread_mutex_unlock(&camstr->m);
   return rt;
 }
+/**
+   Publish the pixel counters, so that darc can wait for pixels without taking the mutex.
+*/
+int camPixelsReady(void *camHandle,volatile int **pxlsReady){
+  CamStruct *camstr=(CamStruct*)camHandle;
+  if(camHandle==NULL)
+    return 1;
+  *pxlsReady=camstr->pxlsReady;
+  return 0;
+}
 int camFrameFinishedSync(void *camHandle,int err,int forcewrite){//subap thread (once)
   int i;
   CamStruct *camstr=(CamStruct*)camHandle;
@@ -32,6 +32,8 @@ Please note, these functions are not thread safe, and so must be called from a t
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 //#include <semaphore.h>
 
 
@@ -187,6 +189,25 @@ int circReshape(circBuf *cb,int nd, int *dims,char dtype){
 #define DATATYPE(cb,indx) *((char*)(&(((char*)cb->data)[indx*cb->frameSize+16])))
 #define THEDATA(cb,indx) &(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE])
 #define THEFRAME(cb,indx) &(((char*)cb->data)[indx*cb->frameSize])
+
+/**
+   Mark entry indx as being written (CIRCSEQ odd).  Can be called more than once before circSeqEnd (e.g. by circInsert and then circAddSize).
+*/
+void circSeqBegin(circBuf *cb,int indx){
+  unsigned int seq=2*(cb->nwritten+1)-1;
+  if(CIRCSEQ(cb,indx)!=seq){
+    __atomic_store_n(&CIRCSEQ(cb,indx),seq,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);//the sequence must be seen to change before the data does.
+  }
+}
+/**
+   Mark entry indx as complete - it is then the nwritten'th entry.  Must be called before LASTWRITTEN is updated.
+*/
+void circSeqEnd(circBuf *cb,int indx){
+  cb->nwritten++;
+  __atomic_store_n(&CIRCSEQ(cb,indx),2*cb->nwritten,__ATOMIC_RELEASE);
+}
+
 /**
    Add data which is of size, to the circular buffer.  This may not be a complete entry, but we add it anyway - e.g. status or error messages, which may not be of fixed length.
 */
@@ -222,6 +243,7 @@ int circAddSize(circBuf *cb,void *data,int size,int setzero,double timestamp,int
     indx=LASTWRITTEN(cb)+1;
     if(indx>=NSTORE(cb))
       indx=0;
+    circSeqBegin(cb,indx);
     memcpy(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE]),data,size<cb->datasize?size:cb->datasize);
     if(setzero==1 && size<cb->datasize){//set the rest to zero...
       memset(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE+size]),0,cb->datasize-size);
@@ -233,6 +255,7 @@ int circAddSize(circBuf *cb,void *data,int size,int setzero,double timestamp,int
     DATATYPE(cb,indx)=DTYPE(cb);
     //cb->timestamp[indx]=timestamp;//t1.tv_sec+t1.tv_usec*1e-6;
     //cb->frameNo[indx]=frameno;//cb->framecnt;
+    circSeqEnd(cb,indx);
     LASTWRITTEN(cb)=indx;
     //unblock futex
     darc_futex_broadcast(cb->futex);
@@ -257,6 +280,7 @@ int circAdd(circBuf *cb,void *data,double timestamp,int frameno){
     indx=LASTWRITTEN(cb)+1;
     if(indx>=NSTORE(cb))
       indx=0;
+    circSeqBegin(cb,indx);
     memcpy(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE]),data,cb->datasize);
     //gettimeofday(&t1,NULL);
     DATASIZE(cb,indx)=cb->datasize+CIRCHSIZE-4;
@@ -266,6 +290,7 @@ int circAdd(circBuf *cb,void *data,double timestamp,int frameno){
     //cb->timestamp[indx]=t1->tv_sec+t1->tv_usec*1e-6;
     //cb->timestamp[indx]=timestamp;
     //cb->frameNo[indx]=frameno;//cb->framecnt;
+    circSeqEnd(cb,indx);
     LASTWRITTEN(cb)=indx;
     darc_futex_broadcast(cb->futex);
   }
@@ -280,12 +305,14 @@ int circAddForce(circBuf *cb,void *data,double timestamp,int frameno){
   indx=LASTWRITTEN(cb)+1;
   if(indx>=NSTORE(cb))
     indx=0;
+  circSeqBegin(cb,indx);
   memcpy(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE]),data,cb->datasize);
   //gettimeofday(&t1,NULL);
   DATASIZE(cb,indx)=cb->datasize+CIRCHSIZE-4;
   FRAMENO(cb,indx)=frameno;
   TIMESTAMP(cb,indx)=timestamp;
   DATATYPE(cb,indx)=DTYPE(cb);
+  circSeqEnd(cb,indx);
   LASTWRITTEN(cb)=indx;
   darc_futex_broadcast(cb->futex);
   return err;
@@ -299,6 +326,7 @@ int circAddSizeForce(circBuf *cb,void *data,int size,int setzero,double timestam
   indx=LASTWRITTEN(cb)+1;
   if(indx>=NSTORE(cb))
     indx=0;
+  circSeqBegin(cb,indx);
   memcpy(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE]),data,size<cb->datasize?size:cb->datasize);
   if(setzero==1 && size<cb->datasize){//set the rest to zero
     memset(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE+size]),0,cb->datasize-size);
@@ -308,6 +336,7 @@ int circAddSizeForce(circBuf *cb,void *data,int size,int setzero,double timestam
   FRAMENO(cb,indx)=frameno;
   TIMESTAMP(cb,indx)=timestamp;
   DATATYPE(cb,indx)=DTYPE(cb);
+  circSeqEnd(cb,indx);
   LASTWRITTEN(cb)=indx;
   darc_futex_broadcast(cb->futex);
   return err;
@@ -322,14 +351,50 @@ int circInsert(circBuf *cb,void* data,int size, int offset){
   indx=LASTWRITTEN(cb)+1;
   if(indx>=NSTORE(cb))
     indx=0;
-  if(size+offset<=cb->datasize)
+  if(size+offset<=cb->datasize){
+    circSeqBegin(cb,indx);//the entry is no longer valid - circAddSize will publish it.
     memcpy(&(((char*)cb->data)[indx*cb->frameSize+CIRCHSIZE+offset]),data,size);
-  else
+  }else
     return 1;
   return 0;
   
 }
 
+/**
+   Zero copy adding: returns a pointer to the data part of the next entry, so that the producer can write into it directly, rather than into its own array followed by a circAdd.  The entry is marked as being written, so is unavailable to readers (which reduces the number of entries available to them by one), until circCommitSlot is called.  The pointer is valid until the entry is committed or the buffer reshaped, and can be used over several frames if the entry isn't committed.  Returns NULL if the buffer has no entries.
+*/
+void *circReserveSlot(circBuf *cb){
+  int indx;
+  if(cb==NULL || NSTORE(cb)<=0)
+    return NULL;
+  indx=LASTWRITTEN(cb)+1;
+  if(indx>=NSTORE(cb))
+    indx=0;
+  circSeqBegin(cb,indx);
+  return THEDATA(cb,indx);
+}
+
+/**
+   Publish the entry returned by circReserveSlot (whether or not it is required by the decimation - use circCheckAddRequired first if needed).
+*/
+int circCommitSlot(circBuf *cb,double timestamp,int frameno){
+  int indx;
+  if(cb==NULL || NSTORE(cb)<=0)
+    return 1;
+  indx=LASTWRITTEN(cb)+1;
+  if(indx>=NSTORE(cb))
+    indx=0;
+  circSeqBegin(cb,indx);//in case circReserveSlot wasn't called.
+  DATASIZE(cb,indx)=cb->datasize+CIRCHSIZE-4;
+  FRAMENO(cb,indx)=frameno;
+  TIMESTAMP(cb,indx)=timestamp;
+  DATATYPE(cb,indx)=DTYPE(cb);
+  circSeqEnd(cb,indx);
+  LASTWRITTEN(cb)=indx;
+  darc_futex_broadcast(cb->futex);
+  return 0;
+}
+
 /*
 int circAddPartial(circBuf *cb,void *data,int offset,int size,double timestamp,int frameno){
   //struct timeval t1;
@@ -569,6 +634,7 @@ void *circGetFrame(circBuf *cb,int indx){
   cb->lastReceived=indx;
   if(indx<0){
     cb->lastReceivedFrame=-1;
+    cb->lastReceivedSeq=0;
     return NULL;
   }
   //check arrays are right shape...
@@ -577,6 +643,7 @@ void *circGetFrame(circBuf *cb,int indx){
     return NULL;
   }
   cb->lastReceivedFrame=FRAMENO(cb,indx);
+  cb->lastReceivedSeq=__atomic_load_n(&CIRCSEQ(cb,indx),__ATOMIC_ACQUIRE);
   return THEFRAME(cb,indx);
 }
 
@@ -609,6 +676,62 @@ int circHeaderUpdated(circBuf *cb){
   return update;
 }
 
+/**
+   Make entry indx the one last received, counting any entries missed since the previous one in nOverrun.  If the entry is being written, the writer has caught up with us, so take the next (oldest complete) entry instead.
+*/
+static void *circTakeFrame(circBuf *cb,int indx){
+  unsigned int seq=__atomic_load_n(&CIRCSEQ(cb,indx),__ATOMIC_ACQUIRE);
+  int n;
+  if(seq&1){
+    indx=(indx+1)%NSTORE(cb);
+    seq=__atomic_load_n(&CIRCSEQ(cb,indx),__ATOMIC_ACQUIRE);
+  }
+  if(seq!=0 && cb->lastReceivedSeq!=0 && (n=(int)(seq-cb->lastReceivedSeq)/2-1)>0)
+    cb->nOverrun+=n;
+  cb->lastReceived=indx;
+  cb->lastReceivedSeq=seq;
+  cb->lastReceivedFrame=FRAMENO(cb,indx);
+  return THEFRAME(cb,indx);
+}
+
+/**
+   Whether entry indx (=lastReceived) has been rewritten since we received it.
+   If the sequence hasn't changed, the frame number is still checked, in case it was rewritten by something that doesn't maintain CIRCSEQ.
+*/
+static int circNewEntry(circBuf *cb,int indx,int frameno){
+  unsigned int seq=__atomic_load_n(&CIRCSEQ(cb,indx),__ATOMIC_ACQUIRE);
+  if(seq!=0 && cb->lastReceivedSeq!=0 && seq!=cb->lastReceivedSeq)
+    return 1;
+  return cb->lastReceivedFrame!=frameno;
+}
+
+/**
+   Check whether the entry last received (by circGetNextFrame, circGetFrame etc) has been, or is being, overwritten since it was received.  Returns 0 if not (or if the writer doesn't maintain CIRCSEQ), otherwise the number of entries it has been overrun by - in which case, anything read from it may be corrupt.
+*/
+int circCheckFrame(circBuf *cb){
+  unsigned int seq;
+  if(cb->lastReceived<0 || cb->lastReceivedSeq==0)
+    return 0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);//our reads of the data must complete before the sequence is read.
+  seq=__atomic_load_n(&CIRCSEQ(cb,cb->lastReceived),__ATOMIC_RELAXED);
+  if(seq==cb->lastReceivedSeq && (seq&1)==0)
+    return 0;
+  return (int)(seq+1-cb->lastReceivedSeq)/2>0?(int)(seq+1-cb->lastReceivedSeq)/2:1;
+}
+
+/**
+   Copy the entry last received, including its mini header, into dest (at most size bytes), and check that it wasn't overwritten during the copy.  Returns as circCheckFrame - if nonzero, the copy should be discarded, and it is counted in nOverrun.
+*/
+int circCopyFrame(circBuf *cb,void *dest,int size){
+  int n,rt;
+  if(cb->lastReceived<0)
+    return 0;
+  n=cb->frameSize<size?cb->frameSize:size;
+  memcpy(dest,THEFRAME(cb,cb->lastReceived),n);
+  if((rt=circCheckFrame(cb))!=0)
+    cb->nOverrun++;
+  return rt;
+}
 
 void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
   //Look at lastReceived and lastWritten, and then send if not equal, otherwise wait...
@@ -621,6 +744,7 @@ void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
     if(circHeaderUpdated(cb)){//self.nstoreSave!=self.nstore[0] or self.ndimSave!=self.ndim[0] or (not numpy.alltrue(self.shapeArrSave==self.shapeArr[:self.ndim[0]])) or self.dtypeSave!=self.dtype[0]:
       cb->lastReceived=-1;
       cb->lastReceivedFrame=-1;
+      cb->lastReceivedSeq=0;
     }
     lw=LASTWRITTEN(cb);//int(self.lastWritten[0])
     if(lw>=0){
@@ -630,17 +754,14 @@ void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
     }
     if(lw<0){//no frame written yet - so block, waiting.
     }else if(lw==cb->lastReceived){
-      //If the buffer has been reshaped, this might be the case even if new data has arrived.  So, we should also check the frame numbers here.  Also if the buffer has wrapped round...
-      if(cb->lastReceivedFrame!=lwf){//probably new data
-	cb->lastReceivedFrame=lwf;
-	data=THEFRAME(cb,cb->lastReceived);
+      //If the buffer has been reshaped, this might be the case even if new data has arrived.  So, we should also check the sequence (or if not available, frame numbers) here.  Also if the buffer has wrapped round...
+      if(circNewEntry(cb,lw,lwf)){//new data
+	data=circTakeFrame(cb,lw);
       }else{
 	//printf("circGetNextFrame no new data\n");
       }
     }else{
-      cb->lastReceived=(cb->lastReceived+1)%NSTORE(cb);
-      cb->lastReceivedFrame=FRAMENO(cb,cb->lastReceived);
-      data=THEFRAME(cb,cb->lastReceived);
+      data=circTakeFrame(cb,(cb->lastReceived+1)%NSTORE(cb));
     }
     if(data==NULL){
       if(ftimeout==0)
@@ -663,6 +784,7 @@ void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
 	if(circHeaderUpdated(cb)){//has been remade.
 	  cb->lastReceived=-1;
 	  cb->lastReceivedFrame=-1;
+	  cb->lastReceivedSeq=0;
 	}
 	lw=LASTWRITTEN(cb);
 	if(lw>=0)
@@ -672,14 +794,11 @@ void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
 	//printf("lw now %d lr %d lwf %d\n",lw,cb->lastReceived,lwf);
 	if(lw<0){//no frame yet written - do nothing.
 	}else if(lw==cb->lastReceived){
-	  if(cb->lastReceivedFrame!=lwf){//probably new data
-	    cb->lastReceivedFrame=lwf;
-	    data=THEFRAME(cb,cb->lastReceived);
+	  if(circNewEntry(cb,lw,lwf)){//new data
+	    data=circTakeFrame(cb,lw);
 	  }
 	}else{
-	  cb->lastReceived=(cb->lastReceived+1)%NSTORE(cb);
-	  cb->lastReceivedFrame=FRAMENO(cb,cb->lastReceived);
-	  data=THEFRAME(cb,cb->lastReceived);
+	  data=circTakeFrame(cb,(cb->lastReceived+1)%NSTORE(cb));
 	  //printf("Data is for frame %d (frameno %d, framesize %d datsize %d)\n",cb->lastReceived,cb->lastReceivedFrame,cb->frameSize,cb->datasize);
 	}
       }else if(errno==EAGAIN || timeup==ETIMEDOUT){//timeout
@@ -698,6 +817,109 @@ void *circGetNextFrame(circBuf *cb,float ftimeout,int retry){
   return data;
 }
 
+static int circShmHuge=0;//whether to ask for (transparent) huge pages for new buffers
+static int circShmNode=-1;//numa node for new buffers, or -1 for the default (first touch) placement.
+
+void circSetShmPlacement(int huge,int numaNode){
+  /*Set how the shared memory of buffers subsequently opened by this process (openCircBuf, and the rtc parameter buffers) is placed - huge pages, and/or on a given numa node.  Called once at startup: prints what is available, and falls back to normal pages/placement for anything that isn't.
+  Note, huge pages for /dev/shm are transparent huge pages, which are only used if /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise, within_size or always (or /dev/shm is mounted with huge=).  hugetlbfs can't be used, since clients open the buffers through /dev/shm.
+  */
+  FILE *fd;
+  char line[80],*s,*e;
+  if(huge){
+    if((fd=fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled","r"))==NULL){
+      printf("Huge pages for shared memory not available (no shmem_enabled) - using normal pages\n");
+      huge=0;
+    }else{
+      if(fgets(line,80,fd)!=NULL && (s=strchr(line,'['))!=NULL && (e=strchr(s,']'))!=NULL){
+	*e='\0';
+	s++;
+	if(strcmp(s,"never")==0 || strcmp(s,"deny")==0){
+	  printf("Huge pages for shared memory disabled (shmem_enabled is %s, needs to be advise) - using normal pages\n",s);
+	  huge=0;
+	}else
+	  printf("Using transparent huge pages for shared memory (shmem_enabled is %s)\n",s);
+      }
+      fclose(fd);
+    }
+  }
+  if(numaNode>=0){
+    snprintf(line,80,"/sys/devices/system/node/node%d",numaNode);
+    if(access(line,F_OK)!=0){
+      printf("NUMA node %d not present - using default placement for shared memory\n",numaNode);
+      numaNode=-1;
+    }else if(numaNode>=(int)(sizeof(unsigned long)*8*4)){
+      printf("NUMA node %d too large - using default placement for shared memory\n",numaNode);
+      numaNode=-1;
+    }else
+      printf("Placing shared memory on NUMA node %d\n",numaNode);
+  }
+  circShmHuge=huge;
+  circShmNode=numaNode;
+}
+
+static long circShmHugeSize(char *buf,long size){
+  /*Returns the number of kB of buf that is mapped with huge pages, from /proc/self/smaps, or -1 if this can't be read.
+  */
+  FILE *fd;
+  char line[256];
+  unsigned long start,end,from=(unsigned long)buf,to=(unsigned long)buf+size;
+  long kb,huge=0;
+  int inbuf=0;
+  if((fd=fopen("/proc/self/smaps","r"))==NULL)
+    return -1;
+  while(fgets(line,256,fd)!=NULL){
+    if(sscanf(line,"%lx-%lx ",&start,&end)==2)//start of a new mapping
+      inbuf=(start<to && end>from);
+    else if(inbuf && (sscanf(line,"ShmemPmdMapped: %ld",&kb)==1 || sscanf(line,"FilePmdMapped: %ld",&kb)==1 || sscanf(line,"AnonHugePages: %ld",&kb)==1))
+      huge+=kb;
+  }
+  fclose(fd);
+  return huge;
+}
+
+int circShmPrepare(char *name,char *buf,long size,int numaNode){
+  /*Clear a newly mapped shared memory region (which also faults the pages in), having first applied the huge page and numa placement set by circSetShmPlacement.  If numaNode>=0, it is used in place of the default node.
+  Returns 0 if the memory was placed as requested, 1 if not (a message is printed) - in which case the memory can still be used.
+  */
+  int rt=0;
+  int node=-1;
+  unsigned long mask[4];
+  if(numaNode<0)
+    numaNode=circShmNode;
+  if(circShmHuge && size>=2*1024*1024){
+    if(madvise(buf,size,MADV_HUGEPAGE)!=0){
+      printf("madvise(MADV_HUGEPAGE) failed for %s: %s - using normal pages\n",name,strerror(errno));
+      rt=1;
+    }
+  }
+  if(numaNode>=0){
+    memset(mask,0,sizeof(mask));
+    mask[numaNode/(sizeof(unsigned long)*8)]=1UL<<(numaNode%(sizeof(unsigned long)*8));
+    //MOVE_ALL migrates any pages already faulted in (e.g. an existing buffer being reopened), but needs CAP_SYS_NICE - else move those only mapped by us.
+    if(syscall(SYS_mbind,buf,size,MPOL_PREFERRED,mask,sizeof(mask)*8+1,MPOL_MF_MOVE_ALL)!=0 && (errno!=EPERM || syscall(SYS_mbind,buf,size,MPOL_PREFERRED,mask,sizeof(mask)*8+1,MPOL_MF_MOVE)!=0)){
+      printf("mbind to numa node %d failed for %s: %s\n",numaNode,name,strerror(errno));
+      rt=1;
+    }
+  }
+  memset(buf,0,size);
+  if(numaNode>=0 && rt==0){//check where the memory ended up.
+    if(syscall(SYS_get_mempolicy,&node,NULL,0,&buf[size/2],MPOL_F_NODE|MPOL_F_ADDR)==0 && node!=numaNode){
+      printf("Warning: %s placed on numa node %d, not %d (node full?)\n",name,node,numaNode);
+      rt=1;
+    }
+  }
+  if(circShmHuge && size>=2*1024*1024 && rt==0){//check whether huge pages were actually used.
+    long huge=circShmHugeSize(buf,size);
+    if(huge==0){
+      printf("Warning: %s not using huge pages (check shmem_enabled, and available memory)\n",name);
+      rt=1;
+    }else if(huge>0)
+      printf("%s: %ld of %ld kB in huge pages\n",name,huge,size/1024);
+  }
+  return rt;
+}
+
 //circOpen
 circBuf* openCircBuf(char *name,int nd,int *dims,char dtype,int nstore){
   //opens a circbuf for writing.
@@ -750,7 +972,7 @@ circBuf* openCircBuf(char *name,int nd,int *dims,char dtype,int nstore){
     return NULL;
   }
   //printf("mmap done buf=%p now calling memset(buf,0,%d)\n",buf,size);
-  memset(buf,0,size);
+  circShmPrepare(name,(char*)buf,size,-1);
   //printf("done memset of mmap buffer\n");
   if((cb=circAssign(name,buf,size,semid,nd,dim,dtype,NULL))==NULL){
     printf("Could not create %s circular buffer object\n",name);
@@ -92,6 +92,13 @@ enum circFlagEnum{CIRCPXL,CIRCCALPXL,CIRCCENT,CIRCFLUX,CIRCSUBLOC,CIRCMIRROR,CIR
 #define PRINTTIMING(NAME)
 #endif
 
+#define PXLSPIN 100000//pause loops spent spinning on camPxlsReady before falling back to blocking in camWaitPixels.
+#if defined(__x86_64__) || defined(__i386__)
+#define PXLPAUSE() __builtin_ia32_pause()
+#else
+#define PXLPAUSE()
+#endif
+
 /**
    Write an error to the circular buffer which will then wake clients.
  */
@@ -187,6 +194,146 @@ int computeNStore(int nstore,int maxmem,int framesize,int minstore,int maxstore)
   return ns;
 }
 
+static const char *telemetryStreamNames[TELEMETRYNSTREAM]={"rtcPxlBuf","rtcCalPxlBuf","rtcCentBuf","rtcFluxBuf","rtcSubLocBuf","rtcMirrorBuf","rtcActuatorBuf","rtcStatusBuf","rtcTimeBuf","rtcThreadTimeBuf"};//in circFlagEnum order.
+
+/**
+   Parse telemetryDefer - a string of stream names separated by spaces or commas - into circAddFlags bits.
+*/
+int telemetryParseDefer(char *str,int nb){
+  int flags=0,i,len,start=0,end;
+  while(start<nb && str[start]!='\0'){
+    if(str[start]==' ' || str[start]==','){
+      start++;
+      continue;
+    }
+    end=start;
+    while(end<nb && str[end]!='\0' && str[end]!=' ' && str[end]!=',')
+      end++;
+    len=end-start;
+    for(i=0;i<TELEMETRYNSTREAM;i++){
+      if(strlen(telemetryStreamNames[i])==len && strncmp(telemetryStreamNames[i],&str[start],len)==0)
+	break;
+    }
+    if(i==CIRCACTUATOR || i==CIRCCALPXL){
+      printf("telemetryDefer: %s can't be deferred (written by the mirror library, or in place)\n",telemetryStreamNames[i]);
+    }else if(i==TELEMETRYNSTREAM){
+      printf("telemetryDefer: unknown stream %.*s\n",len,&str[start]);
+    }else
+      flags|=1<<i;
+    start=end;
+  }
+  return flags;
+}
+
+/**
+   Add an entry to a telemetry stream, replacing circAddForce in the frame path.
+   If the stream is deferred (telemetryDefer), the data is copied into a private ring, and later published by the telemetry thread - so the frame path doesn't write to shared memory or wake the clients.  If the telemetry thread has fallen behind, the entry is dropped.  Otherwise the entry is added here, as before.
+   Each stream must only be added from one thread at a time (as for circAddForce).
+*/
+int telemetryAdd(globalStruct *glob,int stream,circBuf *cb,void *data,double timestamp,int frameno){
+  TelemetryWriter *tw=glob->telemetry;
+  TelemetryStream *ts;
+  void *tmp;
+  int i,n;
+  if(cb==NULL)
+    return 1;
+  if(tw==NULL)
+    return circAddForce(cb,data,timestamp,frameno);
+  ts=&tw->stream[stream];
+  if((glob->telemetryDeferFlags&(1<<stream))==0){
+    for(i=0;i<TELEMETRYNBUF && __atomic_load_n(&ts->ready[i],__ATOMIC_ACQUIRE)==0;i++);
+    if(i<TELEMETRYNBUF){//no longer deferred, but entries still waiting - drop them, so that the buffer has one writer.
+      pthread_mutex_lock(&tw->mutex);
+      n=0;
+      for(i=0;i<TELEMETRYNBUF;i++){
+	n+=ts->ready[i];
+	ts->ready[i]=0;
+      }
+      ts->tail=ts->head;
+      ts->ndropped+=n;
+      pthread_mutex_unlock(&tw->mutex);
+    }
+    return circAddForce(cb,data,timestamp,frameno);
+  }
+  i=ts->head;
+  if(__atomic_load_n(&ts->ready[i],__ATOMIC_ACQUIRE)){//telemetry thread is behind.
+    ts->ndropped++;
+    return 1;
+  }
+  if(ts->memsize[i]<cb->datasize){
+    if((tmp=realloc(ts->data[i],cb->datasize))==NULL){
+      printf("telemetryAdd: unable to allocate %d bytes for %s\n",cb->datasize,telemetryStreamNames[stream]);
+      ts->ndropped++;
+      return 1;
+    }
+    ts->data[i]=tmp;
+    ts->memsize[i]=cb->datasize;
+  }
+  memcpy(ts->data[i],data,cb->datasize);
+  ts->cb[i]=cb;
+  ts->size[i]=cb->datasize;
+  ts->timestamp[i]=timestamp;
+  ts->frameno[i]=frameno;
+  __atomic_store_n(&ts->ready[i],1,__ATOMIC_RELEASE);
+  ts->head=(i+1)%TELEMETRYNBUF;
+  return 0;
+}
+
+/**
+   Wake the telemetry thread if it is asleep.  Called once per frame (at the end of post processing), so that deferred streams cost at most one wakeup per frame, rather than one per stream.
+*/
+void telemetryWake(globalStruct *glob){
+  TelemetryWriter *tw=glob->telemetry;
+  if(tw==NULL || glob->telemetryDeferFlags==0)
+    return;
+  __atomic_add_fetch(&tw->futex,1,__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&tw->waiting,__ATOMIC_SEQ_CST))
+    darc_futex_signal(&tw->futex);
+}
+
+/**
+   The telemetry thread - publishes the entries of deferred streams into their circular buffers, and wakes the clients.  Runs with the affinity and (non real-time) scheduling of the main darc thread.
+*/
+void *telemetryThread(void *globv){
+  globalStruct *glob=(globalStruct*)globv;
+  TelemetryWriter *tw=glob->telemetry;
+  TelemetryStream *ts;
+  struct timespec timeout;
+  int i,j,val;
+  int nreported[TELEMETRYNSTREAM];
+  memset(nreported,0,sizeof(nreported));
+  while(tw->go){
+    val=__atomic_load_n(&tw->futex,__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&tw->mutex);
+    for(i=0;i<TELEMETRYNSTREAM;i++){
+      ts=&tw->stream[i];
+      while(__atomic_load_n(&ts->ready[ts->tail],__ATOMIC_ACQUIRE)){
+	j=ts->tail;
+	if(ts->cb[j]->datasize==ts->size[j])//not reshaped since.
+	  circAddForce(ts->cb[j],ts->data[j],ts->timestamp[j],ts->frameno[j]);
+	__atomic_store_n(&ts->ready[j],0,__ATOMIC_RELEASE);
+	ts->tail=(j+1)%TELEMETRYNBUF;
+      }
+    }
+    pthread_mutex_unlock(&tw->mutex);
+    for(i=0;i<TELEMETRYNSTREAM;i++){
+      j=tw->stream[i].ndropped;
+      if(j!=nreported[i]){
+	printf("telemetry: %d %s entries dropped (telemetry thread behind)\n",j-nreported[i],telemetryStreamNames[i]);
+	nreported[i]=j;
+      }
+    }
+    __atomic_store_n(&tw->waiting,1,__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&tw->futex,__ATOMIC_SEQ_CST)==val){
+      timeout.tv_sec=0;
+      timeout.tv_nsec=100000000;//so that deferred entries of the last frame before a pause still get sent.
+      darc_futex_timedwait_if_value(&tw->futex,val,&timeout);
+    }
+    __atomic_store_n(&tw->waiting,0,__ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
 /**
    This is called before the main processing threads do their jobs, so that they are forced to wait for post processing to finish such that the arrays can be rewritten.
    Note - *StartFrameFn and *NewFrameSyncFn will already have been called, and *NewFrameFn may or may not have been called.
@@ -265,8 +412,8 @@ int computePixelsRequired(threadStruct *threadInfo){
   return maxpxl;
 }
 
-int waitPixels(threadStruct *threadInfo){
-  int rt=0;
+int waitPixels(threadStruct *threadInfo,int spin){
+  int rt=0,i;
   globalStruct *glob=threadInfo->globals;
   infoStruct *info=threadInfo->info;
   int cnt;
@@ -275,6 +422,12 @@ int waitPixels(threadStruct *threadInfo){
     cnt=(*glob->camComputePixelsFn)(info->subapLocation,threadInfo->nsubapsProcessing,threadInfo->cursubindx,info->cam,glob->camHandle);
   else//use the default calculation
     cnt=computePixelsRequired(threadInfo);
+  //If the camera library publishes its pixel count, spin on this rather than blocking inside the library.  The thread that takes the first chunk of a frame doesn't, since the library may only start its frame during that camWaitPixels call.
+  //The spin is bounded, so that if the camera stalls or never reaches cnt (or darc is stopping), camWaitPixels does the waiting, and reports any error.
+  if(spin && glob->camPxlsReady!=NULL){
+    for(i=0;i<PXLSPIN && glob->camPxlsReady[info->cam]<cnt && glob->go;i++)
+      PXLPAUSE();
+  }
   //Then wait until this many have arrived.
   if(glob->camWaitPixelsFn!=NULL){
     rt=(*glob->camWaitPixelsFn)(cnt,info->cam,glob->camHandle);
@@ -295,7 +448,30 @@ int waitNextSubaps(threadStruct *threadInfo){
   int endFrame=0,i,cnt=0,npxls=0;
   //int centindx;
   int subindx,skip=0;
-  if(glob->subapAllocationArr==NULL){
+  int *chunk;
+  if(glob->subapAllocationArr==NULL && glob->subapScheduling!=0 && info->chunkList!=NULL){
+    //Chunks were computed at buffer swap - claim the next one.  No mutex is held while waiting for pixels, so other threads can claim later chunks (and wait for their pixels) at the same time.
+    if(info->frameFinished==1)
+      return -1;
+    i=__sync_fetch_and_add(&info->chunkCursor,1);
+    if(i>=info->nchunks){
+      threadInfo->frameFinished=1;
+      return -1;
+    }
+    chunk=&info->chunkList[i*5];
+    threadInfo->cursubindx=chunk[0];
+    threadInfo->nsubapsProcessing=chunk[1];
+    threadInfo->nsubapsDoing=chunk[2];
+    threadInfo->centindx=chunk[3];
+    threadInfo->nsubs=chunk[3]+2*chunk[2]-info->centCumIndx;
+    if(i==info->nchunks-1)//last chunk - this thread still processes it, but others shouldn't wait for more.
+      info->frameFinished=1;
+    endFrame=waitPixels(threadInfo,glob->subapScheduling==2 && i>0);
+    if(endFrame){
+      info->frameFinished=1;
+      writeErrorVA(glob->rtcErrorBuf,CAMGETERROR,glob->thisiter,"Error - getting camera pixels");
+    }
+  }else if(glob->subapAllocationArr==NULL){
     //Any thread can process any subap for its camera.
     //Threads run in order, and are returned a subap as it becomes available...
     //first block in the thread queue until it is my turn.
@@ -360,7 +536,7 @@ int waitNextSubaps(threadStruct *threadInfo){
       //  npxls=updateSubapLocation(threadInfo);
       //}
       //npxls=computePixelsRequired(threadInfo);
-      endFrame=waitPixels(threadInfo);//info->pxlCnt[threadInfo->cursubindx+info->nsubapsTogether-1]+extrapxl,threadInfo);
+      endFrame=waitPixels(threadInfo,0);//info->pxlCnt[threadInfo->cursubindx+info->nsubapsTogether-1]+extrapxl,threadInfo);
       dprintf("waited pixels\n");
       if(endFrame){
 	info->frameFinished=1;//added 180514
@@ -410,7 +586,7 @@ int waitNextSubaps(threadStruct *threadInfo){
 	threadInfo->frameFinished=1;
       }
       //npxls=computePixelsRequired(threadInfo);
-      endFrame=waitPixels(threadInfo);
+      endFrame=waitPixels(threadInfo,0);
       if(endFrame){
 	info->frameFinished=1;//added 180514
 	writeErrorVA(glob->rtcErrorBuf,CAMGETERROR,glob->thisiter,"Error - getting camera pixels");
@@ -420,6 +596,43 @@ int waitNextSubaps(threadStruct *threadInfo){
   return endFrame;
 }
 
+/**
+   Calibrates and computes slopes for the subaps obtained by waitNextSubaps, using the batch library functions.  Only the valid subaps are passed, with their slope indices, and the calibration library returns the layout of the subap arena, so the slope library doesn't have to recompute it.
+   @return 0 on success, 1 on error.
+*/
+int processSubapBatch(threadStruct *threadInfo){
+  globalStruct *glob=threadInfo->globals;
+  int i,n=0,centindx=threadInfo->centindx;
+  int *subapIndx,*slopeIndx,*subapInfo;
+  if(threadInfo->batchSize<threadInfo->nsubapsDoing){
+    if(threadInfo->batchIndx!=NULL)
+      free(threadInfo->batchIndx);
+    if((threadInfo->batchIndx=malloc(sizeof(int)*5*threadInfo->nsubapsDoing))==NULL){
+      printf("Unable to allocate batchIndx\n");
+      threadInfo->batchSize=0;
+      return 1;
+    }
+    threadInfo->batchSize=threadInfo->nsubapsDoing;
+  }
+  subapIndx=threadInfo->batchIndx;
+  slopeIndx=&threadInfo->batchIndx[threadInfo->batchSize];
+  subapInfo=&threadInfo->batchIndx[threadInfo->batchSize*2];
+  for(i=0; i<threadInfo->nsubapsProcessing; i++){
+    if(glob->subapFlagArr[threadInfo->cursubindx+i]==1){
+      subapIndx[n]=threadInfo->cursubindx+i;
+      slopeIndx[n]=centindx;
+      centindx+=2;
+      n++;
+    }
+  }
+  if((*glob->calibrateNewSubapBatchFn)(glob->calibrateHandle,threadInfo->info->cam,threadInfo->threadno,n,subapIndx,&threadInfo->subap,&threadInfo->subapSize,subapInfo)!=0)
+    return 1;
+  if((*glob->centCalcSlopeBatchFn)(glob->centHandle,threadInfo->info->cam,threadInfo->threadno,threadInfo->nsubs,n,subapIndx,slopeIndx,threadInfo->subap,threadInfo->subapSize,subapInfo)==1){
+    writeErrorVA(glob->rtcErrorBuf,SLOPEERROR,glob->thisiter,"Error getting slopes");
+    return 1;
+  }
+  return 0;
+}
 
 /**
    Called after processing of the actuator values has completed.
@@ -552,7 +765,7 @@ int sendActuators(PostComputeData *p,globalStruct *glob){
   if(p->pxlCentInputError==0){
     //we send the dmCommand here, because sendActuators can alter this depending on the bleed gain... and we don't want that to be seen - this is the result of the reconstruction process only...
     if(p->circAddFlags&(1<<CIRCMIRROR))
-      circAddForce(glob->rtcMirrorBuf,p->dmCommand,p->timestamp,p->thisiter);//actsSent);
+      telemetryAdd(glob,CIRCMIRROR,glob->rtcMirrorBuf,p->dmCommand,p->timestamp,p->thisiter);//actsSent);
   }
   resetRecon=0;
   if(userActs==NULL || addUserActs!=0){
@@ -1554,6 +1767,23 @@ int updateBuffer(globalStruct *globals){
       }
       globals->subapAllocationArr=NULL;
     }
+    i=SUBAPSCHEDULING;
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=0 && *((int*)values[i])<=2){
+      globals->subapScheduling=*((int*)values[i]);
+    }else{
+      printf("warning - subapScheduling incorrect\n");
+      globals->subapScheduling=0;
+    }
+    i=TELEMETRYDEFER;
+    if(nbytes[i]==0){
+      globals->telemetryDeferFlags=0;
+    }else if(dtype[i]=='s'){
+      globals->telemetryDeferFlags=telemetryParseDefer((char*)values[i],nbytes[i]);
+    }else{
+      printf("telemetryDefer error\n");
+      globals->telemetryDeferFlags=0;
+      err=i;
+    }
     i=ADAPWINSHIFTCNT;
     if(dtype[i]=='i' && nbytes[i]==globals->nsubaps*2*sizeof(int)){
       globals->adapWinShiftCnt=(int*)values[i];
@@ -1576,6 +1806,62 @@ int updateBuffer(globalStruct *globals){
 
     return err;
 }
+/**
+   Used when subapScheduling!=0.  Splits the subaps for this camera into chunks, in the same way as the mutex queue in waitNextSubaps does (consecutive subaps requiring the same number of pixels), so that threads can then claim them without taking the subapMutex.
+   If subapScheduling==2, the chunks are then ordered by pxlCnt, so that they are handed out in the order that their pixels arrive.
+   Called at buffer swap by the first thread for this camera.
+*/
+void computeChunkList(infoStruct *info,globalStruct *globals){
+  int s=0,i,j,cnt,centindx=info->centCumIndx;
+  int *pxlCnt=&globals->pxlCnt[info->subCumIndx];
+  int *tmp;
+  int chunk[5];
+  info->nchunks=0;
+  while(s<info->nsub){
+    while(s<info->nsub && info->subflag[s]==0)
+      s++;//skip unused subaps
+    if(s>=info->nsub)
+      break;
+    i=0;
+    cnt=0;
+    while(i<info->nsub-s && (info->subflag[s+i]==0 || pxlCnt[s]==pxlCnt[s+i])){
+      cnt+=info->subflag[s+i];
+      i++;
+    }
+    if(info->nchunks>=info->chunkListSize){
+      if((tmp=realloc(info->chunkList,sizeof(int)*5*(info->chunkListSize+64)))==NULL){
+	printf("Error allocating chunkList - reverting to subapMutex scheduling\n");
+	free(info->chunkList);
+	info->chunkList=NULL;
+	info->chunkListSize=0;
+	info->nchunks=0;
+	return;
+      }
+      info->chunkList=tmp;
+      info->chunkListSize+=64;
+    }
+    tmp=&info->chunkList[info->nchunks*5];
+    tmp[0]=s+info->subCumIndx;
+    tmp[1]=i;
+    tmp[2]=cnt;
+    tmp[3]=centindx;
+    tmp[4]=pxlCnt[s];
+    info->nchunks++;
+    centindx+=2*cnt;
+    s+=i;
+  }
+  if(globals->subapScheduling==2){
+    //Stable insertion sort on pxlCnt - usually already (nearly) in order, so cheap.
+    for(i=1; i<info->nchunks; i++){
+      memcpy(chunk,&info->chunkList[i*5],sizeof(int)*5);
+      for(j=i; j>0 && info->chunkList[(j-1)*5+4]>chunk[4]; j--)
+	memcpy(&info->chunkList[j*5],&info->chunkList[(j-1)*5],sizeof(int)*5);
+      memcpy(&info->chunkList[j*5],chunk,sizeof(int)*5);
+    }
+  }
+  info->chunkCursor=0;
+}
+
 void updateInfo(threadStruct *threadInfo){
   infoStruct *info=threadInfo->info;
   globalStruct *globals=threadInfo->globals;
@@ -1602,7 +1888,8 @@ void updateInfo(threadStruct *threadInfo){
     info->centCumIndx+=globals->subapFlagArr[j];
   }
   info->centCumIndx*=2;
-
+  if(globals->subapScheduling!=0 && globals->subapAllocationArr==NULL)
+    computeChunkList(info,globals);
 }
 
 /**
@@ -1675,6 +1962,9 @@ int updateCalibrateLibrary(globalStruct *glob){
 	if((*(void**)(&glob->calibrateNewSubapFn)=dlsym(glob->calibrateLib,"calibrateNewSubap"))==NULL){
 	  printf("dlsym failed for calibrateNewSubap (non-fatal)\n");
 	}else{nsym++;}
+	if((*(void**)(&glob->calibrateNewSubapBatchFn)=dlsym(glob->calibrateLib,"calibrateNewSubapBatch"))==NULL){
+	  printf("dlsym failed for calibrateNewSubapBatch (non-fatal)\n");
+	}else{nsym++;}
 	if((*(void**)(&glob->calibrateEndFrameFn)=dlsym(glob->calibrateLib,"calibrateEndFrame"))==NULL){
 	  printf("dlsym failed for calibrateEndFrame (non-fatal)\n");
 	}else{nsym++;}
@@ -1723,6 +2013,7 @@ int updateCalibrateLibrary(globalStruct *glob){
       glob->calibrateNewFrameSyncFn=NULL;
       glob->calibrateStartFrameFn=NULL;
       glob->calibrateNewSubapFn=NULL;
+      glob->calibrateNewSubapBatchFn=NULL;
       glob->calibrateEndFrameFn=NULL;
       glob->calibrateFrameFinishedFn=NULL;
       glob->calibrateFrameFinishedSyncFn=NULL;
@@ -1810,6 +2101,9 @@ int updateCentLibrary(globalStruct *glob){
 	if((*(void**)(&glob->centCalcSlopeFn)=dlsym(glob->centLib,"slopeCalcSlope"))==NULL){
 	  printf("dlsym failed for slopeCalcSlope (non-fatal)\n");
 	}else{nsym++;}
+	if((*(void**)(&glob->centCalcSlopeBatchFn)=dlsym(glob->centLib,"slopeCalcSlopeBatch"))==NULL){
+	  printf("dlsym failed for slopeCalcSlopeBatch (non-fatal)\n");
+	}else{nsym++;}
 	if((*(void**)(&glob->centEndFrameFn)=dlsym(glob->centLib,"slopeEndFrame"))==NULL){
 	  printf("dlsym failed for slopeEndFrame (non-fatal)\n");
 	}else{nsym++;}
@@ -1858,6 +2152,7 @@ int updateCentLibrary(globalStruct *glob){
       glob->centNewFrameSyncFn=NULL;
       glob->centStartFrameFn=NULL;
       glob->centCalcSlopeFn=NULL;
+      glob->centCalcSlopeBatchFn=NULL;
       glob->centEndFrameFn=NULL;
       glob->centFrameFinishedFn=NULL;
       glob->centFrameFinishedSyncFn=NULL;
@@ -2133,6 +2428,7 @@ int updateCameraLibrary(globalStruct *glob){
       if(glob->camCloseFn!=NULL)
 	(*glob->camCloseFn)(&glob->camHandle);
       glob->camHandle=NULL;
+      glob->camPxlsReady=NULL;
       if(dlclose(glob->cameraLib)!=0){
 	printf("Failed to close camera dynamic library - ignoring\n");
       }
@@ -2179,6 +2475,9 @@ int updateCameraLibrary(globalStruct *glob){
 	if((*(void**)(&glob->camComputePixelsFn)=dlsym(glob->cameraLib,"camComputePixels"))==NULL){
 	  printf("dlsym failed for camComputePixels\n");
 	}else{nsym++;}
+	if((*(void**)(&glob->camPixelsReadyFn)=dlsym(glob->cameraLib,"camPixelsReady"))==NULL){
+	  printf("dlsym failed for camPixelsReady (non-fatal)\n");
+	}else{nsym++;}
 	if((*(void**)(&glob->camNewParamFn)=dlsym(glob->cameraLib,"camNewParam"))==NULL){
 	  printf("camera library has no newParam function - continuing...\n");
 	  //this is now an error, just a warning.
@@ -2213,6 +2512,9 @@ int updateCameraLibrary(globalStruct *glob){
 	    printf("Faild to close camera library - ignoring\n");
 	  }
 	  glob->cameraLib=NULL;
+	}else if(glob->camPixelsReadyFn!=NULL && (*glob->camPixelsReadyFn)(glob->camHandle,&glob->camPxlsReady)!=0){
+	  printf("camPixelsReady failed - ignoring\n");
+	  glob->camPxlsReady=NULL;
 	}
       }
       if(glob->cameraLib==NULL){
@@ -2236,6 +2538,8 @@ int updateCameraLibrary(globalStruct *glob){
       glob->camNewFrameSyncFn=NULL;
       glob->camWaitPixelsFn=NULL;
       glob->camComputePixelsFn=NULL;
+      glob->camPixelsReadyFn=NULL;
+      glob->camPxlsReady=NULL;
       glob->camNewParamFn=NULL;
       glob->camStartFrameFn=NULL;
       glob->camEndFrameFn=NULL;
@@ -2556,16 +2860,19 @@ int updateMemory(globalStruct *glob){
   }
 
   if(arr->calpxlbufSize<glob->totPxls){
-    if(arr->calpxlbuf!=NULL)
-      free(arr->calpxlbuf);
+    //arr->calpxlbuf may be an entry of rtcCalPxlBuf (see doPostProcessing) - the array we own is calpxlbufMem.
+    if(glob->calpxlbufMem!=NULL)
+      free(glob->calpxlbufMem);
     arr->calpxlbufSize=glob->totPxls;
-    if(posix_memalign((void**)&arr->calpxlbuf,ARRAYALIGN,sizeof(float)*glob->totPxls)!=0){
+    if(posix_memalign((void**)&glob->calpxlbufMem,ARRAYALIGN,sizeof(float)*glob->totPxls)!=0){
       printf("malloc of calpxlbuf failed\n");
       err=1;
       arr->calpxlbufSize=0;
+      glob->calpxlbufMem=NULL;
     }else{
-      memset(arr->calpxlbuf,0,sizeof(float)*glob->totPxls);
+      memset(glob->calpxlbufMem,0,sizeof(float)*glob->totPxls);
     }
+    arr->calpxlbuf=glob->calpxlbufMem;
   }
   /*
   if(arr->corrbufSize<info->totPxls){
@@ -2765,16 +3072,31 @@ void doPostProcessing(globalStruct *glob){
     //circAdd(glob->rtcCorrBuf,pp->corrbuf,timestamp,pp->thisiter);
     //calpxlbuf can now be written to by other threads
     if(pp->circAddFlags&(1<<CIRCCALPXL)){
-      circAddForce(glob->rtcCalPxlBuf,pp->calpxlbuf,timestamp,pp->thisiter);
-      memset(pp->calpxlbuf,0,pp->totPxls*sizeof(float));//clear the buffer for next time.
+      if(pp->calpxlbuf!=glob->calpxlbufMem){//calibration wrote straight into the circular buffer.
+	circCommitSlot(glob->rtcCalPxlBuf,timestamp,pp->thisiter);
+	glob->arrays->calpxlbuf=glob->calpxlbufMem;//so that a new entry is reserved below.
+      }else{
+	circAddForce(glob->rtcCalPxlBuf,pp->calpxlbuf,timestamp,pp->thisiter);
+	memset(pp->calpxlbuf,0,pp->totPxls*sizeof(float));//clear the buffer for next time.
+      }
+    }
+    //While the stream is active, the calibration library writes the calibrated pixels straight into the next rtcCalPxlBuf entry, saving a copy of the whole image.  The entry is only moved on (and cleared) once it has been published.
+    if(FREQ(glob->rtcCalPxlBuf)>0 && glob->rtcCalPxlBuf->datasize==pp->totPxls*sizeof(float)){
+      float *slot;
+      if(glob->arrays->calpxlbuf==glob->calpxlbufMem && (slot=circReserveSlot(glob->rtcCalPxlBuf))!=NULL){
+	memset(slot,0,pp->totPxls*sizeof(float));
+	glob->arrays->calpxlbuf=slot;
+      }
+    }else if(glob->arrays->calpxlbuf!=glob->calpxlbufMem){
+      glob->arrays->calpxlbuf=glob->calpxlbufMem;
     }
     if(pp->circAddFlags&(1<<CIRCCENT))
-      circAddForce(glob->rtcCentBuf,pp->centroids,timestamp,pp->thisiter);
+      telemetryAdd(glob,CIRCCENT,glob->rtcCentBuf,pp->centroids,timestamp,pp->thisiter);
     if(pp->circAddFlags&(1<<CIRCFLUX))
-      circAddForce(glob->rtcFluxBuf,pp->flux,timestamp,pp->thisiter);
+      telemetryAdd(glob,CIRCFLUX,glob->rtcFluxBuf,pp->flux,timestamp,pp->thisiter);
     //centroids can now be written to by other threads
     if(pp->circAddFlags&(1<<CIRCSUBLOC))
-      circAddForce(glob->rtcSubLocBuf,pp->subapLocation,timestamp,pp->thisiter);
+      telemetryAdd(glob,CIRCSUBLOC,glob->rtcSubLocBuf,pp->subapLocation,timestamp,pp->thisiter);
 
   }
   if(!pp->noPrePostThread)
@@ -2845,8 +3167,9 @@ void doPostProcessing(globalStruct *glob){
   glob->nclipped=pp->nclipped;
   if(pp->circAddFlags&(1<<CIRCSTATUS)){
     postwriteStatusBuf(glob);//,0,*pp->closeLoop);
-    circAddForce(glob->rtcStatusBuf,glob->statusBuf,timestamp,pp->thisiter);
+    telemetryAdd(glob,CIRCSTATUS,glob->rtcStatusBuf,glob->statusBuf,timestamp,pp->thisiter);
   }
+  telemetryWake(glob);
 }
 
 /**
@@ -3115,6 +3438,8 @@ int updateCircBufs(threadStruct *threadInfo){
   //infoStruct *info=threadInfo->info;
   globalStruct *glob=threadInfo->globals;
   int dim,err=0;
+  if(glob->telemetry!=NULL)//the telemetry thread mustn't be writing while buffers are reshaped.
+    pthread_mutex_lock(&glob->telemetry->mutex);
   if(glob->rtcPxlBuf!=NULL && (glob->rtcPxlBuf->datasize!=glob->totPxls*glob->arrays->pxlbufelsize || DTYPE(glob->rtcPxlBuf)!=glob->arrays->pxlbuftype)){
     dim=glob->totPxls;
     if(circReshape(glob->rtcPxlBuf,1,&dim,glob->arrays->pxlbuftype)!=0){
@@ -3124,6 +3449,7 @@ int updateCircBufs(threadStruct *threadInfo){
   }
   if(glob->rtcCalPxlBuf!=NULL && glob->rtcCalPxlBuf->datasize!=glob->totPxls*sizeof(float)){
     dim=glob->totPxls;
+    glob->arrays->calpxlbuf=glob->calpxlbufMem;//any entry reserved in doPostProcessing is no longer valid.
     if(circReshape(glob->rtcCalPxlBuf,1,&dim,'f')!=0){
       printf("Error reshaping rtcCalPxlBuf\n");
       err=1;
@@ -3187,6 +3513,8 @@ int updateCircBufs(threadStruct *threadInfo){
       err=1;
     }
   }
+  if(glob->telemetry!=NULL)
+    pthread_mutex_unlock(&glob->telemetry->mutex);
   return err;
 }
 
@@ -3637,12 +3965,16 @@ int processFrame(threadStruct *threadInfo){
           //Or should we allow both modes with a parameter to switch between?
           //Is there any benefit to the current mode (apart from fallback - it works!).
 #ifndef OLDMULTINEWFN
-          if(glob->calibrateNewSubapFn!=NULL)
-            err=(*glob->calibrateNewSubapFn)(glob->calibrateHandle,threadInfo->info->cam,threadInfo->threadno,threadInfo->cursubindx,&threadInfo->subap,&threadInfo->subapSize,&threadInfo->nsubapsProcessing,NULL);
-          if(err==0 && glob->centCalcSlopeFn!=NULL){
-            if((*glob->centCalcSlopeFn)(glob->centHandle,threadInfo->info->cam,threadInfo->threadno,threadInfo->nsubs,threadInfo->subap,threadInfo->subapSize,threadInfo->cursubindx,threadInfo->centindx,threadInfo->nsubapsProcessing,0)==1){
-              err=1;
-              writeErrorVA(glob->rtcErrorBuf,SLOPEERROR,glob->thisiter,"Error getting slopes");
+          if(glob->calibrateNewSubapBatchFn!=NULL && glob->centCalcSlopeBatchFn!=NULL){
+            err=processSubapBatch(threadInfo);
+          }else{
+            if(glob->calibrateNewSubapFn!=NULL)
+              err=(*glob->calibrateNewSubapFn)(glob->calibrateHandle,threadInfo->info->cam,threadInfo->threadno,threadInfo->cursubindx,&threadInfo->subap,&threadInfo->subapSize,&threadInfo->nsubapsProcessing,NULL);
+            if(err==0 && glob->centCalcSlopeFn!=NULL){
+              if((*glob->centCalcSlopeFn)(glob->centHandle,threadInfo->info->cam,threadInfo->threadno,threadInfo->nsubs,threadInfo->subap,threadInfo->subapSize,threadInfo->cursubindx,threadInfo->centindx,threadInfo->nsubapsProcessing,0)==1){
+                err=1;
+                writeErrorVA(glob->rtcErrorBuf,SLOPEERROR,glob->thisiter,"Error getting slopes");
+              }
             }
           }
 #else
@@ -3731,6 +4063,7 @@ int processFrame(threadStruct *threadInfo){
       info->threadCountFinished=0;
       info->subindx=0;
       info->centindx=0;
+      info->chunkCursor=0;
       dprintf("resetting info->threadCountFinished\n");
       info->frameFinished=0;//091109[threadInfo->mybuf]=0;
       glob->pxlCentInputError|=info->pxlCentInputError;
@@ -3765,7 +4098,7 @@ int processFrame(threadStruct *threadInfo){
 	//moved here by agb 110301 - needs to be done
 	if(glob->pxlCentInputError==0)
 	  if(glob->rtcPxlBuf->addRequired)
-	    circAddForce(glob->rtcPxlBuf,glob->arrays->pxlbufs,timestamp,glob->thisiter);
+	    telemetryAdd(glob,CIRCPXL,glob->rtcPxlBuf,glob->arrays->pxlbufs,timestamp,glob->thisiter);
       }else{//paused
 	glob->thisiter++;//have to increment this so that the frameno changes in the circular buffer, OTHERWISE, the buffer may not get written
 	//Note, myiter doesn't get incremented here, and neither do the .so library frameno's so, once unpaused, the thisiter value may decrease back to what it was.
@@ -3773,7 +4106,7 @@ int processFrame(threadStruct *threadInfo){
 	  prewriteStatusBuf(glob,1,*glob->closeLoop);
 	  postwriteStatusBuf(glob);
 	  //printf("circAddForce2\n");
-	  circAddForce(glob->rtcStatusBuf,glob->statusBuf,timestamp,glob->thisiter);
+	  telemetryAdd(glob,CIRCSTATUS,glob->rtcStatusBuf,glob->statusBuf,timestamp,glob->thisiter);
 	}
       }
       glob->doswitch=0;//091109[threadInfo->mybuf]=0;
@@ -3785,7 +4118,7 @@ int processFrame(threadStruct *threadInfo){
 	glob->starttime=timestamp;//thistime;
 	if(glob->rtcTimeBuf->addRequired){
 	  dtime=0;
-	  circAddForce(glob->rtcTimeBuf,&dtime,timestamp,glob->thisiter);
+	  telemetryAdd(glob,CIRCTIME,glob->rtcTimeBuf,&dtime,timestamp,glob->thisiter);
 	}
 	//gettimeofday(&glob->starttime,NULL);
       }else{
@@ -3805,9 +4138,9 @@ int processFrame(threadStruct *threadInfo){
 	  fflush(NULL);
 	}
 	if(glob->rtcTimeBuf->addRequired){
-	  circAddForce(glob->rtcTimeBuf,&dtime,timestamp,glob->thisiter);
+	  telemetryAdd(glob,CIRCTIME,glob->rtcTimeBuf,&dtime,timestamp,glob->thisiter);
     #ifdef THREADTIMING
-    circAddForce(glob->rtcThreadTimeBuf,glob->threadEndTime,timestamp,glob->thisiter);
+    telemetryAdd(glob,CIRCTHREADTIME,glob->rtcThreadTimeBuf,glob->threadEndTime,timestamp,glob->thisiter);
     #endif
 	}
 	//glob->thisiter++;//This is now updated earlier, when first pixels arrive...
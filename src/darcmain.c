@@ -85,7 +85,7 @@ paramBuf *openParamBuf(char *bname,char *prefix,int size,int block,int nhdr){
     return NULL;
   }
   //printf("Setting buf to zero %p size %d\n",buf,size);
-  memset(buf,0,size);
+  circShmPrepare(name,buf,size,-1);//with huge pages/numa node if requested (-H, -M).
   //printf("Set to zero\n");
   if((pb=malloc(sizeof(paramBuf)))==NULL){
     printf("Malloc of paramBuf failed %s: %s\n",name,strerror(errno));
@@ -165,14 +165,15 @@ paramBuf *openParamBufNuma(char *bname,char *prefix,long size,int block,int nhdr
     if(prefix!=NULL)free(name);
     return NULL;
   }
-  //clear the buffer.
-  memset(buf,0,size);
-  //Now move the pages to the correct NUMA node
-  pagesize = sysconf(_SC_PAGESIZE);
-  for(i=0;i<(size+pagesize-1)/pagesize;i++){
-    ptr=(void*)&buf[i*pagesize];
-    if(numa_move_pages(0,1,&ptr, &numaNode, &status, MPOL_MF_MOVE)!=0){
-      printf("Error in numa_move_pages: %s\n",strerror(errno));
+  //clear the buffer, placing it on the correct NUMA node.
+  if(circShmPrepare(name,buf,size,numaNode)){
+    //Didn't get there - so move the pages to the correct NUMA node
+    pagesize = sysconf(_SC_PAGESIZE);
+    for(i=0;i<(size+pagesize-1)/pagesize;i++){
+      ptr=(void*)&buf[i*pagesize];
+      if(numa_move_pages(0,1,&ptr, &numaNode, &status, MPOL_MF_MOVE)!=0){
+	printf("Error in numa_move_pages: %s\n",strerror(errno));
+      }
     }
   }
 
@@ -528,6 +529,8 @@ char* initParamNames(){//char paramNames[NBUFFERVARIABLES][16]){
     strncpy(&paramNames[BUFFERUSESEQ*16],"bufferUseSeq",16);
     strncpy(&paramNames[NOPREPOSTTHREAD*16],"noPrePostThread",16);
     strncpy(&paramNames[SUBAPALLOCATION*16],"subapAllocation",16);
+    strncpy(&paramNames[SUBAPSCHEDULING*16],"subapScheduling",16);
+    strncpy(&paramNames[TELEMETRYDEFER*16],"telemetryDefer",16);
     strncpy(&paramNames[OPENLOOPIFCLIP*16],"openLoopIfClip",16);
     strncpy(&paramNames[ADAPWINSHIFTCNT*16],"adapWinShiftCnt",16);
     strncpy(&paramNames[V0*16],"v0",16);
@@ -568,6 +571,10 @@ int main(int argc, char **argv){
   unsigned long long int affin;
   cpu_set_t mask;
   long numaSize=0;
+  int shmHuge=0;
+  int shmNode=-1;
+  int mcl;
+  pthread_mutexattr_t mutexattr;
   globalGlobStruct=NULL;
   //first check whether user has specified thread affinity for the main thread:
   for(i=1;i<argc;i++){
@@ -629,7 +636,7 @@ int main(int argc, char **argv){
 	buffile=&argv[i][2];
 	break;
       case 'h':
-	printf("Usage: %s -nNITERS -bBUFSIZE -sSHMPREFIX -fFILENAME.FITS (not yet implemented) -i (to ignore keyboard interrupt) -r (to redirect stdout) -eNHDR -c rtcXBuf N -mCIRCBUFMAXSIZE\n",argv[0]);
+	printf("Usage: %s -nNITERS -bBUFSIZE -sSHMPREFIX -fFILENAME.FITS (not yet implemented) -i (to ignore keyboard interrupt) -r (to redirect stdout) -eNHDR -c rtcXBuf N -mCIRCBUFMAXSIZE -NNUMASIZE -H (huge pages for shared memory) -MNUMANODE (shared memory on this numa node)\n",argv[0]);
 	exit(0);
 	break;
       case 'r':
@@ -674,6 +681,12 @@ int main(int argc, char **argv){
 	numaSize=atol(&argv[i][2]);
 	glob->numaSize=numaSize;
 	break;
+      case 'H'://huge pages for the parameter and circular buffers
+	shmHuge=1;
+	break;
+      case 'M'://numa node for the parameter and circular buffers
+	shmNode=atoi(&argv[i][2]);
+	break;
       default:
 	printf("Unrecognised argument %s\n",argv[i]);
 	break;
@@ -717,8 +730,18 @@ int main(int argc, char **argv){
     printf("Failed libraryMutex\n");
     exit(0);
   }
+  circSetShmPlacement(shmHuge,shmNode);//reports what can be used.
 
-  if(mlockall(MCL_CURRENT|MCL_FUTURE)==-1){
+  mcl=MCL_CURRENT|MCL_FUTURE;
+#ifdef MCL_ONFAULT
+  if(shmHuge || shmNode>=0)//else MCL_FUTURE faults the buffers in (as small pages, on the current node) when mapped, before circShmPrepare has applied the placement.
+    mcl|=MCL_ONFAULT;
+#endif
+  if((err=mlockall(mcl))==-1 && errno==EINVAL && mcl!=(MCL_CURRENT|MCL_FUTURE)){
+    printf("mlockall: MCL_ONFAULT not supported - buffers will be locked before huge page/NUMA placement is applied\n");
+    err=mlockall(MCL_CURRENT|MCL_FUTURE);
+  }
+  if(err==-1){
     printf("mlockall failed (you need to be running as root): %s (note this probably makes no performance difference if you aren't swapping)\n",strerror(errno));
   }
   if(shmPrefix==NULL)
@@ -950,6 +973,20 @@ int main(int argc, char **argv){
     printf("pthread_create runPrepareActuators failed\n");
     return -1;
   }
+  //The telemetry thread publishes streams listed in telemetryDefer.  It keeps the affinity (-I) and normal scheduling of this thread.
+  if((glob->telemetry=calloc(1,sizeof(TelemetryWriter)))==NULL){
+    printf("telemetry malloc\n");
+    return -1;
+  }
+  pthread_mutexattr_init(&mutexattr);
+  pthread_mutexattr_setprotocol(&mutexattr,PTHREAD_PRIO_INHERIT);//the rtc may need to wait for it.
+  pthread_mutex_init(&glob->telemetry->mutex,&mutexattr);
+  pthread_mutexattr_destroy(&mutexattr);
+  glob->telemetry->go=1;
+  if(pthread_create(&glob->telemetry->threadid,NULL,telemetryThread,glob)){
+    printf("pthread_create telemetryThread failed\n");
+    return -1;
+  }
   /*if((glob->camframeno=calloc(ncam,sizeof(int)))==NULL){//malloc
     printf("camframeno malloc failed\n");
     return -1;
@@ -1042,6 +1079,10 @@ int main(int argc, char **argv){
   pthread_cond_signal(&glob->precomp->post.actsRequiredCond);
   printf("Waiting for figureThread\n");
   pthread_join(figureThreadID,NULL);
+  glob->telemetry->go=0;
+  __atomic_add_fetch(&glob->telemetry->futex,1,__ATOMIC_SEQ_CST);
+  darc_futex_broadcast(&glob->telemetry->futex);
+  pthread_join(glob->telemetry->threadid,NULL);
   gettimeofday(&t2,NULL);
   tottime=t2.tv_sec-t1.tv_sec+(t2.tv_usec-t1.tv_usec)*1e-6;
   //printf("Done core for %d iters, time %gs, %gs per iter, %gHz\n",niters,tottime,tottime/niter,niter/tottime);
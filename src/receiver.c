@@ -36,6 +36,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <signal.h>
 #include "circ.h"
 #include "darcMutex.h"
+#include "telcodec.h"
 
 typedef struct{
   char *shmprefix;
@@ -68,6 +69,12 @@ typedef struct{
   pthread_t thread;
   time_t timeDataLastRequested;
   pthread_mutex_t m;
+  int codec;//compression stages accepted from the sender's offer.
+  int sendCodec;//set when the poller should tell the sender (also used to request a key frame).
+  codecState cs;
+  char *zdata;//compressed frame, as received.
+  int zdataSize;
+  int ndropped;//frames not published because they couldn't be decompressed.
 }RecvStruct;
 
 
@@ -124,6 +131,16 @@ void *poller(void *rrstr){
     if(rstr->hasclient==0){
       lastDec=0;
     }else{
+      if(rstr->sendCodec){
+	rstr->sendCodec=0;
+	msg[0]=MSGCODEC;
+	msg[1]=rstr->codec;
+	if(send(rstr->client,msg,2*sizeof(int),0)!=2*sizeof(int)){
+	  printf("Error sending codec value %d\n",rstr->codec);
+	  close(rstr->client);
+	  rstr->hasclient=0;
+	}
+      }
       if(rstr->cb!=NULL && FREQ(rstr->cb)!=lastDec){
 	lastDec=FREQ(rstr->cb);
 	//printf("receiver sending new decimate val of %d\n",lastDec);
@@ -293,6 +310,8 @@ int acceptSocket(RecvStruct *rstr){
   char namesize;
   memset(buf,0,80);
   rstr->hasclient=0;
+  rstr->codec=0;//until the new sender offers compression.
+  rstr->sendCodec=0;
   size=(socklen_t)sizeof(struct sockaddr_in);
   if((rstr->client=accept(rstr->lsocket,(struct sockaddr*)&clientname,&size))<0){
     printf("Failed to accept on socket: %s\n",strerror(errno));
@@ -337,6 +356,9 @@ int readData(RecvStruct *rstr){
   int indx=-1;
   char *data;
   int rec;
+  int used=0,zsize=0;
+  int drop=0;
+  char *dest;
   pthread_mutex_lock(&rstr->m);
   err=1-rstr->hasclient;
   //printf("readData\n");
@@ -370,6 +392,13 @@ int readData(RecvStruct *rstr){
       }else{
 	circReshape(rstr->cb,rstr->nd,rstr->dims,rstr->dtype);
       }
+    }else if(rstr->hdr[4]==0x55 && rstr->hdr[5]==0x43){
+      //The sender is offering compression.  Accept whatever stages we know about.
+      char name[64];
+      rstr->codec=((int*)rstr->hdr)[2]&CODECALL;
+      codecReset(&rstr->cs);
+      rstr->sendCodec=1;
+      printf("Receiver accepting compression %s\n",codecName(rstr->codec,name,64));
     }//otherwise, igore it - it is probably the sender testing the connection while waiting to reopen shm... (i.e. if the rtc has stopped and waiting to restart).
   }else{//receiving a data packet.
     if(((int*)rstr->hdr)[0]==((int*)rstr->prevhdr)[0]){//data size same, so no need to reset counter...
@@ -390,21 +419,51 @@ int readData(RecvStruct *rstr){
       LASTWRITTEN(rstr->cb)=-1;
       indx=0;
     }
+    if(rstr->codec!=0 && rstr->hdr[24]!=0){//a compressed frame.
+      used=(unsigned char)rstr->hdr[24];
+      zsize=((int*)rstr->hdr)[7];
+      memset(&rstr->hdr[24],0,8);//so that the circular buffer is identical to the sender's.
+    }
     //and now store this header.
     memcpy(rstr->prevhdr,rstr->hdr,HSIZE);
-    //and copy it into the shm
-    memcpy(&(((char*)rstr->cb->data)[indx*rstr->cb->frameSize]),rstr->hdr,HSIZE);
+    //and copy it into the shm - apart from the sender's sequence, since we keep our own.
+    circSeqBegin(rstr->cb,indx);
+    memcpy(&(((char*)rstr->cb->data)[indx*rstr->cb->frameSize]),rstr->hdr,20);
+    memcpy(&(((char*)rstr->cb->data)[indx*rstr->cb->frameSize+24]),&rstr->hdr[24],HSIZE-24);
     //now get a pointer to the data...
     data=&(((char*)rstr->cb->data)[indx*rstr->cb->frameSize+HSIZE]);
     //Now get the data size...
     dsize=((int*)rstr->hdr)[0]-HSIZE+4;
+    dest=data;
+    if(used!=0){//read into a temporary buffer, to decompress into the shm.
+      if(zsize<=0 || zsize>dsize){
+	printf("Compressed size %d out of range in receiver - closing\n",zsize);
+	err=-1;
+      }else if(rstr->zdataSize<zsize){
+	if((dest=realloc(rstr->zdata,zsize))==NULL){
+	  printf("Error allocating compressed data buffer in receiver - closing\n");
+	  err=-1;
+	}else{
+	  rstr->zdata=dest;
+	  rstr->zdataSize=zsize;
+	}
+      }else
+	dest=rstr->zdata;
+      if(err==0)
+	dsize=zsize;
+    }
     //and write the data into the shm array
     pthread_mutex_lock(&rstr->m);
     //printf("Reading data of size %d\n",dsize);
     n=0;
-    err=1-rstr->hasclient;
+    if(err==0)
+      err=1-rstr->hasclient;
+    else if(rstr->hasclient){//can't continue with this stream.
+      close(rstr->client);
+      rstr->hasclient=0;
+    }
     while(err==0 && n<dsize){
-      rec=recv(rstr->client,&data[n],dsize-n,0);
+      rec=recv(rstr->client,&dest[n],dsize-n,0);
       if(rec>0)
 	n+=rec;
       else if(n<=0){
@@ -414,12 +473,27 @@ int readData(RecvStruct *rstr){
 	rstr->hasclient=0;
       }
     }
+    if(err==0 && used!=0){
+      if(codecDecode(&rstr->cs,used,rstr->hdr[16],dest,zsize,data,((int*)rstr->hdr)[0]-HSIZE+4)!=0){
+	//Can't recover this frame - drop it, and ask the sender to start again from a key frame.
+	rstr->ndropped++;
+	printf("Error decompressing frame %d in receiver - dropped (%d so far), requesting key frame\n",((int*)rstr->hdr)[1],rstr->ndropped);
+	codecReset(&rstr->cs);
+	rstr->sendCodec=1;
+	drop=1;
+      }
+    }else if(err==0 && rstr->codec!=0){//sent raw, but following frames may be relative to it.
+      codecKeep(&rstr->cs,data,dsize);
+    }
     //printf("Setting lastwritten to %d\n",indx);
-    LASTWRITTEN(rstr->cb)=indx;
+    if(drop==0){
+      circSeqEnd(rstr->cb,indx);
+      LASTWRITTEN(rstr->cb)=indx;
+    }//else the entry is left marked as being written (so clients skip it), and is reused by the next frame.
 
 
 
-    if(err==0){
+    if(err==0 && drop==0){
       //Now wake any clients...
       if(CIRCSIGNAL(rstr->cb)!=0){//someone has set this - so they are interested in the data.
 	rstr->timeDataLastRequested=time(NULL);
@@ -53,13 +53,10 @@ typedef enum{
 #define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","kalmanAtur","kalmanHinfDM","kalmanHinfT","kalmanInvN","kalmanPhaseSize","nacts","v0")
 //char *RECONPARAM[]={"kalmanPhaseSize","kalmanHinfT","kalmanHinfDM","kalmanAtur","kalmanInvN","v0","bleedGain","nacts"};
 #ifndef ASYNCKALMANINIT
+//Rows [start,end) of Xpred that a thread propagates in reconStartFrame.
 typedef struct{
-  int Atur;
-  int AturStart;
-  int AturSize;
-  int HinfDM;
-  int HinfDMStart;
-  int HinfDMSize;
+  int start;
+  int end;
 }DoStruct;
 #endif
 
@@ -90,6 +87,8 @@ typedef struct{
   int dmReady;
   float *Xpred;
   int XpredSize;
+  float *XpredAcc;//sum of the thread XpredArr, formed in reconEndFrame.
+  int nXpredAcc;//number of XpredArr summed into XpredAcc this frame.
 #ifndef ASYNCKALMANINIT
   float *Xpred1tmp;
 #endif
@@ -123,6 +122,8 @@ int reconClose(void **reconHandle){
     pthread_cond_destroy(&reconStruct->dmCond);
     if(reconStruct->Xpred!=NULL)
       free(reconStruct->Xpred);
+    if(reconStruct->XpredAcc!=NULL)
+      free(reconStruct->XpredAcc);
     if(reconStruct->Xpred2tmp!=NULL)
       free(reconStruct->Xpred2tmp);
 #ifndef ASYNCKALMANINIT
@@ -178,7 +179,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
   RECONBUFFERVARIABLEINDX i;
   int nfound;
 #ifndef ASYNCKALMANINIT
-  int halfthr;
+  long work;
 #endif
   int *nbytes=reconStruct->nbytes;
   void **values=reconStruct->values;
@@ -313,23 +314,34 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     if(reconStruct->XpredSize<rs->kalmanPhaseSize*3){
       if(reconStruct->Xpred!=NULL)
 	free(reconStruct->Xpred);
+      if(reconStruct->XpredAcc!=NULL)
+	free(reconStruct->XpredAcc);
+      reconStruct->XpredAcc=NULL;
       if(reconStruct->Xpred2tmp!=NULL)
 	free(reconStruct->Xpred2tmp);
 #ifndef ASYNCKALMANINIT
-      if(reconStruct->Xpred2tmp!=NULL)
-	free(reconStruct->Xpred2tmp);
+      if(reconStruct->Xpred1tmp!=NULL)
+	free(reconStruct->Xpred1tmp);
 #endif
       reconStruct->XpredSize=rs->kalmanPhaseSize*3;
       if((reconStruct->Xpred=calloc(reconStruct->XpredSize,sizeof(float)))==NULL){
 	printf("malloc of Xpred failed in reconKalman\n");
 	err=-3;
 	reconStruct->XpredSize=0;
+      }else if((reconStruct->XpredAcc=calloc(reconStruct->XpredSize,sizeof(float)))==NULL){
+	printf("malloc of XpredAcc failed in reconKalman\n");
+	err=-3;
+	reconStruct->XpredSize=0;
+	free(reconStruct->Xpred);
+	reconStruct->Xpred=NULL;
       }else if((reconStruct->Xpred2tmp=calloc(rs->kalmanPhaseSize,sizeof(float)))==NULL){
 	printf("malloc of Xpred2tmp failed in reconKalman\n");
 	err=-3;
 	reconStruct->XpredSize=0;
 	free(reconStruct->Xpred);
+	free(reconStruct->XpredAcc);
 	reconStruct->Xpred=NULL;
+	reconStruct->XpredAcc=NULL;
       }
 #ifndef ASYNCKALMANINIT
       else if((reconStruct->Xpred1tmp=calloc(rs->kalmanPhaseSize,sizeof(float)))==NULL){
@@ -337,8 +349,10 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
 	err=-3;
 	reconStruct->XpredSize=0;
 	free(reconStruct->Xpred);
+	free(reconStruct->XpredAcc);
 	free(reconStruct->Xpred2tmp);
 	reconStruct->Xpred=NULL;
+	reconStruct->XpredAcc=NULL;
 	reconStruct->Xpred2tmp=NULL;
       }
 #endif
@@ -364,34 +378,25 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
 	}
       }
     }
+    //number of elements of XpredArr used (and summed into Xpred) each frame.
+    rs->XpredSize=(err==0)?rs->kalmanPhaseSize*3:0;
 #ifndef ASYNCKALMANINIT
     //work out which initialisation work the threads should do.
-    //First half of threads to the Atur
-    //Second half do the HinfDM.
-    halfthr=(reconStruct->nthreads+1)/2;//compute half the threads, rounded up.
-    rs->doS[0].AturStart=0;
-    for(j=0;j<halfthr;j++){
-      rs->doS[j].Atur=1;
-      rs->doS[j].HinfDM=0;
+    //Each thread gets a contiguous block of the 3*kalmanPhaseSize rows of
+    //Xpred.  The first kalmanPhaseSize rows need both Atur and HinfDM,
+    //so count double, and the blocks are sized to give every thread the
+    //same number of multiply-adds.
+    for(j=0;j<reconStruct->nthreads;j++){
+      work=(long)rs->kalmanPhaseSize*4*(j+1)/reconStruct->nthreads;
       if(j>0)
-	rs->doS[j].AturStart=rs->doS[j-1].AturStart+rs->doS[j-1].AturSize;
-      rs->doS[j].AturSize=(rs->kalmanPhaseSize-rs->doS[j].AturStart)/(halfthr-j);
-    }
-    for(j=halfthr;j<reconStruct->nthreads;j++){
-      rs->doS[j].Atur=0;
-      rs->doS[j].HinfDM=1;
-      if(j==halfthr)
-	rs->doS[j].HinfDMStart=rs->kalmanPhaseSize;
+	rs->doS[j].start=rs->doS[j-1].end;
       else
-	rs->doS[j].HinfDMStart=rs->doS[j-1].HinfDMStart+rs->doS[j-1].HinfDMSize;
-      rs->doS[j].HinfDMSize=(rs->kalmanPhaseSize*3-rs->doS[j].HinfDMStart)/(reconStruct->nthreads-j);
-    }
-    if(reconStruct->nthreads==1){//only 1 thread - has to do everything...
-      rs->doS[0].HinfDM=1;
-      rs->doS[0].HinfDMStart=rs->kalmanPhaseSize;
-      rs->doS[0].HinfDMSize=rs->kalmanPhaseSize*2;
+	rs->doS[j].start=0;
+      if(work<=rs->kalmanPhaseSize*2)
+	rs->doS[j].end=(int)(work/2);
+      else
+	rs->doS[j].end=(int)(work-rs->kalmanPhaseSize);
     }
-
 #endif
 
   }
@@ -544,9 +549,9 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
 #ifdef USEAGBBLAS
     //alpha=1, beta=0
     //Maybe some of this can be moved into reconStartFrame so that the work is split between threads?  But then would have to be very careful about synchronisation...
-    agb_cblas_sgemvRowNN1N101(rs->kalmanPhaseSize,rs->kalmanAtur,&(reconStruct->Xpred[rs->kalmanPhaseSize]),reconStruct->Xpred);
+    agb_cblas_sgemvRowMNL(rs->kalmanPhaseSize,rs->kalmanPhaseSize,1.,rs->kalmanAtur,rs->kalmanPhaseSize,&(reconStruct->Xpred[rs->kalmanPhaseSize]),0.,reconStruct->Xpred);
     //alpha=1, beta=-1.
-    agb_cblas_sgemvRowMN1N1m11(rs->kalmanPhaseSize*3,rs->kalmanPhaseSize,rs->kalmanHinfDM,reconStruct->Xpred2tmp,reconStruct->Xpred);
+    agb_cblas_sgemvRowMNL(rs->kalmanPhaseSize*3,rs->kalmanPhaseSize,1.,rs->kalmanHinfDM,rs->kalmanPhaseSize,reconStruct->Xpred2tmp,-1.,reconStruct->Xpred);
     
 #else
     beta=0.;
@@ -593,36 +598,24 @@ int reconStartFrame(void *reconHandle,int cam,int threadno){
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
   memset(rs->XpredArr[threadno],0,sizeof(float)*rs->XpredSize);
 #ifndef ASYNCKALMANINIT
-  if(reconStruct->err==0){//no error from previous frames...
-    //memcpy(&(reconStruct->Xpred[rs->kalmanPhaseSize*2]),&(reconStruct->Xpred[rs->kalmanPhaseSize*1]),sizeof(float)*rs->kalmanPhaseSize);
-    //memcpy(&(reconStruct->Xpred[rs->kalmanPhaseSize]),reconStruct->Xpred,sizeof(float)*rs->kalmanPhaseSize);
-    //Perform Xpred[:phaseSize]=dot(Atur,Xpred[:phaseSize])
+  int start=rs->doS[threadno].start;
+  int end=rs->doS[threadno].end;
+  int np=rs->kalmanPhaseSize;
+  if(reconStruct->err==0 && end>start){//no error from previous frames...
+    //computes Xpred[0]=Atur.Xpred[1]-HinfDM[0].Xpred[2]
+    //and Xpred[1,2]-=HinfDM[1,2].Xpred[2], for rows start to end.
 #ifdef USEAGBBLAS
-    if(rs->doS[threadno].Atur){
-      //computes Xpred[0]=Atur.Xpred[1]-HinfDM[0].Xpred[2]
-      
-      //alpha=1, beta=0
-      agb_cblas_sgemvRowMN1N101(rs->doS[threadno].AturSize,rs->kalmanPhaseSize,&rs->kalmanAtur[rs->doS[threadno].AturStart*rs->kalmanPhaseSize],reconStruct->Xpred1tmp,&reconStruct->Xpred[rs->doS[threadno].AturStart]);
-      //alpha=1, beta=-1.
-      agb_cblas_sgemvRowMN1N1m11(rs->doS[threadno].AturSize,rs->kalmanPhaseSize,&rs->kalmanHinfDM[rs->doS[threadno].AturStart*rs->kalmanPhaseSize],reconStruct->Xpred2tmp,&reconStruct->Xpred[rs->doS[threadno].AturStart]);
-    }
-    if(rs->doS[threadno].HinfDM){
-      //computes Xpred[1,2]-=HinfDM[1,2].Xpred[2]
-      //alpha=1, beta=-1.
-      agb_cblas_sgemvRowMN1N1m11(rs->doS[threadno].HinfDMSize,rs->kalmanPhaseSize,&rs->kalmanHinfDM[rs->doS[threadno].HinfDMStart*rs->kalmanPhaseSize],reconStruct->Xpred2tmp,&reconStruct->Xpred[rs->doS[threadno].HinfDMStart]);
-    }
-    
+    //alpha=1, beta=0
+    if(start<np)
+      agb_cblas_sgemvRowMNL((end<np?end:np)-start,np,1.,&rs->kalmanAtur[start*np],np,reconStruct->Xpred1tmp,0.,&reconStruct->Xpred[start]);
+    //alpha=1, beta=-1.
+    agb_cblas_sgemvRowMNL(end-start,np,1.,&rs->kalmanHinfDM[start*np],np,reconStruct->Xpred2tmp,-1.,&reconStruct->Xpred[start]);
 #else
     CBLAS_ORDER order=CblasRowMajor;
     CBLAS_TRANSPOSE trans=CblasNoTrans;
-    float alpha=1.,beta=1.;
-    int inc=1;
-    beta=0.;
-    printf("This won't work - needs updating (reconKalman.c)\n");
-    cblas_sgemv(order,trans,rs->kalmanPhaseSize,rs->kalmanPhaseSize,alpha,rs->kalmanAtur,rs->kalmanPhaseSize,&(reconStruct->Xpred[rs->kalmanPhaseSize]),inc,beta,reconStruct->Xpred,inc);
-    
-    beta=-1.;
-    cblas_sgemv(order,trans,rs->kalmanPhaseSize*3,rs->kalmanPhaseSize,alpha,rs->kalmanHinfDM,rs->kalmanPhaseSize,reconStruct->Xpred2tmp,inc,beta,reconStruct->Xpred,inc);
+    if(start<np)
+      cblas_sgemv(order,trans,(end<np?end:np)-start,np,1.,&rs->kalmanAtur[start*np],np,reconStruct->Xpred1tmp,1,0.,&reconStruct->Xpred[start],1);
+    cblas_sgemv(order,trans,end-start,np,1.,&rs->kalmanHinfDM[start*np],np,reconStruct->Xpred2tmp,1,-1.,&reconStruct->Xpred[start],1);
 #endif
   }
 #endif
@@ -668,12 +661,20 @@ int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
       printf("pthread_cond_wait error in copyThreadPhase: %s\n",strerror(errno));
 
 
-  //now add threadInfo->dmCommand to threadInfo->info->dmCommand.
+  //Other threads may still be propagating their rows of Xpred in reconStartFrame, so the slope contribution can't be added to Xpred here.
+  //Sum into XpredAcc instead, which is added to Xpred in reconFrameFinishedSync, once all threads have finished.
+  if(rs->XpredSize>0){
+    if(reconStruct->nXpredAcc==0)
+      memcpy(reconStruct->XpredAcc,rs->XpredArr[threadno],sizeof(float)*rs->XpredSize);
+    else{
 #ifdef USEAGBBLAS
-  agb_cblas_saxpy111(rs->XpredSize,rs->XpredArr[threadno],reconStruct->Xpred);
+      agb_cblas_saxpy111(rs->XpredSize,rs->XpredArr[threadno],reconStruct->XpredAcc);
 #else
-  cblas_saxpy(rs->XpredSize,1.,rs->XpredArr[threadno],1,reconStruct->Xpred,1);
+      cblas_saxpy(rs->XpredSize,1.,rs->XpredArr[threadno],1,reconStruct->XpredAcc,1);
 #endif
+    }
+    reconStruct->nXpredAcc++;
+  }
   //cblas_saxpy(rs->nacts,1.,&rs->dmCommandArr[rs->nacts*threadInfo->threadno],1,glob->arrays->dmCommand,1);
   pthread_mutex_unlock(&reconStruct->dmMutex);
   return 0;
@@ -695,6 +696,15 @@ int reconFrameFinishedSync(void *reconHandle,int err,int forcewrite){
   reconStruct->dmReady=0;
   pthread_mutex_unlock(&reconStruct->dmMutex);
   reconStruct->postbuf=reconStruct->buf;
+  //All threads have called reconEndFrame, so add their slope contributions.
+  if(reconStruct->nXpredAcc>0){
+#ifdef USEAGBBLAS
+    agb_cblas_saxpy111(reconStruct->rs[reconStruct->buf].XpredSize,reconStruct->XpredAcc,reconStruct->Xpred);
+#else
+    cblas_saxpy(reconStruct->rs[reconStruct->buf].XpredSize,1.,reconStruct->XpredAcc,1,reconStruct->Xpred,1);
+#endif
+    reconStruct->nXpredAcc=0;
+  }
 
 
 
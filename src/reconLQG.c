@@ -101,6 +101,8 @@ typedef struct{
   float *Phi[2];
   float *PhiNew[2];
   float **PhiNewPart;
+  float *PhiAcc;//sum of the PhiNewPart, formed in reconEndFrame.
+  int nPhiAcc;//number of PhiNewPart summed into PhiAcc this frame.
   float **Upart;
   float *stateSave;
   int saveSize;
@@ -146,6 +148,7 @@ int reconClose(void **reconHandle){
     if(rs->Phi[1]!=NULL)free(rs->Phi[1]);
     if(rs->PhiNew[0]!=NULL)free(rs->PhiNew[0]);
     if(rs->PhiNew[1]!=NULL)free(rs->PhiNew[1]);
+    if(rs->PhiAcc!=NULL)free(rs->PhiAcc);
     
     if(rs->doS!=NULL)
       free(rs->doS);
@@ -365,11 +368,14 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       if(rs->Phi[1]!=NULL)free(rs->Phi[1]);
       if(rs->PhiNew[0]!=NULL)free(rs->PhiNew[0]);
       if(rs->PhiNew[1]!=NULL)free(rs->PhiNew[1]);
+      if(rs->PhiAcc!=NULL)free(rs->PhiAcc);
       rs->Phi[0]=calloc(rs->lqgPhaseSize,sizeof(float));
       rs->Phi[1]=calloc(rs->lqgPhaseSize,sizeof(float));
       rs->PhiNew[0]=calloc(rs->lqgPhaseSize,sizeof(float));
       rs->PhiNew[1]=calloc(rs->lqgPhaseSize,sizeof(float));
-      if(rs->Phi[0]==NULL || rs->Phi[1]==NULL || rs->PhiNew[0]==NULL || rs->PhiNew[1]==NULL){
+      rs->PhiAcc=calloc(rs->lqgPhaseSize*2,sizeof(float));
+      rs->nPhiAcc=0;
+      if(rs->Phi[0]==NULL || rs->Phi[1]==NULL || rs->PhiNew[0]==NULL || rs->PhiNew[1]==NULL || rs->PhiAcc==NULL){
 	printf("malloc of Phi/PhiNew failed in reconLQG\n");
 	err=-3;
 	rs->PhiSize=0;
@@ -583,6 +589,7 @@ int reconNewFrameSync(void *reconHandle,unsigned int frameno,double timestamp){
     //memset(rs->U[0],0,sizeof(float)*rs->lqgActSize);
     rs->clearU0=1;
   }
+  rs->nPhiAcc=0;
   return 0;
 }
 
@@ -598,30 +605,30 @@ int reconStartFrame(void *reconHandle,int cam,int threadno){
     //U[1]=U[0]
     //U[0]=invN.PhiNew[0] + (optional) invN[1].PhiNew[1]
     //PhiNew[0] = Atur.Phi[0]     alpha=1, beta=0
-    agb_cblas_sgemvRowMN1N101(doS.partPhaseSize,rs->lqgPhaseSize,&(rs->lqgAtur[doS.phaseStart*rs->lqgPhaseSize]),rs->Phi[0],&(rs->PhiNew[0][doS.phaseStart]));
+    agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgPhaseSize,1.,&(rs->lqgAtur[doS.phaseStart*rs->lqgPhaseSize]),rs->lqgPhaseSize,rs->Phi[0],0.,&(rs->PhiNew[0][doS.phaseStart]));
     //PhiNew[0] -= Hdm2[0].U[1]    alpha=-1, beta=1.
-    agb_cblas_sgemvRowMNm1N111(doS.partPhaseSize,rs->lqgActSize,&(rs->lqgHdm2[doS.phaseStart*rs->lqgActSize]),rs->U[1],&(rs->PhiNew[0][doS.phaseStart]));
+    agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgActSize,-1.,&(rs->lqgHdm2[doS.phaseStart*rs->lqgActSize]),rs->lqgActSize,rs->U[1],1.,&(rs->PhiNew[0][doS.phaseStart]));
     //PhiNew[0] -= Hdm1[0].U[0]    alpha=-1, beta=1.
     if(rs->lqgHdm1!=NULL)//phase C mode
-      agb_cblas_sgemvRowMNm1N111(doS.partPhaseSize,rs->lqgActSize,&(rs->lqgHdm1[doS.phaseStart*rs->lqgActSize]),rs->U[2],&(rs->PhiNew[0][doS.phaseStart]));
+      agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgActSize,-1.,&(rs->lqgHdm1[doS.phaseStart*rs->lqgActSize]),rs->lqgActSize,rs->U[2],1.,&(rs->PhiNew[0][doS.phaseStart]));
     //PhiNew[0] += AHwfs[0].Phi[1]  alpha=1, beta=1.
-    agb_cblas_sgemvRowMN1N111(doS.partPhaseSize,rs->lqgPhaseSize,&(rs->lqgAHwfs[doS.phaseStart*rs->lqgPhaseSize]),rs->Phi[1],&(rs->PhiNew[0][doS.phaseStart]));
+    agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgPhaseSize,1.,&(rs->lqgAHwfs[doS.phaseStart*rs->lqgPhaseSize]),rs->lqgPhaseSize,rs->Phi[1],1.,&(rs->PhiNew[0][doS.phaseStart]));
     //PhiNew[1] has had Phi[0] copied into it during NewFrameSync.  So now:
     //PhiNew[1] -= Hdm2[1].U[1]   alpha=-1, beta=1
-    agb_cblas_sgemvRowMNm1N111(doS.partPhaseSize,rs->lqgActSize,&(rs->lqgHdm2[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgActSize]),rs->U[1],&(rs->PhiNew[1][doS.phaseStart]));
+    agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgActSize,-1.,&(rs->lqgHdm2[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgActSize]),rs->lqgActSize,rs->U[1],1.,&(rs->PhiNew[1][doS.phaseStart]));
     //PhiNew[1] -= Hdm1[1].U[0]   alpha=-1, beta=1
     if(rs->lqgHdm1!=NULL)//phase C mode
-      agb_cblas_sgemvRowMNm1N111(doS.partPhaseSize,rs->lqgActSize,&(rs->lqgHdm1[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgActSize]),rs->U[2],&(rs->PhiNew[1][doS.phaseStart]));
+      agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgActSize,-1.,&(rs->lqgHdm1[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgActSize]),rs->lqgActSize,rs->U[2],1.,&(rs->PhiNew[1][doS.phaseStart]));
 
     //PhiNew[1] += AHwfs[1].Phi[1]  alpha=1, beta=1.
-    agb_cblas_sgemvRowMN1N111(doS.partPhaseSize,rs->lqgPhaseSize,&(rs->lqgAHwfs[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgPhaseSize]),rs->Phi[1],&(rs->PhiNew[1][doS.phaseStart]));
+    agb_cblas_sgemvRowMNL(doS.partPhaseSize,rs->lqgPhaseSize,1.,&(rs->lqgAHwfs[(rs->lqgPhaseSize+doS.phaseStart)*rs->lqgPhaseSize]),rs->lqgPhaseSize,rs->Phi[1],1.,&(rs->PhiNew[1][doS.phaseStart]));
     
     //Now, U[0] = invN.PhiNew[0]
     //But since PhiNew[0] isn't complete (we don't know what state the other threads are in), we can only do part of this.  Which means we have to form a partial sum, to be added together later in FrameFinishedSync.
-    agb_cblas_sgemvRowMN1L101(rs->lqgActSize,doS.partPhaseSize,&(rs->lqgInvN[doS.phaseStart]),rs->lqgPhaseSize,&(rs->PhiNew[0][doS.phaseStart]),rs->Upart[threadno]);
+    agb_cblas_sgemvRowMNL(rs->lqgActSize,doS.partPhaseSize,1.,&(rs->lqgInvN[doS.phaseStart]),rs->lqgPhaseSize,&(rs->PhiNew[0][doS.phaseStart]),0.,rs->Upart[threadno]);
     //And optionally (June 2014), do U[0] += invN[1].PhiNew[1]
     if(rs->lqgInvN1!=NULL){
-      agb_cblas_sgemvRowMN1L111(rs->lqgActSize,doS.partPhaseSize,&(rs->lqgInvN1[doS.phaseStart]),rs->lqgPhaseSize,&(rs->PhiNew[1][doS.phaseStart]),rs->Upart[threadno]);
+      agb_cblas_sgemvRowMNL(rs->lqgActSize,doS.partPhaseSize,1.,&(rs->lqgInvN1[doS.phaseStart]),rs->lqgPhaseSize,&(rs->PhiNew[1][doS.phaseStart]),1.,rs->Upart[threadno]);
     }
     //and initialise PhiNewPart:
     rs->clearPart[threadno]=1;
@@ -666,8 +673,14 @@ int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
       printf("pthread_cond_wait error in reconEndFrame: %s\n",strerror(errno));
   //now add threadInfo->dmCommand to threadInfo->info->dmCommand.
   //But there is a thread problem with adding to phiNew here, because all portions of phiNew may not yet be ready.
-  //agb_cblas_saxpy111(rs->lqgPhaseSize,rs->PhiNewPart[threadno],rs->PhiNew[0]);
-  //agb_cblas_saxpy111(rs->lqgPhaseSize,&(rs-Ph>iNewPart[threadno][rs->lqgPhaseSize]),rs->PhiNew[1]);
+  //So, sum into PhiAcc instead, which is then added to PhiNew in FrameFinishedSync - so that the last thread only has one part to add, rather than nthreads.  A thread that got no slopes this frame (clearPart still set) has nothing to add.
+  if(rs->clearPart[threadno]==0){
+    if(rs->nPhiAcc==0)
+      memcpy(rs->PhiAcc,rs->PhiNewPart[threadno],sizeof(float)*2*rs->lqgPhaseSize);
+    else
+      agb_cblas_saxpy111(rs->lqgPhaseSize*2,rs->PhiNewPart[threadno],rs->PhiAcc);
+    rs->nPhiAcc++;
+  }
   if(rs->clearU0){
     rs->clearU0=0;
     memcpy(rs->U[0],rs->Upart[threadno],sizeof(float)*rs->lqgActSize);
@@ -706,9 +719,9 @@ int reconFrameFinishedSync(void *reconHandle,int err,int forcewrite){
   //rs->postbuf=rs->buf;
   if(lc){
     memcpy(rs->U[1],rs->U[2],sizeof(float)*rs->lqgActSize);
-    for(i=0;i<rs->nthreads;i++){
-      agb_cblas_saxpy111(rs->lqgPhaseSize,rs->PhiNewPart[i],rs->PhiNew[0]);
-      agb_cblas_saxpy111(rs->lqgPhaseSize,&(rs->PhiNewPart[i][rs->lqgPhaseSize]),rs->PhiNew[1]);
+    if(rs->nPhiAcc>0){
+      agb_cblas_saxpy111(rs->lqgPhaseSize,rs->PhiAcc,rs->PhiNew[0]);
+      agb_cblas_saxpy111(rs->lqgPhaseSize,&(rs->PhiAcc[rs->lqgPhaseSize]),rs->PhiNew[1]);
     }
     memcpy(dmCommand,rs->U[0],sizeof(float)*(rs->nacts<rs->lqgActSize?rs->nacts:rs->lqgActSize));
     //make a copy of the state vector for if the loop is opened by camera glitch...
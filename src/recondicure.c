@@ -16,37 +16,20 @@ You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 /**
-   This is a library that can be used for a PCG reconstruction
+   This is a library that can be used for a DiCuRe (distributed cumulative reconstructor) reconstruction, for a Shack-Hartmann in Fried geometry.
 
 Parameters required are:
-pcgA - typically 1/gain*numpy.dot(pmx.T,pmx).  Shape nacts,nacts.
-pcgB - typically pmx.T, shape nacts,ncents.  Will be dotted with slopes to give the pcg b vector.  
-But, pcgA, pcbB can also be sparse.  pcgA must be in csc, and pcgB in csr.
-To create pcgA:
-pcgA=numpy.zeros((nacts+1+2*nelements),numpy.int32)
-pcgA[:nacts+1]=csc.indptr
-pcgA[nacts+1::2]=csc.indices
-pcgA[nacts+2::2].view(numpy.float32)[:]=csc.data
-To create pcgB:
-pcgB=numpy.zeros((ncents+1+2*nelements),numpy.int32)
-pcgB[:ncents+1]=csr.indptr
-pcgB[ncents+1::2]=csr.indices
-pcgB[ncents+2::2]=csr.data
-
-pcgMinIter
-pcgMaxIter
-pcgWarmStart - 1 or 0
-pcgInit - NULL or a vector to start from (each iter if warmStart==0, otherwise, only when loop is closed).
-pcgTolerance - tolerance
-pcgPrecond - NULL, or matrix size nacts,nacts, used for preconditioning.  Note, in standard notation, this would be the inverse of a preconditioning matrix.
+dicureGrid - int32 ny,nx: the subaperture grid.
+dicureSubapLoc - int32, size ncents/2: the grid position (row*nx+col) of each subaperture, in slope order, or -1 to ignore that subaperture.
+dicureActMap - int32, size nacts: the subaperture corner (row*(nx+1)+col) of each actuator, or -1 if the actuator isn't driven.
+dicureGain - float32, scalar or size nacts.  dmCommand+=dicureGain*phase.
+dicureNStrips - optional, default the number of subap processing threads.  The number of strips the pupil is split into.
 
 Operation:
 
-As slopes arrive, dot with pcgB matrix, to give b.
+The phase is found at the subaperture corners.  Along each row of corners, the phase is integrated (cumulatively summed) from the x slopes, averaged over the subapertures above and below, along chains of connected corners.  Each chain is then only known up to a constant, which is found from the y slopes shared with a neighbouring chain in the row above or below, averaged over their overlap.
 
-Also need to precompute A.x - this can be done at start of frame.
-
-Once all slopes have arrived, can compute rn, zn, pn and then start the iterations
+The rows are split into dicureNStrips strips (with roughly equal numbers of corners).  As slopes arrive (reconNewSlopes) they are counted per strip, and the thread that delivers the last slope a strip needs integrates that strip, stitching its chains together - so the strips are integrated in parallel, during readout.  In reconFrameFinished, the strips are stitched together (one constant per strip, or per connected piece of a strip), and piston removed, which is cheap.
 
 */
 #include <stdlib.h>
@@ -63,66 +46,82 @@ typedef enum{RECONMODE_SIMPLE,RECONMODE_TRUTH,RECONMODE_OPEN,RECONMODE_OFFSET}Re
 typedef enum{
   BLEEDGAIN,
   DECAYFACTOR,
+  DICUREACTMAP,
+  DICUREGAIN,
+  DICUREGRID,
+  DICURENSTRIPS,
+  DICURESUBAPLOC,
   GAINE,
   NACTS,
-  PCGA,
-  PCGB,//col major - fortran contig.
-  PCGINIT,
-  PCGMAXITER,
-  PCGMINITER,
-  PCGNITERS,
-  PCGPRECOND,
-  PCGTOLERANCE,
-  PCGWARMSTART,
   RECONSTRUCTMODE,
   V0,
   //Add more before this line.
   RECONNBUFFERVARIABLES//equal to number of entries in the enum
 }RECONBUFFERVARIABLEINDX;
 
-#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","decayFactor","gainE","nacts","pcgA","pcgB","pcgInit","pcgMaxIter","pcgMinIter","pcgNIters","pcgPrecond","pcgTolerance","pcgWarmStart","reconstructMode","v0")
+#define DICURESTRIDE 16//ints per cache line - strip counters are this far apart.
+
+#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","decayFactor","dicureActMap","dicureGain","dicureGrid","dicureNStrips","dicureSubapLoc","gainE","nacts","reconstructMode","v0")
 
 
 
 typedef struct{
   ReconModeType reconMode;
   float *gainE;
-  int bArrSize;
-  float **bArr;
-  float *rmxT;
   float *v0;
   float bleedGainOverNact;
   float *decayFactor;
   int nacts;
-  int nactsPrev;
   int totCents;
-  int warmStart;
-  float *pcgInit;
-  float *pcgA;
-  int *pcgAIndx;//for sparsity
-  float *Ax;//for result of A.x
-  int AxArrSize;
-  float *b;
-  float *zn;
-  float *Ap;
-  float *pn;
-  float *iM;
-  float *xn;
-  float tol;
-  int *niters;
-  int miniter;
-  int maxiter;
+  int *subLoc;//the parameters
+  int *actMap;
+  float gain;
+  float *gainArr;
+  int ny;
+  int nx;
+  int npts;//(ny+1)*(nx+1) corners.
+  int nsub;
+  int nstrips;
+  //The plan, made from the parameters, carved out of planArr.
+  int *planArr;
+  int planArrSize;
+  int *subGrid;//ny*nx, the subap at each grid position, or -1.
+  int *subStrip;//2*nsub, the strips needing each subap (-1 if none).
+  int *stripRow;//nstrips+1, first corner row of each strip.
+  int *stripTarget;//nstrips, number of subap-strip incidences to wait for.
+  int *ptChain;//npts, chain of each corner, or -1.
+  int nchains;
+  int *chainRow;
+  int *chainC0;
+  int *chainLen;
+  int *stripChain;//nstrips+1, start of the strip in chainOrder.
+  int *chainOrder;//chains of each strip, in integration order.
+  int *chainParent;//chain whose constant each chain is found from, or -1.
+  int *chainComp;//the first chain of the connected piece of the strip.
+  int *chainGroup;//the connected piece of the pupil.
+  int ncomp;
+  int *compOrder;//first chain of each strip piece, in stitching order.
+  int *compLinkA;//chain (in an earlier piece) to stitch from, or -1.
+  int *compLinkB;//chain (in this piece) to stitch to.
+  int ngroups;
+  int *groupCount;//corners in each group.
+  //Work arrays, carved out of workArr.
+  float *workArr;
+  int workArrSize;
+  float *phase[2];//npts, one for each frame parity.
+  float *compConst;//nchains (indexed by the first chain of the piece).
+  float *groupSum;
+  int *stripCount[2];//strip slope counters, DICURESTRIDE apart.
+  int *stripDone[2];
+  int stripArrSize;
 }ReconStructEntry;
 
 typedef struct{
   ReconStructEntry rs[2];
-  int doneFirstIter;
-  float *pcgB;//only used by main processing threads, so doesnt need to be in rs
-  int *pcgBIndx;//for sparsity.
-  int *AxStart;
-  int *AxSize;
   int buf;//current buffer being used
   int postbuf;//current buffer for post processing threads.
+  int tmpPar;//parity of the frame the subap threads are working on.
+  int postPar;//parity of the frame in reconFrameFinished.
   //int swap;//set if need to change to the other buffer.
   int dmReady;
   float *latestDmCommand;
@@ -138,13 +137,346 @@ typedef struct{
   int nbytes[RECONNBUFFERVARIABLES];
   arrayStruct *arr;
 }ReconStruct;
+
+/**
+   The x phase difference from corner (r,c) to (r,c+1), averaged over the subaps either side.
+*/
+static inline float dicureDx(ReconStructEntry *rs,float *centroids,int r,int c){
+  int s,n=0;
+  float sum=0;
+  if(r>0 && (s=rs->subGrid[(r-1)*rs->nx+c])>=0){
+    sum+=centroids[2*s];
+    n++;
+  }
+  if(r<rs->ny && (s=rs->subGrid[r*rs->nx+c])>=0){
+    sum+=centroids[2*s];
+    n++;
+  }
+  return n==2?sum*0.5:sum;
+}
+
+/**
+   The y phase difference from corner (r,c) to (r+1,c), averaged over the subaps either side.  Sets *n to the number of subaps.
+*/
+static inline float dicureDy(ReconStructEntry *rs,float *centroids,int r,int c,int *n){
+  int s;
+  float sum=0;
+  *n=0;
+  if(c>0 && (s=rs->subGrid[r*rs->nx+c-1])>=0){
+    sum+=centroids[2*s+1];
+    (*n)++;
+  }
+  if(c<rs->nx && (s=rs->subGrid[r*rs->nx+c])>=0){
+    sum+=centroids[2*s+1];
+    (*n)++;
+  }
+  return *n==2?sum*0.5:sum;
+}
+
+/**
+   The constant to add to chain b (in a neighbouring row to chain a) so that it agrees with chain a (plus constant aconst), averaged over their overlap.
+*/
+static float dicureLink(ReconStructEntry *rs,float *centroids,float *phase,int a,int b,float aconst){
+  int c,c0,c1,n,cnt=0;
+  int ra=rs->chainRow[a],rb=rs->chainRow[b];
+  float *pa=&phase[ra*(rs->nx+1)];
+  float *pb=&phase[rb*(rs->nx+1)];
+  float dy,sum=0;
+  c0=rs->chainC0[a]>rs->chainC0[b]?rs->chainC0[a]:rs->chainC0[b];
+  c1=rs->chainC0[a]+rs->chainLen[a]<rs->chainC0[b]+rs->chainLen[b]?rs->chainC0[a]+rs->chainLen[a]:rs->chainC0[b]+rs->chainLen[b];
+  for(c=c0;c<c1;c++){
+    if(rb==ra+1){
+      dy=dicureDy(rs,centroids,ra,c,&n);
+    }else{
+      dy=-dicureDy(rs,centroids,rb,c,&n);
+    }
+    if(n>0){
+      sum+=pa[c]+aconst+dy-pb[c];
+      cnt++;
+    }
+  }
+  return cnt>0?sum/cnt:0;
+}
+
+/**
+   Integrate the chains of strip k, and stitch them together.
+*/
+static void dicureStrip(ReconStructEntry *rs,float *centroids,float *phase,int k){
+  int i,ch,c,len;
+  float v,*p;
+  for(i=rs->stripChain[k];i<rs->stripChain[k+1];i++){
+    ch=rs->chainOrder[i];
+    len=rs->chainLen[ch];
+    p=&phase[rs->chainRow[ch]*(rs->nx+1)+rs->chainC0[ch]];
+    v=0;
+    p[0]=0;
+    for(c=1;c<len;c++){
+      v+=dicureDx(rs,centroids,rs->chainRow[ch],rs->chainC0[ch]+c-1);
+      p[c]=v;
+    }
+    if(rs->chainParent[ch]>=0){
+      v=dicureLink(rs,centroids,phase,rs->chainParent[ch],ch,0.);
+      for(c=0;c<len;c++)
+	p[c]+=v;
+    }
+  }
+}
+
+/**
+   Breadth first search from chain root, over chains in rows r0 to r1-1 not yet seen.  The chains are put in queue (in the order to integrate them), with the chain each is linked from in parent.  Returns the number found.
+   adj is a list of the neighbouring chains of each chain (adjStart indexed).
+*/
+static int dicureBFS(ReconStructEntry *rs,int root,int *adjStart,int *adj,int r0,int r1,int *seen,int *queue,int *parent){
+  int head=0,tail=0,ch,j,nb;
+  queue[tail++]=root;
+  seen[root]=1;
+  parent[root]=-1;
+  while(head<tail){
+    ch=queue[head++];
+    for(j=adjStart[ch];j<adjStart[ch+1];j++){
+      nb=adj[j];
+      if(seen[nb]==0 && rs->chainRow[nb]>=r0 && rs->chainRow[nb]<r1){
+	seen[nb]=1;
+	parent[nb]=ch;
+	queue[tail++]=nb;
+      }
+    }
+  }
+  return tail;
+}
+
+/**
+   Make the integration plan from the parameters: the chains, strips, and the order in which to stitch them.
+*/
+static int dicurePlan(ReconStructEntry *rs){
+  int ny=rs->ny,nx=rs->nx,npts=rs->npts,nsub=rs->nsub;
+  int i,j,k,r,c,s,n,ch,a,b,nlinks,size,tot,cum,ndone,nq;
+  int *p,*adjStart=NULL,*adj=NULL,*linkArr=NULL,*seen=NULL,*queue=NULL,*rowStrip=NULL,*compParent=NULL;
+  int err=0;
+  //Upper limit: chains<=npts/2.
+  size=ny*nx+2*nsub+2*(rs->nstrips+1)+npts+3*(npts/2+1)+(rs->nstrips+1)+7*(npts/2+1)+(npts/2+1);
+  if(rs->planArrSize<size){
+    if(rs->planArr!=NULL)
+      free(rs->planArr);
+    if((rs->planArr=malloc(sizeof(int)*size))==NULL){
+      printf("Error allocating dicure plan\n");
+      rs->planArrSize=0;
+      return 1;
+    }
+    rs->planArrSize=size;
+  }
+  p=rs->planArr;
+  rs->subGrid=p;p+=ny*nx;
+  rs->subStrip=p;p+=2*nsub;
+  rs->stripRow=p;p+=rs->nstrips+1;
+  rs->stripTarget=p;p+=rs->nstrips+1;
+  rs->ptChain=p;p+=npts;
+  rs->chainRow=p;p+=npts/2+1;
+  rs->chainC0=p;p+=npts/2+1;
+  rs->chainLen=p;p+=npts/2+1;
+  rs->stripChain=p;p+=rs->nstrips+1;
+  rs->chainOrder=p;p+=npts/2+1;
+  rs->chainParent=p;p+=npts/2+1;
+  rs->chainComp=p;p+=npts/2+1;
+  rs->chainGroup=p;p+=npts/2+1;
+  rs->compOrder=p;p+=npts/2+1;
+  rs->compLinkA=p;p+=npts/2+1;
+  rs->compLinkB=p;p+=npts/2+1;
+  rs->groupCount=p;p+=npts/2+1;
+  //subap positions.
+  for(i=0;i<ny*nx;i++)
+    rs->subGrid[i]=-1;
+  for(s=0;s<nsub;s++){
+    i=rs->subLoc[s];
+    if(i<-1 || i>=ny*nx || (i>=0 && rs->subGrid[i]>=0)){
+      printf("dicureSubapLoc error - entry %d (%d) out of range or repeated\n",s,i);
+      return 1;
+    }
+    if(i>=0)
+      rs->subGrid[i]=s;
+  }
+  //chains: runs of corners joined by an x edge with a subap either side.
+  rs->nchains=0;
+  for(i=0;i<npts;i++)
+    rs->ptChain[i]=-1;
+  for(r=0;r<=ny;r++){
+    c=0;
+    while(c<nx){
+      if((r>0 && rs->subGrid[(r-1)*nx+c]>=0) || (r<ny && rs->subGrid[r*nx+c]>=0)){
+	ch=rs->nchains++;
+	rs->chainRow[ch]=r;
+	rs->chainC0[ch]=c;
+	while(c<nx && ((r>0 && rs->subGrid[(r-1)*nx+c]>=0) || (r<ny && rs->subGrid[r*nx+c]>=0)))
+	  c++;
+	rs->chainLen[ch]=c-rs->chainC0[ch]+1;
+	for(j=rs->chainC0[ch];j<=c;j++)
+	  rs->ptChain[r*(nx+1)+j]=ch;
+      }else
+	c++;
+    }
+  }
+  if(rs->nchains==0){
+    printf("dicure: no subapertures\n");
+    return 1;
+  }
+  //strips: split the corner rows so that each has a similar number of corners.
+  tot=0;
+  for(i=0;i<rs->nchains;i++)
+    tot+=rs->chainLen[i];
+  if((rowStrip=malloc(sizeof(int)*(ny+1)))==NULL || (adjStart=calloc(sizeof(int),rs->nchains+1))==NULL || (linkArr=malloc(sizeof(int)*2*2*rs->nchains))==NULL || (seen=calloc(sizeof(int),rs->nchains))==NULL || (queue=malloc(sizeof(int)*rs->nchains))==NULL || (compParent=malloc(sizeof(int)*rs->nchains))==NULL){
+    printf("Error allocating dicure plan work arrays\n");
+    err=1;
+    goto done;
+  }
+  k=0;
+  cum=0;
+  i=0;
+  rs->stripRow[0]=0;
+  for(r=0;r<=ny;r++){
+    while(i<rs->nchains && rs->chainRow[i]==r)
+      cum+=rs->chainLen[i++];
+    rowStrip[r]=k;
+    if(k<rs->nstrips-1 && (long)cum*rs->nstrips>=(long)tot*(k+1) && r<ny)
+      rs->stripRow[++k]=r+1;
+  }
+  while(k<rs->nstrips-1)//empty strips, if there are more strips than rows.
+    rs->stripRow[++k]=ny+1;
+  rs->stripRow[rs->nstrips]=ny+1;
+  //each subap is needed by the strips of the corner rows above and below it.
+  memset(rs->stripTarget,0,sizeof(int)*rs->nstrips);
+  for(s=0;s<nsub;s++){
+    i=rs->subLoc[s];
+    if(i<0){
+      rs->subStrip[2*s]=-1;
+      rs->subStrip[2*s+1]=-1;
+    }else{
+      r=i/nx;
+      rs->subStrip[2*s]=rowStrip[r];
+      rs->stripTarget[rowStrip[r]]++;
+      if(rowStrip[r+1]!=rowStrip[r]){
+	rs->subStrip[2*s+1]=rowStrip[r+1];
+	rs->stripTarget[rowStrip[r+1]]++;
+      }else
+	rs->subStrip[2*s+1]=-1;
+    }
+  }
+  //links between chains in neighbouring rows, that share a y edge with a subap either side.
+  //Chains in a row don't overlap, so the links between rows r and r+1 form a forest, with fewer than n_r+n_r+1 links - so fewer than 2*nchains in total.
+  nlinks=0;
+  a=0;
+  for(r=0;r<ny;r++){
+    while(a<rs->nchains && rs->chainRow[a]<r)
+      a++;
+    for(i=a;i<rs->nchains && rs->chainRow[i]==r;i++){
+      for(j=i+1;j<rs->nchains && rs->chainRow[j]<=r+1;j++){
+	if(rs->chainRow[j]!=r+1)
+	  continue;
+	for(c=(rs->chainC0[i]>rs->chainC0[j]?rs->chainC0[i]:rs->chainC0[j]);c<rs->chainC0[i]+rs->chainLen[i] && c<rs->chainC0[j]+rs->chainLen[j];c++){
+	  if((c>0 && rs->subGrid[r*nx+c-1]>=0) || (c<nx && rs->subGrid[r*nx+c]>=0))
+	    break;
+	}
+	if(c<rs->chainC0[i]+rs->chainLen[i] && c<rs->chainC0[j]+rs->chainLen[j]){
+	  linkArr[2*nlinks]=i;
+	  linkArr[2*nlinks+1]=j;
+	  nlinks++;
+	  adjStart[i+1]++;
+	  adjStart[j+1]++;
+	}
+      }
+    }
+  }
+  for(i=0;i<rs->nchains;i++)
+    adjStart[i+1]+=adjStart[i];
+  if((adj=malloc(sizeof(int)*(2*nlinks+1)))==NULL){
+    printf("Error allocating dicure adjacency\n");
+    err=1;
+    goto done;
+  }
+  memset(queue,0,sizeof(int)*rs->nchains);//used as a fill counter
+  for(i=0;i<nlinks;i++){
+    a=linkArr[2*i];
+    b=linkArr[2*i+1];
+    adj[adjStart[a]+queue[a]++]=b;
+    adj[adjStart[b]+queue[b]++]=a;
+  }
+  //within each strip, the order to integrate chains, and which chain each gets its constant from.
+  ndone=0;
+  rs->ncomp=0;
+  for(k=0;k<rs->nstrips;k++){
+    rs->stripChain[k]=ndone;
+    for(ch=0;ch<rs->nchains;ch++){
+      if(seen[ch] || rs->chainRow[ch]<rs->stripRow[k] || rs->chainRow[ch]>=rs->stripRow[k+1])
+	continue;
+      nq=dicureBFS(rs,ch,adjStart,adj,rs->stripRow[k],rs->stripRow[k+1],seen,&rs->chainOrder[ndone],rs->chainParent);
+      for(i=ndone;i<ndone+nq;i++)
+	rs->chainComp[rs->chainOrder[i]]=ch;
+      rs->compOrder[rs->ncomp++]=ch;
+      ndone+=nq;
+    }
+  }
+  rs->stripChain[rs->nstrips]=ndone;
+  //then, between the pieces of the strips: BFS over pieces, via any link between chains in different pieces.
+  memset(seen,0,sizeof(int)*rs->nchains);
+  rs->ngroups=0;
+  n=0;
+  for(i=0;i<rs->ncomp;i++){
+    a=rs->compOrder[i];
+    if(seen[a])
+      continue;
+    seen[a]=1;
+    queue[n]=a;
+    compParent[a]=-1;
+    rs->compLinkA[n]=-1;
+    rs->compLinkB[n]=-1;
+    j=n++;
+    rs->groupCount[rs->ngroups]=0;
+    while(j<n){
+      a=queue[j++];
+      rs->chainGroup[a]=rs->ngroups;//group of this piece (by first chain).
+      for(k=0;k<nlinks;k++){
+	ch=-1;
+	if(rs->chainComp[linkArr[2*k]]==a && !seen[rs->chainComp[linkArr[2*k+1]]]){
+	  ch=linkArr[2*k];
+	  b=linkArr[2*k+1];
+	}else if(rs->chainComp[linkArr[2*k+1]]==a && !seen[rs->chainComp[linkArr[2*k]]]){
+	  ch=linkArr[2*k+1];
+	  b=linkArr[2*k];
+	}
+	if(ch>=0){
+	  seen[rs->chainComp[b]]=1;
+	  compParent[rs->chainComp[b]]=a;
+	  rs->compLinkA[n]=ch;
+	  rs->compLinkB[n]=b;
+	  queue[n++]=rs->chainComp[b];
+	}
+      }
+    }
+    rs->ngroups++;
+  }
+  memcpy(rs->compOrder,queue,sizeof(int)*rs->ncomp);
+  for(ch=0;ch<rs->nchains;ch++){
+    rs->chainGroup[ch]=rs->chainGroup[rs->chainComp[ch]];
+    rs->groupCount[rs->chainGroup[ch]]+=rs->chainLen[ch];
+  }
+  printf("dicure: %d chains in %d strips, %d pieces, %d groups\n",rs->nchains,rs->nstrips,rs->ncomp,rs->ngroups);
+ done:
+  if(rowStrip!=NULL)free(rowStrip);
+  if(adjStart!=NULL)free(adjStart);
+  if(adj!=NULL)free(adj);
+  if(linkArr!=NULL)free(linkArr);
+  if(seen!=NULL)free(seen);
+  if(queue!=NULL)free(queue);
+  if(compParent!=NULL)free(compParent);
+  return err;
+}
+
 /**
    Called to free the reconstructor module when it is being closed.
 */
 int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
   ReconStruct *reconStruct=(ReconStruct*)*reconHandle;
   ReconStructEntry *rs;
-  int i,j;
+  int j;
   printf("Closing reconlibrary\n");
   if(reconStruct!=NULL){
     if(reconStruct->paramNames!=NULL)
@@ -152,27 +484,15 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
     pthread_mutex_destroy(&reconStruct->dmMutex);
     pthread_cond_destroy(&reconStruct->dmCond);
     if(reconStruct->latestDmCommand!=NULL)free(reconStruct->latestDmCommand);
-    if(reconStruct->AxSize!=NULL)free(reconStruct->AxSize);
-    if(reconStruct->AxStart!=NULL)free(reconStruct->AxStart);
     for(j=0;j<2;j++){
       rs=&reconStruct->rs[j];
-      if(rs->bArr!=NULL){
-	for(i=0; i<reconStruct->nthreads; i++){
-	  if(rs->bArr[i]!=NULL)
-	    free(rs->bArr[i]);
-	}
-	free(rs->bArr);
-      }
-      if(rs->pn!=NULL)free(rs->pn);
-      if(rs->xn!=NULL)free(rs->xn);
-      if(rs->Ap!=NULL)free(rs->Ap);
-      if(rs->zn!=NULL)free(rs->zn);
-      if(rs->b!=NULL)free(rs->b);
-      if(rs->Ax!=NULL)free(rs->Ax);
+      if(rs->planArr!=NULL)free(rs->planArr);
+      if(rs->workArr!=NULL)free(rs->workArr);
+      if(rs->stripCount[0]!=NULL)free(rs->stripCount[0]);
     }
     free(reconStruct);
   }
-  
+
   *reconHandle=NULL;
   printf("Finished reconClose\n");
   return 0;
@@ -203,13 +523,12 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
   rs->totCents=totCents;
   nfound=bufferGetIndex(pbuf,RECONNBUFFERVARIABLES,reconStruct->paramNames,reconStruct->index,reconStruct->values,reconStruct->dtype,reconStruct->nbytes);
   if(nfound!=RECONNBUFFERVARIABLES){
-    printf("Didn't get all buffer entries for reconpcg module:\n");
+    printf("Didn't get all buffer entries for recondicure module:\n");
     for(j=0; j<RECONNBUFFERVARIABLES; j++){
       if(reconStruct->index[j]<0)
 	printf("Missing %16s\n",&reconStruct->paramNames[j*BUFNAMESIZE]);
     }
   }
-  rs->nactsPrev=rs->nacts;
   i=NACTS;
   if(err==0 && index[i]>=0){
     if(dtype[i]=='i' && nbytes[i]==4){
@@ -247,23 +566,20 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     err=1;
   if(err==0){
     i=GAINE;
-    if(index[i]>=0){
-      if(index[i]>=0){
-	if(dtype[i]=='f' && nbytes[i]==sizeof(float)*rs->nacts*rs->nacts){
-	  rs->gainE=(float*)values[i];
-	}else{
-	  printf("gainE error\n");
-	  writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"gainE");
-	  err=1;
-	  rs->gainE=NULL;
-	}
+    rs->gainE=NULL;
+    if(index[i]>=0 && nbytes[i]!=0){
+      if(dtype[i]=='f' && nbytes[i]==sizeof(float)*rs->nacts*rs->nacts){
+	rs->gainE=(float*)values[i];
       }else{
-	rs->gainE=NULL;
+	printf("gainE error\n");
+	writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"gainE");
+	err=1;
       }
     }else{
-      if(rs->reconMode==RECONMODE_OPEN)
+      if(rs->reconMode==RECONMODE_OPEN){
+	printf("gainE needed for reconstructMode open\n");
 	err=1;
-      else
+      }else
 	printf("Ignoring missing gainE\n");
     }
   }
@@ -307,229 +623,117 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       printf("Ignoring missing decay factor\n");
     }
   }
-  i=PCGA;
+  i=DICUREGRID;
   if(err==0 && index[i]>=0){
-    if(dtype[i]=='f'){
-      if(nbytes[i]==sizeof(float)*rs->nacts*rs->nacts){
-	rs->pcgA=(float*)values[i];
-	rs->pcgAIndx=NULL;
-      }else if(nbytes[i]>sizeof(int)*(rs->nacts+1)){//sparse?...
-	rs->pcgAIndx=(int*)values[i];
-	if(rs->pcgAIndx[rs->nacts]*(sizeof(float)+sizeof(int))+(rs->nacts+1)*sizeof(int)==nbytes[i]){
-	  rs->pcgA=(float*)(&(((int*)values)[rs->nacts+1]));
-	}else{
-	  err=1;
-	}
-      }else{
-	err=1;
-      }
+    if(dtype[i]=='i' && nbytes[i]==2*sizeof(int) && ((int*)values[i])[0]>0 && ((int*)values[i])[1]>0){
+      rs->ny=((int*)values[i])[0];
+      rs->nx=((int*)values[i])[1];
+      rs->npts=(rs->ny+1)*(rs->nx+1);
     }else{
-      err=1;
-    }
-    if(err==1){
-      rs->pcgA=NULL;
-      rs->pcgAIndx=NULL;
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgA error");
-      printf("pcgA error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureGrid error");
+      printf("dicureGrid error - should be int32 ny,nx\n");
       err=1;
     }
   }else
     err=1;
-  i=PCGB;//Must be col major - ie fortran contig
+  i=DICURESUBAPLOC;
   if(err==0 && index[i]>=0){
-    if(dtype[i]=='f'){
-      if(nbytes[i]==sizeof(float)*rs->nacts*rs->totCents){
-	reconStruct->pcgB=(float*)values[i];
-	reconStruct->pcgBIndx=NULL;
-      }else if(nbytes[i]>sizeof(int)*(rs->totCents+1)){//sparse?...
-	reconStruct->pcgBIndx=(int*)values[i];
-	if(reconStruct->pcgBIndx[rs->totCents]*(sizeof(float)+sizeof(int))+(rs->totCents+1)*sizeof(int)==nbytes[i]){
-	  reconStruct->pcgB=(float*)(&(((int*)values)[rs->totCents+1]));
-	}else{
-	  err=1;
-	}
-      }else{
-	err=1;
-      }
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int)*(totCents/2)){
+      rs->subLoc=(int*)values[i];
+      rs->nsub=totCents/2;
     }else{
-      err=1;
-    }
-    if(err==1){
-      reconStruct->pcgB=NULL;
-      reconStruct->pcgBIndx=NULL;
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgB error");
-      printf("pcgB error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureSubapLoc error");
+      printf("dicureSubapLoc error - should be int32 size ncents/2\n");
       err=1;
     }
   }else
     err=1;
-  i=PCGINIT;
-  if(err==0){
-    if(index[i]>=0){
-      if(nbytes[i]==0){
-	rs->pcgInit=NULL;
-      }else if(nbytes[i]==sizeof(float)*rs->nacts && dtype[i]=='f'){
-	rs->pcgInit=(float*)values[i];
-      }else{
-	rs->pcgInit=NULL;
-	writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgInit error");
-	printf("pcgInit error\n");
-	err=1;
-      }
-    }else{
-      rs->pcgInit=NULL;
-      printf("Ignoring missing pcgInit\n");
-    }
-  }
-  i=PCGMAXITER;
-  if(err==0 && index[i]>=0){
-    if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
-      rs->maxiter=*(int*)values[i];
-    }else{
-      rs->maxiter=100;
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgMaxIter error");
-      printf("pcgMaxIter error\n");
-      err=1;
-    }
-  }else
-    err=1;
-  i=PCGMINITER;
+  i=DICUREACTMAP;
   if(err==0 && index[i]>=0){
-    if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
-      rs->miniter=*(int*)values[i];
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int)*rs->nacts){
+      rs->actMap=(int*)values[i];
+      for(j=0;j<rs->nacts;j++){
+	if(rs->actMap[j]<-1 || rs->actMap[j]>=rs->npts){
+	  printf("dicureActMap[%d] (%d) out of range\n",j,rs->actMap[j]);
+	  err=1;
+	}
+      }
+      if(err)
+	writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureActMap error");
     }else{
-      rs->miniter=1;
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgMinIter error");
-      printf("pcgMinIter error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureActMap error");
+      printf("dicureActMap error - should be int32 size nacts\n");
       err=1;
     }
   }else
     err=1;
-  i=PCGNITERS;
-  if(err==0){
-    if(index[i]>=0){
-      if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
-	rs->niters=(int*)values[i];
-      }else{
-	rs->niters=NULL;
-	writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgNIters error");
-	printf("pcgNIters error\n");
-	err=1;
-      }
-    }else{
-      rs->niters=NULL;
-      printf("Ignoring missing pcgNIters\n");
-    }
-  }
-  i=PCGPRECOND;
-  if(err==0){
-    if(index[i]>=0){
-      if(nbytes[i]==0)
-	rs->iM=NULL;
-      else if(nbytes[i]==sizeof(float)*rs->nacts*rs->nacts && dtype[i]=='f'){
-	rs->iM=(float*)values[i];
-      }else{
-	rs->iM=NULL;
-	writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgPrecond error");
-	printf("pcgPrecond error\n");
-	err=1;
-      }
-    }else{
-      rs->iM=NULL;
-      printf("Ignoring missing pcgPrecond\n");
-    }
-  }
-  i=PCGTOLERANCE;
+  i=DICUREGAIN;
   if(err==0 && index[i]>=0){
-    if(nbytes[i]==sizeof(float) && dtype[i]=='f'){
-      rs->tol=*(float*)values[i];
+    if(dtype[i]=='f' && nbytes[i]==sizeof(float)){
+      rs->gain=*(float*)values[i];
+      rs->gainArr=NULL;
+    }else if(dtype[i]=='f' && nbytes[i]==sizeof(float)*rs->nacts){
+      rs->gainArr=(float*)values[i];
     }else{
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgTolerance error");
-      printf("pcgTolerance error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureGain error");
+      printf("dicureGain error\n");
       err=1;
     }
   }else
     err=1;
-  i=PCGWARMSTART;
-  if(err==0 && index[i]>=0){
-    if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
-      rs->warmStart=*(int*)values[i];
+  i=DICURENSTRIPS;
+  rs->nstrips=reconStruct->nthreads;
+  if(err==0 && index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *(int*)values[i]>0){
+      rs->nstrips=*(int*)values[i];
     }else{
-      rs->warmStart=1;
-      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgWarmStart error");
-      printf("pcgWarmStart error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicureNStrips error");
+      printf("dicureNStrips error\n");
       err=1;
     }
-  }else
+  }
+  if(err==0 && rs->nstrips>rs->ny+1)
+    rs->nstrips=rs->ny+1;
+  if(err==0 && dicurePlan(rs)!=0){
+    writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"dicure plan error");
     err=1;
+  }
   //No need to get the lock here because this and newFrame() are called inside glob->libraryMutex.
   reconStruct->dmReady=0;
-  if(rs->bArrSize<sizeof(float)*rs->nacts){
-    rs->bArrSize=sizeof(float)*rs->nacts;
-    if(rs->pn!=NULL)
-      free(rs->pn);
-    if((rs->pn=malloc(rs->bArrSize))==NULL){
-      printf("Error allocating recon pn memory\n");
+  if(err==0 && rs->workArrSize<2*rs->npts+rs->nchains+rs->ngroups){
+    rs->workArrSize=2*rs->npts+rs->nchains+rs->ngroups;
+    if(rs->workArr!=NULL)
+      free(rs->workArr);
+    if((rs->workArr=calloc(sizeof(float),rs->workArrSize))==NULL){
+      printf("Error allocating dicure workArr\n");
       err=-2;
-      rs->bArrSize=0;
-    }
-    if(err==0){
-      if(rs->Ap!=NULL)
-	free(rs->Ap);
-      if((rs->Ap=malloc(rs->bArrSize))==NULL){
-	printf("Error allocating recon Ap memory\n");
-	err=-2;
-	rs->bArrSize=0;
-      }
-    }
-    if(err==0){
-      if(rs->zn!=NULL)
-	free(rs->zn);
-      if((rs->zn=malloc(rs->bArrSize))==NULL){
-	printf("Error allocating recon zn memory\n");
-	err=-2;
-	rs->bArrSize=0;
-      }
-    }
-    if(err==0){
-      if(rs->xn!=NULL)
-	free(rs->xn);
-      if((rs->xn=malloc(rs->bArrSize))==NULL){
-	printf("Error allocating recon xn memory\n");
-	err=-2;
-	rs->bArrSize=0;
-      }
-    }
-    if(err==0){
-      if(rs->b!=NULL)
-	free(rs->b);
-      if((rs->b=malloc(rs->bArrSize))==NULL){
-	printf("Error allocating recon b memory\n");
-	err=-2;
-	rs->bArrSize=0;
-      }else{
-	for(i=0; i<reconStruct->nthreads; i++){
-	  if(rs->bArr[i]!=NULL)
-	    free(rs->bArr[i]);
-	  if((rs->bArr[i]=calloc(sizeof(float),rs->nacts))==NULL){
-	    printf("Error allocating recon dmCommand memory\n");
-	    err=-2;
-	    rs->bArrSize=0;
-	  }
-	}
-      }
+      rs->workArrSize=0;
     }
   }
-  if(rs->AxArrSize<sizeof(float)*rs->nacts){
-    rs->AxArrSize=sizeof(float)*rs->nacts;
-    if(rs->Ax!=NULL)
-      free(rs->Ax);
-    if((rs->Ax=malloc(rs->AxArrSize))==NULL){
-      printf("Error allocatiing recon dmCommand memory\n");
+  if(err==0){
+    rs->phase[0]=rs->workArr;
+    rs->phase[1]=&rs->workArr[rs->npts];
+    rs->compConst=&rs->workArr[2*rs->npts];
+    rs->groupSum=&rs->workArr[2*rs->npts+rs->nchains];
+  }
+  if(err==0 && rs->stripArrSize<rs->nstrips){
+    rs->stripArrSize=rs->nstrips;
+    if(rs->stripCount[0]!=NULL)
+      free(rs->stripCount[0]);
+    if(posix_memalign((void**)&rs->stripCount[0],ARRAYALIGN,sizeof(int)*DICURESTRIDE*rs->nstrips*4)!=0){
+      printf("Error allocating dicure stripCount\n");
       err=-2;
-      rs->AxArrSize=0;
+      rs->stripCount[0]=NULL;
+      rs->stripArrSize=0;
     }
   }
+  if(err==0){
+    //Frames using this buffer start with everything zeroed.
+    rs->stripCount[1]=&rs->stripCount[0][DICURESTRIDE*rs->nstrips];
+    rs->stripDone[0]=&rs->stripCount[0][2*DICURESTRIDE*rs->nstrips];
+    rs->stripDone[1]=&rs->stripCount[0][3*DICURESTRIDE*rs->nstrips];
+    memset(rs->stripCount[0],0,sizeof(int)*DICURESTRIDE*rs->nstrips*4);
+  }
   if(reconStruct->latestDmCommandSize<sizeof(float)*rs->nacts){
     reconStruct->latestDmCommandSize=sizeof(float)*rs->nacts;
     if(reconStruct->latestDmCommand!=NULL)
@@ -540,15 +744,6 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       reconStruct->latestDmCommandSize=0;
     }
   }
-  if(rs->nactsPrev!=rs->nacts){
-    reconStruct->AxStart[0]=0;
-    reconStruct->AxSize[0]=rs->nacts/reconStruct->nthreads;
-    for(i=1;i<reconStruct->nthreads;i++){
-      reconStruct->AxStart[i]=reconStruct->AxStart[i-1]+reconStruct->AxSize[i-1];
-      reconStruct->AxSize[i]=(rs->nacts-reconStruct->AxStart[i])/(reconStruct->nthreads-i);
-    }
-  }
-  printf("pcg params err: %d\n",err);
   return err;
 }
 
@@ -557,7 +752,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
    Initialise the reconstructor module
  */
 int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,char *prefix,arrayStruct *arr,void **reconHandle,int nthreads,unsigned int frameno,unsigned int **reconframeno,int *reconframenoSize,int totCents){
-  //Sort through the parameter buffer, and get the things we need, and do 
+  //Sort through the parameter buffer, and get the things we need, and do
   //the allocations we need.
   ReconStruct *reconStruct;
   //ReconStructEntry *rs;
@@ -575,35 +770,11 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
   reconStruct->nthreads=nthreads;//this doesn't change.
   reconStruct->rtcErrorBuf=rtcErrorBuf;
   reconStruct->paramNames=reconMakeNames();
-  if((reconStruct->AxSize=malloc(sizeof(int)*nthreads))==NULL){
-    reconClose(reconHandle);
-    printf("Error allocating AxSize\n");
-    *reconHandle=NULL;
-    return 1;
-  }
-  if((reconStruct->AxStart=malloc(sizeof(int)*nthreads))==NULL){
-    reconClose(reconHandle);
-    printf("Error allocating AxStart\n");
-    *reconHandle=NULL;
-    return 1;
-  }
-  if((reconStruct->rs[0].bArr=calloc(sizeof(float*),nthreads))==NULL){
-    printf("Error allocating recon memory[0]\n");
-    reconClose(reconHandle);
-    *reconHandle=NULL;
-    return 1;
-  }
-  if((reconStruct->rs[1].bArr=calloc(sizeof(float*),nthreads))==NULL){
-    printf("Error allocating recon memory[1]\n");
-    reconClose(reconHandle);
-    *reconHandle=NULL;
-    return 1;
-  }
   err=reconNewParam(*reconHandle,pbuf,frameno,arr,totCents);//this will change ->buf to 0.
   //rs->swap=0;//no - we don't need to swap.
   //rs=&reconStruct->rs[reconStruct->buf];
   if(err!=0){
-    printf("Error in reconpcg...\n");
+    printf("Error in recondicure...\n");
     reconClose(reconHandle);
     *reconHandle=NULL;
     return 1;
@@ -636,19 +807,10 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
   ReconStructEntry *rs;
   int i;
   float *dmCommand=reconStruct->arr->dmCommand;
-  //if(reconStruct->swap){
-  // reconStruct->swap=0;
-  // reconStruct->buf=1-reconStruct->buf;
-  //}
   rs=&reconStruct->rs[reconStruct->buf];
-  //Now wake up the thread that does the initial processing...
-  //No need to get a mutex here, because the preprocessing thread must be sleeping.
-  //We do this processing in a separate thread because it has a while to complete, so we may as well let subap processing threads get on with their tasks...
-  //pthread_cond_signal(&reconStruct->dmCond);
   if(rs->reconMode==RECONMODE_SIMPLE){//simple open loop
-    //memset(p->dmCommand,0,sizeof(float)*p->nacts);
     memcpy(dmCommand,rs->v0,sizeof(float)*rs->nacts);
- }else if(rs->reconMode==RECONMODE_TRUTH){//closed loop
+  }else if(rs->reconMode==RECONMODE_TRUTH){//closed loop
     if(rs->decayFactor==NULL){
       memcpy(dmCommand,reconStruct->latestDmCommand,sizeof(float)*rs->nacts);
     }else{
@@ -657,25 +819,11 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
       }
     }
   }else if(rs->reconMode==RECONMODE_OPEN){//reconmode_open
-    //initialise by copying v0 into the result.
-    //This line removed 100528 after discussion with Eric Gendron.
-    //memcpy(glob->arrays->dmCommand,rs->v0,sizeof(float)*rs->nacts);
-    //beta=1.;
-    //memset(glob->arrays->dmCommand,0,sizeof(float)*rs->nacts);
     //Now: dmcommand=dot(gainE,latestDmCommand)
     agb_cblas_sgemvRowNN1N101(rs->nacts,rs->gainE,reconStruct->latestDmCommand,dmCommand);
   }else{//reconmode_offset
     memcpy(dmCommand,rs->v0,sizeof(float)*rs->nacts);
   }
-  memset(rs->b,0,sizeof(float)*rs->nacts);
-  if(rs->warmStart && reconStruct->doneFirstIter){
-    //nothing - since the previous result is already in there.
-  }else if(rs->pcgInit!=NULL){
-    memcpy(rs->xn,rs->pcgInit,sizeof(float)*rs->nacts);
-  }else{//start from zeros.
-    memset(rs->xn,0,sizeof(float)*rs->nacts);
-  }
-
   //set the DM arrays ready.
   if(pthread_mutex_lock(&reconStruct->dmMutex))
     printf("pthread_mutex_lock error in setDMArraysReady: %s\n",strerror(errno));
@@ -688,43 +836,8 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
 
 /**
    Called once per thread at the start of each frame, possibly simultaneously.
-
-   Here, we pre-multiply A.x since we have time while waiting for pixels.
 */
 int reconStartFrame(void *reconHandle,int cam,int threadno){
-  ReconStruct *reconStruct=(ReconStruct*)reconHandle;//threadInfo->globals->reconStruct;
-  ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-  memset((void*)(rs->bArr[threadno]),0,rs->nacts*sizeof(float));
-
-  //Do partial multiply of A, xn using select rows of A and all of xn.
-  if(rs->warmStart && reconStruct->doneFirstIter){
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowMN1N101(reconStruct->AxSize[threadno],rs->nacts,&(rs->pcgA[reconStruct->AxStart[threadno]*rs->nacts]),rs->xn,&rs->Ax[reconStruct->AxStart[threadno]]);
-    }else{//sparse
-      int i,j;
-      for(i=rs->pcgAIndx[reconStruct->AxStart[threadno]];i<rs->pcgAIndx[reconStruct->AxStart[threadno]]+rs->pcgAIndx[reconStruct->AxSize[threadno]];i++){//for each row:
-	rs->Ax[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){//for each col
-	  rs->Ax[i]+=rs->pcgA[j*2+1]*rs->xn[((int*)rs->pcgA)[j*2]];
-	}
-      }
-    }
-  }else if(rs->pcgInit!=NULL){
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowMN1N101(reconStruct->AxSize[threadno],rs->nacts,&(rs->pcgA[reconStruct->AxStart[threadno]*rs->nacts]),rs->pcgInit,&rs->Ax[reconStruct->AxStart[threadno]]);
-    }else{
-      int i,j;
-      for(i=rs->pcgAIndx[reconStruct->AxStart[threadno]];i<rs->pcgAIndx[reconStruct->AxStart[threadno]]+rs->pcgAIndx[reconStruct->AxSize[threadno]];i++){//for each row:
-	rs->Ax[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){//for each col
-	  rs->Ax[i]+=rs->pcgA[j*2+1]*rs->pcgInit[((int*)rs->pcgA)[j*2]];
-	}
-      }
-    }
-  }else{
-    //Ax not needed - would be all zeros.
-  }
-
   return 0;
 }
 
@@ -733,46 +846,50 @@ int reconStartFrame(void *reconHandle,int cam,int threadno){
    Called multiple times by multiple threads, whenever new slope data is ready
    centroids may not be complete, and writing to dmCommand is not thread-safe without locking.
 
-   Compute pcgB . slopes
+   Count the slopes arrived for each strip, and integrate any strip that is now complete.
 */
 int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsubapsDoing){
-  int step;//number of rows to do in mmx...
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
   float *centroids=reconStruct->arr->centroids;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-  //So, here we just do b+=pcgB[:,n]*centx+pcgB[:,n+1]*centy.
-  step=2*nsubapsDoing;
-  if(reconStruct->pcgBIndx==NULL){//dense
-    agb_cblas_sgemvColMN1M111(rs->nacts,step,&(reconStruct->pcgB[centindx*rs->nacts]),&(centroids[centindx]),rs->bArr[threadno]);
-  }else{//sparse
-    int i,j;
-    for(i=centindx;i<centindx+step;i++){
-      for(j=reconStruct->pcgBIndx[i];j<reconStruct->pcgBIndx[i+1];j++){
-	rs->bArr[threadno][((int*)reconStruct->pcgB)[j*2]]+=reconStruct->pcgB[j*2+1]*centroids[i];
+  int par=reconStruct->tmpPar;
+  int *count=rs->stripCount[par];
+  int s,j,k,strip=-1,n=0;
+  //subaps arrive in order, so mostly hit the same strip - only touch the shared counter when the strip changes.
+  for(s=centindx/2;s<centindx/2+nsubapsDoing;s++){
+    for(j=0;j<2;j++){
+      k=rs->subStrip[2*s+j];
+      if(k<0)
+	continue;
+      if(k!=strip){
+	if(n>0 && __atomic_add_fetch(&count[strip*DICURESTRIDE],n,__ATOMIC_ACQ_REL)==rs->stripTarget[strip]){
+	  dicureStrip(rs,centroids,rs->phase[par],strip);
+	  __atomic_store_n(&rs->stripDone[par][strip*DICURESTRIDE],1,__ATOMIC_RELEASE);
+	}
+	strip=k;
+	n=0;
       }
+      n++;
     }
   }
+  if(n>0 && __atomic_add_fetch(&count[strip*DICURESTRIDE],n,__ATOMIC_ACQ_REL)==rs->stripTarget[strip]){
+    dicureStrip(rs,centroids,rs->phase[par],strip);
+    __atomic_store_n(&rs->stripDone[par][strip*DICURESTRIDE],1,__ATOMIC_RELEASE);
+  }
   return 0;
 }
 
 /**
    Called once for each thread at the end of a frame
-   Here we sum the individual dmCommands together to get the final one.
-   centroids may not be complete, and writing to dmCommand is not thread-safe without locking.
+   Nothing to sum here - but wait for reconNewFrame, which guarantees that reconFrameFinished for the previous frame has completed before the strip counters are reused, in two frames time.
 */
 int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
-  //dmCommand=glob->arrays->dmCommand;
-  //globalStruct *glob=threadInfo->globals;
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
-  ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-  //float *dmCommand=reconStruct->arr->dmCommand;
   if(pthread_mutex_lock(&reconStruct->dmMutex))
     printf("pthread_mutex_lock error in copyThreadPhase: %s\n",strerror(errno));
   if(reconStruct->dmReady==0)//wait for the precompute thread to finish (it will call setDMArraysReady when done)...
     if(pthread_cond_wait(&reconStruct->dmCond,&reconStruct->dmMutex))
       printf("pthread_cond_wait error in copyThreadPhase: %s\n",strerror(errno));
-  //now add bArr[threadno] to b.
-  agb_cblas_saxpy111(rs->nacts,rs->bArr[threadno],rs->b);
   pthread_mutex_unlock(&reconStruct->dmMutex);
   return 0;
 }
@@ -787,6 +904,9 @@ int reconFrameFinishedSync(void *reconHandle,int err,int forcewrite){
   //No need to get the lock here.
   reconStruct->dmReady=0;
   reconStruct->postbuf=reconStruct->buf;
+  //the next frame uses the other strip counters.
+  reconStruct->postPar=reconStruct->tmpPar;
+  reconStruct->tmpPar=1-reconStruct->tmpPar;
   return 0;
 }
 /**
@@ -800,84 +920,55 @@ int reconFrameFinished(void *reconHandle,int *err){//globalStruct *glob){
   //Note: dmCommand=glob->arrays->dmCommand.
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;//glob->reconStruct;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->postbuf];
+  int par=reconStruct->postPar;
+  float *phase=rs->phase[par];
+  float *centroids=reconStruct->arr->centroids;
   float bleedVal=0.;
-  int i,k;
+  float *p,sum;
+  int i,k,a,ch,pt;
   float *dmCommand=reconStruct->arr->dmCommand;
-  float *rn;
-  float *zn;
-  float rnpznp;
-  float rnzn;
-  float alpha,beta;
-  //Here, we have to do the PCG.
-  rn=rs->b;
-  if((rs->warmStart && reconStruct->doneFirstIter) || rs->pcgInit!=NULL){
-    //rn=b-Ax;
-    agb_cblas_saxpym111(rs->nacts,rs->Ax,rn);
-  }
-  reconStruct->doneFirstIter=1;
-  if(rs->iM!=NULL){//zn=iM.rn
-    zn=rs->zn;
-    agb_cblas_sgemvRowNN1N101(rs->nacts,rs->iM,rn,zn);
-  }else
-    zn=rn;
-  memcpy(rs->pn,zn,sizeof(float)*rs->nacts);
-  k=0;
-  rnpznp=agb_cblas_sdot11(rs->nacts,rn,zn);
-  while(1){
-    //Ap=A.pn;
-    //Probably, this multiplication at least should be multithreaded.
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowNN1N101(rs->nacts,rs->pcgA,rs->pn,rs->Ap);
-    }else{//sparse
-      int i,j;
-      for(i=0;i<rs->nacts;i++){
-	rs->Ap[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){
-	  rs->Ap[i]+=rs->pcgA[j*2+1]*rs->pn[((int*)rs->pcgA)[j*2]];
-	}
-      }
+  //Any strips not completed in reconNewSlopes (e.g. if some slopes weren't delivered).
+  for(k=0;k<rs->nstrips;k++){
+    if(__atomic_load_n(&rs->stripDone[par][k*DICURESTRIDE],__ATOMIC_ACQUIRE)==0)
+      dicureStrip(rs,centroids,phase,k);
+    rs->stripCount[par][k*DICURESTRIDE]=0;
+    rs->stripDone[par][k*DICURESTRIDE]=0;
+  }
+  //Stitch the strip pieces together.
+  for(i=0;i<rs->ncomp;i++){
+    a=rs->compLinkA[i];
+    if(a<0)
+      rs->compConst[rs->compOrder[i]]=0;
+    else
+      rs->compConst[rs->compOrder[i]]=dicureLink(rs,centroids,phase,a,rs->compLinkB[i],rs->compConst[rs->chainComp[a]]);
+  }
+  //And remove piston, from each separate part of the pupil.
+  memset(rs->groupSum,0,sizeof(float)*rs->ngroups);
+  for(ch=0;ch<rs->nchains;ch++){
+    p=&phase[rs->chainRow[ch]*(rs->nx+1)+rs->chainC0[ch]];
+    sum=0;
+    for(i=0;i<rs->chainLen[ch];i++)
+      sum+=p[i];
+    rs->groupSum[rs->chainGroup[ch]]+=sum+rs->chainLen[ch]*rs->compConst[rs->chainComp[ch]];
+  }
+  for(i=0;i<rs->ngroups;i++)
+    rs->groupSum[i]/=rs->groupCount[i];
+  for(a=0;a<rs->nacts;a++){
+    pt=rs->actMap[a];
+    if(pt>=0 && (ch=rs->ptChain[pt])>=0){
+      sum=phase[pt]+rs->compConst[rs->chainComp[ch]]-rs->groupSum[rs->chainGroup[ch]];
+      dmCommand[a]+=(rs->gainArr==NULL?rs->gain:rs->gainArr[a])*sum;
     }
-    rnzn=rnpznp;
-    alpha=rnzn/agb_cblas_sdot11(rs->nacts,rs->pn,rs->Ap);
-    //xn+=alpha*pn;
-    agb_cblas_saxpy11(rs->nacts,alpha,rs->pn,rs->xn);
-    if(rs->maxiter>0 && k>=rs->maxiter)
-      break;
-    //rn-=alpha*Ap;
-    agb_cblas_saxpym11(rs->nacts,alpha,rs->Ap,rn);
-    if(rs->iM==NULL)
-      zn=rn;
-    else{//zn=iM.rn
-      zn=rs->zn;
-      agb_cblas_sgemvRowNN1N101(rs->nacts,rs->iM,rn,zn);
-    }
-    rnpznp=agb_cblas_sdot11(rs->nacts,rn,zn);
-    if(k>rs->miniter && rnpznp<rs->tol)
-      break;
-    beta=rnpznp/rnzn;
-    //pn=zn+beta*pn;
-    agb_cblas_sscal1(rs->nacts,beta,rs->pn);
-    agb_cblas_saxpy111(rs->nacts,zn,rs->pn);
-
-    k++;
-  }
-  if(rs->niters!=NULL)
-    *rs->niters=k;//write to the param buf
-  //answer (phase) is in xn: Add this to dmCommand.
-  agb_cblas_saxpy111(rs->nacts,rs->xn,dmCommand);
-
+  }
 
   if(rs->bleedGainOverNact!=0.){//compute the bleed value
     for(i=0; i<rs->nacts; i++){
-      //bleedVal+=glob->arrays->dmCommand[i];
       bleedVal+=dmCommand[i]-rs->v0[i];
     }
     bleedVal*=rs->bleedGainOverNact;
-    //bleedVal-=rs->midRangeTimesBleed;//Note - really midrange times bleed over nact... maybe this should be replaced by v0 - to allow a midrange value per actuator?
     for(i=0; i<rs->nacts; i++)
       dmCommand[i]-=bleedVal;
   }
-  //bleedVal-=0.5;//do proper rounding...
   if(*err==0)
     memcpy(reconStruct->latestDmCommand,dmCommand,sizeof(float)*rs->nacts);
   return 0;
@@ -891,9 +982,6 @@ int reconOpenLoop(void *reconHandle){//globalStruct *glob){
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;//glob->reconStruct;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->postbuf];
   memcpy(reconStruct->latestDmCommand,rs->v0,sizeof(float)*rs->nacts);
-  reconStruct->doneFirstIter=0;
-  //Some pcg stuff also required.
   return 0;
 
 }
- 
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <pthread.h>
 #include <errno.h>
 #ifdef USEMKL
@@ -42,9 +43,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 #endif
 
+#include <sys/mman.h>
+#include <numa.h>
+#include <numaif.h>
 #include "darc.h"
 #include "agbcblas.h"
 
+#define REDPAD 16 //ints per cache line, to keep reduction locks and counters apart.
+
 typedef enum{RECONMODE_SIMPLE,RECONMODE_TRUTH,RECONMODE_OPEN,RECONMODE_OFFSET}ReconModeType;
 
 typedef enum{
@@ -63,9 +69,18 @@ typedef enum{
   NSUB,
   //#ifdef USETREEADD
   //#endif
+  RECONPIPELINE,
+  RECONMXBATCH,
+  RECONMXFORMAT,
+  RECONMXNUMA,
+  RECONMXSPTHRESH,
+  RECONMXSPARSE,
+  RECONMXVALIDATE,
   RECONSTRUCTMODE,
   SUBAPALLOCATION,
   SUBAPFLAG,
+  THREADAFFELSIZE,
+  THREADAFFINITY,
   THREADTONUMA,
   TREEBARRIERWAITS,
   TREENPARTS,
@@ -75,7 +90,7 @@ typedef enum{
   RECONNBUFFERVARIABLES//equal to number of entries in the enum
 }RECONBUFFERVARIABLEINDX;
 
-#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","bleedGroups","decayFactor","gainE","gainE2","gainReconmxT","nacts","ncam","nsub","reconstructMode","subapAllocation","subapFlag","threadToNuma","treeBarrierWaits","treeNparts","treePartArray","v0")
+#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","bleedGroups","decayFactor","gainE","gainE2","gainReconmxT","nacts","ncam","nsub","reconPipeline","reconmxBatch","reconmxFormat","reconmxNuma","reconmxSpThresh","reconmxSparse","reconmxValidate","reconstructMode","subapAllocation","subapFlag","threadAffElSize","threadAffinity","threadToNuma","treeBarrierWaits","treeNparts","treePartArray","v0")
 //char *RECONPARAM[]={"gainReconmxT","reconstructMode","gainE","v0","bleedGain","decayFactor","nacts"};//,"midrange"};
 
 
@@ -119,6 +134,44 @@ typedef struct{
 #endif
   int *subapAlloc;
   int *threadSubapCnt;
+  int rmxFmt;//AGBMVM_FP32, or the reduced precision format of rmxLP.
+  void *rmxLP;//gainReconmxT converted to rmxFmt.
+  size_t rmxLPSize;
+  float *rmxScale;//per slope scale for AGBMVM_INT8.
+  int rmxScaleSize;
+  int rmxValidate;//report the error due to rmxFmt every rmxValidate frames.
+  float **mvmRefArr;//per thread, fp32 MVM result when validating rmxFmt.
+  float *mvmErr;//summed error due to rmxFmt this frame.
+  float *mvmRefSum;//summed fp32 MVM result this frame.
+  int mvmValidateSize;
+  int *rmxCsc;//gainReconmxT, if given in sparse format, stored as for reconpcg pcgB (then rmxT is NULL).
+  long rmxCscSize;//number of ints in rmxCsc.
+  int rmxSparse;//if set, the MVM uses the block sparse copy of gainReconmxT (spPtr, spRow, spVal).
+  int *spPtr;//per column pair, first block (see agb_cblas_bscFromDense).
+  int spPtrSize;
+  int *spRow;//row block of each block.
+  int spRowSize;
+  float *spVal;//AGBBSC_ROWS*2 values per block.
+  int rmxNuma;//if set, threads use a copy of gainReconmxT (threadPart) made by reconBuildParts.
+  void **threadPart;//per thread, its part of gainReconmxT in rmxFmt, on its numa node.  Points into partMem.
+  float **threadPartScale;
+  void **partMem;//one per thread with subapAllocation, else one per numa node.
+  size_t *partMemSize;
+  int *partMemNode;
+  float **partScale;
+  int *partScaleSize;
+  /* automatic reduction of dmCommandArr into dmCommand, used if treeAdd isn't. */
+  int redNstripes;//dmCommand is split into this many stripes, each reduced separately.
+  int redStripeLen;//floats per stripe, a multiple of a cache line.
+  int *redNode;//per thread, the node partial it adds to, or -1 to add straight into dmCommand.
+  int *redNodeCnt;//per node, number of threads adding to its partial.
+  int *redNodeDone;//per node (REDPAD apart), number of threads that have added to its partial this frame.
+  float **redPart;//per node, partial sum of dmCommandArr, on that node.
+  size_t *redPartSize;
+  int *redLock;//per stripe of dmCommand, then of each node partial (REDPAD apart).
+  char *redTodo;//per thread, the stripes still to be added.
+  int pipeline;//if >0, threads fold their partial into dmCommand after this many slopes, rather than at reconEndFrame.
+  int mvmBatch;//number of slopes to gather before doing the MVM (0 to do each block as it arrives).
 }ReconStructEntry;
 
 
@@ -147,6 +200,16 @@ typedef struct{
   arrayStruct *arr;
   int *threadToNumaList;
   int *centIndxTot;//only used for Numa.
+#ifndef USECUDA
+  int *mvmPending;//per thread, first slope and number of slopes not yet multiplied.
+  int *mvmUnfolded;//per thread, number of slopes multiplied but not yet folded into dmCommand (reconPipeline).
+  char **mvmPendingRmx;//per thread, rmx column for the first pending slope (in rmxFmt).
+  float **mvmPendingScale;//per thread, int8 scale for the first pending slope.
+  int nnodes;//number of numa nodes.
+  float mvmMaxErr;
+  float mvmMaxRef;
+  int mvmValidateCnt;
+#endif
 #ifdef USECUDA
   //float *setDmCommand;
   char *mqname;
@@ -195,6 +258,62 @@ void freeTreeAdd(ReconStructEntry *rs){
       free((void *)rs->barrierFinished);
     }
 }
+
+#ifndef USECUDA
+/**
+   Free the reconmxNuma copies of gainReconmxT.
+*/
+static void reconFreeParts(ReconStructEntry *rs,int n){
+  int i;
+  for(i=0;i<n;i++){
+    if(rs->partMem!=NULL && rs->partMemSize!=NULL && rs->partMem[i]!=NULL)
+      munmap(rs->partMem[i],rs->partMemSize[i]);
+    if(rs->partScale!=NULL && rs->partScale[i]!=NULL)
+      free(rs->partScale[i]);
+  }
+  if(rs->partMem!=NULL)
+    free(rs->partMem);
+  if(rs->partMemSize!=NULL)
+    free(rs->partMemSize);
+  if(rs->partMemNode!=NULL)
+    free(rs->partMemNode);
+  if(rs->partScale!=NULL)
+    free(rs->partScale);
+  if(rs->partScaleSize!=NULL)
+    free(rs->partScaleSize);
+  if(rs->threadPart!=NULL)
+    free(rs->threadPart);
+  if(rs->threadPartScale!=NULL)
+    free(rs->threadPartScale);
+}
+
+/**
+   Free the arrays used for the reduction of dmCommandArr.
+*/
+static void reconFreeReduce(ReconStructEntry *rs,int nnodes){
+  int i;
+  if(rs->redPart!=NULL){
+    for(i=0;i<nnodes;i++){
+      if(rs->redPart[i]!=NULL)
+	munmap(rs->redPart[i],rs->redPartSize[i]);
+    }
+    free(rs->redPart);
+  }
+  if(rs->redPartSize!=NULL)
+    free(rs->redPartSize);
+  if(rs->redNode!=NULL)
+    free(rs->redNode);
+  if(rs->redNodeCnt!=NULL)
+    free(rs->redNodeCnt);
+  if(rs->redNodeDone!=NULL)
+    free(rs->redNodeDone);
+  if(rs->redLock!=NULL)
+    free(rs->redLock);
+  if(rs->redTodo!=NULL)
+    free(rs->redTodo);
+}
+#endif
+
 /**
    Called to free the reconstructor module when it is being closed.
 */
@@ -202,7 +321,7 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
   ReconStruct *reconStruct=(ReconStruct*)*reconHandle;
   ReconStructEntry *rs;
 #ifndef USECUDA
-  int i;
+  int i,j;
 #endif
   printf("Closing reconlibrary\n");
   if(reconStruct!=NULL){
@@ -261,6 +380,39 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
       }
       free(rs->dmCommandArr);
     }
+    if(reconStruct->mvmPending!=NULL)
+      free(reconStruct->mvmPending);
+    if(reconStruct->mvmPendingRmx!=NULL)
+      free(reconStruct->mvmPendingRmx);
+    if(reconStruct->mvmUnfolded!=NULL)
+      free(reconStruct->mvmUnfolded);
+    if(reconStruct->mvmPendingScale!=NULL)
+      free(reconStruct->mvmPendingScale);
+    for(i=0; i<2; i++){
+      if(reconStruct->rs[i].mvmRefArr!=NULL){
+	for(j=0; j<reconStruct->nthreads; j++){
+	  if(reconStruct->rs[i].mvmRefArr[j]!=NULL)
+	    free(reconStruct->rs[i].mvmRefArr[j]);
+	}
+	free(reconStruct->rs[i].mvmRefArr);
+      }
+      if(reconStruct->rs[i].mvmErr!=NULL)
+	free(reconStruct->rs[i].mvmErr);
+      if(reconStruct->rs[i].mvmRefSum!=NULL)
+	free(reconStruct->rs[i].mvmRefSum);
+      if(reconStruct->rs[i].rmxLP!=NULL)
+	free(reconStruct->rs[i].rmxLP);
+      if(reconStruct->rs[i].rmxScale!=NULL)
+	free(reconStruct->rs[i].rmxScale);
+      reconFreeParts(&reconStruct->rs[i],reconStruct->nthreads>reconStruct->nnodes?reconStruct->nthreads:reconStruct->nnodes);
+      reconFreeReduce(&reconStruct->rs[i],reconStruct->nnodes);
+      if(reconStruct->rs[i].spPtr!=NULL)
+	free(reconStruct->rs[i].spPtr);
+      if(reconStruct->rs[i].spRow!=NULL)
+	free(reconStruct->rs[i].spRow);
+      if(reconStruct->rs[i].spVal!=NULL)
+	free(reconStruct->rs[i].spVal);
+    }
 #endif
     free(reconStruct);
   }
@@ -651,6 +803,526 @@ void initTreeAdd(void *reconHandle){
 }
 
 
+#ifndef USECUDA
+/**
+   Get the numa node closest to a subap processing thread.
+   Uses threadToNuma if given, otherwise the thread's threadAffinity (all CPUs must be on the same node).
+   Returns -1 if not known.
+*/
+static int reconThreadNode(ReconStruct *reconStruct,int threadno){
+  void **values=reconStruct->values;
+  char *dtype=reconStruct->dtype;
+  int *nbytes=reconStruct->nbytes;
+  unsigned int *affin;
+  int elsize,cpu,ncpu,node=-1,n;
+  if(reconStruct->index[THREADTONUMA]>=0 && dtype[THREADTONUMA]=='i' && nbytes[THREADTONUMA]==sizeof(int)*reconStruct->nthreads)
+    return ((int*)values[THREADTONUMA])[threadno];
+  if(numa_available()<0 || reconStruct->index[THREADAFFINITY]<0 || reconStruct->index[THREADAFFELSIZE]<0 || dtype[THREADAFFELSIZE]!='i' || nbytes[THREADAFFELSIZE]!=sizeof(int))
+    return -1;
+  elsize=*((int*)values[THREADAFFELSIZE]);
+  if(dtype[THREADAFFINITY]!='i' || nbytes[THREADAFFINITY]!=sizeof(int)*elsize*(reconStruct->nthreads+1))
+    return -1;
+  affin=&((unsigned int*)values[THREADAFFINITY])[(threadno+1)*elsize];//entry 0 is the pre/post processing thread.
+  ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+  for(cpu=0;cpu<ncpu && cpu<elsize*32;cpu++){
+    if((affin[cpu/32]>>(cpu%32))&1){
+      n=numa_node_of_cpu(cpu);
+      if(node==-1)
+	node=n;
+      else if(n!=node)
+	return -1;
+    }
+  }
+  return node;
+}
+
+/**
+   Allocate memory whose pages will be placed on node (if >=0) when first touched.
+*/
+static void *reconAllocOnNode(size_t size,int node){
+  void *ptr;
+  unsigned long *mask;
+  int nlong;
+  if((ptr=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0))==MAP_FAILED)
+    return NULL;
+  if(node>=0){
+    nlong=node/(8*sizeof(unsigned long))+1;
+    if((mask=calloc(sizeof(unsigned long),nlong))!=NULL){
+      mask[node/(8*sizeof(unsigned long))]=1UL<<(node%(8*sizeof(unsigned long)));
+      if(mbind(ptr,size,MPOL_PREFERRED,mask,nlong*8*sizeof(unsigned long)+1,0)!=0)
+	printf("reconmvm: mbind to node %d failed: %s\n",node,strerror(errno));
+      free(mask);
+    }
+  }
+  return ptr;
+}
+
+/**
+   Make each thread's copy of gainReconmxT (reconmxNuma), in format fmt, on the thread's numa node.
+   With subapAllocation, each thread gets just the columns for its own subaps, in the order it processes them.
+   Otherwise, there is one whole copy per numa node in use.
+   The copies are reused (same memory, same node) if the layout hasn't changed, so that e.g. a change of gain just refreshes the values.
+*/
+static int reconBuildParts(ReconStruct *reconStruct,ReconStructEntry *rs,int fmt){
+  void **values=reconStruct->values;
+  int nthreads=reconStruct->nthreads;
+  int elsize=agb_cblas_mvmElSize(fmt);
+  int ncam=*((int*)values[NCAM]);
+  int *nsub=(int*)values[NSUB];
+  int *subapFlag=(int*)values[SUBAPFLAG];
+  int nsubtot=0,nparts,i,j,p,t,c,node,unknown=0;
+  int *ncols,*off,*threadNode;
+  size_t size;
+  for(i=0;i<ncam;i++)
+    nsubtot+=nsub[i];
+  nparts=rs->subapAlloc!=NULL?nthreads:reconStruct->nnodes;
+  ncols=calloc(sizeof(int),nparts);
+  off=calloc(sizeof(int),nparts);
+  threadNode=calloc(sizeof(int),nthreads);
+  if(ncols==NULL || off==NULL || threadNode==NULL){
+    printf("Error allocating in reconBuildParts\n");
+    free(ncols);
+    free(off);
+    free(threadNode);
+    return -2;
+  }
+  for(t=0;t<nthreads;t++){
+    threadNode[t]=reconThreadNode(reconStruct,t);
+    if(threadNode[t]<0 || threadNode[t]>=reconStruct->nnodes){
+      threadNode[t]=-1;
+      unknown++;
+    }
+  }
+  if(unknown)
+    printf("reconmvm: Warning - numa node not known for %d threads (set threadToNuma or threadAffinity)\n",unknown);
+  if(rs->subapAlloc!=NULL){
+    for(j=0;j<nsubtot;j++){
+      if(subapFlag[j] && rs->subapAlloc[j]>=0 && rs->subapAlloc[j]<nthreads)
+	ncols[rs->subapAlloc[j]]+=2;
+    }
+  }else{
+    for(t=0;t<nthreads;t++){
+      if(threadNode[t]>=0)
+	ncols[threadNode[t]]=rs->totCents;
+    }
+  }
+  for(p=0;p<nparts;p++){
+    node=rs->subapAlloc!=NULL?threadNode[p]:p;
+    size=(size_t)elsize*rs->nacts*ncols[p];
+    if(rs->partMem[p]!=NULL && (rs->partMemSize[p]<size || rs->partMemNode[p]!=node || size==0)){
+      munmap(rs->partMem[p],rs->partMemSize[p]);
+      rs->partMem[p]=NULL;
+      rs->partMemSize[p]=0;
+    }
+    if(size>0 && rs->partMem[p]==NULL){
+      if((rs->partMem[p]=reconAllocOnNode(size,node))==NULL){
+	printf("Error allocating reconmxNuma part %d\n",p);
+	free(ncols);
+	free(off);
+	free(threadNode);
+	return -2;
+      }
+      rs->partMemSize[p]=size;
+      rs->partMemNode[p]=node;
+    }
+    if(rs->partScaleSize[p]<ncols[p]){
+      if(rs->partScale[p]!=NULL)
+	free(rs->partScale[p]);
+      if((rs->partScale[p]=calloc(sizeof(float),ncols[p]))==NULL){
+	printf("Error allocating reconmxNuma scale %d\n",p);
+	rs->partScaleSize[p]=0;
+	free(ncols);
+	free(off);
+	free(threadNode);
+	return -2;
+      }
+      rs->partScaleSize[p]=ncols[p];
+    }
+  }
+  //Now fill them.  This is the first touch, so the pages end up on the right node.
+  if(rs->subapAlloc!=NULL){
+    c=0;
+    for(j=0;j<nsubtot;j++){
+      if(subapFlag[j]){
+	p=rs->subapAlloc[j];
+	if(p>=0 && p<nthreads){
+	  agb_cblas_mvmConvert(fmt,rs->nacts,2,&rs->rmxT[(size_t)c*rs->nacts],(char*)rs->partMem[p]+(size_t)off[p]*rs->nacts*elsize,&rs->partScale[p][off[p]]);
+	  off[p]+=2;
+	}
+	c+=2;
+      }
+    }
+    for(t=0;t<nthreads;t++){
+      rs->threadPart[t]=rs->partMem[t];
+      rs->threadPartScale[t]=rs->partScale[t];
+    }
+  }else{
+    for(p=0;p<nparts;p++){
+      if(ncols[p]>0)
+	agb_cblas_mvmConvert(fmt,rs->nacts,rs->totCents,rs->rmxT,rs->partMem[p],rs->partScale[p]);
+    }
+    for(t=0;t<nthreads;t++){
+      rs->threadPart[t]=threadNode[t]<0?NULL:rs->partMem[threadNode[t]];
+      rs->threadPartScale[t]=threadNode[t]<0?NULL:rs->partScale[threadNode[t]];
+    }
+  }
+  free(ncols);
+  free(off);
+  free(threadNode);
+  return 0;
+}
+
+/**
+   Set up the reduction of the per-thread dmCommandArr into dmCommand (used unless treeAdd is configured).
+   dmCommand is split into cache line aligned stripes, each with its own lock, so threads finishing at the
+   same time add into different stripes, rather than queueing for the whole vector.
+   If threads are on more than one numa node, threads first sum into a partial on their own node, and the
+   last to finish on each node then adds this into dmCommand, so that fewer vectors cross between nodes.
+*/
+static int reconInitReduce(ReconStruct *reconStruct,ReconStructEntry *rs){
+  int nthreads=reconStruct->nthreads;
+  int nnodes=reconStruct->nnodes;
+  int t,n,nused=0,ns;
+  size_t size;
+  //Stripes of at least a cache line, and about one per thread.
+  ns=nthreads<(rs->nacts+REDPAD-1)/REDPAD?nthreads:(rs->nacts+REDPAD-1)/REDPAD;
+  if(ns<1)
+    ns=1;
+  rs->redStripeLen=((rs->nacts+ns-1)/ns+REDPAD-1)/REDPAD*REDPAD;
+  if(rs->redStripeLen==0)
+    rs->redStripeLen=REDPAD;
+  ns=(rs->nacts+rs->redStripeLen-1)/rs->redStripeLen;
+  if(ns<1)
+    ns=1;
+  if(ns!=rs->redNstripes || rs->redLock==NULL){
+    if(rs->redLock!=NULL)
+      free(rs->redLock);
+    if(rs->redTodo!=NULL)
+      free(rs->redTodo);
+    rs->redTodo=calloc(ns,nthreads);
+    if(posix_memalign((void**)&rs->redLock,ARRAYALIGN,sizeof(int)*REDPAD*ns*(nnodes+1))!=0)
+      rs->redLock=NULL;
+    if(rs->redLock==NULL || rs->redTodo==NULL){
+      printf("Error allocating recon reduction arrays\n");
+      rs->redNstripes=0;
+      return -2;
+    }
+    memset(rs->redLock,0,sizeof(int)*REDPAD*ns*(nnodes+1));
+    rs->redNstripes=ns;
+  }
+  //Which node is each thread on?  Only worth summing per node if more than one is in use.
+  memset(rs->redNodeCnt,0,sizeof(int)*nnodes);
+  for(t=0;t<nthreads;t++){
+    n=reconThreadNode(reconStruct,t);
+    rs->redNode[t]=(n>=0 && n<nnodes)?n:-1;
+    if(rs->redNode[t]>=0)
+      rs->redNodeCnt[n]++;
+  }
+  for(n=0;n<nnodes;n++)
+    nused+=(rs->redNodeCnt[n]>1);
+  for(t=0;t<nthreads;t++){
+    if(nused<2 || (rs->redNode[t]>=0 && rs->redNodeCnt[rs->redNode[t]]<2))
+      rs->redNode[t]=-1;
+  }
+  if(nused<2)
+    memset(rs->redNodeCnt,0,sizeof(int)*nnodes);
+  for(n=0;n<nnodes;n++){
+    size=sizeof(float)*rs->nacts;
+    if(rs->redPart[n]!=NULL && (rs->redNodeCnt[n]<2 || rs->redPartSize[n]<size)){
+      munmap(rs->redPart[n],rs->redPartSize[n]);
+      rs->redPart[n]=NULL;
+      rs->redPartSize[n]=0;
+    }
+    if(rs->redNodeCnt[n]>1 && rs->redPart[n]==NULL){
+      if((rs->redPart[n]=reconAllocOnNode(size,n))==NULL){
+	printf("Error allocating recon reduction partial for node %d\n",n);
+	rs->redNstripes=0;
+	return -2;
+      }
+      rs->redPartSize[n]=size;
+      memset(rs->redPart[n],0,size);//first touch.
+    }else if(rs->redPart[n]!=NULL)
+      memset(rs->redPart[n],0,size);
+    rs->redNodeDone[n*REDPAD]=0;
+  }
+  printf("reconmvm: Reducing dmCommand in %d stripes of %d%s\n",rs->redNstripes,rs->redStripeLen,nused>1?", summing per numa node first":"");
+  return 0;
+}
+
+/**
+   Add src into dst, one stripe at a time, starting at stripe first.
+   Stripes locked by another thread are skipped and returned to later, so that a thread only waits when
+   every stripe it has left is busy.  If zero is set, src is zeroed as it is added.
+*/
+static void reconStripeAdd(ReconStructEntry *rs,float *src,float *dst,int *lock,char *todo,int first,int zero){
+  int ns=rs->redNstripes;
+  int left=ns,s=first%ns,i,n;
+  memset(todo,1,ns);
+  while(left>0){
+    if(todo[s] && __atomic_load_n(&lock[s*REDPAD],__ATOMIC_RELAXED)==0 && __atomic_exchange_n(&lock[s*REDPAD],1,__ATOMIC_ACQUIRE)==0){
+      i=s*rs->redStripeLen;
+      n=rs->nacts-i<rs->redStripeLen?rs->nacts-i:rs->redStripeLen;
+#ifdef USEMKL
+      cblas_saxpy(n,1.,&src[i],1,&dst[i],1);
+#else
+      agb_cblas_saxpy111(n,&src[i],&dst[i]);
+#endif
+      if(zero)
+	memset(&src[i],0,sizeof(float)*n);
+      __atomic_store_n(&lock[s*REDPAD],0,__ATOMIC_RELEASE);
+      todo[s]=0;
+      left--;
+    }
+    s=(s+1==ns)?0:s+1;
+  }
+}
+#endif
+
+#if !defined(USECUDA) && defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+/**
+   Make the block sparse copy of gainReconmxT, if it is given in sparse format, or if enough of it is zero
+   (or no larger than reconmxSpThresh) that the MVM will stream fewer bytes.
+   mode is 1 for automatic, 2 to always use it.
+*/
+static int reconPrepareSparse(ReconStructEntry *rs,int mode,float thresh){
+  int np=rs->totCents/2;
+  int nb,nrb=(rs->nacts+AGBBSC_ROWS-1)/AGBBSC_ROWS;
+  double sparseBytes,denseBytes;
+  rs->rmxSparse=0;
+  if(rs->spPtrSize<np+1){
+    if(rs->spPtr!=NULL)
+      free(rs->spPtr);
+    if((rs->spPtr=malloc(sizeof(int)*(np+1)))==NULL){
+      printf("Error allocating recon spPtr\n");
+      rs->spPtrSize=0;
+      return -2;
+    }
+    rs->spPtrSize=np+1;
+  }
+  if(rs->rmxCsc!=NULL)
+    nb=agb_cblas_bscFromCsc(rs->nacts,rs->totCents,rs->rmxCsc,rs->rmxCscSize,rs->spPtr,NULL,NULL);
+  else
+    nb=agb_cblas_bscFromDense(rs->nacts,rs->totCents,rs->rmxT,thresh,rs->spPtr,NULL,NULL);
+  if(nb<0){
+    printf("gainReconmxT sparse format error\n");
+    return GAINRECONMXT;
+  }
+  sparseBytes=(double)nb*(2*AGBBSC_ROWS*sizeof(float)+sizeof(int))+(np+1)*sizeof(int);
+  denseBytes=(double)rs->nacts*rs->totCents*sizeof(float);
+  if(mode==1 && sparseBytes>0.6*denseBytes)//not enough zeros to be worth it.
+    return 0;
+  if(rs->spRowSize<nb || rs->spVal==NULL){
+    if(rs->spRow!=NULL)
+      free(rs->spRow);
+    if(rs->spVal!=NULL)
+      free(rs->spVal);
+    rs->spRowSize=0;
+    rs->spVal=NULL;
+    if((rs->spRow=malloc(sizeof(int)*(nb>0?nb:1)))==NULL || posix_memalign((void**)&rs->spVal,ARRAYALIGN,sizeof(float)*2*AGBBSC_ROWS*(nb>0?nb:1))!=0){
+      printf("Error allocating recon block sparse gainReconmxT\n");
+      rs->spVal=NULL;
+      return -2;
+    }
+    rs->spRowSize=nb;
+  }
+  if(rs->rmxCsc!=NULL)
+    agb_cblas_bscFromCsc(rs->nacts,rs->totCents,rs->rmxCsc,rs->rmxCscSize,rs->spPtr,rs->spRow,rs->spVal);
+  else
+    agb_cblas_bscFromDense(rs->nacts,rs->totCents,rs->rmxT,thresh,rs->spPtr,rs->spRow,rs->spVal);
+  rs->rmxSparse=1;
+  printf("reconmvm: Using block sparse gainReconmxT, %d of %d blocks (%.1f%% of the dense size)\n",nb,nrb*np,100.*sparseBytes/denseBytes);
+  return 0;
+}
+#endif
+
+#ifndef USECUDA
+/**
+   Set up the storage format of gainReconmxT (reconmxFormat), converting it if not fp32.
+   Also allocates the arrays needed for reconmxValidate.
+*/
+static int reconPrepareRmx(ReconStruct *reconStruct,ReconStructEntry *rs,unsigned int frameno){
+  void **values=reconStruct->values;
+  char *dtype=reconStruct->dtype;
+  int *nbytes=reconStruct->nbytes;
+  int i,j,n;
+  int fmt=AGBMVM_FP32;
+#if defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+  int sparse=1;
+  float thresh=0;
+#endif
+  size_t size;
+  char *fmtNames[]={"fp32","bf16","fp16","int8"};
+  rs->rmxValidate=0;
+  i=RECONMXFORMAT;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=AGBMVM_FP32 && *((int*)values[i])<=AGBMVM_INT8){
+      fmt=*((int*)values[i]);
+    }else{
+      printf("reconmxFormat error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxFormat error");
+      rs->rmxFmt=AGBMVM_FP32;
+      return RECONMXFORMAT;
+    }
+  }
+  i=RECONMXVALIDATE;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=0){
+      rs->rmxValidate=*((int*)values[i]);
+    }else{
+      printf("reconmxValidate error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxValidate error");
+      rs->rmxFmt=AGBMVM_FP32;
+      return RECONMXVALIDATE;
+    }
+  }
+  rs->rmxNuma=0;
+  i=RECONMXNUMA;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int)){
+      rs->rmxNuma=(*((int*)values[i])!=0);
+    }else{
+      printf("reconmxNuma error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxNuma error");
+      rs->rmxFmt=AGBMVM_FP32;
+      return RECONMXNUMA;
+    }
+  }
+#if defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+  i=RECONMXSPARSE;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=0 && *((int*)values[i])<=2){
+      sparse=*((int*)values[i]);
+    }else{
+      printf("reconmxSparse error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxSparse error");
+      rs->rmxFmt=AGBMVM_FP32;
+      return RECONMXSPARSE;
+    }
+  }
+  i=RECONMXSPTHRESH;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='f' && nbytes[i]==sizeof(float) && *((float*)values[i])>=0){
+      thresh=*((float*)values[i]);
+    }else{
+      printf("reconmxSpThresh error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxSpThresh error");
+      rs->rmxFmt=AGBMVM_FP32;
+      return RECONMXSPTHRESH;
+    }
+  }
+#endif
+  if(rs->rmxCsc!=NULL){//can only be used block sparse.
+    if(fmt!=AGBMVM_FP32 || rs->rmxNuma)
+      printf("reconmvm: Warning - reconmxFormat and reconmxNuma not used with sparse gainReconmxT\n");
+    fmt=AGBMVM_FP32;
+    rs->rmxNuma=0;
+    rs->rmxValidate=0;
+#if defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+    sparse=2;
+#endif
+    memset(rs->threadRmx,0,sizeof(float*)*reconStruct->nthreads);
+  }
+#if !defined(USEAGBBLAS) || defined(USEICC) || defined(USEMKL)
+  if(fmt!=AGBMVM_FP32){
+    printf("reconmvm: Warning - reconmxFormat needs the agbcblas MVM, using fp32\n");
+    fmt=AGBMVM_FP32;
+  }
+#endif
+  if(rs->rmxNuma)//we make our own copies, so don't use any supplied by the user.
+    memset(rs->threadRmx,0,sizeof(float*)*reconStruct->nthreads);
+  for(j=0;j<reconStruct->nthreads && fmt!=AGBMVM_FP32;j++){
+    if(rs->threadRmx[j]!=NULL){
+      printf("reconmvm: Warning - reconmxFormat not used with numa gainReconmxT, using fp32\n");
+      fmt=AGBMVM_FP32;
+    }
+  }
+  rs->rmxFmt=fmt;
+  if(fmt==AGBMVM_FP32)
+    rs->rmxValidate=0;
+  rs->rmxSparse=0;
+#if defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+  for(j=0;j<reconStruct->nthreads && rs->threadRmx[j]==NULL;j++);
+  if(sparse>0 && fmt==AGBMVM_FP32 && rs->rmxNuma==0 && j==reconStruct->nthreads && rs->totCents%2==0){
+    if((n=reconPrepareSparse(rs,sparse,thresh))!=0)
+      return n;
+  }
+#endif
+  if(rs->rmxCsc!=NULL && rs->rmxSparse==0){
+    printf("reconmvm: Error - sparse gainReconmxT can't be used\n");
+    return GAINRECONMXT;
+  }
+  if(rs->rmxNuma){
+    if((n=reconBuildParts(reconStruct,rs,fmt))!=0){
+      rs->rmxNuma=0;
+      rs->rmxFmt=AGBMVM_FP32;
+      memset(rs->threadPart,0,sizeof(void*)*reconStruct->nthreads);
+      return n;
+    }
+    printf("reconmvm: Using %s gainReconmxT, copied to the numa node of each thread\n",fmtNames[fmt]);
+  }else
+    memset(rs->threadPart,0,sizeof(void*)*reconStruct->nthreads);
+  for(j=0;j<reconStruct->nthreads && rs->threadPart[j]!=NULL;j++);
+  if(fmt!=AGBMVM_FP32 && j<reconStruct->nthreads){//some threads use the global copy.
+    size=(size_t)agb_cblas_mvmElSize(fmt)*rs->nacts*rs->totCents;
+    if(rs->rmxLPSize<size){
+      if(rs->rmxLP!=NULL)
+	free(rs->rmxLP);
+      if(posix_memalign(&rs->rmxLP,ARRAYALIGN,size)!=0){
+	printf("Error allocating recon rmxLP\n");
+	rs->rmxLP=NULL;
+	rs->rmxLPSize=0;
+	rs->rmxFmt=AGBMVM_FP32;
+	return -2;
+      }
+      rs->rmxLPSize=size;
+    }
+    if(rs->rmxScaleSize<rs->totCents){
+      if(rs->rmxScale!=NULL)
+	free(rs->rmxScale);
+      if((rs->rmxScale=calloc(sizeof(float),rs->totCents))==NULL){
+	printf("Error allocating recon rmxScale\n");
+	rs->rmxScaleSize=0;
+	rs->rmxFmt=AGBMVM_FP32;
+	return -2;
+      }
+      rs->rmxScaleSize=rs->totCents;
+    }
+    //The param buffer doesn't say whether gainReconmxT has changed, so always convert.
+    if((n=agb_cblas_mvmConvert(fmt,rs->nacts,rs->totCents,rs->rmxT,rs->rmxLP,rs->rmxScale))>0)
+      printf("reconmvm: Warning - %d values of gainReconmxT out of range for %s\n",n,fmtNames[fmt]);
+    printf("reconmvm: Using %s gainReconmxT\n",fmtNames[fmt]);
+  }
+  if(rs->rmxValidate>0 && rs->mvmValidateSize<rs->nacts){//these are per buffer, since the live buffer may still be using its own.
+    for(j=0;j<reconStruct->nthreads;j++){
+      if(rs->mvmRefArr[j]!=NULL)
+	free(rs->mvmRefArr[j]);
+      rs->mvmRefArr[j]=calloc(sizeof(float),rs->nacts);
+    }
+    if(rs->mvmErr!=NULL)
+      free(rs->mvmErr);
+    if(rs->mvmRefSum!=NULL)
+      free(rs->mvmRefSum);
+    rs->mvmErr=calloc(sizeof(float),rs->nacts);
+    rs->mvmRefSum=calloc(sizeof(float),rs->nacts);
+    rs->mvmValidateSize=rs->nacts;
+    for(j=0;j<reconStruct->nthreads;j++){
+      if(rs->mvmRefArr[j]==NULL)
+	rs->mvmValidateSize=0;
+    }
+    if(rs->mvmErr==NULL || rs->mvmRefSum==NULL)
+      rs->mvmValidateSize=0;
+    if(rs->mvmValidateSize==0){
+      printf("Error allocating reconmxValidate arrays - not validating\n");
+      rs->rmxValidate=0;
+    }
+  }
+  reconStruct->mvmMaxErr=0;
+  reconStruct->mvmMaxRef=0;
+  reconStruct->mvmValidateCnt=0;
+  return 0;
+}
+#endif
+
 /**
    Called asynchronously, whenever new parameters are ready.
    Once this returns, a call to swap buffers will be issued.
@@ -683,7 +1355,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
   nfound=bufferGetIndex(pbuf,RECONNBUFFERVARIABLES,reconStruct->paramNames,reconStruct->index,reconStruct->values,reconStruct->dtype,reconStruct->nbytes);
   if(nfound!=RECONNBUFFERVARIABLES){
     for(j=0; j<RECONNBUFFERVARIABLES; j++){
-      if(reconStruct->index[j]<0 && j!=GAINE2 && j!=SUBAPALLOCATION && j!=THREADTONUMA && j!=TREENPARTS && j!=TREEBARRIERWAITS && j!=TREEPARTARRAY){
+      if(reconStruct->index[j]<0 && j!=GAINE2 && j!=RECONPIPELINE && j!=RECONMXBATCH && j!=RECONMXFORMAT && j!=RECONMXNUMA && j!=RECONMXSPTHRESH && j!=RECONMXSPARSE && j!=RECONMXVALIDATE && j!=SUBAPALLOCATION && j!=THREADAFFELSIZE && j!=THREADAFFINITY && j!=THREADTONUMA && j!=TREENPARTS && j!=TREEBARRIERWAITS && j!=TREEPARTARRAY){
 	printf("Missing %16s\n",&reconStruct->paramNames[j*BUFNAMESIZE]);
 	err=-1;
       }
@@ -725,8 +1397,15 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       err=RECONSTRUCTMODE;
     }
     i=GAINRECONMXT;
+    rs->rmxCsc=NULL;
     if(dtype[i]=='f' && nbytes[i]==rs->totCents*rs->nacts*sizeof(float)){
       rs->rmxT=(float*)values[i];
+#if !defined(USECUDA) && defined(USEAGBBLAS) && !defined(USEICC) && !defined(USEMKL)
+    }else if(dtype[i]=='f' && nbytes[i]>sizeof(int)*(rs->totCents+1) && ((int*)values[i])[rs->totCents]>=0 && sizeof(int)*(rs->totCents+1)+(sizeof(int)+sizeof(float))*(size_t)((int*)values[i])[rs->totCents]==nbytes[i]){//sparse, indptr then (index,value) pairs, as pcgB in reconpcg.  Checked fully by agb_cblas_bscFromCsc.
+      rs->rmxT=NULL;
+      rs->rmxCsc=(int*)values[i];
+      rs->rmxCscSize=nbytes[i]/sizeof(int);
+#endif
     }else{
       printf("gainReconmxT error %c %d %d %d\n",dtype[i],nbytes[i],rs->totCents,rs->nacts);
       err=GAINRECONMXT;
@@ -896,6 +1575,43 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     }
 #endif
   }
+#ifndef USECUDA
+  rs->pipeline=0;
+  i=RECONPIPELINE;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=0){
+      rs->pipeline=*((int*)values[i]);
+    }else{
+      printf("reconPipeline error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconPipeline error");
+      err=RECONPIPELINE;
+    }
+  }
+  rs->mvmBatch=0;
+  i=RECONMXBATCH;
+  if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=-1){
+      rs->mvmBatch=*((int*)values[i]);
+      if(rs->mvmBatch==-1){//what suits the MVM kernel.
+#if defined(USEAGBBLAS) && !defined(USEICC)
+	rs->mvmBatch=agb_cblas_mvmBatchCols();
+#else
+	rs->mvmBatch=32;
+#endif
+      }
+    }else{
+      printf("reconmxBatch error\n");
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"reconmxBatch error");
+      err=RECONMXBATCH;
+    }
+  }
+  if(err==0 && rs->nparts==0)
+    err=reconInitReduce(reconStruct,rs);
+  if(rs->pipeline>0 && rs->nparts>0){
+    printf("reconmvm: Warning - reconPipeline not used with treeAdd\n");
+    rs->pipeline=0;
+  }
+#endif
   if(reconStruct->latestDmCommandSize<sizeof(float)*rs->nacts){
     reconStruct->latestDmCommandSize=sizeof(float)*rs->nacts;
     if(reconStruct->latestDmCommand!=NULL)
@@ -949,11 +1665,22 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     }
   }
 
+  //Work out which subaps are done by each thread, if defined - used for numa rmx parts.
+  rs->subapAlloc=NULL;
+  if(reconStruct->index[SUBAPALLOCATION]>=0){//defined subaps
+    int ncam,nsubtot=0;
+    int *nsub;
+    ncam=*((int*)values[NCAM]);//number of cameras
+    nsub=((int*)values[NSUB]);//array of number of subaps/camera.
+    for(j=0;j<ncam;j++)
+      nsubtot+=nsub[j];//total number of subaps (used and unused)
+    if(nbytes[SUBAPALLOCATION]==sizeof(int)*nsubtot && dtype[SUBAPALLOCATION]=='i'){
+      rs->subapAlloc=(int*)values[SUBAPALLOCATION];
+    }
+  }
   if(pbuf->nNumaNodes!=0 && reconStruct->index[THREADTONUMA]>=0 && dtype[THREADTONUMA]=='i' && nbytes[THREADTONUMA]==sizeof(int)*reconStruct->nthreads){
     //some numa aware buffers - search for partial reconstruction matrices here.
     //Need to work out now many subaps to be done by each thread... which then tells us the size of the relevant arrays to look out for.
-    int ncam,nsubtot=0;
-    int *nsub;
     char paramList[17];
     int indx;
     void *valptr;
@@ -962,17 +1689,8 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     int numaIndx;
     int *subapFlag;
     reconStruct->threadToNumaList=(int*)values[THREADTONUMA];
-    ncam=*((int*)values[NCAM]);//number of cameras
-    nsub=((int*)values[NSUB]);//array of number of subaps/camera.
-    for(j=0;j<ncam;j++)
-      nsubtot+=nsub[j];//total number of subaps (used and unused)
-    rs->subapAlloc=NULL;
-    if(reconStruct->index[SUBAPALLOCATION]>=0){//defined subaps
-      if(nbytes[SUBAPALLOCATION]==sizeof(int)*nsubtot && dtype[SUBAPALLOCATION]=='i'){
-	rs->subapAlloc=(int*)values[SUBAPALLOCATION];
-      }
-    }
     if(rs->subapAlloc!=NULL){//threads have defined subaps.
+      int nsubtot=nbytes[SUBAPALLOCATION]/sizeof(int);
       subapFlag=(int*)values[SUBAPFLAG];
       memset(rs->threadSubapCnt,0,sizeof(int)*reconStruct->nthreads);
       for(j=0;j<nsubtot;j++){
@@ -1014,6 +1732,12 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
   }else{
     memset(rs->threadRmx,0,sizeof(float*)*reconStruct->nthreads);
   }
+#ifndef USECUDA
+  if(err==0)
+    err=reconPrepareRmx(reconStruct,rs,frameno);
+  else
+    rs->rmxFmt=AGBMVM_FP32;
+#endif
 
 
 
@@ -1046,6 +1770,9 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
   ReconStruct *reconStruct;
   //ReconStructEntry *rs;
   int err=0;
+#ifndef USECUDA
+  int i;
+#endif
 #ifdef USECUDA
   mqd_t mq;
   struct mq_attr attr;
@@ -1088,6 +1815,46 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
   reconStruct->rs[0].threadRmx=calloc(sizeof(float*),nthreads);
   reconStruct->rs[1].threadRmx=calloc(sizeof(float*),nthreads);
   reconStruct->centIndxTot=calloc(sizeof(int),nthreads);
+#ifndef USECUDA
+  reconStruct->mvmPending=calloc(sizeof(int),nthreads*2);
+  reconStruct->mvmUnfolded=calloc(sizeof(int),nthreads);
+  reconStruct->mvmPendingRmx=calloc(sizeof(char*),nthreads);
+  reconStruct->mvmPendingScale=calloc(sizeof(float*),nthreads);
+  reconStruct->rs[0].mvmRefArr=calloc(sizeof(float*),nthreads);
+  reconStruct->rs[1].mvmRefArr=calloc(sizeof(float*),nthreads);
+  if(reconStruct->mvmPending==NULL || reconStruct->mvmUnfolded==NULL || reconStruct->mvmPendingRmx==NULL || reconStruct->mvmPendingScale==NULL || reconStruct->rs[0].mvmRefArr==NULL || reconStruct->rs[1].mvmRefArr==NULL){
+    printf("Error allocating recon mvmPending\n");
+    reconClose(reconHandle);
+    *reconHandle=NULL;
+    return 1;
+  }
+  reconStruct->nnodes=(numa_available()<0)?1:numa_max_node()+1;
+  for(i=0;i<2;i++){//allocate the reconmxNuma part arrays.
+    ReconStructEntry *rs=&reconStruct->rs[i];
+    int np=nthreads>reconStruct->nnodes?nthreads:reconStruct->nnodes;
+    rs->threadPart=calloc(sizeof(void*),nthreads);
+    rs->threadPartScale=calloc(sizeof(float*),nthreads);
+    rs->partMem=calloc(sizeof(void*),np);
+    rs->partMemSize=calloc(sizeof(size_t),np);
+    rs->partMemNode=calloc(sizeof(int),np);
+    rs->partScale=calloc(sizeof(float*),np);
+    rs->partScaleSize=calloc(sizeof(int),np);
+    rs->redNode=calloc(sizeof(int),nthreads);
+    rs->redNodeCnt=calloc(sizeof(int),reconStruct->nnodes);
+    rs->redPart=calloc(sizeof(float*),reconStruct->nnodes);
+    rs->redPartSize=calloc(sizeof(size_t),reconStruct->nnodes);
+    if(posix_memalign((void**)&rs->redNodeDone,ARRAYALIGN,sizeof(int)*REDPAD*reconStruct->nnodes)!=0)
+      rs->redNodeDone=NULL;
+    else
+      memset(rs->redNodeDone,0,sizeof(int)*REDPAD*reconStruct->nnodes);
+    if(rs->threadPart==NULL || rs->threadPartScale==NULL || rs->partMem==NULL || rs->partMemSize==NULL || rs->partMemNode==NULL || rs->partScale==NULL || rs->partScaleSize==NULL || rs->redNode==NULL || rs->redNodeCnt==NULL || rs->redPart==NULL || rs->redPartSize==NULL || rs->redNodeDone==NULL){
+      printf("Error allocating recon part arrays\n");
+      reconClose(reconHandle);
+      *reconHandle=NULL;
+      return 1;
+    }
+  }
+#endif
 
 #ifdef USECUDA
 
@@ -1412,47 +2179,150 @@ int reconStartFrame(void *reconHandle,int cam,int threadno){
 
   memset((void*)(rs->dmCommandArr[threadno]),0,rs->nacts*sizeof(float));
   reconStruct->centIndxTot[threadno]=0;//only used for Numa.
+  reconStruct->mvmPending[threadno*2+1]=0;
+  reconStruct->mvmUnfolded[threadno]=0;
+  if(rs->rmxValidate)
+    memset(rs->mvmRefArr[threadno],0,rs->nacts*sizeof(float));
   return 0;
 }
 #endif
 
 
+#ifndef USECUDA
 /**
-   Called multiple times by multiple threads, whenever new slope data is ready
-   centroids may not be complete, and writing to dmCommand is not thread-safe without locking.
+   Multiply the slopes that this thread has gathered since the last MVM into its dmCommandArr.
+   Contiguous slope blocks are merged, so the MVM sees several blocks at once, and dmCommandArr is
+   then only read and written once for all of them.
 */
-int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsubapsDoing){
-#if !defined(USEAGBBLAS) && !defined(USECUDA) || defined(USEMKL)
+static int reconFlushSlopes(ReconStruct *reconStruct,ReconStructEntry *rs,int threadno){
+#if !defined(USEAGBBLAS) || defined(USEMKL)
   CBLAS_ORDER order=CblasColMajor;
   CBLAS_TRANSPOSE trans=CblasNoTrans;
   float alpha=1.,beta=1.;
   int inc=1;
 #endif
+  int *pend=&reconStruct->mvmPending[threadno*2];
+#if defined(USEMKL) || (defined(USEAGBBLAS) && !defined(DUMMY))
+  char *rmx=reconStruct->mvmPendingRmx[threadno];
+  float *centroids=reconStruct->arr->centroids;
+  int centindx=pend[0];
+#endif
+  int step=pend[1];
+  if(step==0)
+    return 0;
+  pend[1]=0;
+  reconStruct->mvmUnfolded[threadno]+=step;
+#ifdef USEMKL
+  cblas_sgemv(order,trans,rs->nacts,step,alpha,(float*)rmx,rs->nacts,&(centroids[centindx]),inc,beta,rs->dmCommandArr[threadno],inc);
+#elif defined(USEAGBBLAS)
+#ifndef DUMMY
+  #ifdef USEICC
+  agb_cblas_32sgemvColMN1M111(rs->nacts,step,(void*)rmx,&(centroids[centindx]),rs->dmCommandArr[threadno]);
+  #else
+  if(rs->rmxSparse){
+    agb_cblas_sgemvColMN1M111BSC(rs->nacts,step,&rs->spPtr[centindx/2],rs->spRow,rs->spVal,&(centroids[centindx]),rs->dmCommandArr[threadno]);
+  }else if(rs->rmxFmt==AGBMVM_FP32){
+    agb_cblas_sgemvColMN1M111Tiled(rs->nacts,step,(float*)rmx,&(centroids[centindx]),rs->dmCommandArr[threadno]);
+  }else{
+    agb_cblas_sgemvColMN1M111TiledLP(rs->rmxFmt,rs->nacts,step,rmx,reconStruct->mvmPendingScale[threadno],&(centroids[centindx]),rs->dmCommandArr[threadno]);
+    if(rs->rmxValidate)//and at full precision, for comparison.
+      agb_cblas_sgemvColMN1M111Tiled(rs->nacts,step,&(rs->rmxT[(size_t)centindx*rs->nacts]),&(centroids[centindx]),rs->mvmRefArr[threadno]);
+  }
+  #endif
+#endif
+#else
+  printf("Error: No cblas lib defined in Makefile\n");
+  return 1;
+#endif
+  return 0;
+}
+
+/**
+   Add this thread's reduced precision error (dmCommandArr - mvmRefArr) to the frame total, for reconmxValidate.
+   mvmRefArr is then zeroed, since dmCommandArr may be folded into dmCommand before the end of frame.
+*/
+static void reconValidateAdd(ReconStruct *reconStruct,ReconStructEntry *rs,int threadno){
+  int i;
+  float *ref=rs->mvmRefArr[threadno];
+  float *dmc=rs->dmCommandArr[threadno];
+  darc_mutex_lock(&reconStruct->dmMutex);
+  for(i=0;i<rs->nacts;i++){
+    rs->mvmErr[i]+=dmc[i]-ref[i];
+    rs->mvmRefSum[i]+=ref[i];
+  }
+  darc_mutex_unlock(&reconStruct->dmMutex);
+  memset(ref,0,sizeof(float)*rs->nacts);
+}
+
+/**
+   For reconPipeline, add this thread's partial DM command into dmCommand now, while further slopes are
+   still arriving, and zero it, so that less is left for reconEndFrame after the last slopes.
+   If dmCommand isn't yet ready, this is left until the next MVM.
+   Called from reconNewSlopes, after the MVM, so it is done before the thread goes back to wait for pixels,
+   not while it is waiting - it is only free if the thread is keeping up with the readout, otherwise it delays
+   the thread's next block.
+*/
+static void reconFoldPartial(ReconStruct *reconStruct,ReconStructEntry *rs,int threadno){
+  if(__atomic_load_n(&reconStruct->dmReady,__ATOMIC_ACQUIRE)==0 || (rs->polc==1 && reconStruct->polcCounter<reconStruct->nthreads))
+    return;
+  if(rs->rmxValidate)
+    reconValidateAdd(reconStruct,rs,threadno);
+  reconStripeAdd(rs,rs->dmCommandArr[threadno],reconStruct->arr->dmCommand,rs->redLock,&rs->redTodo[threadno*rs->redNstripes],threadno,1);
+  reconStruct->mvmUnfolded[threadno]=0;
+}
+#endif
+
+/**
+   Called multiple times by multiple threads, whenever new slope data is ready
+   centroids may not be complete, and writing to dmCommand is not thread-safe without locking.
+   If reconmxBatch is set, the MVM may be deferred until more slopes arrive (or reconEndFrame), so that several blocks are done together.
+*/
+int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsubapsDoing){
   int step;//number of rows to do in mmx...
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
+  float *centroids=reconStruct->arr->centroids;
 #ifndef USECUDA
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-#endif
-  float *centroids=reconStruct->arr->centroids;
-  float *rmx=&(rs->rmxT[centindx*rs->nacts])
+  char *rmx;
+  float *scale=NULL;
+  size_t elsize=agb_cblas_mvmElSize(rs->rmxFmt);
+  int *pend;
   //float *dmCommand=reconStruct->arr->dmCommand;
   //infoStruct *info=threadInfo->info;
   //globalStruct *glob=threadInfo->globals;
   //We assume that each row i of the reconstructor has already been multiplied by gain[i].
   //So, here we just do dmCommand+=rmx[:,n]*centx+rmx[:,n+1]*centy.
   dprintf("in partialReconstruct %d %d %d %p %p %p\n",rs->nacts,centindx,rs->totCents,centroids,rs->rmxT,rs->dmCommandArr[threadno]);
+#endif
   step=2*nsubapsDoing;
 
+#ifndef USECUDA
   //do we need a numa matrix???
-  if(rs->threadRmx[threadno]!=NULL){
+  if(rs->rmxSparse){//block sparse, indexed by centindx in reconFlushSlopes.
+    rmx=NULL;
+  }else if(rs->threadPart[threadno]!=NULL){//our own copy, on this thread's node, in rmxFmt.
+    if(rs->subapAlloc!=NULL){//just the columns for this thread, in the order it does them.
+      rmx=(char*)rs->threadPart[threadno]+(size_t)reconStruct->centIndxTot[threadno]*rs->nacts*elsize;
+      scale=&(rs->threadPartScale[threadno][reconStruct->centIndxTot[threadno]]);
+      reconStruct->centIndxTot[threadno]+=step;
+    }else{
+      rmx=(char*)rs->threadPart[threadno]+(size_t)centindx*rs->nacts*elsize;
+      scale=&(rs->threadPartScale[threadno][centindx]);
+    }
+  }else if(rs->threadRmx[threadno]!=NULL){
     //is this a whole matrix (no subapAllocation), or just the relevant portion?
     if(rs->subapAlloc!=NULL){//threads have defined subaps.
       //centindx will only increase for a particular thread.  And since subapAllocation is defined, this will be known.  Therefore keep a note of where we are.
-      rmx=&((rs->threadRmx[threadno])[reconStruct->centIndxTot[threadno]*rs->nacts]);
+      rmx=(char*)&((rs->threadRmx[threadno])[reconStruct->centIndxTot[threadno]*rs->nacts]);
       reconStruct->centIndxTot[threadno]+=step;
     }else{//whole matrix, but in the correct Numa area.
-      rmx=rs->threadRmx[threadno];
+      rmx=(char*)&((rs->threadRmx[threadno])[centindx*rs->nacts]);
     }
+  }else if(rs->rmxFmt==AGBMVM_FP32){
+    rmx=(char*)&(rs->rmxT[centindx*rs->nacts]);
+  }else{
+    rmx=(char*)rs->rmxLP+(size_t)centindx*rs->nacts*elsize;
+    scale=&(rs->rmxScale[centindx]);
   }
   if(rs->polc==2){//explicit polc.
     //wait until the POL slopes are ready, then add these to the centroids that we're investigating here.
@@ -1463,17 +2333,25 @@ int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsuba
       centroids[i]+=rs->polcCentroids[i];
     }
   }
-#ifdef USEMKL
-  cblas_sgemv(order,trans,rs->nacts,step,alpha,rmx,rs->nacts,&(centroids[centindx]),inc,beta,rs->dmCommandArr[threadno],inc);
-#elif defined(USEAGBBLAS)
-#ifndef DUMMY
-  #ifdef USEICC
-  agb_cblas_32sgemvColMN1M111(rs->nacts,step,(void*)rmx,&(centroids[centindx]),rs->dmCommandArr[threadno]);
-  #else
-  agb_cblas_sgemvColMN1M111(rs->nacts,step,rmx,&(centroids[centindx]),rs->dmCommandArr[threadno]);
-  #endif
-#endif
-#elif defined(USECUDA)
+  //Gather this block with any pending ones, if it follows on from them in both centroids and rmx.
+  pend=&reconStruct->mvmPending[threadno*2];
+  if(pend[1]>0 && (pend[0]+pend[1]!=centindx || (rmx!=NULL && reconStruct->mvmPendingRmx[threadno]+(size_t)pend[1]*rs->nacts*elsize!=rmx))){
+    if(reconFlushSlopes(reconStruct,rs,threadno))
+      return 1;
+  }
+  if(pend[1]==0){
+    pend[0]=centindx;
+    reconStruct->mvmPendingRmx[threadno]=rmx;
+    reconStruct->mvmPendingScale[threadno]=scale;
+  }
+  pend[1]+=step;
+  if(pend[1]>=rs->mvmBatch){
+    if(reconFlushSlopes(reconStruct,rs,threadno))
+      return 1;
+  }
+  if(rs->pipeline>0 && reconStruct->mvmUnfolded[threadno]>=rs->pipeline && rs->redNstripes>0)
+    reconFoldPartial(reconStruct,rs,threadno);
+#else
   //Need to wait here until the INITFRAME has been done...
 #ifdef MYCUBLAS
   if(reconStruct->rs[reconStruct->buf].newswap)
@@ -1489,9 +2367,6 @@ int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsuba
   if(mq_send(reconStruct->mq,(char*)msg,sizeof(int)*3,0)!=0)
     printf("error in mq_send in reconNewSlopes\n");
   pthread_mutex_unlock(&reconStruct->cudamutex);
-#else
-  printf("Error: No cblas lib defined in Makefile\n");
-  return 1;
 #endif
   return 0;
 }
@@ -1548,6 +2423,11 @@ int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
 #if !defined(USECUDA)
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
+  //do any MVM still outstanding for this thread.
+  if(reconFlushSlopes(reconStruct,rs,threadno))
+    return 1;
+  if(rs->rmxValidate)//add this thread's reduced precision error to the total.
+    reconValidateAdd(reconStruct,rs,threadno);
 #endif
   if(rs->polc==1){
     //wait until the POL is all done in reconStartFrame.
@@ -1563,6 +2443,24 @@ int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
       // busy wait ...
     }
     treeAdd(reconStruct,threadno);
+#ifndef USECUDA
+  }else if(rs->redNstripes>0){//striped reduction, per numa node first if needed.
+    float *dmCommand=reconStruct->arr->dmCommand;
+    char *todo=&rs->redTodo[threadno*rs->redNstripes];
+    int node=rs->pipeline>0?-1:rs->redNode[threadno];//with reconPipeline, threads have already been adding into dmCommand.
+    if(node>=0){//add to the partial for this node - doesn't need dmCommand to be ready.
+      reconStripeAdd(rs,rs->dmCommandArr[threadno],rs->redPart[node],&rs->redLock[(node+1)*rs->redNstripes*REDPAD],todo,threadno,0);
+      if(__atomic_add_fetch(&rs->redNodeDone[node*REDPAD],1,__ATOMIC_ACQ_REL)==rs->redNodeCnt[node]){
+	//last thread on this node, so add the node partial into dmCommand (and zero it for next time).
+	darc_futex_wait_if_value(&reconStruct->dmFutex,reconStruct->dmReady);
+	reconStripeAdd(rs,rs->redPart[node],dmCommand,rs->redLock,todo,node*rs->redNstripes/reconStruct->nnodes,1);
+	__atomic_store_n(&rs->redNodeDone[node*REDPAD],0,__ATOMIC_RELEASE);
+      }
+    }else{
+      darc_futex_wait_if_value(&reconStruct->dmFutex,reconStruct->dmReady);
+      reconStripeAdd(rs,rs->dmCommandArr[threadno],dmCommand,rs->redLock,todo,threadno,0);
+    }
+#endif
   }else{//not using the butterfly treeAdd addition...
   //#else
 #ifndef USECUDA
@@ -1619,6 +2517,36 @@ int reconFrameFinishedSync(void *reconHandle,int err,int forcewrite){
   reconStruct->polcCounter=0;
   reconStruct->dmReady=0;
   //pthread_mutex_unlock(&reconStruct->dmMutex);
+#ifndef USECUDA
+  ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
+  if(rs->nparts==0 && rs->redNstripes>0){
+    int n;
+    for(n=0;n<reconStruct->nnodes;n++){
+      if(rs->redPart[n]!=NULL && rs->redNodeDone[n*REDPAD]!=0){//not all threads on this node called reconEndFrame (e.g. a paused camera), so add what there is.
+	agb_cblas_saxpy111(rs->nacts,rs->redPart[n],reconStruct->arr->dmCommand);
+	memset(rs->redPart[n],0,sizeof(float)*rs->nacts);
+	rs->redNodeDone[n*REDPAD]=0;
+      }
+    }
+  }
+  if(rs->rmxValidate){//all threads have finished, so report the reconmxFormat error.
+    int i;
+    for(i=0;i<rs->nacts;i++){
+      if(fabsf(rs->mvmErr[i])>reconStruct->mvmMaxErr)
+	reconStruct->mvmMaxErr=fabsf(rs->mvmErr[i]);
+      if(fabsf(rs->mvmRefSum[i])>reconStruct->mvmMaxRef)
+	reconStruct->mvmMaxRef=fabsf(rs->mvmRefSum[i]);
+    }
+    memset(rs->mvmErr,0,sizeof(float)*rs->nacts);
+    memset(rs->mvmRefSum,0,sizeof(float)*rs->nacts);
+    if(++reconStruct->mvmValidateCnt>=rs->rmxValidate){
+      printf("reconmvm: reconmxFormat max DM error %g (max fp32 MVM %g) over %d frames\n",reconStruct->mvmMaxErr,reconStruct->mvmMaxRef,reconStruct->mvmValidateCnt);
+      reconStruct->mvmMaxErr=0;
+      reconStruct->mvmMaxRef=0;
+      reconStruct->mvmValidateCnt=0;
+    }
+  }
+#endif
   reconStruct->postbuf=reconStruct->buf;
   return 0;
 }
@@ -17,12 +17,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 /**
    This is a library that can be used for a neural network implementation.
+
+The first layer is multiplied with the slopes as they arrive (in reconNewSlopes), each subap processing thread accumulating a partial result.  In reconFrameFinished, the partials are summed, and the remaining layers computed, by the post processing thread and annNThreads helper threads (owned by this module).  Each layer is split into row blocks, one per thread, and the bias and activation are applied to a block as soon as it is computed, with one barrier per layer.  The weights of the hidden layers are packed per block (column major, aligned) when the parameters change, optionally as reduced precision (annFormat).
+
+annNThreads - optional, default 0.  Number of helper threads.
+annThreadAffin - optional, affinity bitmask (uint32 words) of each helper thread, size annNThreads*n.  If not given, helpers may run on any cpu.
+annFormat - optional, default 0.  Storage of the weights: 0 float32, 1 bfloat16, 2 float16, 3 int8 (with a scale per column).  Computation is always float32.
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <errno.h>
 #ifdef USEAGBBLAS
 #include "agbcblas.h"
@@ -38,11 +46,14 @@ typedef enum{RECONMODE_SIMPLE,RECONMODE_TRUTH,RECONMODE_OPEN,RECONMODE_OFFSET}Re
 
 typedef enum{
   ANNBIAS,
+  ANNFORMAT,
   ANNLAYERSIZE,
   ANNLAYERTYPE,
   //ANNNLAYERS,
+  ANNNTHREADS,
   ANNOFFSET,
   ANNSCALE,
+  ANNTHREADAFFIN,
   ANNTYPEARRAY,
   ANNWEIGHTS,
   BLEEDGAIN,
@@ -58,7 +69,9 @@ typedef enum{
   RECONNBUFFERVARIABLES//equal to number of entries in the enum
 }RECONBUFFERVARIABLEINDX;
 
-#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"annBias","annLayerSize","annLayerType","annOffset","annScale","annTypeArray","annWeights","bleedGain","bleedGroups","decayFactor","gainE",/*"gainReconmxT",*/"nacts","reconstructMode","recordLinear","v0")
+#define ANNSTRIDE 16//floats per cache line - used for padding per thread arrays.
+
+#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"annBias","annFormat","annLayerSize","annLayerType","annNThreads","annOffset","annScale","annThreadAffin","annTypeArray","annWeights","bleedGain","bleedGroups","decayFactor","gainE",/*"gainReconmxT",*/"nacts","reconstructMode","recordLinear","v0")
 
 
 typedef struct{
@@ -93,8 +106,19 @@ typedef struct{
   int nacts;
   int totCents;
   float recordLinear;
-  int isLinear;
-  int isNotLinear;
+  int annFormat;
+  void *annW0;//first layer weights as used in reconNewSlopes (annWeights, or converted).
+  float *annW0Scale;//per column scale for int8.
+  int nHelpers;
+  unsigned int *helperAffin;
+  int helperAffinElSize;
+  int nblocks;//row blocks per layer (nHelpers+1) that the packed weights are split into.
+  char *annPack;//packed weights, first layer (if converted) then hidden layers.
+  size_t annPackSize;
+  float *annPackScale;
+  int annPackScaleSize;
+  size_t *annBlkOff;//per hidden layer and block: offset into annPack, and into annPackScale.
+  int annBlkOffSize;
 }ReconStructEntry;
 
 typedef struct{
@@ -105,8 +129,10 @@ typedef struct{
   int dmReady;
   float *latestDmCommand;
   int latestDmCommandSize;
-  float **annTmpArr;
+  float **annTmpArr;//per thread first layer partials, for two frames (2*nthreads).
   int annTmpArrSize;
+  int tmpPar;//which of the two sets of partials the subap threads are using.
+  int postPar;//and the set being used by reconFrameFinished.
   pthread_mutex_t dmMutex;
   pthread_cond_t dmCond;
   //int bufindx[RECONNBUFFERVARIABLES];
@@ -119,8 +145,154 @@ typedef struct{
   int nbytes[RECONNBUFFERVARIABLES];
   arrayStruct *arr;
   unsigned int *reconFrameno;
+  agbTeam team;//the helper thread team, started by the post processing thread.
+  int *linArr;//per thread counts of linear and non-linear neurons, ANNSTRIDE apart.
+  ReconStructEntry *job;
 }ReconStruct;
 
+static inline float tansig(float v){
+  return (2/(1+expf(-v)))-1;
+}
+
+/**
+   Activate n neurons of a layer, starting at neuron start.  in can point to out.
+   lin[0] and lin[1] count the linear and non-linear tansig neurons, if recordLinear is set.
+*/
+static void activate(ReconStructEntry *rs,int layer,int start,int n,float *in,float *out,int *lin){
+  int i;
+  int *typeArr;
+  switch(rs->annLayerType[layer]){
+  case 0://no activation
+    if(out!=in)
+      memcpy(out,in,sizeof(float)*n);
+    break;
+  case 1://tansig activation.
+    if(rs->recordLinear!=0.){
+      for(i=0;i<n;i++){
+	if(fabsf(in[i])<rs->recordLinear)
+	  lin[0]++;
+	else
+	  lin[1]++;
+	out[i]=tansig(in[i]);
+      }
+    }else{
+      for(i=0;i<n;i++){
+	out[i]=tansig(in[i]);
+      }
+    }
+    break;
+  case -1://per neuron activation.
+    if(rs->annTypeArray==NULL){
+      printf("Type not defined - assuming linear\n");
+      if(out!=in)
+	memcpy(out,in,sizeof(float)*n);
+    }else{
+      typeArr=&rs->annTypeArray[rs->annCum[layer]+start];
+      for(i=0;i<n;i++){
+	switch(typeArr[i]){
+	case 1://tansig
+	  out[i]=tansig(in[i]);
+	  break;
+	default:
+	  printf("Unknown activation function %d  for layer %d - assuming linear\n",typeArr[i],layer);
+	  //fall through
+	case 0://no activation
+	  out[i]=in[i];
+	  break;
+	}
+      }
+    }
+    break;
+  default:
+    printf("Unknown activation function %d for layer %d: Assuming linear\n",rs->annLayerType[layer],layer);
+    if(out!=in)
+      memcpy(out,in,sizeof(float)*n);
+    break;
+  }
+}
+
+/**
+   Scale n outputs, starting at actuator start, and add them to dmCommand.
+*/
+static void annOutput(ReconStructEntry *rs,float *dmCommand,float *y,int start,int n){
+  int i;
+  float *annScale=rs->annScale==NULL?NULL:&rs->annScale[start];
+  float *annOffset=rs->annOffset==NULL?NULL:&rs->annOffset[start];
+  dmCommand=&dmCommand[start];
+  if(annScale==NULL){
+    if(annOffset!=NULL){
+      for(i=0;i<n;i++)
+	dmCommand[i]+=y[i]+annOffset[i];
+    }else{
+      for(i=0;i<n;i++)
+	dmCommand[i]+=y[i];
+    }
+  }else{
+    if(annOffset!=NULL){
+      for(i=0;i<n;i++)
+	dmCommand[i]+=y[i]*annScale[i]+annOffset[i];
+    }else{
+      for(i=0;i<n;i++)
+	dmCommand[i]+=y[i]*annScale[i];
+    }
+  }
+}
+
+/**
+   Evaluate the network, as thread w of nHelpers+1.
+   Sums the first layer partials (from the subap threads) into annTmp, then does each hidden layer in turn, ping-ponging between annTmp and annTmpOut.
+   The outputs are added to dmCommand.  Called by agb_cblas_teamRun.
+*/
+static void annForward(void *data,int w,int *sense){
+  ReconStruct *reconStruct=(ReconStruct*)data;
+  ReconStructEntry *rs=reconStruct->job;
+  int nw=reconStruct->team.nHelpers+1;
+  int *lin=&reconStruct->linArr[w*ANNSTRIDE];
+  int *annLayerSize=rs->annLayerSize;
+  int nblocks=rs->nblocks;
+  float *dmCommand=reconStruct->arr->dmCommand;
+  float **part=&reconStruct->annTmpArr[reconStruct->postPar*reconStruct->nthreads];
+  float *in=rs->annTmp,*out=rs->annTmpOut,*y,*tmp;
+  size_t *off;
+  int i,b,t,start,n;
+  lin[0]=0;
+  lin[1]=0;
+  //First layer: bias + sum of the thread partials, summed in thread order.
+  start=(int)((long)annLayerSize[0]*w/nw);
+  n=(int)((long)annLayerSize[0]*(w+1)/nw)-start;
+  if(n>0){
+    y=&in[start];
+    memcpy(y,&rs->annBias[start],sizeof(float)*n);
+    for(t=0;t<reconStruct->nthreads;t++)
+      agb_cblas_saxpy111(n,&part[t][start],y);
+    activate(rs,0,start,n,y,y,lin);
+    if(rs->annNLayers==1)
+      annOutput(rs,dmCommand,y,start,n);
+  }
+  //Then the hidden layers, a row block at a time.  Blocks are shared round robin, in case fewer helpers are running than were requested.
+  for(i=1;i<rs->annNLayers;i++){
+    agb_cblas_teamBarrier(&reconStruct->team,sense);//the whole of the previous layer is needed.
+    for(b=w;b<nblocks;b+=nw){
+      start=(int)((long)annLayerSize[i]*b/nblocks);
+      n=(int)((long)annLayerSize[i]*(b+1)/nblocks)-start;
+      if(n==0)
+	continue;
+      off=&rs->annBlkOff[2*((i-1)*nblocks+b)];
+      y=&out[start];
+      memcpy(y,&rs->annBias[rs->annCum[i]+start],sizeof(float)*n);
+      //y+=W.x, with this block of W packed column major.
+      agb_cblas_sgemvColMN1M111TiledLP(rs->annFormat,n,annLayerSize[i-1],&rs->annPack[off[0]],rs->annPackScale==NULL?NULL:&rs->annPackScale[off[1]],in,y);
+      activate(rs,i,start,n,y,y,lin);
+      if(i==rs->annNLayers-1)
+	annOutput(rs,dmCommand,y,start,n);
+    }
+    tmp=in;
+    in=out;
+    out=tmp;
+  }
+  agb_cblas_teamBarrier(&reconStruct->team,sense);
+}
+
 /**
    Called to free the reconstructor module when it is being closed.
 */
@@ -130,12 +302,14 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
   int j;
   printf("Closing reconlibrary\n");
   if(reconStruct!=NULL){
+    agb_cblas_teamFree(&reconStruct->team);
     if(reconStruct->paramNames!=NULL)
       free(reconStruct->paramNames);
     pthread_mutex_destroy(&reconStruct->dmMutex);
     pthread_cond_destroy(&reconStruct->dmCond);
     if(reconStruct->latestDmCommand!=NULL)
       free(reconStruct->latestDmCommand);
+    if(reconStruct->linArr!=NULL)free(reconStruct->linArr);
     if(reconStruct->annTmpArr!=NULL){
       if(reconStruct->annTmpArr[0]!=NULL)
 	free(reconStruct->annTmpArr[0]);
@@ -146,6 +320,9 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
       if(rs->bleedVal!=NULL)free(rs->bleedVal);
       if(rs->annCum!=NULL)free(rs->annCum);
       if(rs->annTmp!=NULL)free(rs->annTmp);
+      if(rs->annPack!=NULL)free(rs->annPack);
+      if(rs->annPackScale!=NULL)free(rs->annPackScale);
+      if(rs->annBlkOff!=NULL)free(rs->annBlkOff);
       /*if(rs->dmCommandArr!=NULL){
 	for(i=0; i<reconStruct->nthreads; i++){
 	  if(rs->dmCommandArr[i]!=NULL)
@@ -162,6 +339,112 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
 }
 
 
+/**
+   Pack the weights of the hidden layers into row blocks, one per thread, each stored column major and aligned, as annFormat.  Also converts the first layer weights, if not float32.
+   Called from reconNewParam - the param buffer doesn't say whether annWeights has changed, so always repack.
+*/
+static int annPrepare(ReconStructEntry *rs){
+  int i,b,start,n,nscale,nover=0,nblocks=rs->nHelpers+1;
+  int fmt=rs->annFormat;
+  int *annLayerSize=rs->annLayerSize;
+  size_t size,off,elsize;
+  float *tmp=NULL,*w;
+  int r,c,mx=0;
+  char *fmtNames[]={"fp32","bf16","fp16","int8"};
+  elsize=agb_cblas_mvmElSize(fmt);
+  rs->nblocks=nblocks;
+  //Work out the sizes.
+  size=0;
+  nscale=0;
+  if(fmt!=AGBMVM_FP32){
+    size=((elsize*annLayerSize[0]*rs->totCents+ARRAYALIGN-1)/ARRAYALIGN)*ARRAYALIGN;
+    nscale=rs->totCents;
+  }
+  for(i=1;i<rs->annNLayers;i++){
+    for(b=0;b<nblocks;b++){
+      start=(int)((long)annLayerSize[i]*b/nblocks);
+      n=(int)((long)annLayerSize[i]*(b+1)/nblocks)-start;
+      size+=((elsize*n*annLayerSize[i-1]+ARRAYALIGN-1)/ARRAYALIGN)*ARRAYALIGN;
+      nscale+=annLayerSize[i-1];
+      if(n*annLayerSize[i-1]>mx)
+	mx=n*annLayerSize[i-1];
+    }
+  }
+  if(rs->annPackSize<size){
+    if(rs->annPack!=NULL)
+      free(rs->annPack);
+    if(posix_memalign((void**)&rs->annPack,ARRAYALIGN,size)!=0){
+      printf("Error allocating ann annPack\n");
+      rs->annPack=NULL;
+      rs->annPackSize=0;
+      return -2;
+    }
+    rs->annPackSize=size;
+  }
+  if(fmt==AGBMVM_INT8 && rs->annPackScaleSize<nscale){
+    if(rs->annPackScale!=NULL)
+      free(rs->annPackScale);
+    if((rs->annPackScale=malloc(sizeof(float)*nscale))==NULL){
+      printf("Error allocating ann annPackScale\n");
+      rs->annPackScaleSize=0;
+      return -2;
+    }
+    rs->annPackScaleSize=nscale;
+  }
+  if(rs->annBlkOffSize<2*(rs->annNLayers-1)*nblocks){
+    if(rs->annBlkOff!=NULL)
+      free(rs->annBlkOff);
+    if((rs->annBlkOff=malloc(sizeof(size_t)*2*(rs->annNLayers-1)*nblocks))==NULL){
+      printf("Error allocating ann annBlkOff\n");
+      rs->annBlkOffSize=0;
+      return -2;
+    }
+    rs->annBlkOffSize=2*(rs->annNLayers-1)*nblocks;
+  }
+  if(mx>0 && (tmp=malloc(sizeof(float)*mx))==NULL){
+    printf("Error allocating ann packing array\n");
+    return -2;
+  }
+  //The first layer (column major already).
+  off=0;
+  nscale=0;
+  rs->annW0=rs->annWeights;
+  rs->annW0Scale=NULL;
+  if(fmt!=AGBMVM_FP32){
+    nover+=agb_cblas_mvmConvert(fmt,annLayerSize[0],rs->totCents,rs->annWeights,rs->annPack,rs->annPackScale);
+    rs->annW0=rs->annPack;
+    rs->annW0Scale=rs->annPackScale;
+    off=((elsize*annLayerSize[0]*rs->totCents+ARRAYALIGN-1)/ARRAYALIGN)*ARRAYALIGN;
+    nscale=rs->totCents;
+  }
+  //And the hidden layers, which are row major: transpose each block.
+  for(i=1;i<rs->annNLayers;i++){
+    for(b=0;b<nblocks;b++){
+      start=(int)((long)annLayerSize[i]*b/nblocks);
+      n=(int)((long)annLayerSize[i]*(b+1)/nblocks)-start;
+      w=&rs->annWeights[rs->annCum2[i]+(long)start*annLayerSize[i-1]];
+      for(r=0;r<n;r++){
+	for(c=0;c<annLayerSize[i-1];c++)
+	  tmp[c*n+r]=w[r*annLayerSize[i-1]+c];
+      }
+      rs->annBlkOff[2*((i-1)*nblocks+b)]=off;
+      rs->annBlkOff[2*((i-1)*nblocks+b)+1]=nscale;
+      nover+=agb_cblas_mvmConvert(fmt,n,annLayerSize[i-1],tmp,&rs->annPack[off],fmt==AGBMVM_INT8?&rs->annPackScale[nscale]:NULL);
+      off+=((elsize*n*annLayerSize[i-1]+ARRAYALIGN-1)/ARRAYALIGN)*ARRAYALIGN;
+      nscale+=annLayerSize[i-1];
+    }
+  }
+  if(tmp!=NULL)
+    free(tmp);
+  if(fmt!=AGBMVM_INT8)
+    rs->annW0Scale=NULL;
+  if(nover>0)
+    printf("reconneural: Warning - %d values of annWeights out of range for %s\n",nover,fmtNames[fmt]);
+  if(fmt!=AGBMVM_FP32)
+    printf("reconneural: Using %s annWeights\n",fmtNames[fmt]);
+  return 0;
+}
+
 /**
    Called asynchronously, whenever new parameters are ready.
    Once this returns, a call to swap buffers will be issued.
@@ -190,7 +473,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
   if(nfound!=RECONNBUFFERVARIABLES){
     err=0;
     for(i=0;i<RECONNBUFFERVARIABLES;i++){
-      if(reconStruct->index[i]<0 && (i!=RECORDLINEAR)){
+      if(reconStruct->index[i]<0 && i!=RECORDLINEAR && i!=ANNFORMAT && i!=ANNNTHREADS && i!=ANNTHREADAFFIN){
 	printf("Missing %16s\n",&reconStruct->paramNames[i*BUFNAMESIZE]);
 	err=1;
       }
@@ -410,7 +693,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       i=ANNTYPEARRAY;
       if(nbytes[i]==0){
 	rs->annTypeArray=NULL;
-      }else if((dtype[i]=='f') && (nbytes[i]==sizeof(int)*totsize)){
+      }else if((dtype[i]=='i') && (nbytes[i]==sizeof(int)*totsize)){
 	rs->annTypeArray=(int*)values[i];
       }else{
 	printf("Error annTypeArray\n");
@@ -428,17 +711,56 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
 	  err=1;
 	}
       }
-    }   
-    if(reconStruct->annTmpArrSize<sizeof(float)*rs->annLayerSize[0]){
-      reconStruct->annTmpArrSize=sizeof(float)*rs->annLayerSize[0];
+      i=ANNFORMAT;
+      rs->annFormat=AGBMVM_FP32;
+      if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+	if(dtype[i]=='i' && nbytes[i]==sizeof(int) && *((int*)values[i])>=AGBMVM_FP32 && *((int*)values[i])<=AGBMVM_INT8){
+	  rs->annFormat=*((int*)values[i]);
+	}else{
+	  printf("annFormat error\n");
+	  writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"annFormat error");
+	  err=1;
+	}
+      }
+      i=ANNNTHREADS;
+      rs->nHelpers=0;
+      if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+	if(nbytes[i]==sizeof(int) && dtype[i]=='i' && *(int*)values[i]>=0){
+	  rs->nHelpers=*(int*)values[i];
+	}else{
+	  printf("annNThreads error\n");
+	  writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"annNThreads error");
+	  err=1;
+	}
+      }
+      i=ANNTHREADAFFIN;
+      rs->helperAffin=NULL;
+      rs->helperAffinElSize=0;
+      if(reconStruct->index[i]>=0 && nbytes[i]!=0){
+	if(dtype[i]=='i' && rs->nHelpers>0 && nbytes[i]%(sizeof(unsigned int)*rs->nHelpers)==0){
+	  rs->helperAffin=(unsigned int*)values[i];
+	  rs->helperAffinElSize=nbytes[i]/sizeof(unsigned int)/rs->nHelpers;
+	}else{
+	  printf("annThreadAffin error - should be uint32 size annNThreads*n\n");
+	  writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"annThreadAffin error");
+	  err=1;
+	}
+      }
+    }
+    //Per thread first layer partials, for this frame and the previous one (which reconFrameFinished may still be using).  Each is padded to a cache line.
+    nb=((rs->annLayerSize==NULL?0:rs->annLayerSize[0])+ANNSTRIDE-1)/ANNSTRIDE*ANNSTRIDE;
+    if(err==0 && reconStruct->annTmpArrSize<sizeof(float)*nb){
+      reconStruct->annTmpArrSize=sizeof(float)*nb;
       if(reconStruct->annTmpArr[0]!=NULL)free(reconStruct->annTmpArr[0]);
-      if((reconStruct->annTmpArr[0]=calloc(reconStruct->nthreads,reconStruct->annTmpArrSize))==NULL){
+      if(posix_memalign((void**)&reconStruct->annTmpArr[0],ARRAYALIGN,reconStruct->annTmpArrSize*2*reconStruct->nthreads)!=0){
 	printf("Error allocing annTmpArr\n");
 	err=1;
+	reconStruct->annTmpArr[0]=NULL;
 	reconStruct->annTmpArrSize=0;
       }else{
-	for(j=1;j<reconStruct->nthreads;j++){
-	  reconStruct->annTmpArr[j]=&(reconStruct->annTmpArr[j-1][rs->annLayerSize[0]]);
+	memset(reconStruct->annTmpArr[0],0,reconStruct->annTmpArrSize*2*reconStruct->nthreads);
+	for(j=1;j<2*reconStruct->nthreads;j++){
+	  reconStruct->annTmpArr[j]=&(reconStruct->annTmpArr[j-1][nb]);
 	}
       }
     }
@@ -457,6 +779,8 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       }else
 	rs->annTmpOut=&(rs->annTmp[mx]);
     }
+    if(err==0)
+      err=annPrepare(rs);
   }
   //No need to get the lock here because this and newFrame() are called inside glob->libraryMutex.
   reconStruct->dmReady=0;
@@ -549,7 +873,7 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
     *reconHandle=NULL;
     return 1;
     }*/
-  if((reconStruct->annTmpArr=calloc(sizeof(float*),nthreads))==NULL){
+  if((reconStruct->annTmpArr=calloc(sizeof(float*),2*nthreads))==NULL){
     printf("Error allocating reconann memory[0]\n");
     reconClose(reconHandle);
     *reconHandle=NULL;
@@ -589,6 +913,12 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
     *reconHandle=NULL;
     return 1;
   }
+  if(agb_cblas_teamInit(&reconStruct->team,"ann",annForward,reconStruct)){
+    printf("Error init recon team\n");
+    reconClose(reconHandle);
+    *reconHandle=NULL;
+    return 1;
+  }
   return 0;
 }
 
@@ -653,7 +983,6 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
   }else{//reconmode_offset
     memcpy(dmCommand,rs->v0,sizeof(float)*rs->nacts);
   }	
-  memcpy(rs->annTmp,rs->annBias,sizeof(float)*rs->annLayerSize[0]);
   //set the DM arrays ready.
   if(pthread_mutex_lock(&reconStruct->dmMutex))
     printf("pthread_mutex_lock error in setDMArraysReady: %s\n",strerror(errno));
@@ -670,7 +999,7 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
 int reconStartFrame(void *reconHandle,int cam,int threadno){
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;//threadInfo->globals->reconStruct;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-  memset((void*)(reconStruct->annTmpArr[threadno]),0,rs->annLayerSize[0]*sizeof(float));
+  memset((void*)(reconStruct->annTmpArr[reconStruct->tmpPar*reconStruct->nthreads+threadno]),0,rs->annLayerSize[0]*sizeof(float));
   return 0;
 }
 
@@ -690,43 +1019,34 @@ int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsuba
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
   float *centroids=reconStruct->arr->centroids;
+  float *annTmpArr=reconStruct->annTmpArr[reconStruct->tmpPar*reconStruct->nthreads+threadno];
   //All we can do before having the first set of slopes, is multiply the first weighting matrix.
 
   //So, here we just do annTmpArr+=annWeights[0][:,n]*centx+annWeights[0][:,n+1]*centy.
-  //Note, annTmpArr has previously been initialised with 0, and annTmp with the hidden layer bias.
-  dprintf("in partialReconstruct %d %d %d %p %p %p\n",rs->annLayerSize[0],centindx,rs->totCents,centroids,rs->annWeights[0],reconStruct->annTmpArr[threadno]);
+  //Note, annTmpArr has previously been initialised with 0.  The bias is added in reconFrameFinished.
+  dprintf("in partialReconstruct %d %d %d %p %p %p\n",rs->annLayerSize[0],centindx,rs->totCents,centroids,rs->annWeights,annTmpArr);
   step=2*nsubapsDoing;
 #ifdef USEAGBBLAS
-  agb_cblas_sgemvColMN1M111(rs->annLayerSize[0],step,&(rs->annWeights[centindx*rs->annLayerSize[0]]),&(centroids[centindx]),reconStruct->annTmpArr[threadno]);
+  //annW0 is column major (lda=annLayerSize[0]) in all formats, so can be offset by column.
+  agb_cblas_sgemvColMN1M111TiledLP(rs->annFormat,rs->annLayerSize[0],step,(char*)rs->annW0+(size_t)centindx*rs->annLayerSize[0]*agb_cblas_mvmElSize(rs->annFormat),rs->annW0Scale==NULL?NULL:&rs->annW0Scale[centindx],&(centroids[centindx]),annTmpArr);
 #else
-  cblas_sgemv(order,trans,rs->annLayerSize[0],step,alpha,&(rs->annWeights[centindx*rs->annLayerSize[0]]),rs->annLayerSize[0],&(centroids[centindx]),inc,beta,reconStruct->annTmpArr[threadno],inc);
+  cblas_sgemv(order,trans,rs->annLayerSize[0],step,alpha,&(rs->annWeights[centindx*rs->annLayerSize[0]]),rs->annLayerSize[0],&(centroids[centindx]),inc,beta,annTmpArr,inc);
 #endif
   return 0;
 }
 
 /**
    Called once for each thread at the end of a frame
-   Here we sum the individual dmCommands together to get the final one.
+   The thread partials are summed in reconFrameFinished, so all we do here is wait for reconNewFrame, which guarantees that reconFrameFinished for the previous frame has completed before these partials are reused, in two frames time.
    centroids may not be complete, and writing to dmCommand is not thread-safe without locking.
 */
 int reconEndFrame(void *reconHandle,int cam,int threadno,int err){
-  //dmCommand=glob->arrays->dmCommand;
-  //globalStruct *glob=threadInfo->globals;
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;
-  ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
-  //float *dmCommand=reconStruct->arr->dmCommand;
   if(pthread_mutex_lock(&reconStruct->dmMutex))
     printf("pthread_mutex_lock error in copyThreadPhase: %s\n",strerror(errno));
   if(reconStruct->dmReady==0)//wait for the precompute thread to finish (it will call setDMArraysReady when done)...
     if(pthread_cond_wait(&reconStruct->dmCond,&reconStruct->dmMutex))
       printf("pthread_cond_wait error in copyThreadPhase: %s\n",strerror(errno));
-  //now add threadInfo->dmCommand to threadInfo->info->dmCommand.
-#ifdef USEAGBBLAS
-  agb_cblas_saxpy111(rs->annLayerSize[0],reconStruct->annTmpArr[threadno],rs->annTmp);
-#else
-  cblas_saxpy(rs->annLayerSize[0],1.,reconStruct->annTmpArr[threadno],1,rs->annTmp,1);
-#endif
-
   pthread_mutex_unlock(&reconStruct->dmMutex);
   return 0;
 }
@@ -742,63 +1062,12 @@ int reconFrameFinishedSync(void *reconHandle,int err,int forcewrite){
   reconStruct->dmReady=0;
   //pthread_mutex_unlock(&reconStruct->dmMutex);
   reconStruct->postbuf=reconStruct->buf;
+  //the next frame uses the other set of partials.
+  reconStruct->postPar=reconStruct->tmpPar;
+  reconStruct->tmpPar=1-reconStruct->tmpPar;
   return 0;
 }
 
-inline float tansig(float v){
-  return (2/(1+expf(-v)))-1;
-}
-
-void activate(ReconStructEntry *rs,int layer,float *in,float *out){
-  //in can point to out.
-  int i;
-  switch(rs->annLayerType[layer]){
-  case 0://no activation
-    if(out!=in)
-      memcpy(out,in,sizeof(float)*rs->annLayerSize[layer]);
-    break;
-  case 1://tansig activation.
-    if(rs->recordLinear!=0.){
-      for(i=0;i<rs->annLayerSize[layer];i++){
-	if(fabsf(in[i])<rs->recordLinear)
-	  rs->isLinear++;
-	else
-	  rs->isNotLinear++;
-	out[i]=tansig(in[i]);
-      }
-      
-    }else{
-      for(i=0;i<rs->annLayerSize[layer];i++){
-	out[i]=tansig(in[i]);
-      }
-    }
-    break;
-  case -1://per neuron activation.
-    if(rs->annTypeArray==NULL){
-      printf("Type not defined - assuming linear\n");
-    }else{
-      for(i=0;i<rs->annLayerSize[layer];i++){
-	switch(rs->annTypeArray[rs->annCum[layer]+i]){
-	case 0://no activation
-	  out[i]=in[i];
-	  break;
-	case 1://tansig
-	  out[i]=tansig(in[i]);
-	  break;
-	default:
-	  printf("Unknown activation function %d  for layer %d - assuming linear\n",rs->annTypeArray[rs->annCum[layer]+i],layer);
-	  break;
-	}
-      }
-    }
-    break;
-  default:
-    printf("Unknown activation function %d for layer %d: Assuming linear\n",rs->annLayerType[layer],layer);
-    break;
-  }
-
-}
-
 /**
    Called by single thread per frame - end of frame
    Do any post processing here.
@@ -813,62 +1082,26 @@ int reconFrameFinished(void *reconHandle,int *err){//globalStruct *glob){
   float *bleedVal=rs->bleedVal;
   int i,bleedGroup;
   float *dmCommand=reconStruct->arr->dmCommand;
-#if !defined(USEAGBBLAS)
-  CBLAS_ORDER order=CblasRowMajor;
-  CBLAS_TRANSPOSE trans=CblasNoTrans;
-  float alpha=1.,beta=1.;
-  int inc=1;
-#endif
-  float *annTmp=rs->annTmp;
-  int annNLayers=rs->annNLayers;
-  float *annBias=rs->annBias;
-  float *annTmpOut=rs->annTmpOut;
-  int *annCum=rs->annCum;
-  int *annCum2=rs->annCum2;
-  int *annLayerSize=rs->annLayerSize;
-  float *annWeights=rs->annWeights;
-  float *annScale=rs->annScale;
-  float *annOffset=rs->annOffset;
   int nacts=rs->nacts;
-  //So far, we have multiplied input slopes with first weighting matrix, and added bias.  Results are in annTmp.
-  //So, we need to activate this, and then continue for the other hidden layers.
-  rs->isLinear=0;
-  rs->isNotLinear=0;
-  activate(rs,0,annTmp,annTmp);
-  for(i=1;i<annNLayers;i++){
-    //val=activate(dot(weight, annTmp) + bias)
-    memcpy(annTmpOut,&annBias[annCum[i]],sizeof(float)*annLayerSize[i]);
-#ifdef USEAGBBLAS
-    agb_cblas_sgemvRowMN1N111(annLayerSize[i],annLayerSize[i-1],&annWeights[annCum2[i]],annTmp,annTmpOut);
-    //sgemv(weights,annTmp,bias,annTmpOut);
-#else
-    //order,trans,rows,cols,alpha,weights,cols,x,inc,beta,y,inc
-    cblas_sgemv(order,trans,annLayerSize[i],annLayerSize[i-1],alpha,&annWeights[annCum2[i]],annLayerSize[i-1],annTmp,inc,beta,annTmpOut,inc);
-#endif
-    activate(rs,i,annTmpOut,annTmp);
-  }
-  //Now scale the output.
-  if(annScale==NULL){
-    if(annOffset!=NULL){
-      for(i=0;i<nacts;i++){
-	dmCommand[i]+=annTmp[i]+annOffset[i];
-      }
-    }else{
-      for(i=0;i<nacts;i++){
-	dmCommand[i]+=annTmp[i];
-      }
-    }
-  }else{
-    if(annOffset!=NULL){
-      for(i=0;i<nacts;i++){
-	dmCommand[i]+=annTmp[i]*annScale[i]+annOffset[i];
-      }
-    }else{
-      for(i=0;i<nacts;i++){
-	dmCommand[i]+=annTmp[i]*annScale[i];
-      }
+  int isLinear=0,isNotLinear=0;
+  //So far, each subap thread has multiplied its slopes with the first weighting matrix.  Now sum these, add the bias and activate, and then continue for the other hidden layers, adding the scaled output to dmCommand.
+  //(re)start the helpers if annNThreads or annThreadAffin have changed.
+  if(agb_cblas_teamCheck(&reconStruct->team,rs->nHelpers,rs->helperAffin,rs->helperAffinElSize) || reconStruct->linArr==NULL){
+    if(reconStruct->linArr!=NULL)
+      free(reconStruct->linArr);
+    if(posix_memalign((void**)&reconStruct->linArr,ARRAYALIGN,sizeof(int)*ANNSTRIDE*(rs->nHelpers+1))!=0){
+      printf("Error allocating ann linArr - reconstruction will not work\n");
+      reconStruct->linArr=NULL;
+      *err=1;
+      return 1;
     }
   }
+  reconStruct->job=rs;
+  agb_cblas_teamRun(&reconStruct->team);
+  for(i=0;i<=reconStruct->team.nHelpers;i++){
+    isLinear+=reconStruct->linArr[i*ANNSTRIDE];
+    isNotLinear+=reconStruct->linArr[i*ANNSTRIDE+1];
+  }
   if(rs->bleedGain!=0. || rs->bleedGainArr!=NULL){//compute the bleed value
     memset(bleedVal,0,sizeof(float)*rs->bleedGroups);
     for(i=0; i<nacts; i++){
@@ -894,9 +1127,9 @@ int reconFrameFinished(void *reconHandle,int *err){//globalStruct *glob){
     }
   }
   if(reconStruct->reconFrameno!=NULL){
-    rs->isNotLinear+=rs->isLinear;//get the total
-    if(rs->isNotLinear!=0)
-      reconStruct->reconFrameno[0]=(unsigned int)((rs->isLinear*100)/(rs->isNotLinear));
+    isNotLinear+=isLinear;//get the total
+    if(isNotLinear!=0)
+      reconStruct->reconFrameno[0]=(unsigned int)((isLinear*100)/(isNotLinear));
   }
   if(*err==0)
     memcpy(reconStruct->latestDmCommand,dmCommand,sizeof(float)*nacts);
@@ -39,20 +39,27 @@ pcgWarmStart - 1 or 0
 pcgInit - NULL or a vector to start from (each iter if warmStart==0, otherwise, only when loop is closed).
 pcgTolerance - tolerance
 pcgPrecond - NULL, or matrix size nacts,nacts, used for preconditioning.  Note, in standard notation, this would be the inverse of a preconditioning matrix.
+pcgNThreads - optional, default 0.  Number of helper threads (owned by this module) that share the iterations with the post processing thread.
+pcgThreadAffin - optional, affinity bitmask (uint32 words) of each helper thread, size pcgNThreads*n.  If not given, helpers may run on any cpu.
+pcgPipelined - optional, default 0.  If 1, use the pipelined (Ghysels-Vanroose) pcg, with one synchronisation per iteration instead of three.
+pcgFixedIter - optional, default 0.  If >0, do exactly this many iterations each frame, ignoring pcgTolerance, pcgMinIter and pcgMaxIter.
 
 Operation:
 
 As slopes arrive, dot with pcgB matrix, to give b.
 
-Also need to precompute A.x - this can be done at start of frame.
+A.pcgInit is computed when the parameters change.  If warm starting, A.x is computed at the start of the iterations (x is the previous solution, still being written while the next frame starts).
 
-Once all slopes have arrived, can compute rn, zn, pn and then start the iterations
+Once all slopes have arrived, can compute rn, zn, pn and then start the iterations.  These are split by row block between the post processing thread and pcgNThreads helper threads, which synchronise with a spin barrier.  Partial dot products are summed in thread order, so results are reproducible for a given pcgNThreads.
 
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <float.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <errno.h>
 #include "agbcblas.h"
 #include "darc.h"
@@ -67,11 +74,15 @@ typedef enum{
   NACTS,
   PCGA,
   PCGB,//col major - fortran contig.
+  PCGFIXEDITER,
   PCGINIT,
   PCGMAXITER,
   PCGMINITER,
   PCGNITERS,
+  PCGNTHREADS,
+  PCGPIPELINED,
   PCGPRECOND,
+  PCGTHREADAFFIN,
   PCGTOLERANCE,
   PCGWARMSTART,
   RECONSTRUCTMODE,
@@ -80,7 +91,9 @@ typedef enum{
   RECONNBUFFERVARIABLES//equal to number of entries in the enum
 }RECONBUFFERVARIABLEINDX;
 
-#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","decayFactor","gainE","nacts","pcgA","pcgB","pcgInit","pcgMaxIter","pcgMinIter","pcgNIters","pcgPrecond","pcgTolerance","pcgWarmStart","reconstructMode","v0")
+#define PCGDOTSTRIDE 16//floats per thread for partial dot products (a cache line).
+
+#define reconMakeNames() bufferMakeNames(RECONNBUFFERVARIABLES,"bleedGain","decayFactor","gainE","nacts","pcgA","pcgB","pcgFixedIter","pcgInit","pcgMaxIter","pcgMinIter","pcgNIters","pcgNThreads","pcgPipelined","pcgPrecond","pcgThreadAffin","pcgTolerance","pcgWarmStart","reconstructMode","v0")
 
 
 
@@ -112,6 +125,13 @@ typedef struct{
   int *niters;
   int miniter;
   int maxiter;
+  int fixedIter;
+  int pipelined;
+  float *pipeArr;//work vectors for pipelined pcg.
+  int pipeArrSize;
+  int nHelpers;
+  unsigned int *helperAffin;
+  int helperAffinElSize;
 }ReconStructEntry;
 
 typedef struct{
@@ -119,8 +139,6 @@ typedef struct{
   int doneFirstIter;
   float *pcgB;//only used by main processing threads, so doesnt need to be in rs
   int *pcgBIndx;//for sparsity.
-  int *AxStart;
-  int *AxSize;
   int buf;//current buffer being used
   int postbuf;//current buffer for post processing threads.
   //int swap;//set if need to change to the other buffer.
@@ -137,7 +155,289 @@ typedef struct{
   char dtype[RECONNBUFFERVARIABLES];
   int nbytes[RECONNBUFFERVARIABLES];
   arrayStruct *arr;
+  int lastbuf;//buffer holding the last solution, for warm start.
+  agbTeam team;//the helper thread team, started by the post processing thread.
+  float *dotArr;
+  ReconStructEntry *job;
+  int jobResid;//0 r=b, 1 r=b-Ax, 2 r=b-A.xn
+  int jobIters;//iterations done.
 }ReconStruct;
+
+/**
+   Sum a partial dot product over threads - always in the same order.
+*/
+static inline float pcgSum(ReconStruct *reconStruct,int slot){
+  int i;
+  float sum=0.;
+  for(i=0;i<=reconStruct->team.nHelpers;i++)
+    sum+=reconStruct->dotArr[i*PCGDOTSTRIDE+slot];
+  return sum;
+}
+
+/**
+   First row of a sparse matrix starting at or after element target.
+*/
+static int pcgSplitRow(int *indptr,int n,long target){
+  int lo=0,hi=n,mid;
+  while(lo<hi){
+    mid=(lo+hi)/2;
+    if(indptr[mid]<target)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+/**
+   The rows of A that thread w works on.  For sparse A, balanced by number of elements.
+*/
+static void pcgRows(ReconStructEntry *rs,int nworkers,int w,int *start,int *end){
+  int n=rs->nacts;
+  if(rs->pcgAIndx==NULL){
+    *start=(int)((long)n*w/nworkers);
+    *end=(int)((long)n*(w+1)/nworkers);
+  }else{
+    *start=pcgSplitRow(rs->pcgAIndx,n,(long)rs->pcgAIndx[n]*w/nworkers);
+    *end=(w+1==nworkers)?n:pcgSplitRow(rs->pcgAIndx,n,(long)rs->pcgAIndx[n]*(w+1)/nworkers);
+  }
+}
+
+/**
+   y[start:end]=A[start:end].x
+*/
+static void pcgMatvec(ReconStructEntry *rs,int start,int end,float *x,float *y){
+  if(end<=start)
+    return;
+  if(rs->pcgAIndx==NULL)//dense
+    agb_cblas_sgemvRowMNL(end-start,rs->nacts,1.,&rs->pcgA[(long)start*rs->nacts],rs->nacts,x,0.,&y[start]);
+  else//sparse
+    agb_cblas_sparse_csrpair_sgemvRowMN1N101(end-start,&rs->pcgAIndx[start],(int*)rs->pcgA,x,&y[start]);
+}
+
+/**
+   y[start:end]=iM[start:end].x
+*/
+static void pcgPrecondRows(ReconStructEntry *rs,int start,int end,float *x,float *y){
+  if(end>start)
+    agb_cblas_sgemvRowMNL(end-start,rs->nacts,1.,&rs->iM[(long)start*rs->nacts],rs->nacts,x,0.,&y[start]);
+}
+
+/**
+   Set rn to the residual of the starting guess, for this thread's rows.
+   tmp is used for A.xn.
+*/
+static void pcgResid(ReconStruct *reconStruct,ReconStructEntry *rs,int start,int end,float *tmp){
+  if(reconStruct->jobResid==2){
+    pcgMatvec(rs,start,end,rs->xn,tmp);
+    agb_cblas_saxpym111(end-start,&tmp[start],&rs->b[start]);
+  }else if(reconStruct->jobResid==1){
+    agb_cblas_saxpym111(end-start,&rs->Ax[start],&rs->b[start]);
+  }
+}
+
+/**
+   Standard pcg, as previously done serially, for thread w.
+   Returns the iteration count.
+*/
+static int pcgSolveStd(ReconStruct *reconStruct,int w,int *sense){
+  ReconStructEntry *rs=reconStruct->job;
+  float *dots=&reconStruct->dotArr[w*PCGDOTSTRIDE];
+  float *rn=rs->b;
+  float *zn=rn;
+  float rnpznp,rnzn,pAp,alpha,beta;
+  int start,end,n,k;
+  pcgRows(rs,reconStruct->team.nHelpers+1,w,&start,&end);
+  n=end-start;
+  pcgResid(reconStruct,rs,start,end,rs->Ap);
+  if(rs->iM!=NULL){//zn=iM.rn
+    zn=rs->zn;
+    agb_cblas_teamBarrier(&reconStruct->team,sense);
+    pcgPrecondRows(rs,start,end,rn,zn);
+  }
+  memcpy(&rs->pn[start],&zn[start],sizeof(float)*n);
+  dots[0]=agb_cblas_sdot11(n,&rn[start],&zn[start]);
+  agb_cblas_teamBarrier(&reconStruct->team,sense);
+  rnpznp=pcgSum(reconStruct,0);
+  k=0;
+  while(1){
+    //Ap=A.pn;
+    pcgMatvec(rs,start,end,rs->pn,rs->Ap);
+    dots[1]=agb_cblas_sdot11(n,&rs->pn[start],&rs->Ap[start]);
+    agb_cblas_teamBarrier(&reconStruct->team,sense);
+    pAp=pcgSum(reconStruct,1);
+    if(pAp<=0.)//nothing to do, e.g. b==0.
+      break;
+    rnzn=rnpznp;
+    alpha=rnzn/pAp;
+    //xn+=alpha*pn;
+    agb_cblas_saxpy11(n,alpha,&rs->pn[start],&rs->xn[start]);
+    if(rs->fixedIter>0){
+      if(k+1>=rs->fixedIter)
+	break;
+    }else if(rs->maxiter>0 && k>=rs->maxiter)
+      break;
+    //rn-=alpha*Ap;
+    agb_cblas_saxpym11(n,alpha,&rs->Ap[start],&rn[start]);
+    if(rs->iM!=NULL){//zn=iM.rn
+      agb_cblas_teamBarrier(&reconStruct->team,sense);
+      pcgPrecondRows(rs,start,end,rn,zn);
+    }
+    dots[2]=agb_cblas_sdot11(n,&rn[start],&zn[start]);
+    agb_cblas_teamBarrier(&reconStruct->team,sense);
+    rnpznp=pcgSum(reconStruct,2);
+    if(rs->fixedIter==0 && k>rs->miniter && rnpznp<rs->tol)
+      break;
+    beta=rnpznp/rnzn;
+    //pn=zn+beta*pn;
+    agb_cblas_sscal1(n,beta,&rs->pn[start]);
+    agb_cblas_saxpy111(n,&zn[start],&rs->pn[start]);
+    agb_cblas_teamBarrier(&reconStruct->team,sense);//A.pn needs all of pn.
+    k++;
+  }
+  return k;
+}
+
+/**
+   Pipelined pcg (Ghysels and Vanroose 2014), for thread w.
+   The dot products for the next iteration are computed alongside the vector
+   updates, and published with the new w, so only one barrier is needed per
+   iteration (two with a preconditioner).  w is double buffered since A.w reads
+   all of it while other threads update their rows.
+   Once (rn,un) is down at rounding level the recurrences drift and can
+   diverge, so we stop there (and if the step length goes non-positive),
+   whatever pcgTolerance or pcgFixedIter.
+   Returns the iteration count, as for pcgSolveStd.
+*/
+static int pcgSolvePipe(ReconStruct *reconStruct,int w,int *sense){
+  ReconStructEntry *rs=reconStruct->job;
+  float *dots=&reconStruct->dotArr[w*PCGDOTSTRIDE];
+  int nacts=rs->nacts;
+  float *rn=rs->b;
+  float *xn=rs->xn;
+  float *pn=rs->pn;
+  float *nn=rs->Ap;
+  float *un=rn;
+  float *wn[2];
+  float *zz=&rs->pipeArr[2*nacts];
+  float *ss=&rs->pipeArr[3*nacts];
+  float *mm=&rs->pipeArr[4*nacts];
+  float *qq=&rs->pipeArr[5*nacts];
+  float *wc,*wo,*mn;
+  float gamma,delta,den,alpha,beta;
+  float gammaOld=1.,alphaOld=1.,gamma0=0.;
+  int start,end,n,k,i,cur=0,par,niters;
+  wn[0]=rs->pipeArr;
+  wn[1]=&rs->pipeArr[nacts];
+  pcgRows(rs,reconStruct->team.nHelpers+1,w,&start,&end);
+  n=end-start;
+  pcgResid(reconStruct,rs,start,end,nn);
+  if(rs->iM!=NULL){//un=iM.rn
+    un=rs->zn;
+    agb_cblas_teamBarrier(&reconStruct->team,sense);
+    pcgPrecondRows(rs,start,end,rn,un);
+  }
+  agb_cblas_teamBarrier(&reconStruct->team,sense);
+  pcgMatvec(rs,start,end,un,wn[0]);
+  dots[4]=agb_cblas_sdot11(n,&rn[start],&un[start]);
+  dots[5]=agb_cblas_sdot11(n,&wn[0][start],&un[start]);
+  memset(&zz[start],0,sizeof(float)*n);
+  memset(&ss[start],0,sizeof(float)*n);
+  memset(&qq[start],0,sizeof(float)*n);
+  memset(&pn[start],0,sizeof(float)*n);
+  agb_cblas_teamBarrier(&reconStruct->team,sense);
+  k=0;
+  while(1){
+    par=k&1;
+    gamma=pcgSum(reconStruct,4+2*par);//(rn,un)
+    delta=pcgSum(reconStruct,5+2*par);//(wn,un)
+    if(rs->fixedIter==0 && k-1>rs->miniter && gamma<rs->tol){
+      niters=k-1;//same count as pcgSolveStd would give.
+      break;
+    }
+    if(k==0)
+      gamma0=gamma;
+    else if(gamma<=gamma0*16*FLT_EPSILON*FLT_EPSILON){
+      niters=k-1;
+      break;
+    }
+    wc=wn[cur];
+    wo=wn[1-cur];
+    mn=wc;
+    if(rs->iM!=NULL){//mn=iM.wn
+      mn=mm;
+      pcgPrecondRows(rs,start,end,wc,mn);
+      agb_cblas_teamBarrier(&reconStruct->team,sense);
+    }
+    pcgMatvec(rs,start,end,mn,nn);
+    if(k==0){
+      beta=0.;
+      den=delta;
+    }else{
+      beta=gamma/gammaOld;
+      den=delta-beta*gamma/alphaOld;
+    }
+    if(den<=0. || gamma<=0.){//b==0, or lost positive definiteness.
+      niters=k;
+      break;
+    }
+    alpha=gamma/den;
+    if(rs->iM==NULL){//un==rn, mn==wn and qq==ss.
+      for(i=start;i<end;i++){
+	zz[i]=nn[i]+beta*zz[i];
+	ss[i]=wc[i]+beta*ss[i];
+	pn[i]=rn[i]+beta*pn[i];
+	xn[i]+=alpha*pn[i];
+	rn[i]-=alpha*ss[i];
+	wo[i]=wc[i]-alpha*zz[i];
+      }
+    }else{
+      for(i=start;i<end;i++){
+	zz[i]=nn[i]+beta*zz[i];
+	qq[i]=mn[i]+beta*qq[i];
+	ss[i]=wc[i]+beta*ss[i];
+	pn[i]=un[i]+beta*pn[i];
+	xn[i]+=alpha*pn[i];
+	rn[i]-=alpha*ss[i];
+	un[i]-=alpha*qq[i];
+	wo[i]=wc[i]-alpha*zz[i];
+      }
+    }
+    if(rs->fixedIter>0){
+      if(k+1>=rs->fixedIter){
+	niters=k;
+	break;
+      }
+    }else if(rs->maxiter>0 && k>=rs->maxiter){
+      niters=k;
+      break;
+    }
+    dots[4+2*(1-par)]=agb_cblas_sdot11(n,&rn[start],&un[start]);
+    dots[5+2*(1-par)]=agb_cblas_sdot11(n,&wo[start],&un[start]);
+    gammaOld=gamma;
+    alphaOld=alpha;
+    cur=1-cur;
+    k++;
+    agb_cblas_teamBarrier(&reconStruct->team,sense);
+  }
+  return niters;
+}
+
+/**
+   Run the current job as thread w, returning once all threads are done.  Called by agb_cblas_teamRun.
+*/
+static void pcgSolve(void *data,int w,int *sense){
+  ReconStruct *reconStruct=(ReconStruct*)data;
+  int k;
+  if(reconStruct->job->pipelined)
+    k=pcgSolvePipe(reconStruct,w,sense);
+  else
+    k=pcgSolveStd(reconStruct,w,sense);
+  agb_cblas_teamBarrier(&reconStruct->team,sense);
+  if(w==0)
+    reconStruct->jobIters=k;
+}
+
 /**
    Called to free the reconstructor module when it is being closed.
 */
@@ -147,13 +447,13 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
   int i,j;
   printf("Closing reconlibrary\n");
   if(reconStruct!=NULL){
+    agb_cblas_teamFree(&reconStruct->team);
     if(reconStruct->paramNames!=NULL)
       free(reconStruct->paramNames);
     pthread_mutex_destroy(&reconStruct->dmMutex);
     pthread_cond_destroy(&reconStruct->dmCond);
     if(reconStruct->latestDmCommand!=NULL)free(reconStruct->latestDmCommand);
-    if(reconStruct->AxSize!=NULL)free(reconStruct->AxSize);
-    if(reconStruct->AxStart!=NULL)free(reconStruct->AxStart);
+    if(reconStruct->dotArr!=NULL)free(reconStruct->dotArr);
     for(j=0;j<2;j++){
       rs=&reconStruct->rs[j];
       if(rs->bArr!=NULL){
@@ -169,6 +469,7 @@ int reconClose(void **reconHandle){//reconHandle is &globals->reconStruct.
       if(rs->zn!=NULL)free(rs->zn);
       if(rs->b!=NULL)free(rs->b);
       if(rs->Ax!=NULL)free(rs->Ax);
+      if(rs->pipeArr!=NULL)free(rs->pipeArr);
     }
     free(reconStruct);
   }
@@ -314,7 +615,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       }else if(nbytes[i]>sizeof(int)*(rs->nacts+1)){//sparse?...
 	rs->pcgAIndx=(int*)values[i];
 	if(rs->pcgAIndx[rs->nacts]*(sizeof(float)+sizeof(int))+(rs->nacts+1)*sizeof(int)==nbytes[i]){
-	  rs->pcgA=(float*)(&(((int*)values)[rs->nacts+1]));
+	  rs->pcgA=(float*)(&(((int*)values[i])[rs->nacts+1]));
 	}else{
 	  err=1;
 	}
@@ -342,7 +643,7 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       }else if(nbytes[i]>sizeof(int)*(rs->totCents+1)){//sparse?...
 	reconStruct->pcgBIndx=(int*)values[i];
 	if(reconStruct->pcgBIndx[rs->totCents]*(sizeof(float)+sizeof(int))+(rs->totCents+1)*sizeof(int)==nbytes[i]){
-	  reconStruct->pcgB=(float*)(&(((int*)values)[rs->totCents+1]));
+	  reconStruct->pcgB=(float*)(&(((int*)values[i])[rs->totCents+1]));
 	}else{
 	  err=1;
 	}
@@ -460,6 +761,52 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
     }
   }else
     err=1;
+  i=PCGFIXEDITER;
+  rs->fixedIter=0;
+  if(err==0 && index[i]>=0){
+    if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
+      rs->fixedIter=*(int*)values[i];
+    }else if(nbytes[i]!=0){
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgFixedIter error");
+      printf("pcgFixedIter error\n");
+      err=1;
+    }
+  }
+  i=PCGPIPELINED;
+  rs->pipelined=0;
+  if(err==0 && index[i]>=0){
+    if(nbytes[i]==sizeof(int) && dtype[i]=='i'){
+      rs->pipelined=*(int*)values[i];
+    }else if(nbytes[i]!=0){
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgPipelined error");
+      printf("pcgPipelined error\n");
+      err=1;
+    }
+  }
+  i=PCGNTHREADS;
+  rs->nHelpers=0;
+  if(err==0 && index[i]>=0){
+    if(nbytes[i]==sizeof(int) && dtype[i]=='i' && *(int*)values[i]>=0){
+      rs->nHelpers=*(int*)values[i];
+    }else if(nbytes[i]!=0){
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgNThreads error");
+      printf("pcgNThreads error\n");
+      err=1;
+    }
+  }
+  i=PCGTHREADAFFIN;
+  rs->helperAffin=NULL;
+  rs->helperAffinElSize=0;
+  if(err==0 && index[i]>=0 && nbytes[i]!=0){
+    if(dtype[i]=='i' && rs->nHelpers>0 && nbytes[i]%(sizeof(unsigned int)*rs->nHelpers)==0){
+      rs->helperAffin=(unsigned int*)values[i];
+      rs->helperAffinElSize=nbytes[i]/sizeof(unsigned int)/rs->nHelpers;
+    }else{
+      writeErrorVA(reconStruct->rtcErrorBuf,-1,frameno,"pcgThreadAffin error");
+      printf("pcgThreadAffin error - should be uint32 size pcgNThreads*n\n");
+      err=1;
+    }
+  }
   //No need to get the lock here because this and newFrame() are called inside glob->libraryMutex.
   reconStruct->dmReady=0;
   if(rs->bArrSize<sizeof(float)*rs->nacts){
@@ -528,6 +875,18 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       rs->AxArrSize=0;
     }
   }
+  if(err==0 && rs->pipelined && rs->pipeArrSize<sizeof(float)*rs->nacts*6){
+    rs->pipeArrSize=sizeof(float)*rs->nacts*6;
+    if(rs->pipeArr!=NULL)
+      free(rs->pipeArr);
+    if((rs->pipeArr=malloc(rs->pipeArrSize))==NULL){
+      printf("Error allocating recon pipeArr memory\n");
+      err=-2;
+      rs->pipeArrSize=0;
+    }
+  }
+  if(err==0 && rs->pcgInit!=NULL)//A.pcgInit, for the residual when not warm starting.
+    pcgMatvec(rs,0,rs->nacts,rs->pcgInit,rs->Ax);
   if(reconStruct->latestDmCommandSize<sizeof(float)*rs->nacts){
     reconStruct->latestDmCommandSize=sizeof(float)*rs->nacts;
     if(reconStruct->latestDmCommand!=NULL)
@@ -538,14 +897,6 @@ int reconNewParam(void *reconHandle,paramBuf *pbuf,unsigned int frameno,arrayStr
       reconStruct->latestDmCommandSize=0;
     }
   }
-  if(rs->nactsPrev!=rs->nacts){
-    reconStruct->AxStart[0]=0;
-    reconStruct->AxSize[0]=rs->nacts/reconStruct->nthreads;
-    for(i=1;i<reconStruct->nthreads;i++){
-      reconStruct->AxStart[i]=reconStruct->AxStart[i-1]+reconStruct->AxSize[i-1];
-      reconStruct->AxSize[i]=(rs->nacts-reconStruct->AxStart[i])/(reconStruct->nthreads-i);
-    }
-  }
   printf("pcg params err: %d\n",err);
   return err;
 }
@@ -573,18 +924,6 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
   reconStruct->nthreads=nthreads;//this doesn't change.
   reconStruct->rtcErrorBuf=rtcErrorBuf;
   reconStruct->paramNames=reconMakeNames();
-  if((reconStruct->AxSize=malloc(sizeof(int)*nthreads))==NULL){
-    reconClose(reconHandle);
-    printf("Error allocating AxSize\n");
-    *reconHandle=NULL;
-    return 1;
-  }
-  if((reconStruct->AxStart=malloc(sizeof(int)*nthreads))==NULL){
-    reconClose(reconHandle);
-    printf("Error allocating AxStart\n");
-    *reconHandle=NULL;
-    return 1;
-  }
   if((reconStruct->rs[0].bArr=calloc(sizeof(float*),nthreads))==NULL){
     printf("Error allocating recon memory[0]\n");
     reconClose(reconHandle);
@@ -619,6 +958,12 @@ int reconOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
     *reconHandle=NULL;
     return 1;
   }
+  if(agb_cblas_teamInit(&reconStruct->team,"pcg",pcgSolve,reconStruct)){
+    printf("Error init recon team\n");
+    reconClose(reconHandle);
+    *reconHandle=NULL;
+    return 1;
+  }
   return 0;
 }
 
@@ -667,7 +1012,13 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
   }
   memset(rs->b,0,sizeof(float)*rs->nacts);
   if(rs->warmStart && reconStruct->doneFirstIter){
-    //nothing - since the previous result is already in there.
+    //nothing - since the previous result is already in there, unless the buffer has swapped.
+    if(reconStruct->lastbuf!=reconStruct->buf){
+      if(reconStruct->rs[reconStruct->lastbuf].nacts==rs->nacts)
+	memcpy(rs->xn,reconStruct->rs[reconStruct->lastbuf].xn,sizeof(float)*rs->nacts);
+      else
+	memset(rs->xn,0,sizeof(float)*rs->nacts);
+    }
   }else if(rs->pcgInit!=NULL){
     memcpy(rs->xn,rs->pcgInit,sizeof(float)*rs->nacts);
   }else{//start from zeros.
@@ -687,42 +1038,12 @@ int reconNewFrame(void *reconHandle,unsigned int frameno,double timestamp){
 /**
    Called once per thread at the start of each frame, possibly simultaneously.
 
-   Here, we pre-multiply A.x since we have time while waiting for pixels.
+   A.x is no longer computed here - xn may still be being updated by the previous frame's pcg.  A.pcgInit is computed in reconNewParam, and A.xn (warm start) within the pcg iterations.
 */
 int reconStartFrame(void *reconHandle,int cam,int threadno){
   ReconStruct *reconStruct=(ReconStruct*)reconHandle;//threadInfo->globals->reconStruct;
   ReconStructEntry *rs=&reconStruct->rs[reconStruct->buf];
   memset((void*)(rs->bArr[threadno]),0,rs->nacts*sizeof(float));
-
-  //Do partial multiply of A, xn using select rows of A and all of xn.
-  if(rs->warmStart && reconStruct->doneFirstIter){
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowMN1N101(reconStruct->AxSize[threadno],rs->nacts,&(rs->pcgA[reconStruct->AxStart[threadno]*rs->nacts]),rs->xn,&rs->Ax[reconStruct->AxStart[threadno]]);
-    }else{//sparse
-      int i,j;
-      for(i=rs->pcgAIndx[reconStruct->AxStart[threadno]];i<rs->pcgAIndx[reconStruct->AxStart[threadno]]+rs->pcgAIndx[reconStruct->AxSize[threadno]];i++){//for each row:
-	rs->Ax[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){//for each col
-	  rs->Ax[i]+=rs->pcgA[j*2+1]*rs->xn[((int*)rs->pcgA)[j*2]];
-	}
-      }
-    }
-  }else if(rs->pcgInit!=NULL){
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowMN1N101(reconStruct->AxSize[threadno],rs->nacts,&(rs->pcgA[reconStruct->AxStart[threadno]*rs->nacts]),rs->pcgInit,&rs->Ax[reconStruct->AxStart[threadno]]);
-    }else{
-      int i,j;
-      for(i=rs->pcgAIndx[reconStruct->AxStart[threadno]];i<rs->pcgAIndx[reconStruct->AxStart[threadno]]+rs->pcgAIndx[reconStruct->AxSize[threadno]];i++){//for each row:
-	rs->Ax[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){//for each col
-	  rs->Ax[i]+=rs->pcgA[j*2+1]*rs->pcgInit[((int*)rs->pcgA)[j*2]];
-	}
-      }
-    }
-  }else{
-    //Ax not needed - would be all zeros.
-  }
-
   return 0;
 }
 
@@ -743,12 +1064,7 @@ int reconNewSlopes(void *reconHandle,int cam,int centindx,int threadno,int nsuba
   if(reconStruct->pcgBIndx==NULL){//dense
     agb_cblas_sgemvColMN1M111(rs->nacts,step,&(reconStruct->pcgB[centindx*rs->nacts]),&(centroids[centindx]),rs->bArr[threadno]);
   }else{//sparse
-    int i,j;
-    for(i=centindx;i<centindx+step;i++){
-      for(j=reconStruct->pcgBIndx[i];j<reconStruct->pcgBIndx[i+1];j++){
-	rs->bArr[threadno][((int*)reconStruct->pcgB)[j*2]]+=reconStruct->pcgB[j*2+1]*centroids[i];
-      }
-    }
+    agb_cblas_sparse_cscpair_sgemvColMN1M111(step,&reconStruct->pcgBIndx[centindx],(int*)reconStruct->pcgB,&centroids[centindx],rs->bArr[threadno]);
   }
   return 0;
 }
@@ -801,64 +1117,29 @@ int reconFrameFinished(void *reconHandle,int *err){//globalStruct *glob){
   float bleedVal=0.;
   int i,k;
   float *dmCommand=reconStruct->arr->dmCommand;
-  float *rn;
-  float *zn;
-  float rnpznp;
-  float rnzn;
-  float alpha,beta;
   //Here, we have to do the PCG.
-  rn=rs->b;
-  if((rs->warmStart && reconStruct->doneFirstIter) || rs->pcgInit!=NULL){
-    //rn=b-Ax;
-    agb_cblas_saxpym111(rs->nacts,rs->Ax,rn);
-  }
+  if(rs->warmStart && reconStruct->doneFirstIter)
+    reconStruct->jobResid=2;//rn=b-A.xn
+  else if(rs->pcgInit!=NULL)
+    reconStruct->jobResid=1;//rn=b-Ax, precomputed
+  else
+    reconStruct->jobResid=0;
   reconStruct->doneFirstIter=1;
-  if(rs->iM!=NULL){//zn=iM.rn
-    zn=rs->zn;
-    agb_cblas_sgemvRowNN1N101(rs->nacts,rs->iM,rn,zn);
-  }else
-    zn=rn;
-  memcpy(rs->pn,zn,sizeof(float)*rs->nacts);
-  k=0;
-  rnpznp=agb_cblas_sdot11(rs->nacts,rn,zn);
-  while(1){
-    //Ap=A.pn;
-    //Probably, this multiplication at least should be multithreaded.
-    if(rs->pcgAIndx==NULL){//dense
-      agb_cblas_sgemvRowNN1N101(rs->nacts,rs->pcgA,rs->pn,rs->Ap);
-    }else{//sparse
-      int i,j;
-      for(i=0;i<rs->nacts;i++){
-	rs->Ap[i]=0;
-	for(j=rs->pcgAIndx[i];j<rs->pcgAIndx[i+1];j++){
-	  rs->Ap[i]+=rs->pcgA[j*2+1]*rs->pn[((int*)rs->pcgA)[j*2]];
-	}
-      }
+  reconStruct->lastbuf=reconStruct->postbuf;
+  //(re)start the helpers if pcgNThreads or pcgThreadAffin have changed.
+  if(agb_cblas_teamCheck(&reconStruct->team,rs->nHelpers,rs->helperAffin,rs->helperAffinElSize) || reconStruct->dotArr==NULL){
+    if(reconStruct->dotArr!=NULL)
+      free(reconStruct->dotArr);
+    if(posix_memalign((void**)&reconStruct->dotArr,64,sizeof(float)*PCGDOTSTRIDE*(rs->nHelpers+1))!=0){
+      printf("Error allocating pcg dotArr - pcg will not work\n");
+      reconStruct->dotArr=NULL;
+      *err=1;
+      return 1;
     }
-    rnzn=rnpznp;
-    alpha=rnzn/agb_cblas_sdot11(rs->nacts,rs->pn,rs->Ap);
-    //xn+=alpha*pn;
-    agb_cblas_saxpy11(rs->nacts,alpha,rs->pn,rs->xn);
-    if(rs->maxiter>0 && k>=rs->maxiter)
-      break;
-    //rn-=alpha*Ap;
-    agb_cblas_saxpym11(rs->nacts,alpha,rs->Ap,rn);
-    if(rs->iM==NULL)
-      zn=rn;
-    else{//zn=iM.rn
-      zn=rs->zn;
-      agb_cblas_sgemvRowNN1N101(rs->nacts,rs->iM,rn,zn);
-    }
-    rnpznp=agb_cblas_sdot11(rs->nacts,rn,zn);
-    if(k>rs->miniter && rnpznp<rs->tol)
-      break;
-    beta=rnpznp/rnzn;
-    //pn=zn+beta*pn;
-    agb_cblas_sscal1(rs->nacts,beta,rs->pn);
-    agb_cblas_saxpy111(rs->nacts,zn,rs->pn);
-
-    k++;
   }
+  reconStruct->job=rs;
+  agb_cblas_teamRun(&reconStruct->team);
+  k=reconStruct->jobIters;
   if(rs->niters!=NULL)
     *rs->niters=k;//write to the param buf
   //answer (phase) is in xn: Add this to dmCommand.
@@ -27,7 +27,105 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <gsl/gsl_randist.h>
 #endif
 #include "darc.h"
-#include "qsort.h"
+
+/**
+   Pixel calibration kernels, applied to a contiguous row of a subap (unit x step in subapLocation).
+   Indexed by CALKERN_MULT|CALKERN_SUB|CALKERN_THR, depending on which of calmult, calsub and calthr are in use.
+   The same loops are compiled for AVX2 and AVX-512 (and left to the compiler to vectorise), and chosen at calibrateOpen depending on the CPU.  FMA contraction is turned off so that all versions give identical results.
+*/
+#define CALKERN_MULT 1
+#define CALKERN_SUB 2
+#define CALKERN_THR 4
+typedef void (*calRowFn)(float *restrict subap,const float *restrict calmult,const float *restrict calsub,const float *restrict calthr,int n);
+
+#define CALROW(NAME,ATTR,BODY) \
+  ATTR static void NAME(float *restrict subap,const float *restrict calmult,const float *restrict calsub,const float *restrict calthr,int n){ \
+    int k;								\
+    float v;								\
+    for(k=0;k<n;k++){							\
+      v=subap[k];							\
+      BODY;								\
+      subap[k]=v;							\
+    }									\
+  }
+
+#define CALROWSET(SUF,ATTR)						\
+  CALROW(calRowM##SUF,ATTR,v*=calmult[k])				\
+  CALROW(calRowS##SUF,ATTR,v-=calsub[k])				\
+  CALROW(calRowMS##SUF,ATTR,v*=calmult[k];v-=calsub[k])			\
+  CALROW(calRowT##SUF,ATTR,v=(v<calthr[k])?0.f:v)			\
+  CALROW(calRowMT##SUF,ATTR,v*=calmult[k];v=(v<calthr[k])?0.f:v)	\
+  CALROW(calRowST##SUF,ATTR,v-=calsub[k];v=(v<calthr[k])?0.f:v)	\
+  CALROW(calRowMST##SUF,ATTR,v*=calmult[k];v-=calsub[k];v=(v<calthr[k])?0.f:v) \
+  static calRowFn calRowTable##SUF[8]={NULL,calRowM##SUF,calRowS##SUF,calRowMS##SUF,calRowT##SUF,calRowMT##SUF,calRowST##SUF,calRowMST##SUF};
+
+/**
+   Fused versions, which convert a row of raw pixels (of type given by pxlbuftype) to float and calibrate in the same pass, rather than copySubap writing the subap and subapPxlCalibration reading it back.  Indexed by [pixel type][CALKERN_*], with index 0 being conversion only.
+*/
+#define CALPXLTYPES "bBhHiIf"
+typedef void (*calRowFusedFn)(float *restrict subap,const void *restrict raw,const float *restrict calmult,const float *restrict calsub,const float *restrict calthr,int n);
+
+#define CALFUSED(NAME,ATTR,TYPE,BODY) \
+  ATTR static void NAME(float *restrict subap,const void *restrict rawv,const float *restrict calmult,const float *restrict calsub,const float *restrict calthr,int n){ \
+    const TYPE *restrict raw=(const TYPE*)rawv;				\
+    int k;								\
+    float v;								\
+    for(k=0;k<n;k++){							\
+      v=(float)raw[k];							\
+      BODY;								\
+      subap[k]=v;							\
+    }									\
+  }
+
+#define CALFUSEDTYPE(SUF,ATTR,TC,TYPE)					\
+  CALFUSED(calFused##TC##SUF,ATTR,TYPE,)				\
+  CALFUSED(calFusedM##TC##SUF,ATTR,TYPE,v*=calmult[k])			\
+  CALFUSED(calFusedS##TC##SUF,ATTR,TYPE,v-=calsub[k])			\
+  CALFUSED(calFusedMS##TC##SUF,ATTR,TYPE,v*=calmult[k];v-=calsub[k])	\
+  CALFUSED(calFusedT##TC##SUF,ATTR,TYPE,v=(v<calthr[k])?0.f:v)		\
+  CALFUSED(calFusedMT##TC##SUF,ATTR,TYPE,v*=calmult[k];v=(v<calthr[k])?0.f:v) \
+  CALFUSED(calFusedST##TC##SUF,ATTR,TYPE,v-=calsub[k];v=(v<calthr[k])?0.f:v) \
+  CALFUSED(calFusedMST##TC##SUF,ATTR,TYPE,v*=calmult[k];v-=calsub[k];v=(v<calthr[k])?0.f:v)
+#define CALFUSEDROW(TC,SUF) {calFused##TC##SUF,calFusedM##TC##SUF,calFusedS##TC##SUF,calFusedMS##TC##SUF,calFusedT##TC##SUF,calFusedMT##TC##SUF,calFusedST##TC##SUF,calFusedMST##TC##SUF}
+#define CALFUSEDSET(SUF,ATTR)						\
+  CALFUSEDTYPE(SUF,ATTR,b,char)						\
+  CALFUSEDTYPE(SUF,ATTR,B,unsigned char)				\
+  CALFUSEDTYPE(SUF,ATTR,h,short)					\
+  CALFUSEDTYPE(SUF,ATTR,H,unsigned short)				\
+  CALFUSEDTYPE(SUF,ATTR,i,int)						\
+  CALFUSEDTYPE(SUF,ATTR,I,unsigned int)					\
+  CALFUSEDTYPE(SUF,ATTR,f,float)					\
+  static calRowFusedFn calFusedTable##SUF[7][8]={CALFUSEDROW(b,SUF),CALFUSEDROW(B,SUF),CALFUSEDROW(h,SUF),CALFUSEDROW(H,SUF),CALFUSEDROW(i,SUF),CALFUSEDROW(I,SUF),CALFUSEDROW(f,SUF)};
+
+CALROWSET(Scalar,)
+CALFUSEDSET(Scalar,)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define CALSIMD
+CALROWSET(Avx2,__attribute__((target("avx2"),optimize("fp-contract=off"))))
+CALROWSET(Avx512,__attribute__((target("avx512f"),optimize("fp-contract=off"))))
+CALFUSEDSET(Avx2,__attribute__((target("avx2"),optimize("fp-contract=off"))))
+CALFUSEDSET(Avx512,__attribute__((target("avx512f"),optimize("fp-contract=off"))))
+#endif
+
+/**
+   Choose the calibration kernels for this CPU.
+*/
+calRowFn *selectCalKernels(calRowFusedFn (**fused)[8]){
+#ifdef CALSIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    printf("rtccalibrate using AVX-512 kernels\n");
+    *fused=calFusedTableAvx512;
+    return calRowTableAvx512;
+  }else if(__builtin_cpu_supports("avx2")){
+    printf("rtccalibrate using AVX2 kernels\n");
+    *fused=calFusedTableAvx2;
+    return calRowTableAvx2;
+  }
+#endif
+  *fused=calFusedTableScalar;
+  return calRowTableScalar;
+}
 
 typedef struct{
   int curnpxly;
@@ -45,6 +143,7 @@ typedef struct{
   int *subapSizeHandle;
 #endif
   int cursubindx;
+  int calibrated;//set by copySubap if it has also done the pixel calibration.
   //int npxlCum;
   //int npxlx;
   //int npxly;
@@ -98,6 +197,8 @@ typedef struct{
   //pthread_cond_t calcond;
   int addSubapToCalBuf;
   int *pxlMap;
+  calRowFn *calRowKernel;//calibration kernels for this CPU.
+  calRowFusedFn (*calFusedKernel)[8];//and the fused unpack+calibration kernels.
 #ifdef WITHSIM
   int simCorrThreshType;
   int *simCorrThreshTypeArr;
@@ -288,6 +389,9 @@ int copySubap(CalStruct *cstr,int cam,int threadno){
   unsigned int *Ipxlbuf;
   float subapImgGain;
   int npxlx=cstr->npxlx[cam];
+#ifndef WITHSIM
+  char *pxltype;
+#endif
   loc=&(cstr->arr->subapLocation[tstr->cursubindx*6]);
 #ifndef OLDMULTINEWFN //this is now the usual case.
   //already malloced - no need to do this.
@@ -315,6 +419,32 @@ int copySubap(CalStruct *cstr,int cam,int threadno){
     free(tstr->sort);
     tstr->sort=tmp;
   }
+#endif
+  if(cstr->subapImgGainArr!=NULL)
+    subapImgGain=cstr->subapImgGainArr[tstr->cursubindx];
+  else
+    subapImgGain=cstr->subapImgGain;
+  tstr->calibrated=0;
+#ifndef WITHSIM //simulation needs the raw subap before calibration.
+  if(cstr->fakeCCDImage==NULL && loc[5]==1 && (subapImgGain==1. || cstr->integratedImg==NULL) && cstr->arr->pxlbuftype!=0 && (pxltype=strchr(CALPXLTYPES,cstr->arr->pxlbuftype))!=NULL){
+    //Convert and calibrate in one pass, one row at a time.
+    calRowFusedFn fn;
+    int elsize=cstr->arr->pxlbuftype=='b'||cstr->arr->pxlbuftype=='B'?1:(cstr->arr->pxlbuftype=='h'||cstr->arr->pxlbuftype=='H'?2:4);
+    int nx=loc[4]-loc[3];
+    int pos,kern;
+    char *raw=&(((char*)cstr->arr->pxlbufs)[cstr->npxlCum[cam]*elsize]);
+    kern=(cstr->calmult!=NULL?CALKERN_MULT:0)|(cstr->calsub!=NULL?CALKERN_SUB:0)|((cstr->thresholdAlgo==1 || cstr->thresholdAlgo==2) && cstr->calthr!=NULL?CALKERN_THR:0);
+    fn=cstr->calFusedKernel[pxltype-CALPXLTYPES][kern];
+    if(nx>0){
+      for(i=loc[0]; i<loc[1]; i+=loc[2]){
+	pos=cstr->npxlCum[cam]+i*npxlx+loc[3];
+	(*fn)(&tstr->subap[cnt],&raw[(i*npxlx+loc[3])*elsize],cstr->calmult==NULL?NULL:&cstr->calmult[pos],cstr->calsub==NULL?NULL:&cstr->calsub[pos],(kern&CALKERN_THR)==0?NULL:&cstr->calthr[pos],nx);
+	cnt+=nx;
+      }
+    }
+    tstr->calibrated=1;
+    return 0;
+  }
 #endif
   if(cstr->fakeCCDImage!=NULL){
     for(i=loc[0]; i<loc[1]; i+=loc[2]){
@@ -384,10 +514,6 @@ int copySubap(CalStruct *cstr,int cam,int threadno){
       printf("Error in rtccalibrate - raw pixel data type %c not understood\n",cstr->arr->pxlbuftype);
     }
   }
-  if(cstr->subapImgGainArr!=NULL)
-    subapImgGain=cstr->subapImgGainArr[tstr->cursubindx];
-  else
-    subapImgGain=cstr->subapImgGain;
   if(subapImgGain!=1. && cstr->integratedImg!=NULL){
     int indx;
     //apply the gain.
@@ -410,14 +536,55 @@ int copySubap(CalStruct *cstr,int cam,int threadno){
 
 
 
+/**
+   Partial ordering of a[0..n-1] such that a[k] holds the value it would have
+   after a full ascending sort, everything before it is <= and everything
+   after it is >=.  Hoare partitioning with a median of 3 pivot, finishing with
+   an insertion sort once the remaining range is small - so small subaps are
+   effectively just insertion sorted.  O(n) on average, rather than O(n log n)
+   for the full sort previously used by applyBrightest.
+*/
+#define SELECTINSERT 16
+static float selectNth(float *a,int n,int k){
+  int l=0,r=n-1,i,j,m;
+  float x,t;
+  while(r-l>SELECTINSERT){
+    m=l+(r-l)/2;
+    if(a[m]<a[l]){t=a[m];a[m]=a[l];a[l]=t;}
+    if(a[r]<a[m]){t=a[r];a[r]=a[m];a[m]=t;
+      if(a[m]<a[l]){t=a[m];a[m]=a[l];a[l]=t;}
+    }
+    x=a[m];
+    i=l;
+    j=r;
+    do{
+      while(a[i]<x)i++;
+      while(x<a[j])j--;
+      if(i<=j){
+	t=a[i];a[i]=a[j];a[j]=t;
+	i++;
+	j--;
+      }
+    }while(i<=j);
+    if(j<k)l=i;
+    if(k<i)r=j;
+  }
+  for(i=l+1;i<=r;i++){
+    x=a[i];
+    for(j=i-1;j>=l && x<a[j];j--)
+      a[j+1]=a[j];
+    a[j+1]=x;
+  }
+  return a[k];
+}
+
 /**
    We only want to use the brightest N (=info->useBrightest) pixels - set the
    rest to zero.
 */
 int applyBrightest(CalStruct *cstr,int threadno){
   CalThreadStruct *tstr=cstr->tstr[threadno];
-  int i;
-  //int j;
+  int i,j,n;
   //float min=threadInfo->subap[0];
   //int n=info->useBrightest;
   //float v;
@@ -463,31 +630,44 @@ int applyBrightest(CalStruct *cstr,int threadno){
 #endif
   if(useBrightest>=tstr->curnpxl || useBrightest==0)
     return 0;//want to allow more pixels than there are...
-  //copy the first n pixels, and then sort this...
-  //Actually - may as well copy the whole lot, and sort the whole lot... not a lot of difference in speed depending on how many pixels you want to keep, and this is more understandable and robust...
+  //Only the threshold (and for subtraction, the next brightest pixels) is
+  //needed, so select rather than sort.
   memcpy(sort,subap,sizeof(float)*tstr->curnpxl);
-#define cmp(a,b) ((*a)<(*b))
-  QSORT(float,sort,tstr->curnpxl,cmp);
-#undef cmp
-
+  n=tstr->curnpxl-useBrightest;
   //The threshold to use is:
-  thr=sort[tstr->curnpxl-useBrightest];
+  thr=selectNth(sort,tstr->curnpxl,n);
   if(subtract){//want to subtract the next brightest pixel
-    subtract=tstr->curnpxl-useBrightest-1;
-    while(subtract>=0 && sort[subtract]==thr)
-      subtract--;
-    if(subtract>=0){
+    //sort[0..n-1] are all <=thr.  Gather those strictly below it.
+    subtract=0;
+    for(i=0;i<n;i++){
+      if(sort[i]<thr)
+	sort[subtract++]=sort[i];
+    }
+    if(subtract>0){
       if(useBrightAv>1){
 	//now average this many pixels, to find the subtraction threshold.
-	ssum=0.;
-	subtract++;//we want upto, but not including this.
 	if(subtract<useBrightAv)
 	  useBrightAv=subtract;
-	for(i=subtract-useBrightAv;i<subtract;i++)
+	if(subtract>useBrightAv)
+	  selectNth(sort,subtract,subtract-useBrightAv);
+	//sum in ascending order, as the full sort used to.
+	sort=&sort[subtract-useBrightAv];
+	for(i=1;i<useBrightAv;i++){
+	  sub=sort[i];
+	  for(j=i-1;j>=0 && sub<sort[j];j--)
+	    sort[j+1]=sort[j];
+	  sort[j+1]=sub;
+	}
+	ssum=0.;
+	for(i=0;i<useBrightAv;i++)
 	  ssum+=sort[i];
 	sub=ssum/useBrightAv;
       }else{
-	sub=sort[subtract];
+	sub=sort[0];
+	for(i=1;i<subtract;i++){
+	  if(sort[i]>sub)
+	    sub=sort[i];
+	}
       }
     }else
       sub=0;
@@ -640,6 +820,7 @@ int subapPxlCalibration(CalStruct *cstr,int cam,int threadno){
   int thresholdAlgo;
   int npxlx=cstr->npxlx[cam];
   int npxlCum=cstr->npxlCum[cam];
+  int kern,nx;
 #ifdef WITHSIM
   if(tstr->simulating){
     calmult=cstr->simcalmult;
@@ -657,7 +838,20 @@ int subapPxlCalibration(CalStruct *cstr,int cam,int threadno){
 #endif
   //STARTTIMING;
   loc=&(cstr->arr->subapLocation[tstr->cursubindx*6]);
-  if(calmult!=NULL && calsub!=NULL){
+  kern=(calmult!=NULL?CALKERN_MULT:0)|(calsub!=NULL?CALKERN_SUB:0)|((thresholdAlgo==1 || thresholdAlgo==2) && calthr!=NULL?CALKERN_THR:0);
+  if(kern==0 || tstr->calibrated){
+    //nothing to do (or already done by copySubap).
+    tstr->calibrated=0;
+  }else if(loc[5]==1){//contiguous rows, so use the vectorised kernels.
+    nx=loc[4]-loc[3];
+    if(nx>0){
+      for(i=loc[0]; i<loc[1]; i+=loc[2]){
+	pos=npxlCum+i*npxlx+loc[3];
+	(*cstr->calRowKernel[kern])(&subap[cnt],calmult==NULL?NULL:&calmult[pos],calsub==NULL?NULL:&calsub[pos],(kern&CALKERN_THR)==0?NULL:&calthr[pos],nx);
+	cnt+=nx;
+      }
+    }
+  }else if(calmult!=NULL && calsub!=NULL){
     if((thresholdAlgo==1 || thresholdAlgo==2) && calthr!=NULL){
 #ifdef DOPREFETCH //didn't seem to make a difference (or was slightly worse)
       for(i=loc[0]; i<loc[1]; i+=loc[2]){
@@ -1932,6 +2126,7 @@ int calibrateOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf
   cstr->arr=arr;
   cstr->prefix=prefix;
   cstr->subapImgGain=1.;
+  cstr->calRowKernel=selectCalKernels(&cstr->calFusedKernel);
   //cstr->calpxlbufReady=1;
   //pthread_mutex_init(&cstr->calmutex,NULL);
   //pthread_cond_init(&cstr->calcond,NULL);
@@ -2016,13 +2211,80 @@ int calibrateNewFrame(void *calibrateHandle,unsigned int frameno){//#non-subap t
 //int calibrateStartFrame(void *calibrateHandle,int cam,int threadno){//subap thread (once per thread)
 //}
 #ifndef OLDMULTINEWFN //this is now the usual case.
+/**
+   Make sure the subap arena holds at least size floats, and the sort array at least max.
+*/
+int allocSubapArena(CalStruct *cstr,int threadno,float **subap,int *subapSize,int size,int max){
+  CalThreadStruct *tstr=cstr->tstr[threadno];
+  float *tmp;
+  if(*subapSize<size){
+    if(posix_memalign((void**)(&tmp),SUBAPALIGN,sizeof(float)*size)!=0){
+      printf("subap re-malloc failed for thread %d, size %d\n",threadno,size);
+      return 1;
+    }
+    if(*subap!=NULL)
+      free(*subap);
+    *subap=tmp;
+    *subapSize=size;
+    tstr->subapSize=size;
+  }
+  if(tstr->sortSize<max){
+    if((tmp=malloc(sizeof(float)*max))==NULL){
+      printf("sort remalloc failed for thread %d size %d\n",threadno,max);
+      return 1;
+    }
+    if(tstr->sort!=NULL)free(tstr->sort);
+    tstr->sort=tmp;
+    tstr->sortSize=max;
+  }
+  return 0;
+}
+
+/**
+   Batch version of calibrateNewSubap.  subapIndx holds the nsubaps (valid) subaps to be calibrated, which are placed in the subap arena, aligned to SUBAPALIGN.  subapInfo is filled with the offset, npxly and npxlx of each, for passing to slopeCalcSlopeBatch.
+*/
+int calibrateNewSubapBatch(void *calibrateHandle,int cam,int threadno,int nsubaps,int *subapIndx,float **subap,int *subapSize,int *subapInfo){//subap thread
+  CalStruct *cstr=(CalStruct*)calibrateHandle;
+  CalThreadStruct *tstr=cstr->tstr[threadno];
+  int i,size=0,max=0,curnpxl;
+  int *loc;
+  tstr->subapHandle=subap;
+  tstr->subapSizeHandle=subapSize;
+  for(i=0;i<nsubaps;i++){
+    loc=&(cstr->arr->subapLocation[subapIndx[i]*6]);
+    subapInfo[i*3]=size;
+    subapInfo[i*3+1]=(loc[1]-loc[0])/loc[2];
+    subapInfo[i*3+2]=(loc[4]-loc[3])/loc[5];
+    curnpxl=subapInfo[i*3+1]*subapInfo[i*3+2];
+    if(curnpxl*3+subapInfo[i*3+2]>max)//as for calibrateNewSubap.
+      max=curnpxl*3+subapInfo[i*3+2];
+    size+=((curnpxl+(SUBAPALIGN/sizeof(float))-1)/(SUBAPALIGN/sizeof(float)))*(SUBAPALIGN/sizeof(float));
+  }
+  if(allocSubapArena(cstr,threadno,subap,subapSize,size,max))
+    return 1;
+  for(i=0;i<nsubaps;i++){
+    tstr->subap=&((*subap)[subapInfo[i*3]]);
+    tstr->cursubindx=subapIndx[i];
+    tstr->curnpxly=subapInfo[i*3+1];
+    tstr->curnpxlx=subapInfo[i*3+2];
+    tstr->curnpxl=tstr->curnpxly*tstr->curnpxlx;
+    copySubap(cstr,cam,threadno);
+#ifdef WITHSIM
+    simulateSubap(cstr,cam,threadno);
+#endif
+    subapPxlCalibration(cstr,cam,threadno);
+    if(cstr->arr->rtcCalPxlBuf->addRequired || cstr->subapImgGain!=1. || cstr->subapImgGainArr!=NULL)
+      storeCalibratedSubap(cstr,cam,threadno);
+  }
+  return 0;
+}
+
 int calibrateNewSubap(void *calibrateHandle,int cam,int threadno,int cursubindx,float **subap,int *subapSize,int *NProcessing,int *rubbish){//subap thread
   CalStruct *cstr=(CalStruct*)calibrateHandle;
   CalThreadStruct *tstr=cstr->tstr[threadno];
   int nprocessing=*NProcessing;
   int i;
   int *loc;
-  float *tmp;
   int curnpxly,curnpxlx,curnpxl,size,max,pos;
   //calibrating all subaps at once - first work out how much space we need.
   tstr->subapHandle=subap;
@@ -2054,29 +2316,9 @@ int calibrateNewSubap(void *calibrateHandle,int cam,int threadno,int cursubindx,
       size+=(((curnpxl+(SUBAPALIGN/sizeof(float))-1)/(SUBAPALIGN/sizeof(float))))*(SUBAPALIGN/sizeof(float));
     }
   }
-  //Now allocate memory if needed.
-  if(*subapSize<size){
-    if((i=posix_memalign((void**)(&tmp),SUBAPALIGN,sizeof(float)*size))!=0){
-      tmp=NULL;
-      printf("subap re-malloc failed for thread %d, size %d\n",threadno,size);
-      return 1;
-    }
-    if(*subap!=NULL)
-      free(*subap);
-    *subap=tmp;
-    *subapSize=size;
-    tstr->subapSize=size;
-  }
-  //and allocate the sort array if needed.
-  if(tstr->sortSize<max){
-    if((tmp=malloc(sizeof(float)*max))==NULL){
-      printf("sort remalloc failed for thread %d size %d\n",threadno,max);
-      return 1;
-    }
-    if(tstr->sort!=NULL)free(tstr->sort);
-    tstr->sort=tmp;
-    tstr->sortSize=max;
-  }
+  //Now allocate memory if needed (and the sort array).
+  if(allocSubapArena(cstr,threadno,subap,subapSize,size,max))
+    return 1;
   //Now we have the temporary array, calibrate into it.
   pos=0;
   for(i=0;i<nprocessing;i++){
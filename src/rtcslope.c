@@ -41,6 +41,7 @@ typedef enum{
   CORRCLIP,
   CORRCLIPINTEGIMG,
   CORRFFTPATTERN,
+  CORRFFTPLAN,//0 for FFTW_ESTIMATE, 1 for FFTW_MEASURE, 2 for FFTW_PATIENT.
   CORRIMGOFFSET,//an offset when creating integrated images, for non-symmetric spots.
   CORRNSTORE,
   CORRNPXLCUM,
@@ -87,6 +88,7 @@ typedef enum{
 					 "corrClip",		\
 					 "corrClipIntegImg",	\
 					 "corrFFTPattern",	\
+					 "corrFFTPlan",		\
 					 "corrImgOffset",	\
 					 "corrNStore",		\
 					 "corrNpxlCum",		\
@@ -117,7 +119,174 @@ typedef enum{
 					 )
 
 
+/**
+   Centre of gravity kernels.  cogFn computes the flux, x and y moments of nsub subaps of n pixels each, placing them in res (3 per subap).  xr and yr hold the x and y coordinate of each pixel, so that the subap can be treated as a flat array whatever its shape.
+   cogWeightFn does the same for a single row with a per-pixel weight, adding into res.
+   Partial sums are kept in COGLANES lanes and combined in a fixed order, so that the scalar, AVX2 and AVX-512 versions give identical results.
+*/
+#define COGLANES 16
+typedef void (*cogFn)(const float *const *subaps,const float *restrict xr,const float *restrict yr,int n,int nsub,float *restrict res);
+typedef void (*cogWeightFn)(const float *restrict subap,const float *restrict wt,const float *restrict xr,float y,int n,float *restrict res);
+
+#define COGSET(SUF,ATTR)						\
+  ATTR static void cogMoments##SUF(const float *const *subaps,const float *restrict xr,const float *restrict yr,int n,int nsub,float *restrict res){ \
+    float a[COGLANES],ax[COGLANES],ay[COGLANES];			\
+    const float *restrict v;						\
+    int s,k,l;								\
+    for(s=0;s<nsub;s++){						\
+      v=subaps[s];							\
+      for(l=0;l<COGLANES;l++){						\
+	a[l]=0;								\
+	ax[l]=0;							\
+	ay[l]=0;							\
+      }									\
+      for(k=0;k+COGLANES<=n;k+=COGLANES){				\
+	for(l=0;l<COGLANES;l++){					\
+	  a[l]+=v[k+l];							\
+	  ax[l]+=xr[k+l]*v[k+l];					\
+	  ay[l]+=yr[k+l]*v[k+l];					\
+	}								\
+      }									\
+      for(l=0;k<n;k++,l++){						\
+	a[l]+=v[k];							\
+	ax[l]+=xr[k]*v[k];						\
+	ay[l]+=yr[k]*v[k];						\
+      }									\
+      for(l=1;l<COGLANES;l++){						\
+	a[0]+=a[l];							\
+	ax[0]+=ax[l];							\
+	ay[0]+=ay[l];							\
+      }									\
+      res[s*3]=a[0];							\
+      res[s*3+1]=ax[0];							\
+      res[s*3+2]=ay[0];							\
+    }									\
+  }									\
+  ATTR static void cogWeightRow##SUF(const float *restrict v,const float *restrict wt,const float *restrict xr,float y,int n,float *restrict res){ \
+    float a[COGLANES],ax[COGLANES],p;					\
+    int k,l;								\
+    for(l=0;l<COGLANES;l++){						\
+      a[l]=0;								\
+      ax[l]=0;								\
+    }									\
+    for(k=0;k+COGLANES<=n;k+=COGLANES){					\
+      for(l=0;l<COGLANES;l++){						\
+	p=v[k+l]*wt[k+l];						\
+	a[l]+=p;							\
+	ax[l]+=xr[k+l]*p;						\
+      }									\
+    }									\
+    for(l=0;k<n;k++,l++){						\
+      p=v[k]*wt[k];							\
+      a[l]+=p;								\
+      ax[l]+=xr[k]*p;							\
+    }									\
+    for(l=1;l<COGLANES;l++){						\
+      a[0]+=a[l];							\
+      ax[0]+=ax[l];							\
+    }									\
+    res[0]+=a[0];							\
+    res[1]+=ax[0];							\
+    res[2]+=y*a[0];							\
+  }
+
+COGSET(Scalar,)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define COGSIMD
+COGSET(Avx2,__attribute__((target("avx2"),optimize("fp-contract=off"))))
+COGSET(Avx512,__attribute__((target("avx512f"),optimize("fp-contract=off"))))
+#endif
+
+/**
+   Brute force correlation kernels, computing one row of ncx outputs (shifts).  pad is the zero padded subap, positioned for the first shift of this row, with row length pw.  Vectorised across the shifts, with each output summed in the same order as a straightforward loop over the overlap.
+   diffSqRow is the difference squared version, with mask being 1 where pad holds subap pixels and 0 in the padding, so that only the overlap contributes.  acc is workspace of 3*ncx.
+*/
+typedef void (*bruteRowFn)(float *restrict out,const float *restrict ref,const float *restrict pad,int rnx,int rny,int pw,int ncx);
+typedef void (*diffSqRowFn)(float *restrict out,float *restrict acc,const float *restrict ref,const float *restrict pad,const float *restrict mask,int rnx,int rny,int pw,int ncx);
+
+#define BRUTESET(SUF,ATTR)						\
+  ATTR static void bruteRow##SUF(float *restrict out,const float *restrict ref,const float *restrict pad,int rnx,int rny,int pw,int ncx){ \
+    const float *restrict p;						\
+    float c;								\
+    int j,x,y;								\
+    for(j=0;j<ncx;j++)							\
+      out[j]=0;								\
+    for(y=0;y<rny;y++){							\
+      for(x=0;x<rnx;x++){						\
+	c=ref[y*rnx+x];							\
+	p=&pad[y*pw+x];							\
+	for(j=0;j<ncx;j++)						\
+	  out[j]+=c*p[j];						\
+      }									\
+    }									\
+  }									\
+  ATTR static void diffSqRow##SUF(float *restrict out,float *restrict acc,const float *restrict ref,const float *restrict pad,const float *restrict mask,int rnx,int rny,int pw,int ncx){ \
+    float *restrict s=acc;						\
+    float *restrict tot=&acc[ncx];					\
+    float *restrict tot2=&acc[ncx*2];					\
+    const float *restrict p;						\
+    const float *restrict m;						\
+    float c,d;								\
+    int j,x,y;								\
+    for(j=0;j<ncx;j++){							\
+      s[j]=0;								\
+      tot[j]=0;								\
+      tot2[j]=0;							\
+    }									\
+    for(y=0;y<rny;y++){							\
+      for(x=0;x<rnx;x++){						\
+	c=ref[y*rnx+x];							\
+	p=&pad[y*pw+x];							\
+	m=&mask[y*pw+x];						\
+	for(j=0;j<ncx;j++){						\
+	  tot[j]+=p[j];							\
+	  tot2[j]+=c*m[j];						\
+	  d=(c-p[j])*m[j];						\
+	  s[j]+=d*d;							\
+	}								\
+      }									\
+    }									\
+    for(j=0;j<ncx;j++){							\
+      if(tot[j]!=0 && tot2[j]!=0)					\
+	out[j]=s[j]/(tot[j]*tot2[j]);					\
+    }									\
+  }
+
+BRUTESET(Scalar,)
+#ifdef COGSIMD
+BRUTESET(Avx2,__attribute__((target("avx2"),optimize("fp-contract=off"))))
+BRUTESET(Avx512,__attribute__((target("avx512f"),optimize("fp-contract=off"))))
+#endif
 
+/**
+   Choose the CoG and brute force correlation kernels for this CPU.
+*/
+cogFn selectSlopeKernels(cogWeightFn *wfn,bruteRowFn *bfn,diffSqRowFn *dfn){
+#ifdef COGSIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    printf("rtcslope using AVX-512 kernels\n");
+    *wfn=cogWeightRowAvx512;
+    *bfn=bruteRowAvx512;
+    *dfn=diffSqRowAvx512;
+    return cogMomentsAvx512;
+  }else if(__builtin_cpu_supports("avx2")){
+    printf("rtcslope using AVX2 kernels\n");
+    *wfn=cogWeightRowAvx2;
+    *bfn=bruteRowAvx2;
+    *dfn=diffSqRowAvx2;
+    return cogMomentsAvx2;
+  }
+#endif
+  *wfn=cogWeightRowScalar;
+  *bfn=bruteRowScalar;
+  *dfn=diffSqRowScalar;
+  return cogMomentsScalar;
+}
+
+
+#define CORRBATCH 8 //number of subaps to FFT together when correlating.
+#define CORRSTRIDE(n) ((int)((((n)+SUBAPALIGN/sizeof(float)-1)/(SUBAPALIGN/sizeof(float)))*(SUBAPALIGN/sizeof(float))))//spacing of the subaps in corrBatch, so that each is aligned for the single subap FFT plans.
 typedef struct{
   float *subap;
   //int subapSize;
@@ -134,6 +303,25 @@ typedef struct{
   int curnpxlSubap;
   float *tmpSubap;
   int tmpSubapSize;
+  float *cogRamp;//x then y pixel coordinates for a cogRampNx*cogRampNy subap.
+  int cogRampSize;
+  int cogRampNx;
+  int cogRampNy;
+  float *cogMoments;//if set, the precomputed flux, x and y moments for this subap.
+  float *cogRes;//moments for several subaps, computed together by calcCogMoments.
+  const float **batchPtr;//pixels of the subaps being processed by this call of slopeCalcSlope.
+  int *batchDims;//nx, ny and subap index of each.
+  int cogResSize;
+  float *corrBatch;//FFT workspace for CORRBATCH subaps, see calcCorrelationBatch.
+  int corrBatchSize;
+  int corrBatchSlot;//spacing of the subaps in corrBatch.
+  int corrBatchStart;//range of batchPtr entries currently held in corrBatch.
+  int corrBatchEnd;
+  int corrBatchNpxl[CORRBATCH];//number of correlation pixels (after clipping) of each.
+  float *corrResult;//if set, the correlation of this subap, in corrBatch.
+  int corrResultNpxl;
+  float *bruteBuf;//workspace for calcBruteCorr and calcDiffSquared.
+  int bruteBufSize;
 }CentThreadStruct;
 typedef struct{
   enum CentroidModes centroidMode;
@@ -182,9 +370,11 @@ typedef struct{
   int adaptiveGroupSize;
   float *fftCorrelationPattern;//the spot PSF array, FFT'd in HC format, and placed as per subapLocation...
   int fftCorrPatternSize;
-  int fftIndexSize;
-  int *fftIndex;
-  fftwf_plan *fftPlanArray;//array holding all the fftw plans
+  int fftIndexSize;//number of plans in the registry.
+  int fftIndexAlloc;
+  int *fftIndex;//nx, ny and number of subaps (howmany) for each plan.
+  fftwf_plan *fftPlanArray;//array holding all the fftw plans (forward and inverse for each fftIndex entry).
+  unsigned int fftPlanFlags;
   pthread_mutex_t fftcreateMutex;
   int correlationThresholdType;
   float correlationThreshold;
@@ -209,6 +399,10 @@ typedef struct{
   //unsigned int *centframeno;//can be updated if want to inform the rtc of our frameno (e.g. frame numbers from WPU).   Of size ncam.
   circBuf *rtcErrorBuf;
   float *centWeighting;
+  cogFn cogKernel;
+  cogWeightFn cogWeightKernel;
+  bruteRowFn bruteKernel;
+  diffSqRowFn diffSqKernel;
   float fluxThreshold;
   float *fluxThresholdArr;
   enum WindowModes windowMode;
@@ -263,13 +457,115 @@ typedef struct{
 }CentStruct;
 
 /**
-   Does nothing
+   Returns the x and y coordinate ramps for a subap of nx*ny pixels, which are cached per thread, since consecutive subaps are usually the same size.  Returns NULL if unable to allocate.
+*/
+float *getCogRamp(CentThreadStruct *tstr,int nx,int ny){
+  int i,j,n=nx*ny;
+  float *tmp;
+  if(tstr->cogRampNx==nx && tstr->cogRampNy==ny)
+    return tstr->cogRamp;
+  if(tstr->cogRampSize<2*n){
+    if(posix_memalign((void**)&tmp,SUBAPALIGN,sizeof(float)*2*n)!=0){
+      printf("Error allocating cogRamp\n");
+      return NULL;
+    }
+    free(tstr->cogRamp);
+    tstr->cogRamp=tmp;
+    tstr->cogRampSize=2*n;
+  }
+  for(i=0;i<ny;i++){
+    for(j=0;j<nx;j++){
+      tstr->cogRamp[i*nx+j]=j;
+      tstr->cogRamp[n+i*nx+j]=i;
+    }
+  }
+  tstr->cogRampNx=nx;
+  tstr->cogRampNy=ny;
+  return tstr->cogRamp;
+}
+
+/**
+   Whether all subaps use a plain unweighted CoG, so that their moments can be computed several at a time.
 */
-int applyCentWeighting(CentStruct *cstr,int threadno){
-  printf("centWeighting does nothing\n");
+static inline int cogBatchable(CentStruct *cstr){
+  return cstr->centroidModeArr==NULL && cstr->centroidMode==CENTROIDMODE_COG && cstr->centIndexArr==NULL && cstr->centWeighting==NULL;
+}
+
+/**
+   Computes the CoG moments for nsubaps subaps (with pixels at batchPtr and sizes in batchDims), passing runs of the same size to the kernel together.  Results in tstr->cogRes.  Returns 1 on error.
+*/
+int calcCogMoments(CentStruct *cstr,CentThreadStruct *tstr,int nsubaps){
+  int i,j,nx,ny;
+  float *ramp;
+  for(i=0;i<nsubaps;i=j){
+    nx=tstr->batchDims[i*3];
+    ny=tstr->batchDims[i*3+1];
+    for(j=i+1;j<nsubaps && tstr->batchDims[j*3]==nx && tstr->batchDims[j*3+1]==ny;j++);
+    if((ramp=getCogRamp(tstr,nx,ny))==NULL)
+      return 1;
+    (*cstr->cogKernel)(&tstr->batchPtr[i],ramp,&ramp[nx*ny],nx*ny,j-i,&tstr->cogRes[i*3]);
+  }
+  return 0;
+}
+
+/**
+   Makes sure the per-thread storage for batchPtr, batchDims and calcCogMoments can hold n subaps.  Returns 1 on error.
+*/
+int allocSubapBatch(CentThreadStruct *tstr,int n){
+  if(tstr->cogResSize<n){
+    free(tstr->cogRes);
+    free(tstr->batchPtr);
+    free(tstr->batchDims);
+    tstr->cogRes=malloc(sizeof(float)*3*n);
+    tstr->batchPtr=malloc(sizeof(float*)*n);
+    tstr->batchDims=malloc(sizeof(int)*3*n);
+    if(tstr->cogRes==NULL || tstr->batchPtr==NULL || tstr->batchDims==NULL){
+      printf("Error allocating cogRes\n");
+      free(tstr->cogRes);
+      free(tstr->batchPtr);
+      free(tstr->batchDims);
+      tstr->cogRes=NULL;
+      tstr->batchPtr=NULL;
+      tstr->batchDims=NULL;
+      tstr->cogResSize=0;
+      return 1;
+    }
+    tstr->cogResSize=n;
+  }
   return 0;
 }
 
+/**
+   Weighted CoG moments, with the weights (centWeighting) being an image of the same shape as the pixel image.
+*/
+void calcCogWeighted(CentStruct *cstr,int threadno,float *res){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  int *loc=&(cstr->arr->subapLocation[tstr->subindx*6]);
+  float *wt=&cstr->centWeighting[cstr->npxlCum[tstr->cam]];
+  float *subap=tstr->subap;
+  float *ramp=NULL;
+  int i,j,pos,cnt=0;
+  float p;
+  res[0]=res[1]=res[2]=0;
+  if(loc[5]==1)
+    ramp=getCogRamp(tstr,tstr->curnpxlx,tstr->curnpxly);
+  for(i=0;i<tstr->curnpxly;i++){
+    pos=(loc[0]+i*loc[2])*cstr->npxlx[tstr->cam]+loc[3];
+    if(ramp!=NULL){
+      (*cstr->cogWeightKernel)(&subap[cnt],&wt[pos],ramp,(float)i,tstr->curnpxlx,res);
+      cnt+=tstr->curnpxlx;
+    }else{
+      for(j=0;j<tstr->curnpxlx;j++){
+	p=subap[cnt]*wt[pos+j*loc[5]];
+	res[0]+=p;
+	res[1]+=j*p;
+	res[2]+=i*p;
+	cnt++;
+      }
+    }
+  }
+}
+
 /**
    Calculates the adaptive windows for next time, and updates the current centroids to take into account the position of the current window.
 */
@@ -497,7 +793,128 @@ int calcGlobalAdaptiveWindow(CentStruct *cstr){
   }
   return 0;
 }
+/**
+   Geometry of the zero padding used for brute force correlation, along one axis, with c subap pixels, r reference pixels and nc outputs.  For output k, reference pixel t is matched with subap pixel t+k+(c-r)/2-nc/2 (as with the overlap windows previously computed for each shift).  Gives the padding before the subap and the padded length, and returns the padded index of reference pixel 0 for output 0.
+*/
+static inline int bruteAxis(int c,int r,int nc,int *pad,int *len){
+  int base=(c-r)/2-nc/2;
+  *pad=base<0?-base:0;
+  *len=r+nc-1+base+*pad;
+  if(*len<c+*pad)
+    *len=c+*pad;
+  return base+*pad;
+}
+
+/**
+   Size of the brute force workspace needed for a subap.
+*/
+static inline int bruteWorkspaceSize(int curnpxlx,int curnpxly,int corrnpxlx,int corrnpxly,int ncenx,int nceny){
+  int padx,pady,pw,ph;
+  bruteAxis(curnpxlx,corrnpxlx,ncenx,&padx,&pw);
+  bruteAxis(curnpxly,corrnpxly,nceny,&pady,&ph);
+  return corrnpxlx*corrnpxly+2*pw*ph+3*ncenx;
+}
+
+static inline int isBruteMode(int mode){
+  return mode==CENTROIDMODE_BRUTECOG || mode==CENTROIDMODE_BRUTEGAUSSIAN || mode==CENTROIDMODE_BRUTEQUADRATIC || mode==CENTROIDMODE_BRUTEQUADRATICINTERP || mode==CENTROIDMODE_DIFFSQUCOG || mode==CENTROIDMODE_DIFFSQUGAUSSIAN || mode==CENTROIDMODE_DIFFSQUQUADRATIC || mode==CENTROIDMODE_DIFFSQUQUADRATICINTERP;
+}
+
+/**
+   Called from slopeNewParam, to allocate the workspace for calcBruteCorr and calcDiffSquared, so that this isn't done during a frame.  Returns 1 on error.
+*/
+int allocBruteWorkspace(CentStruct *cstr){
+  int i,*loc,*cloc,corrClip,nx,ny,n,maxn=0,maxnpxl=0;
+  CentThreadStruct *tstr;
+  for(i=0;i<cstr->nsubaps;i++){
+    if(cstr->subapFlag[i]==0 || !isBruteMode(cstr->centroidModeArr==NULL?cstr->centroidMode:cstr->centroidModeArr[i]))
+      continue;
+    loc=&cstr->realSubapLocation[i*6];
+    cloc=(cstr->corrSubapLocation!=NULL)?&cstr->corrSubapLocation[i*6]:loc;
+    corrClip=(cstr->corrClipArr!=NULL)?cstr->corrClipArr[i]:cstr->corrClip;
+    ny=(loc[1]-loc[0])/loc[2];
+    nx=(loc[4]-loc[3])/loc[5];
+    if(nx-2*corrClip<=0 || ny-2*corrClip<=0)
+      continue;
+    n=bruteWorkspaceSize(nx,ny,(cloc[4]-cloc[3])/cloc[5],(cloc[1]-cloc[0])/cloc[2],nx-2*corrClip,ny-2*corrClip);
+    if(n>maxn)
+      maxn=n;
+    if(nx*ny>maxnpxl)
+      maxnpxl=nx*ny;
+  }
+  for(i=0;i<cstr->nthreads;i++){
+    tstr=cstr->tstr[i];
+    if(tstr->bruteBufSize<maxn){
+      free(tstr->bruteBuf);
+      tstr->bruteBufSize=maxn;
+      if(posix_memalign((void**)&tstr->bruteBuf,SUBAPALIGN,sizeof(float)*maxn)!=0){
+	printf("Error allocating bruteBuf\n");
+	tstr->bruteBuf=NULL;
+	tstr->bruteBufSize=0;
+	return 1;
+      }
+    }
+    if(tstr->corrSubapSize<maxnpxl){
+      free(tstr->corrSubap);
+      tstr->corrSubapSize=maxnpxl;
+      if(posix_memalign((void**)&tstr->corrSubap,SUBAPALIGN,sizeof(float)*tstr->corrSubapSize)!=0){
+	printf("Error allocating corrSubap\n");
+	tstr->corrSubap=NULL;
+	tstr->corrSubapSize=0;
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
 #define B(y,x) corrRef[cstr->corrnpxlCum[tstr->cam]+(loc[0]+(y)*loc[2])*cstr->corrnpxlx[tstr->cam]+loc[3]+(x)*loc[5]]
+/**
+   Sets up the brute force workspace for the current subap: a contiguous copy of the reference, the zero padded subap and (if mask!=NULL) the mask of which padded pixels are from the subap.  *off is the offset in pad (and mask) of the first shift of the first output row.  Returns 1 on error.
+*/
+int setupBruteSubap(CentStruct *cstr,int threadno,int *loc,int ncenx,int nceny,float **ref,float **pad,float **mask,float **acc,int *pw,int *off){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  float *corrRef=cstr->fftCorrelationPattern;
+  int curnpxlx=tstr->curnpxlx;
+  int curnpxly=tstr->curnpxly;
+  int corrnpxly=(loc[1]-loc[0])/loc[2];
+  int corrnpxlx=(loc[4]-loc[3])/loc[5];
+  int padx,pady,ph,x0,y0,i,j,n;
+  n=bruteWorkspaceSize(curnpxlx,curnpxly,corrnpxlx,corrnpxly,ncenx,nceny);
+  if(tstr->bruteBufSize<n){//shouldn't happen - allocated in allocBruteWorkspace.
+    printf("Reallocating bruteBuf in rtcslope\n");
+    free(tstr->bruteBuf);
+    tstr->bruteBufSize=n;
+    if(posix_memalign((void**)&tstr->bruteBuf,SUBAPALIGN,sizeof(float)*n)!=0){
+      printf("bruteBuf malloc failed\n");
+      tstr->bruteBuf=NULL;
+      tstr->bruteBufSize=0;
+      return 1;
+    }
+  }
+  x0=bruteAxis(curnpxlx,corrnpxlx,ncenx,&padx,pw);
+  y0=bruteAxis(curnpxly,corrnpxly,nceny,&pady,&ph);
+  *off=y0*(*pw)+x0;
+  *ref=tstr->bruteBuf;
+  *pad=&tstr->bruteBuf[corrnpxlx*corrnpxly];
+  *acc=&(*pad)[ph*(*pw)];
+  for(i=0;i<corrnpxly;i++){
+    for(j=0;j<corrnpxlx;j++)
+      (*ref)[i*corrnpxlx+j]=B(i,j);
+  }
+  memset(*pad,0,sizeof(float)*ph*(*pw));
+  for(i=0;i<curnpxly;i++)
+    memcpy(&(*pad)[(pady+i)*(*pw)+padx],&tstr->subap[i*curnpxlx],sizeof(float)*curnpxlx);
+  if(mask!=NULL){
+    *mask=*acc;
+    *acc=&(*mask)[ph*(*pw)];
+    memset(*mask,0,sizeof(float)*ph*(*pw));
+    for(i=0;i<curnpxly;i++){
+      for(j=0;j<curnpxlx;j++)
+	(*mask)[(pady+i)*(*pw)+padx+j]=1;
+    }
+  }
+  return 0;
+}
 void calcDiffSquared(CentStruct *cstr,int threadno){
   CentThreadStruct *tstr=cstr->tstr[threadno];
   int *loc;
@@ -508,11 +925,10 @@ void calcDiffSquared(CentStruct *cstr,int threadno){
   int corrnpxlx,corrnpxly,corrClip;
   float *corrRef;
   int i,j,x,y;
-  float s,d,tot,tot2,b,c;
+  float s,d;
   int mx,my;
   int nceny,ncenx;
   int mode=2;
-  int minx,miny,srefy,srefx,offx,offy,sinx,siny;
   tstr->curnpxlSubap=curnpxlx*curnpxly;
   //The corrRef can be larger than the subap.  The output is then of size of the original subap, clipped if specified (to reduce computational load)
   if(cstr->corrClipArr!=NULL){corrClip=cstr->corrClipArr[tstr->subindx];
@@ -545,9 +961,6 @@ void calcDiffSquared(CentStruct *cstr,int threadno){
     }
     printf("Aligned, address %p thread %d\n",tstr->corrSubap,threadno);
   }
-  minx=corrnpxlx<curnpxlx?corrnpxlx:curnpxlx;
-  miny=corrnpxly<curnpxly?corrnpxly:curnpxly;
-
   //memset(tstr->corrSubap,0,sizeof(float)*curnpxly*curnpxlx);
   if(mode==1){//best for solar
     for(i=0;i<nceny;i++){
@@ -578,41 +991,12 @@ void calcDiffSquared(CentStruct *cstr,int threadno){
       }
     }
   }else{//best for lgs (different scaling).
-    for(i=0;i<nceny;i++){
-      offy=i-nceny/2;//this offset.  0 for the central point.
-      my=miny;
-      srefy=-offy-(curnpxly-corrnpxly)/2;//starting point in the reference.
-      if(srefy<0) srefy=0;
-      siny=(curnpxly-corrnpxly)/2+offy;//starting point in the input image
-      if(siny<0) siny=0;
-      if(siny+my>curnpxly) my=curnpxly-siny;
-      if(srefy+my>corrnpxly) my=corrnpxly-srefy;
-      for(j=0;j<ncenx;j++){
-	offx=j-ncenx/2;
-	mx=minx;
-	srefx=-offx-(curnpxlx-corrnpxlx)/2;//starting point in the refernce
-	if(srefx<0) srefx=0;
-	sinx=(curnpxlx-corrnpxlx)/2+offx;//starting point in the input image
-	if(sinx<0) sinx=0;
-	if(sinx+mx>curnpxlx) mx=curnpxlx-sinx;
-	if(srefx+mx>corrnpxlx) mx=corrnpxlx-srefx;
-	s=0;
-	tot=0;
-	tot2=0;
-	for(y=0;y<my;y++){
-	  for(x=0;x<mx;x++){
-	    b=subap[(siny+y)*curnpxlx+sinx+x];
-	    tot+=b;
-	    c=B(srefy+y,srefx+x);//corrPattern[(srefy+y)*corrnpxl+srefx+x];
-	    tot2+=c;
-	    d=c-b;
-	    s+=d*d;
-	  }
-	}
-	if(tot!=0 && tot2!=0)
-	  tstr->corrSubap[i*ncenx+j]=s/(tot*tot2);//[(i+(corrnpxly-nceny)/2)*corrnpxlx+j+(corrnpxlx-ncenx)/2]=s/(tot*tot2);
-      }
-    }
+    float *ref,*pad,*mask,*acc;
+    int pw,off;
+    if(setupBruteSubap(cstr,threadno,loc,ncenx,nceny,&ref,&pad,&mask,&acc,&pw,&off)!=0)
+      return;
+    for(i=0;i<nceny;i++)
+      (*cstr->diffSqKernel)(&tstr->corrSubap[i*ncenx],acc,ref,&pad[off+i*pw],&mask[off+i*pw],corrnpxlx,corrnpxly,pw,ncenx);
   }
   memcpy(subap,tstr->corrSubap,nceny*ncenx*sizeof(float));
 }
@@ -628,18 +1012,15 @@ void calcBruteCorr(CentStruct *cstr,int threadno){//brute force correlation - i.
   //int cursubindx=tstr->subindx;
   float *subap=tstr->subap;
   int corrnpxlx,corrnpxly,corrClip;
-  float *corrRef;
-  int i,j,x,y;
-  float s,tot,tot2,b,c;
-  int mx,my;
+  int i;
   int nceny,ncenx;
-  int minx,miny,srefy,srefx,offx,offy,sinx,siny;
+  float *ref,*pad,*acc;
+  int pw,off;
   tstr->curnpxlSubap=curnpxlx*curnpxly;
   //The corrRef can be larger than the subap.  The output is then of size of the original subap, clipped if specified (to reduce computational load)
   if(cstr->corrClipArr!=NULL){corrClip=cstr->corrClipArr[tstr->subindx];
   }else
     corrClip=cstr->corrClip;
-  corrRef=cstr->fftCorrelationPattern;
   if(cstr->corrSubapLocation!=NULL)
     loc=&(cstr->corrSubapLocation[tstr->subindx*6]);
   else
@@ -650,65 +1031,221 @@ void calcBruteCorr(CentStruct *cstr,int threadno){//brute force correlation - i.
   ncenx=curnpxlx-2*corrClip;
   tstr->corrnpxlx=ncenx;//curnpxlx;//the correlation image won't be any bigger
   tstr->corrnpxly=nceny;//curnpxly;//than the shs image.
-  //need some memory for the intermediate result...
-  if(tstr->corrSubapSize<ncenx*nceny){//curnpxlx*curnpxly){
-    if(tstr->corrSubap!=NULL){
-      printf("Freeing existing corrSubap\n");
+  //The subap is copied (zero padded) into the workspace, so the result can go straight into subap.
+  if(setupBruteSubap(cstr,threadno,loc,ncenx,nceny,&ref,&pad,NULL,&acc,&pw,&off)!=0)
+    return;
+  for(i=0;i<nceny;i++)
+    (*cstr->bruteKernel)(&subap[i*ncenx],ref,&pad[off+i*pw],corrnpxlx,corrnpxly,pw,ncenx);
+}
+#undef B
+
+
+//Define a function to allow easy indexing into the fftCorrelationPattern array...
+/**
+   FFT plan registry.  Plans (forward and inverse half complex, for howmany ny*nx subaps spaced by CORRSTRIDE) are created by createFFTPlans from slopeNewParam, for each correlation subap size, and kept until slopeClose, so that nothing is planned during a frame.
+   Returns the index into fftIndex, or -1 if no such plan.
+*/
+int findFFTPlan(CentStruct *cstr,int nx,int ny,int howmany){
+  int i;
+  for(i=0;i<cstr->fftIndexSize;i++){
+    if(cstr->fftIndex[i*3]==nx && cstr->fftIndex[i*3+1]==ny && cstr->fftIndex[i*3+2]==howmany)
+      return i;
+  }
+  return -1;
+}
+
+/**
+   Adds a plan to the registry if not already there.  Planned on a scratch buffer, since FFTW_MEASURE overwrites its input.  Returns -1 on error, 0 if it already existed, or 1 if it was created.
+*/
+int addFFTPlan(CentStruct *cstr,int nx,int ny,int howmany){
+  int n[2]={ny,nx};
+  fftwf_r2r_kind fkind[2]={FFTW_R2HC,FFTW_R2HC};
+  fftwf_r2r_kind ikind[2]={FFTW_HC2R,FFTW_HC2R};
+  float *buf;
+  void *tmp;
+  int i;
+  int dist=(howmany>1)?CORRSTRIDE(nx*ny):nx*ny;
+  if(findFFTPlan(cstr,nx,ny,howmany)>=0)
+    return 0;
+  if(cstr->fftIndexSize==cstr->fftIndexAlloc){
+    if((tmp=realloc(cstr->fftIndex,sizeof(int)*3*(cstr->fftIndexAlloc+16)))==NULL){
+      printf("realloc of fftIndex failed\n");
+      return -1;
+    }
+    cstr->fftIndex=(int*)tmp;
+    if((tmp=realloc(cstr->fftPlanArray,sizeof(fftwf_plan)*2*(cstr->fftIndexAlloc+16)))==NULL){
+      printf("realloc of fftPlanArray failed\n");
+      return -1;
+    }
+    cstr->fftPlanArray=(fftwf_plan*)tmp;
+    cstr->fftIndexAlloc+=16;
+  }
+  if((buf=fftwf_malloc(sizeof(float)*dist*howmany))==NULL){
+    printf("Unable to allocate FFT planning buffer\n");
+    return -1;
+  }
+  i=cstr->fftIndexSize;
+  printf("Planning FFTs size %d x %d (x%d)\n",ny,nx,howmany);
+  pthread_mutex_lock(&cstr->fftcreateMutex);//the FFTW planner isn't thread safe.
+  cstr->fftPlanArray[i*2]=fftwf_plan_many_r2r(2,n,howmany,buf,NULL,1,dist,buf,NULL,1,dist,fkind,cstr->fftPlanFlags);
+  cstr->fftPlanArray[i*2+1]=fftwf_plan_many_r2r(2,n,howmany,buf,NULL,1,dist,buf,NULL,1,dist,ikind,cstr->fftPlanFlags);
+  pthread_mutex_unlock(&cstr->fftcreateMutex);
+  fftwf_free(buf);
+  if(cstr->fftPlanArray[i*2]==NULL || cstr->fftPlanArray[i*2+1]==NULL){
+    printf("FFT planning failed for %d x %d\n",ny,nx);
+    if(cstr->fftPlanArray[i*2]!=NULL)
+      fftwf_destroy_plan(cstr->fftPlanArray[i*2]);
+    if(cstr->fftPlanArray[i*2+1]!=NULL)
+      fftwf_destroy_plan(cstr->fftPlanArray[i*2+1]);
+    return -1;
+  }
+  cstr->fftIndex[i*3]=nx;
+  cstr->fftIndex[i*3+1]=ny;
+  cstr->fftIndex[i*3+2]=howmany;
+  cstr->fftIndexSize++;
+  return 1;
+}
+
+/**
+   The file used to save FFTW wisdom, so that restarting darc doesn't need to measure again.  Caller should free.
+*/
+char *fftWisdomFile(CentStruct *cstr){
+  char *fname;
+  if(asprintf(&fname,"/dev/shm/%srtcSlopeFFTWisdom",cstr->prefix==NULL?"":cstr->prefix)==-1)
+    return NULL;
+  return fname;
+}
+
+static inline int isCorrelationMode(int mode){
+  return mode==CENTROIDMODE_CORRELATIONCOG || mode==CENTROIDMODE_CORRELATIONGAUSSIAN || mode==CENTROIDMODE_CORRELATIONQUADRATIC || mode==CENTROIDMODE_CORRELATIONQUADRATICINTERP;
+}
+
+/**
+   Called from slopeNewParam to make sure there are plans for all the correlation subaps.  Returns 1 on error.
+*/
+int createFFTPlans(CentStruct *cstr){
+  int i,rt,nx,ny,*loc;
+  int nplanned=0,maxnpxl=0;
+  int batch=(cstr->centroidModeArr==NULL && isCorrelationMode(cstr->centroidMode));
+  char *fname;
+  CentThreadStruct *tstr;
+  for(i=0;i<cstr->nsubaps;i++){
+    if(cstr->subapFlag[i]==0)
+      continue;
+    if(!isCorrelationMode(cstr->centroidModeArr==NULL?cstr->centroidMode:cstr->centroidModeArr[i]))
+      continue;
+    if(cstr->corrSubapLocation!=NULL)
+      loc=&cstr->corrSubapLocation[i*6];
+    else
+      loc=&cstr->realSubapLocation[i*6];
+    ny=(loc[1]-loc[0])/loc[2];
+    nx=(loc[4]-loc[3])/loc[5];
+    if(nx<=0 || ny<=0)
+      continue;
+    if((rt=addFFTPlan(cstr,nx,ny,1))<0)
+      return 1;
+    nplanned+=rt;
+    if(batch){//for calcCorrelationBatch.
+      if((rt=addFFTPlan(cstr,nx,ny,CORRBATCH))<0)
+	return 1;
+      nplanned+=rt;
+    }
+    if(nx*ny>maxnpxl)
+      maxnpxl=nx*ny;
+  }
+  //Allocate the per-thread correlation workspace here, rather than in the frame.
+  for(i=0;i<cstr->nthreads;i++){
+    tstr=cstr->tstr[i];
+    if(batch && tstr->corrBatchSize<CORRSTRIDE(maxnpxl)*CORRBATCH){
+      free(tstr->corrBatch);
+      tstr->corrBatchSize=CORRSTRIDE(maxnpxl)*CORRBATCH;
+      if(posix_memalign((void**)&tstr->corrBatch,SUBAPALIGN,sizeof(float)*tstr->corrBatchSize)!=0){
+	printf("Error allocating corrBatch\n");
+	tstr->corrBatch=NULL;
+	tstr->corrBatchSize=0;
+	return 1;
+      }
+    }
+    if(tstr->corrSubapSize<maxnpxl){
       free(tstr->corrSubap);
+      tstr->corrSubapSize=maxnpxl;
+      if(posix_memalign((void**)&tstr->corrSubap,SUBAPALIGN,sizeof(float)*tstr->corrSubapSize)!=0){
+	printf("Error allocating corrSubap\n");
+	tstr->corrSubap=NULL;
+	tstr->corrSubapSize=0;
+	return 1;
+      }
     }
-    tstr->corrSubapSize=ncenx*nceny;//curnpxlx*curnpxly;
-    printf("memaligning corrSubap to %dx%d\n",nceny,ncenx);
-    if((i=posix_memalign((void**)(&(tstr->corrSubap)),SUBAPALIGN,sizeof(float)*tstr->corrSubapSize))!=0){//equivalent to fftwf_malloc... (kernel/kalloc.h in fftw source).
-      tstr->corrSubapSize=0;
-      tstr->corrSubap=NULL;
-      printf("corrSubap re-malloc failed thread %d, size %d\nExiting...\n",threadno,tstr->corrSubapSize);
-      exit(0);
+  }
+  if(nplanned>0 && (cstr->fftPlanFlags&FFTW_ESTIMATE)==0 && (fname=fftWisdomFile(cstr))!=NULL){
+    if(fftwf_export_wisdom_to_filename(fname)==0)
+      printf("Unable to save FFTW wisdom to %s\n",fname);
+    free(fname);
+  }
+  return 0;
+}
+
+#define B(y,x) fftCorrelationPattern[cstr->corrnpxlCum[tstr->cam]+(loc[0]+(y)*loc[2])*cstr->corrnpxlx[tstr->cam]+loc[3]+(x)*loc[5]]
+/**
+   Multiplies a (the FFT of a subap, half complex, m rows of n) by the reference FFT, in place.
+   This is fairly complicated due to the half complex format.  If you need to edit this, make sure you know what you're doing.
+*/
+void multiplyCorrHC(CentStruct *cstr,CentThreadStruct *tstr,int *loc,float *fftCorrelationPattern,float *a,int n,int m){
+  int i,j,neven,meven;
+  float r1,r2,r3,r4,r5,r6,r7,r8;
+
+  a[0]*=B(0,0);
+  neven=(n%2==0);
+  meven=(m%2==0);
+  if(neven){
+    a[n/2]*=B(0,n/2);
+  }
+  if(meven){
+    a[n*m/2]*=B(m/2,0);
+    if(neven){
+      a[n*m/2+n/2]*=B(m/2,n/2);
     }
-    printf("Aligned, address %p thread %d\n",tstr->corrSubap,threadno);
   }
-  minx=corrnpxlx<curnpxlx?corrnpxlx:curnpxlx;
-  miny=corrnpxly<curnpxly?corrnpxly:curnpxly;
-  for(i=0;i<nceny;i++){
-    offy=i-nceny/2;//this offset.  0 for the central point.
-    my=miny;
-    srefy=-offy-(curnpxly-corrnpxly)/2;//starting point in the reference.
-    if(srefy<0) srefy=0;
-    siny=(curnpxly-corrnpxly)/2+offy;//starting point in the input image
-    if(siny<0) siny=0;
-    if(siny+my>curnpxly) my=curnpxly-siny;
-    if(srefy+my>corrnpxly) my=corrnpxly-srefy;
-    for(j=0;j<ncenx;j++){
-      offx=j-ncenx/2;
-      mx=minx;
-      srefx=-offx-(curnpxlx-corrnpxlx)/2;//starting point in the refernce
-      if(srefx<0) srefx=0;
-      sinx=(curnpxlx-corrnpxlx)/2+offx;//starting point in the input image
-      if(sinx<0) sinx=0;
-      if(sinx+mx>curnpxlx) mx=curnpxlx-sinx;
-      if(srefx+mx>corrnpxlx) mx=corrnpxlx-srefx;
-      s=0;
-      tot=0;
-      tot2=0;
-      for(y=0;y<my;y++){
-	for(x=0;x<mx;x++){
-	  b=subap[(siny+y)*curnpxlx+sinx+x];
-	  tot+=b;
-	  c=B(srefy+y,srefx+x);//corrPattern[(srefy+y)*corrnpxl+srefx+x];
-	  tot2+=c;
-	  s+=c*b;
-	}
-      }
-      //if(tot!=0 && tot2!=0)
-      tstr->corrSubap[i*ncenx+j]=s;///(tot*tot2);
+  for(i=1; i<(n+1)/2; i++){
+    r1=a[i]*B(0,i)-a[n-i]*B(0,n-i);
+    r2=a[i]*B(0,n-i)+a[n-i]*B(0,i);
+    a[i]=r1;
+    a[n-i]=r2;
+    if(meven){
+      r3=a[m/2*n+i]*B(m/2,i)-a[m/2*n+n-i]*B(m/2,n-i);
+      r4=a[m/2*n+i]*B(m/2,n-i)+a[m/2*n+n-i]*B(m/2,i);
+      a[m/2*n+i]=r3;
+      a[m/2*n+n-i]=r4;
+    }
+  }
+  
+  for(i=1; i<(m+1)/2; i++){
+    //do the 4 rows/cols that only require 2 values...
+    r5=a[i*n]*B(i,0)-a[(m-i)*n]*B(m-i,0);
+    r6=a[i*n]*B(m-i,0)+a[(m-i)*n]*B(i,0);
+    a[i*n]=r5;
+    a[(m-i)*n]=r6;
+    if(neven){
+      r7=a[i*n+n/2]*B(i,n/2)-a[(m-i)*n+n/2]*B(m-i,n/2);
+      r8=a[i*n+n/2]*B(m-i,n/2)+a[(m-i)*n+n/2]*B(i,n/2);
+      a[i*n+n/2]=r7;
+      a[(m-i)*n+n/2]=r8;//changed from r7 on 120830 by agb
+    }
+    
+    for(j=1; j<(n+1)/2; j++){
+      //and now loop over the rest.
+      r1=a[i*n+j]*B(i,j)+a[(m-i)*n+n-j]*B(m-i,n-j)-a[i*n+n-j]*B(i,n-j)-a[(m-i)*n+j]*B(m-i,j);
+      r2=a[i*n+j]*B(m-i,n-j)+a[(m-i)*n+n-j]*B(i,j)+a[(m-i)*n+j]*B(i,n-j)+a[i*n+n-j]*B(m-i,j);
+      r3=a[i*n+j]*B(i,n-j)-a[(m-i)*n+n-j]*B(m-i,j)+a[i*n+n-j]*B(i,j)-a[(m-i)*n+j]*B(m-i,n-j);
+      r4=a[i*n+j]*B(m-i,j)-a[(m-i)*n+n-j]*B(i,n-j)+a[(m-i)*n+j]*B(i,j)-a[i*n+n-j]*B(m-i,n-j);
+      a[i*n+j]=r1;
+      a[(m-i)*n+n-j]=r2;
+      a[i*n+n-j]=r3;
+      a[(m-i)*n+j]=r4;
     }
   }
-  memcpy(subap,tstr->corrSubap,ncenx*nceny*sizeof(float));
 }
-#undef B
-
 
-//Define a function to allow easy indexing into the fftCorrelationPattern array...
-#define B(y,x) fftCorrelationPattern[cstr->corrnpxlCum[tstr->cam]+(loc[0]+(y)*loc[2])*cstr->corrnpxlx[tstr->cam]+loc[3]+(x)*loc[5]]
 /**
    Calculates the correlation of the spot with the reference.
    fftCorrelationPattern is distributed in memory as per subapLocation, and is
@@ -719,10 +1256,7 @@ void calcBruteCorr(CentStruct *cstr,int threadno){//brute force correlation - i.
 int calcCorrelation(CentStruct *cstr,int threadno,float *fftOut){
   CentThreadStruct *tstr=cstr->tstr[threadno];
   int *loc;
-  int i,j,n,m,neven,meven;
-  float *a;
-  float r1,r2,r3,r4,r5,r6,r7,r8;
-  int *tmp;
+  int i;
   fftwf_plan fPlan=NULL,ifPlan=NULL;
   int curnpxlx=tstr->curnpxlx;
   int curnpxly=tstr->curnpxly;
@@ -730,9 +1264,6 @@ int calcCorrelation(CentStruct *cstr,int threadno,float *fftOut){
   float *subap=tstr->subap;
   int dx,dy,corrnpxlx,corrnpxly,corrClip;
   float *fftCorrelationPattern;
-  //This is how the plans should be created (elsewhere).  Will need a different plan for each different sized subap (see subapLocation).  
-  //fftwPlan=fftwf_plan_r2r_2d(curnpxly,curnpxlx, double *in, double *out,FFTW_R2HC, FFTW_R2HC, FFTW_ESTIMATE);
-  //ifftwPlan=fftwf_plan_r2r_2d(curnpxly,curnpxlx, double *in, double *out,FFTW_HC2R, FFTW_HC2R, FFTW_ESTIMATE);
   if(cstr->corrClipArr!=NULL){
     corrClip=cstr->corrClipArr[tstr->subindx];
   }else
@@ -781,122 +1312,21 @@ int calcCorrelation(CentStruct *cstr,int threadno,float *fftOut){
   }
   
 
-  for(i=0; i<cstr->fftIndexSize; i++){
-    if(cstr->fftIndex[i*2]==0 || cstr->fftIndex[i*2+1]==0){
-      break;
-    }
-    if(cstr->fftIndex[i*2]==corrnpxlx && cstr->fftIndex[i*2+1]==corrnpxly){
-      fPlan=cstr->fftPlanArray[i*2];
-      ifPlan=cstr->fftPlanArray[i*2+1];
-      break;
-    }
-  }
-  if(fPlan==NULL){//need to create the plan...
-    //only allow 1 thread to create a plan at a time.
-    pthread_mutex_lock(&cstr->fftcreateMutex);//reuse camMutex...
-    //now just check again... (another thread may have created it while we were waiting for the mutex)...
-    for(i=0; i<cstr->fftIndexSize; i++){
-      if(cstr->fftIndex[i*2]==0 || cstr->fftIndex[i*2+1]==0){
-	break;
-      }
-      if(cstr->fftIndex[i*2]==corrnpxlx && cstr->fftIndex[i*2+1]==corrnpxly){
-	fPlan=cstr->fftPlanArray[i*2];
-	ifPlan=cstr->fftPlanArray[i*2+1];
-	break;
-      }
-    }
-    if(fPlan==NULL){
-      if(i==cstr->fftIndexSize){//need to make the index larger...
-	if((tmp=realloc(cstr->fftIndex,sizeof(int)*2*(cstr->fftIndexSize+16)))==NULL){
-	  printf("realloc of fftIndex failed - exiting\n");
-	  exit(1);
-	}
-	//fill the new stuff with zeros...
-	cstr->fftIndex=(int*)tmp;
-	memset(&cstr->fftIndex[i*2],0,sizeof(int)*2*16);
-	if((tmp=realloc(cstr->fftPlanArray,sizeof(fftwf_plan)*2*(cstr->fftIndexSize+16)))==NULL){
-	  printf("realloc of fftPlanArray failed - exiting\n");
-	  exit(1);
-	}
-	cstr->fftPlanArray=(fftwf_plan*)tmp;
-	memset(&cstr->fftPlanArray[i*2],0,sizeof(fftwf_plan)*2*16);
-	cstr->fftIndexSize+=16;
-      }
-      //now do the planning
-      printf("Planning FFTs size %d x %d\n",corrnpxly,corrnpxlx);
-      cstr->fftPlanArray[i*2]=fftwf_plan_r2r_2d(corrnpxly,corrnpxlx,subap,subap,FFTW_R2HC, FFTW_R2HC, FFTW_ESTIMATE);
-      cstr->fftPlanArray[i*2+1]=fftwf_plan_r2r_2d(corrnpxly,corrnpxlx,subap,subap,FFTW_HC2R, FFTW_HC2R, FFTW_ESTIMATE);
-      cstr->fftIndex[i*2]=corrnpxlx;
-      cstr->fftIndex[i*2+1]=corrnpxly;
-      fPlan=cstr->fftPlanArray[i*2];
-      ifPlan=cstr->fftPlanArray[i*2+1];
-      
-    }
-    pthread_mutex_unlock(&cstr->fftcreateMutex);//reuse camMutex...
-
+  //Plans are all created in slopeNewParam, never here.
+  if((i=findFFTPlan(cstr,corrnpxlx,corrnpxly,1))<0){
+    printf("No FFT plan for %dx%d correlation (subap %d)\n",corrnpxly,corrnpxlx,tstr->subindx);
+    writeErrorVA(cstr->rtcErrorBuf,-1,cstr->frameno,"rtcSlope missing FFT plan");
+    return 1;
   }
+  fPlan=cstr->fftPlanArray[i*2];
+  ifPlan=cstr->fftPlanArray[i*2+1];
   //FFT the SH image.
   fftwf_execute_r2r(fPlan,subap,subap);
   if(fftOut!=NULL)
     memcpy(fftOut,subap,sizeof(float)*corrnpxlx*corrnpxly);
   //Now multiply by the reference...
-  //This is fairly complicated due to the half complex format.  If you need to edit this, make sure you know what you're doing.
   //Here, we want to use the real subap location rather than the moving one, because this image map in question (the fft'd psf) doesn't move around, and we're just using subap location for convenience rather than having to identify another way to specify it.
-  a=subap;
-  n=corrnpxlx;
-  m=corrnpxly;
-
-
-  a[0]*=B(0,0);
-  neven=(n%2==0);
-  meven=(m%2==0);
-  if(neven){
-    a[n/2]*=B(0,n/2);
-  }
-  if(meven){
-    a[n*m/2]*=B(m/2,0);
-    if(neven){
-      a[n*m/2+n/2]*=B(m/2,n/2);
-    }
-  }
-  for(i=1; i<(n+1)/2; i++){
-    r1=a[i]*B(0,i)-a[n-i]*B(0,n-i);
-    r2=a[i]*B(0,n-i)+a[n-i]*B(0,i);
-    a[i]=r1;
-    a[n-i]=r2;
-    if(meven){
-      r3=a[m/2*n+i]*B(m/2,i)-a[m/2*n+n-i]*B(m/2,n-i);
-      r4=a[m/2*n+i]*B(m/2,n-i)+a[m/2*n+n-i]*B(m/2,i);
-      a[m/2*n+i]=r3;
-      a[m/2*n+n-i]=r4;
-    }
-  }
-  
-  for(i=1; i<(m+1)/2; i++){
-    //do the 4 rows/cols that only require 2 values...
-    r5=a[i*n]*B(i,0)-a[(m-i)*n]*B(m-i,0);
-    r6=a[i*n]*B(m-i,0)+a[(m-i)*n]*B(i,0);
-    a[i*n]=r5;
-    a[(m-i)*n]=r6;
-    if(neven){
-      r7=a[i*n+n/2]*B(i,n/2)-a[(m-i)*n+n/2]*B(m-i,n/2);
-      r8=a[i*n+n/2]*B(m-i,n/2)+a[(m-i)*n+n/2]*B(i,n/2);
-      a[i*n+n/2]=r7;
-      a[(m-i)*n+n/2]=r8;//changed from r7 on 120830 by agb
-    }
-    
-    for(j=1; j<(n+1)/2; j++){
-      //and now loop over the rest.
-      r1=a[i*n+j]*B(i,j)+a[(m-i)*n+n-j]*B(m-i,n-j)-a[i*n+n-j]*B(i,n-j)-a[(m-i)*n+j]*B(m-i,j);
-      r2=a[i*n+j]*B(m-i,n-j)+a[(m-i)*n+n-j]*B(i,j)+a[(m-i)*n+j]*B(i,n-j)+a[i*n+n-j]*B(m-i,j);
-      r3=a[i*n+j]*B(i,n-j)-a[(m-i)*n+n-j]*B(m-i,j)+a[i*n+n-j]*B(i,j)-a[(m-i)*n+j]*B(m-i,n-j);
-      r4=a[i*n+j]*B(m-i,j)-a[(m-i)*n+n-j]*B(i,n-j)+a[(m-i)*n+j]*B(i,j)-a[i*n+n-j]*B(m-i,n-j);
-      a[i*n+j]=r1;
-      a[(m-i)*n+n-j]=r2;
-      a[i*n+n-j]=r3;
-      a[(m-i)*n+j]=r4;
-    }
-  }
+  multiplyCorrHC(cstr,tstr,loc,fftCorrelationPattern,subap,corrnpxlx,corrnpxly);
   //and now do the inverse fft...
   fftwf_execute_r2r(ifPlan,subap,subap);
   //and now, if we were zero padding, copy the right parts back.
@@ -918,6 +1348,151 @@ int calcCorrelation(CentStruct *cstr,int threadno,float *fftOut){
 }
 
 #undef B
+
+/**
+   Whether all subaps use FFT correlation with a fixed reference, so that calcCorrelationBatch can be used.
+*/
+static inline int corrBatchable(CentStruct *cstr,int threadno){
+  return cstr->centroidModeArr==NULL && isCorrelationMode(cstr->centroidMode) && cstr->corrUpdateGain==0 && cstr->fftCorrelationPattern!=NULL && cstr->tstr[threadno]->corrBatchSize>0;
+}
+
+/**
+   Correlates up to CORRBATCH subaps of the same size, starting at entry k of batchPtr, with the FFTs of the batch done together.  The correlations (clipped as in calcCorrelation) are left in corrBatch, at multiples of CORRSTRIDE(corrnpxlx*corrnpxly), and picked up by calcCentroid via useCorrResult.  Sets corrBatchStart and corrBatchEnd to the entries done, which may be none if calcCorrelation should be used instead.
+*/
+void calcCorrelationBatch(CentStruct *cstr,int threadno,int k,int nsubaps){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  int *loc,*loc0;
+  int i,j,cnt,indx,nx,ny,corrnpxlx,corrnpxly,dx,dy,corrClip,n,stride;
+  float *slot;
+  const float *subap;
+  tstr->corrBatchStart=k;
+  tstr->corrBatchEnd=k;
+  loc0=(cstr->corrSubapLocation!=NULL)?cstr->corrSubapLocation:cstr->realSubapLocation;
+  loc=&loc0[tstr->batchDims[k*3+2]*6];
+  corrnpxly=(loc[1]-loc[0])/loc[2];
+  corrnpxlx=(loc[4]-loc[3])/loc[5];
+  n=corrnpxlx*corrnpxly;
+  stride=CORRSTRIDE(n);
+  if(stride*CORRBATCH>tstr->corrBatchSize)
+    return;
+  //Gather (zero padding if required) into the workspace.
+  for(cnt=0;cnt<CORRBATCH && k+cnt<nsubaps;cnt++){
+    loc=&loc0[tstr->batchDims[(k+cnt)*3+2]*6];
+    if((loc[1]-loc[0])/loc[2]!=corrnpxly || (loc[4]-loc[3])/loc[5]!=corrnpxlx)
+      break;
+    nx=tstr->batchDims[(k+cnt)*3];
+    ny=tstr->batchDims[(k+cnt)*3+1];
+    if(nx>corrnpxlx || ny>corrnpxly)
+      break;//calcCorrelation will report this.
+    slot=&tstr->corrBatch[cnt*stride];
+    subap=tstr->batchPtr[k+cnt];
+    if(nx==corrnpxlx && ny==corrnpxly){
+      memcpy(slot,subap,sizeof(float)*n);
+    }else{
+      dx=(corrnpxlx-nx)/2;
+      dy=(corrnpxly-ny)/2;
+      memset(slot,0,sizeof(float)*n);
+      for(i=0;i<ny;i++)
+	memcpy(&slot[(dy+i)*corrnpxlx+dx],&subap[i*nx],sizeof(float)*nx);
+    }
+  }
+  if(cnt==0)
+    return;
+  tstr->corrBatchSlot=stride;
+  //Forward FFTs, multiply, and inverse.
+  if(cnt==CORRBATCH && (indx=findFFTPlan(cstr,corrnpxlx,corrnpxly,CORRBATCH))>=0){
+    fftwf_execute_r2r(cstr->fftPlanArray[indx*2],tstr->corrBatch,tstr->corrBatch);
+    for(i=0;i<cnt;i++)
+      multiplyCorrHC(cstr,tstr,&loc0[tstr->batchDims[(k+i)*3+2]*6],cstr->fftCorrelationPattern,&tstr->corrBatch[i*stride],corrnpxlx,corrnpxly);
+    fftwf_execute_r2r(cstr->fftPlanArray[indx*2+1],tstr->corrBatch,tstr->corrBatch);
+  }else if((indx=findFFTPlan(cstr,corrnpxlx,corrnpxly,1))>=0){
+    for(i=0;i<cnt;i++){
+      slot=&tstr->corrBatch[i*stride];
+      fftwf_execute_r2r(cstr->fftPlanArray[indx*2],slot,slot);
+      multiplyCorrHC(cstr,tstr,&loc0[tstr->batchDims[(k+i)*3+2]*6],cstr->fftCorrelationPattern,slot,corrnpxlx,corrnpxly);
+      fftwf_execute_r2r(cstr->fftPlanArray[indx*2+1],slot,slot);
+    }
+  }else
+    return;
+  //Clip, if padded.
+  for(i=0;i<cnt;i++){
+    nx=tstr->batchDims[(k+i)*3];
+    ny=tstr->batchDims[(k+i)*3+1];
+    tstr->corrBatchNpxl[i]=nx*ny;
+    if(corrnpxlx>nx || corrnpxly>ny){
+      if(cstr->corrClipArr!=NULL)
+	corrClip=cstr->corrClipArr[tstr->batchDims[(k+i)*3+2]];
+      else
+	corrClip=cstr->corrClip;
+      if(corrClip>0){
+	slot=&tstr->corrBatch[i*stride];
+	for(j=0;j<corrnpxly-2*corrClip;j++)
+	  memcpy(&slot[j*(corrnpxlx-2*corrClip)],&slot[(j+corrClip)*corrnpxlx+corrClip],sizeof(float)*(corrnpxlx-2*corrClip));
+	tstr->corrBatchNpxl[i]=(corrnpxlx-2*corrClip)*(corrnpxly-2*corrClip);
+      }else
+	tstr->corrBatchNpxl[i]=n;
+    }
+  }
+  tstr->corrBatchEnd=k+cnt;
+}
+
+/**
+   Used instead of calcCorrelation when the correlation has already been computed by calcCorrelationBatch - puts it where calcCorrelation would have.
+*/
+int useCorrResult(CentStruct *cstr,int threadno){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  int *loc;
+  if(cstr->corrSubapLocation!=NULL)
+    loc=&(cstr->corrSubapLocation[tstr->subindx*6]);
+  else
+    loc=&(cstr->realSubapLocation[tstr->subindx*6]);
+  tstr->corrnpxly=(loc[1]-loc[0])/loc[2];
+  tstr->corrnpxlx=(loc[4]-loc[3])/loc[5];
+  tstr->curnpxlSubap=tstr->corrResultNpxl;
+  if(tstr->corrnpxlx>tstr->curnpxlx || tstr->corrnpxly>tstr->curnpxly){
+    if(tstr->corrSubapSize<tstr->corrnpxlx*tstr->corrnpxly)
+      return calcCorrelation(cstr,threadno,NULL);//shouldn't happen - allocated in createFFTPlans.
+    memcpy(tstr->corrSubap,tstr->corrResult,sizeof(float)*tstr->corrResultNpxl);
+  }else{
+    memcpy(tstr->subap,tstr->corrResult,sizeof(float)*tstr->corrResultNpxl);
+  }
+  return 0;
+}
+
+/**
+   Called once the nsubaps entries of batchPtr and batchDims have been filled in, to do any work that is done for several subaps together.  Returns the mode to pass to setSubapBatch - 0 for none, 1 for CoG moments, 2 for correlation.
+*/
+int prepareSubapBatch(CentStruct *cstr,int threadno,int nsubaps){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  if(cogBatchable(cstr)){
+    if(calcCogMoments(cstr,tstr,nsubaps)==0)
+      return 1;
+  }else if(corrBatchable(cstr,threadno)){
+    tstr->corrBatchStart=0;
+    tstr->corrBatchEnd=0;
+    return 2;
+  }
+  return 0;
+}
+
+/**
+   Called before calcCentroid for entry k of the batch, to point it at any results computed together with other subaps.  Correlations are computed CORRBATCH at a time, as they are reached, to keep the workspace small.
+*/
+void setSubapBatch(CentStruct *cstr,int threadno,int mode,int k,int nsubaps){
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  tstr->cogMoments=NULL;
+  tstr->corrResult=NULL;
+  if(mode==1){
+    tstr->cogMoments=&tstr->cogRes[k*3];
+  }else if(mode==2){
+    if(k>=tstr->corrBatchEnd)
+      calcCorrelationBatch(cstr,threadno,k,nsubaps);
+    if(k>=tstr->corrBatchStart && k<tstr->corrBatchEnd){
+      tstr->corrResult=&tstr->corrBatch[(k-tstr->corrBatchStart)*tstr->corrBatchSlot];
+      tstr->corrResultNpxl=tstr->corrBatchNpxl[k-tstr->corrBatchStart];
+    }
+  }
+}
 /**
    Applies the chosen threshold algorithm to the correlation
    There are 4 possible thresholding algorithms.  The threshold is either a fixed value, or a fraction of the maximum value found in subap.  This threshold is then either subtracted with everything negative being zero'd, or anything below this threshold is zero'd.
@@ -1461,7 +2036,7 @@ int calcCentroid(CentStruct *cstr,int threadno){
   int curnpxlx=tstr->curnpxlx;
   int curnpxly=tstr->curnpxly;
   int centroidMode;
-  int origSubapX,origSubapY;
+  int origSubapX=0,origSubapY=0;
   int corrUpdateRequired=0;
   float *adapWinOffset=cstr->adapWinOffset;//this gets set to NULL if in correlation mode.  
   if(cstr->centroidModeArr==NULL)
@@ -1470,9 +2045,6 @@ int calcCentroid(CentStruct *cstr,int threadno){
     centroidMode=cstr->centroidModeArr[tstr->subindx];
   //If doing correlation centroiding, the idea would be to perform the correlation first here, including any flooring etc of the corelation image.  Then, can apply the chosen centroid algorithm to this here (ie CoG, WCoG etc).
 
-  if(cstr->centWeighting!=NULL){
-    applyCentWeighting(cstr,threadno);
-  }
   cx=0.;
   cy=0.;
   if(cstr->fluxThresholdArr!=NULL){
@@ -1500,7 +2072,10 @@ int calcCentroid(CentStruct *cstr,int threadno){
       memcpy(tstr->tmpSubap,subap,sizeof(float)*tstr->tmpSubapSize);
     }
     //do the correlation...
-    calcCorrelation(cstr,threadno,NULL);
+    if(tstr->corrResult!=NULL)//already done, with neighbouring subaps.
+      useCorrResult(cstr,threadno);
+    else
+      calcCorrelation(cstr,threadno,NULL);
     //here, before thresholding, should probably store this in a circular buffer that can be sent to user.  Or maybe, this is the calibrated image buffer.
     if(cstr->rtcCorrBuf!=NULL && cstr->addReqCorr){// && cstr->rtcCorrBuf->addRequired){
       storeCorrelationSubap(cstr,threadno,cstr->corrbuf);
@@ -1550,15 +2125,29 @@ int calcCentroid(CentStruct *cstr,int threadno){
   }
   if(centroidMode==CENTROIDMODE_COG || centroidMode==CENTROIDMODE_CORRELATIONCOG || centroidMode==CENTROIDMODE_DIFFSQUCOG || centroidMode==CENTROIDMODE_BRUTECOG){
     if(cstr->centIndexArr==NULL){
-      int cnt=0;
-      for(i=0; i<curnpxly; i++){
-	for(j=0; j<curnpxlx; j++){
-	  sum+=subap[cnt];//i*curnpxlx+j];
-	  cx+=j*subap[cnt];//i*curnpxlx+j];
-	  cy+=i*subap[cnt];//i*curnpxlx+j];
-	  cnt++;
+      float res[3];
+      float *ramp;
+      if(centroidMode==CENTROIDMODE_COG && tstr->cogMoments!=NULL){//computed along with neighbouring subaps.
+	memcpy(res,tstr->cogMoments,sizeof(float)*3);
+      }else if(centroidMode==CENTROIDMODE_COG && cstr->centWeighting!=NULL){
+	calcCogWeighted(cstr,threadno,res);
+      }else if((ramp=getCogRamp(tstr,curnpxlx,curnpxly))!=NULL){
+	(*cstr->cogKernel)((const float**)&subap,ramp,&ramp[curnpxlx*curnpxly],curnpxlx*curnpxly,1,res);
+      }else{
+	int cnt=0;
+	res[0]=res[1]=res[2]=0;
+	for(i=0; i<curnpxly; i++){
+	  for(j=0; j<curnpxlx; j++){
+	    res[0]+=subap[cnt];//i*curnpxlx+j];
+	    res[1]+=j*subap[cnt];//i*curnpxlx+j];
+	    res[2]+=i*subap[cnt];//i*curnpxlx+j];
+	    cnt++;
+	  }
 	}
       }
+      sum=res[0];
+      cx=res[1];
+      cy=res[2];
       if(sum>=minflux && sum!=0){
 	cy/=sum;
 	cx/=sum;
@@ -1872,7 +2461,7 @@ int calcCentroid(CentStruct *cstr,int threadno){
 int slopeOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,char *prefix,arrayStruct *arr,void **centHandle,int ncam,int nthreads,unsigned int frameno,unsigned int **centframeno,int *centframenoSize,int totCents){
   CentStruct *cstr;
   int err;
-  char *pn;
+  char *pn,*fname;
   int i;
   printf("Opening rtcslope\n");
   if((pn=makeParamNames())==NULL){
@@ -1913,6 +2502,12 @@ int slopeOpen(char *name,int n,int *args,paramBuf *pbuf,circBuf *rtcErrorBuf,cha
 
 
   cstr->rtcErrorBuf=rtcErrorBuf;
+  cstr->cogKernel=selectSlopeKernels(&cstr->cogWeightKernel,&cstr->bruteKernel,&cstr->diffSqKernel);
+  if((fname=fftWisdomFile(cstr))!=NULL){
+    if(fftwf_import_wisdom_from_filename(fname))
+      printf("Loaded FFTW wisdom from %s\n",fname);
+    free(fname);
+  }
   err=slopeNewParam(*centHandle,pbuf,frameno,arr,totCents);
   if(err!=0){
     printf("Error in slopeOpen...\n");
@@ -1952,7 +2547,7 @@ int slopeNewParam(void *centHandle,paramBuf *pbuf,unsigned int frameno,arrayStru
   if(nfound!=NBUFFERVARIABLES){
     for(i=0; i<NBUFFERVARIABLES; i++){
       if(index[i]<0){
-	if(i==CORRFFTPATTERN || i==CORRTHRESHTYPE || i==CORRTHRESH || i==CORRSUBAPLOCATION || i==CORRNPXLX || i==CORRNPXLCUM || i==CORRCLIP || i==CENTCALDATA || i==CENTCALSTEPS || i==CENTCALBOUNDS || i==CORRNSTORE || i==GAUSSMINVAL || i==GAUSSREPLACEVAL || i==FITMATRICES || i==FITSIZE || i==ADAPBOUNDARY || i==CORRUPDATEGAIN || i==SUBAPALLOCATION || i==CORRUPDATETOCOG || i==CORRCLIPINTEGIMG || i==ADAPWINOFFSET || i==CORRIMGOFFSET || i==CORRUPDATENFR || i==PYRAMIDMODE){
+	if(i==CORRFFTPATTERN || i==CORRFFTPLAN || i==CORRTHRESHTYPE || i==CORRTHRESH || i==CORRSUBAPLOCATION || i==CORRNPXLX || i==CORRNPXLCUM || i==CORRCLIP || i==CENTCALDATA || i==CENTCALSTEPS || i==CENTCALBOUNDS || i==CORRNSTORE || i==GAUSSMINVAL || i==GAUSSREPLACEVAL || i==FITMATRICES || i==FITSIZE || i==ADAPBOUNDARY || i==CORRUPDATEGAIN || i==SUBAPALLOCATION || i==CORRUPDATETOCOG || i==CORRCLIPINTEGIMG || i==ADAPWINOFFSET || i==CORRIMGOFFSET || i==CORRUPDATENFR || i==PYRAMIDMODE){
 	  printf("%.16s not found - continuing\n",&cstr->paramNames[i*BUFNAMESIZE]);
 	}else{
 	  printf("Missing %.16s\n",&cstr->paramNames[i*BUFNAMESIZE]);
@@ -2241,6 +2836,22 @@ int slopeNewParam(void *centHandle,paramBuf *pbuf,unsigned int frameno,arrayStru
 	cstr->fftCorrelationPattern=NULL;
       }
     }
+    cstr->fftPlanFlags=FFTW_MEASURE;
+    if(index[CORRFFTPLAN]>=0){
+      nb=nbytes[CORRFFTPLAN];
+      if(nb==0)
+	cstr->fftPlanFlags=FFTW_MEASURE;
+      else if(dtype[CORRFFTPLAN]=='i' && nb==sizeof(int)){
+	i=*((int*)values[CORRFFTPLAN]);
+	if(i==0)
+	  cstr->fftPlanFlags=FFTW_ESTIMATE;
+	else if(i==2)
+	  cstr->fftPlanFlags=FFTW_PATIENT;
+      }else{
+	printf("corrFFTPlan error\n");
+	err=1;
+      }
+    }
     if(index[CORRCLIP]<0){
       cstr->corrClipArr=NULL;
       cstr->corrClip=0;
@@ -2611,6 +3222,8 @@ int slopeNewParam(void *centHandle,paramBuf *pbuf,unsigned int frameno,arrayStru
     if(nb==0)
       cstr->centWeighting=NULL;
     else if(dtype[CENTROIDWEIGHT]=='f' && nb==4){
+      cstr->centWeighting=NULL;//a uniform weight has no effect on the CoG.
+    }else if(dtype[CENTROIDWEIGHT]=='f' && nb==sizeof(float)*cstr->totPxls){
       cstr->centWeighting=((float*)values[CENTROIDWEIGHT]);
     }else{
       err=1;
@@ -2735,6 +3348,14 @@ int slopeNewParam(void *centHandle,paramBuf *pbuf,unsigned int frameno,arrayStru
       memset(cstr->adaptiveWinPos,0,sizeof(float)*cstr->totCents);
       memset(cstr->adaptiveMaxCount,0,sizeof(int)*cstr->totCents*2);
     }
+    if(err==0 && createFFTPlans(cstr)!=0){
+      printf("Error creating FFT plans\n");
+      err=1;
+    }
+    if(err==0 && allocBruteWorkspace(cstr)!=0){
+      printf("Error allocating brute force correlation workspace\n");
+      err=1;
+    }
   }
 
   return err;
@@ -2780,6 +3401,12 @@ int slopeClose(void **centHandle){
 	    free(cstr->tstr[i]->corrSubap);
 	  if(cstr->tstr[i]->tmpSubap!=NULL)
 	    free(cstr->tstr[i]->tmpSubap);
+	  free(cstr->tstr[i]->cogRamp);
+	  free(cstr->tstr[i]->cogRes);
+	  free(cstr->tstr[i]->batchPtr);
+	  free(cstr->tstr[i]->batchDims);
+	  free(cstr->tstr[i]->corrBatch);
+	  free(cstr->tstr[i]->bruteBuf);
 	  free(cstr->tstr[i]);
 	}
       }
@@ -2793,8 +3420,11 @@ int slopeClose(void **centHandle){
       free(cstr->groupSumX);
     if(cstr->fftIndex!=NULL)
       free(cstr->fftIndex);
-    if(cstr->fftPlanArray!=NULL)
+    if(cstr->fftPlanArray!=NULL){
+      for(i=0;i<cstr->fftIndexSize*2;i++)
+	fftwf_destroy_plan(cstr->fftPlanArray[i]);
       free(cstr->fftPlanArray);
+    }
     if(cstr->adaptiveMaxCount!=NULL)
       free(cstr->adaptiveMaxCount);
     if(cstr->rawSlopes!=NULL)
@@ -2864,11 +3494,32 @@ int slopeCalcSlope(void *centHandle,int cam,int threadno,int nsubs,float *subap,
   CentThreadStruct *tstr=cstr->tstr[threadno];
   int i,pos=0;
   int *loc;
+  int n=0,mode=0,k=0;
   if(subapSize==0 || subap==NULL)
     return 0;
   tstr->cam=cam;
+  if(nprocessing>1 && (cogBatchable(cstr) || corrBatchable(cstr,threadno)) && allocSubapBatch(tstr,nprocessing)==0){
+    for(i=0;i<nprocessing;i++){
+      if(cstr->subapFlag[subindx+i]==1){
+	loc=&(cstr->arr->subapLocation[(subindx+i)*6]);
+	tstr->batchDims[n*3+1]=(loc[1]-loc[0])/loc[2];
+	tstr->batchDims[n*3]=(loc[4]-loc[3])/loc[5];
+	tstr->batchDims[n*3+2]=subindx+i;
+	if(pos+tstr->batchDims[n*3]*tstr->batchDims[n*3+1]>subapSize)
+	  break;
+	tstr->batchPtr[n]=&subap[pos];
+	pos+=((tstr->batchDims[n*3]*tstr->batchDims[n*3+1]+(SUBAPALIGN/sizeof(float))-1)/(SUBAPALIGN/sizeof(float)))*(SUBAPALIGN/sizeof(float));
+	n++;
+      }
+    }
+    if(i==nprocessing)
+      mode=prepareSubapBatch(cstr,threadno,n);
+    pos=0;
+  }
   for(i=0;i<nprocessing;i++){
     if(cstr->subapFlag[subindx]==1){
+      setSubapBatch(cstr,threadno,mode,k,n);
+      k++;
       tstr->subap=&subap[pos];
       tstr->subindx=subindx;
       tstr->centindx=centindx;
@@ -2886,6 +3537,47 @@ int slopeCalcSlope(void *centHandle,int cam,int threadno,int nsubs,float *subap,
     }
     subindx++;
   }
+  setSubapBatch(cstr,threadno,0,0,0);
+  return 0;
+}
+/**
+   Batch version of slopeCalcSlope.  Computes slopes for the nsubaps subaps in subapIndx, placing them at slopeIndx.  The calibrated pixels are in subap, at the offsets (and with the sizes) given in subapInfo by calibrateNewSubapBatch, so subapLocation doesn't need to be looked at again.
+*/
+int slopeCalcSlopeBatch(void *centHandle,int cam,int threadno,int nsubs,int nsubaps,int *subapIndx,int *slopeIndx,float *subap,int subapSize,int *subapInfo){//subap thread.
+  CentStruct *cstr=(CentStruct*)centHandle;
+  CentThreadStruct *tstr=cstr->tstr[threadno];
+  int i;
+  int n=0,mode=0;
+  if(subapSize==0 || subap==NULL)
+    return 0;
+  tstr->cam=cam;
+  if(nsubaps>1 && (cogBatchable(cstr) || corrBatchable(cstr,threadno)) && allocSubapBatch(tstr,nsubaps)==0){
+    for(n=0;n<nsubaps;n++){
+      if(subapInfo[n*3]+subapInfo[n*3+1]*subapInfo[n*3+2]>subapSize)
+	break;
+      tstr->batchPtr[n]=&subap[subapInfo[n*3]];
+      tstr->batchDims[n*3]=subapInfo[n*3+2];
+      tstr->batchDims[n*3+1]=subapInfo[n*3+1];
+      tstr->batchDims[n*3+2]=subapIndx[n];
+    }
+    if(n==nsubaps)
+      mode=prepareSubapBatch(cstr,threadno,n);
+  }
+  for(i=0;i<nsubaps;i++){
+    setSubapBatch(cstr,threadno,mode,i,n);
+    tstr->subap=&subap[subapInfo[i*3]];
+    tstr->subindx=subapIndx[i];
+    tstr->centindx=slopeIndx[i];
+    tstr->curnpxly=subapInfo[i*3+1];
+    tstr->curnpxlx=subapInfo[i*3+2];
+    tstr->curnpxl=tstr->curnpxly*tstr->curnpxlx;
+    if(subapInfo[i*3]+tstr->curnpxl>subapSize){
+      printf("Error - subapSize smaller than expected in rtcslope: %d %d %d %d\n",subapIndx[i],subapInfo[i*3],tstr->curnpxl,subapSize);
+    }else{
+      calcCentroid(cstr,threadno);
+    }
+  }
+  setSubapBatch(cstr,threadno,0,0,0);
   return 0;
 }
 #else
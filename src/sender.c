@@ -35,7 +35,9 @@ $Id$
 #include <sched.h>
 #include <sys/select.h>
 
+#include <time.h>
 #include "circ.h"
+#include "telcodec.h"
 typedef struct{
   void *dataToSend;
   int size;
@@ -73,6 +75,12 @@ typedef struct{
   int readstep;
   int contig;
   Dataset *datasetList;
+  int codecOffer;//compression stages offered to the receiver (-z).
+  int codec;//stages accepted by the receiver - 0 until it replies.
+  codecState cs;
+  char *zdata;//the compressed frame.
+  int zdataSize;
+  int bench;//number of frames for codec benchmark (-B).
 }SendStruct;
 
 
@@ -300,10 +308,143 @@ int connectReceiver(SendStruct *sstr){
       return 1;
     }
   }
+  sstr->codec=0;
+  if(sstr->codecOffer!=0){//offer compression - an older receiver will ignore this, and we continue sending uncompressed.
+    int imsg[8];
+    char *msg=(char*)imsg;
+    int nsent=0,n;
+    memset(imsg,0,sizeof(imsg));
+    imsg[0]=28;
+    msg[4]=0x55;
+    msg[5]=0x43;
+    imsg[2]=sstr->codecOffer;
+    while(nsent<32){
+      if((n=send(sstr->sock,&msg[nsent],32-nsent,0))<0){
+	printf("Failed to send codec offer in sender\n");
+	close(sstr->sock);
+	sstr->sock=0;
+	return 1;
+      }
+      nsent+=n;
+    }
+  }
   sstr->haveHadReceiver=1;
   return 0;
 }
 
+int encodeFrame(SendStruct *sstr,char *frame,int size,char **out){
+  //frame is the 32 byte header followed by the data.  Returns the number of bytes to send from *out.
+  //The header keeps the uncompressed size, with the stages used in byte 24 and the compressed size at 28.
+  int nbytes=size-32;
+  int zsize,used;
+  char *tmp;
+  *out=frame;
+  memset(&frame[24],0,8);
+  if(sstr->codec==0)//receiver hasn't accepted yet.
+    return size;
+  if(sstr->zdataSize<codecMaxSize(nbytes)+32){
+    if((tmp=realloc(sstr->zdata,codecMaxSize(nbytes)+32))==NULL){
+      printf("Error allocating compression buffer in sender - sending uncompressed\n");
+      codecKeep(&sstr->cs,&frame[32],nbytes);
+      return size;
+    }
+    sstr->zdata=tmp;
+    sstr->zdataSize=codecMaxSize(nbytes)+32;
+  }
+  used=codecEncode(&sstr->cs,sstr->codec,frame[16],&frame[32],nbytes,&sstr->zdata[32],&zsize);
+  if(used==0 || zsize>=nbytes)//no gain - send raw (the receiver still keeps it for delta).
+    return size;
+  memcpy(sstr->zdata,frame,32);
+  sstr->zdata[24]=(char)used;
+  ((int*)sstr->zdata)[7]=zsize;
+  *out=sstr->zdata;
+  return zsize+32;
+}
+
+int benchmarkCodecs(SendStruct *sstr){
+  //Compresses frames from the stream with each codec, checks they decode exactly, and reports ratio and time.
+  int combos[6]={CODECRLE,CODECSHUFFLE|CODECRLE,CODECDELTA|CODECRLE,CODECDELTA|CODECSHUFFLE|CODECRLE,CODECDELTA|CODECPACK16|CODECRLE,CODECDELTA|CODECPACK16|CODECSHUFFLE|CODECRLE};
+  char **frames,*zbuf,*dbuf;
+  int *sizes,*zsizes,*used;
+  int nframes=0,ntries=0,i,c,maxsize=0,bad;
+  long rawtot,ztot;
+  double tenc,tdec;
+  struct timespec t1,t2;
+  codecState enc,dec;
+  char name[64];
+  void *ret;
+  frames=calloc(sstr->bench,sizeof(char*));
+  sizes=calloc(sstr->bench,sizeof(int));
+  zsizes=calloc(sstr->bench,sizeof(int));
+  used=calloc(sstr->bench,sizeof(int));
+  if(frames==NULL || sizes==NULL || zsizes==NULL || used==NULL){
+    printf("Error allocating benchmark arrays\n");
+    return 1;
+  }
+  circHeaderUpdated(sstr->cb);
+  while(nframes<sstr->bench && ntries<10){
+    if((ret=circGetNextFrame(sstr->cb,1,1))==NULL){
+      ntries++;
+      continue;
+    }
+    sizes[nframes]=((int*)ret)[0]+4;
+    if((frames[nframes]=malloc(sizes[nframes]))==NULL){
+      printf("Error allocating benchmark frame\n");
+      break;
+    }
+    if(circCopyFrame(sstr->cb,frames[nframes],sizes[nframes])!=0){
+      free(frames[nframes]);
+      continue;
+    }
+    if(sizes[nframes]>maxsize)
+      maxsize=sizes[nframes];
+    nframes++;
+  }
+  printf("Benchmarking %d frames of %s (%d bytes, dtype %c)\n",nframes,sstr->fullname,maxsize-32,nframes>0?frames[0][16]:'-');
+  if(nframes==0)
+    return 1;
+  zbuf=malloc((long)nframes*codecMaxSize(maxsize));
+  dbuf=malloc(maxsize);
+  if(zbuf==NULL || dbuf==NULL){
+    printf("Error allocating benchmark buffers\n");
+    return 1;
+  }
+  for(c=0;c<6;c++){
+    memset(&enc,0,sizeof(codecState));
+    memset(&dec,0,sizeof(codecState));
+    rawtot=ztot=0;
+    bad=0;
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    for(i=0;i<nframes;i++)
+      used[i]=codecEncode(&enc,combos[c],frames[i][16],&frames[i][32],sizes[i]-32,&zbuf[(long)i*codecMaxSize(maxsize)],&zsizes[i]);
+    clock_gettime(CLOCK_MONOTONIC,&t2);
+    tenc=(t2.tv_sec-t1.tv_sec)*1e6+(t2.tv_nsec-t1.tv_nsec)*1e-3;
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    for(i=0;i<nframes;i++){
+      if(codecDecode(&dec,used[i],frames[i][16],&zbuf[(long)i*codecMaxSize(maxsize)],zsizes[i],dbuf,sizes[i]-32)!=0 || memcmp(dbuf,&frames[i][32],sizes[i]-32)!=0)
+	bad++;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t2);
+    tdec=(t2.tv_sec-t1.tv_sec)*1e6+(t2.tv_nsec-t1.tv_nsec)*1e-3;
+    for(i=0;i<nframes;i++){
+      rawtot+=sizes[i]-32;
+      ztot+=zsizes[i]<sizes[i]-32?zsizes[i]:sizes[i]-32;//as would be sent.
+    }
+    printf("%-28s ratio %6.2f  encode %9.1fus  decode %9.1fus per frame%s\n",codecName(combos[c],name,64),ztot>0?(double)rawtot/ztot:0.,tenc/nframes,tdec/nframes,bad?"  DECODE MISMATCH":"");
+    codecFree(&enc);
+    codecFree(&dec);
+  }
+  for(i=0;i<nframes;i++)
+    free(frames[i]);
+  free(frames);
+  free(sizes);
+  free(zsizes);
+  free(used);
+  free(zbuf);
+  free(dbuf);
+  return 0;
+}
+
 int appendDataset(SendStruct *sstr, void *dataToSend, int size){
   Dataset *newDataset;
   Dataset *ptr=sstr->datasetList;
@@ -454,6 +595,7 @@ int loop(SendStruct *sstr){
   int readto=0;
   int wait;
   int size,nsent;
+  int overrun;
   void *dataToSend;
   //int checkDecimation;
   selectTimeout.tv_sec=0;
@@ -605,7 +747,26 @@ int loop(SendStruct *sstr){
 		err=0;
 		if(sstr->readpartial==0){//send everything.
 		  size=((int*)ret)[0]+4;
-		  dataToSend=ret;
+		  //copy it first, so that we don't send a frame that the rtc overwrites while we're sending it.
+		  if(copydatasize<size){
+		    if(copydata!=NULL)
+		      free(copydata);
+		    copydatasize=size;
+		    if((copydata=malloc(copydatasize))==NULL){
+		      printf("Error mallocing copydata in sender - closing socket\n");
+		      err=1;
+		      close(sstr->sock);
+		      sstr->sock=0;
+		      sstr->go=0;
+		      copydatasize=0;
+		      size=0;
+		    }
+		  }
+		  if(copydata!=NULL && err==0 && (overrun=circCopyFrame(sstr->cb,copydata,size))!=0){
+		    printf("Sending of %s overrun by %d frames - dropping frame (%d dropped so far)\n",sstr->fullname,overrun,sstr->cb->nOverrun);
+		    size=0;
+		  }
+		  dataToSend=copydata;
 		}else{//only sending a subset of the data.
 		  nel=(readto-sstr->readfrom)/sstr->readstep;
 		  switch(((char*)ret)[16]){
@@ -691,9 +852,17 @@ int loop(SendStruct *sstr){
 		  //and send...
 		  size=nel*elsize+32;
 		  dataToSend=copydata;
+		  if((overrun=circCheckFrame(sstr->cb))!=0){
+		    sstr->cb->nOverrun++;
+		    printf("Sending of %s overrun by %d frames - dropping frame (%d dropped so far)\n",sstr->fullname,overrun,sstr->cb->nOverrun);
+		    size=0;
+		  }
 		}
 		//Now send some data.
-		if(sstr->contig){
+		if(size!=0 && sstr->codecOffer!=0 && err==0)
+		  size=encodeFrame(sstr,(char*)dataToSend,size,(char**)&dataToSend);
+		if(size==0){//dropped.
+		}else if(sstr->contig){
 		  if(appendDataset(sstr,dataToSend,size)!=0){
 		    printf("Error appending contiguous data\n");
 		  }
@@ -781,6 +950,12 @@ int loop(SendStruct *sstr){
 	  err=0;
 	}else if(msg[0]==MSGCONTIG){//The receiver (client) wants a number of frames guaranteed to be contiguous.  Probably the network can't handle this, so we have to store up here...
 	  sstr->contig=msg[1];//equal to the number of frames for which contiguous delivery is required.
+	}else if(msg[0]==MSGCODEC){//The receiver has accepted compression, or wants a key frame.
+	  char name[64];
+	  sstr->codec=msg[1]&sstr->codecOffer;
+	  codecReset(&sstr->cs);
+	  printf("sender compressing %s with %s\n",sstr->fullname,codecName(sstr->codec,name,64));
+	  err=0;
 	}else{
 	  printf("Unknown message from sender: %d\n",msg[0]);
 	}
@@ -800,6 +975,8 @@ int loop(SendStruct *sstr){
   }
   if(copydata!=NULL)
     free(copydata);
+  codecFree(&sstr->cs);
+  free(sstr->zdata);
   return 0;
 }
 
@@ -928,6 +1105,15 @@ int main(int argc, char **argv){
       case 'q'://quiet - redirect output...
 	redirect=1;
 	break;
+      case 'z'://offer compression, e.g. -z or -zdelta,shuffle,rle
+	if((sstr->codecOffer=codecParse(&argv[i][2]))<0)
+	  return 1;
+	break;
+      case 'B'://benchmark the codecs on this many frames, then exit.
+	sstr->bench=atoi(&argv[i][2]);
+	if(sstr->bench<=0)
+	  sstr->bench=100;
+	break;
       default:
 	break;
       }
@@ -966,6 +1152,10 @@ int main(int argc, char **argv){
     }
   }
   openSHM(sstr);
+  if(sstr->bench){
+    benchmarkCodecs(sstr);
+    return 0;
+  }
   if(sstr->connect && sstr->host!=NULL){
     if((err=connectReceiver(sstr))!=0){
       printf("Couldn't connect\n");
@@ -68,6 +68,8 @@ typedef struct{
   void *data2;
   int dtypeAsData;
   int sumsquare;
+  void *frame;//copy of the frame being summed.
+  int frameSize;
 }SendStruct;
 
 int openSHMReader(SendStruct *sstr){
@@ -685,6 +687,7 @@ int loop(SendStruct *sstr){
   int diff;
   int cbfreq;
   int err=0;
+  int overrun;
   //struct timeval selectTimeout;
   int ihdrmsg[8];
   char *hdrmsg=(char*)ihdrmsg;
@@ -834,6 +837,20 @@ int loop(SendStruct *sstr){
 		circReshape(sstr->out2buf,(int)NDIM(sstr->cb),SHAPEARR(sstr->cb),sstr->dtype);
 	    }
 	  }
+	  //Copy the frame first, so that it can't be overwritten while we sum it.
+	  if(sstr->frameSize<sstr->cb->frameSize){
+	    if(sstr->frame!=NULL)free(sstr->frame);
+	    if((sstr->frame=malloc(sstr->cb->frameSize))==NULL){
+	      printf("Unable to malloc frame in summer.c\n");
+	      return 1;
+	    }
+	    sstr->frameSize=sstr->cb->frameSize;
+	  }
+	  if((overrun=circCopyFrame(sstr->cb,sstr->frame,sstr->frameSize))!=0){
+	    printf("Averaging of %s overrun by %d frames - skipping frame (%d skipped so far)\n",sstr->fullname,overrun,sstr->cb->nOverrun);
+	    continue;
+	  }
+	  ret=sstr->frame;
 	  //Now sum the data
 	  if(sstr->debug)
 	    printf("Summing %s\n",sstr->fullname);
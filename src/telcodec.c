@@ -0,0 +1,364 @@
+/*
+darc, the Durham Adaptive optics Real-time Controller.
+Copyright (C) 2010 Alastair Basden.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+Lossless telemetry frame compression, for sender and receiver.  See telcodec.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "telcodec.h"
+
+static const char *codecNames[4]={"delta","pack16","shuffle","rle"};
+
+int codecParse(char *str){
+  int codec=0,i,len;
+  char *s=str,*e;
+  if(str==NULL || *str=='\0')
+    return CODECDEFAULT;
+  while(*s!='\0'){
+    e=strchr(s,',');
+    len=(e==NULL)?strlen(s):e-s;
+    if(len==3 && strncmp(s,"all",3)==0)
+      codec|=CODECALL;
+    else if(len==4 && strncmp(s,"none",4)==0)
+      codec|=0;
+    else{
+      for(i=0;i<4;i++){
+	if(strlen(codecNames[i])==len && strncmp(s,codecNames[i],len)==0)
+	  break;
+      }
+      if(i==4){
+	printf("Unknown codec %.*s (use delta,pack16,shuffle,rle)\n",len,s);
+	return -1;
+      }
+      codec|=1<<i;
+    }
+    s+=len;
+    if(*s==',')
+      s++;
+  }
+  return codec;
+}
+
+char *codecName(int codec,char *buf,int n){
+  int i,pos=0;
+  buf[0]='\0';
+  for(i=0;i<4 && pos<n;i++){
+    if(codec&(1<<i))
+      pos+=snprintf(&buf[pos],n-pos,"%s%s",pos==0?"":",",codecNames[i]);
+  }
+  if(pos==0)
+    snprintf(buf,n,"none");
+  return buf;
+}
+
+int codecMaxSize(int nbytes){
+  return nbytes+nbytes/128+16;
+}
+
+static int codecElSize(char dtype){
+  switch(dtype){
+  case 'i':
+  case 'I':
+  case 'f':
+    return 4;
+  case 'l':
+  case 'L':
+  case 'd':
+  case 'q':
+    return 8;
+  case 'h':
+  case 'H':
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+static int codecIsFloat(char dtype){
+  return dtype=='f' || dtype=='d';
+}
+
+static int codecAlloc(codecState *cs,int nbytes){
+  int size=codecMaxSize(nbytes);
+  char *tmp;
+  int i;
+  if(cs->tmpSize<size){
+    for(i=0;i<2;i++){
+      if((tmp=realloc(cs->tmp[i],size))==NULL){
+	printf("telcodec: unable to allocate %d bytes\n",size);
+	return 1;
+      }
+      cs->tmp[i]=tmp;
+    }
+    cs->tmpSize=size;
+  }
+  return 0;
+}
+
+int codecKeep(codecState *cs,char *data,int nbytes){
+  char *tmp;
+  if(cs->prevSizeMem<nbytes){
+    if((tmp=realloc(cs->prev,nbytes))==NULL){
+      printf("telcodec: unable to allocate previous frame\n");
+      cs->prevSize=0;
+      return 1;
+    }
+    cs->prev=tmp;
+    cs->prevSizeMem=nbytes;
+  }
+  memcpy(cs->prev,data,nbytes);
+  cs->prevSize=nbytes;
+  return 0;
+}
+
+void codecReset(codecState *cs){
+  cs->prevSize=0;
+}
+
+void codecFree(codecState *cs){
+  free(cs->prev);
+  free(cs->tmp[0]);
+  free(cs->tmp[1]);
+  memset(cs,0,sizeof(codecState));
+}
+
+/*Frame to frame difference.  For integers, the difference is zigzag encoded (0,-1,1,-2,... to 0,1,2,3,...) so that small changes of either sign leave the high bits zero.  xor for floating point, so that it is lossless.*/
+#define DELTAENC(ut,st,bits) for(i=0;i<n;i++){st d=(st)(((ut*)in)[i]-((ut*)prev)[i]);((ut*)out)[i]=((ut)d<<1)^(ut)(d>>(bits-1));}
+#define DELTADEC(ut,st) for(i=0;i<n;i++){ut z=((ut*)in)[i];((ut*)out)[i]=((ut*)prev)[i]+((z>>1)^(ut)(-(st)(z&1)));}
+static void codecDelta(char *in,char *prev,char *out,int n,int el,int isfloat,int encode){
+  int i;
+  if(isfloat){
+    if(el==4){
+      for(i=0;i<n;i++)
+	((uint32_t*)out)[i]=((uint32_t*)in)[i]^((uint32_t*)prev)[i];
+    }else{
+      for(i=0;i<n;i++)
+	((uint64_t*)out)[i]=((uint64_t*)in)[i]^((uint64_t*)prev)[i];
+    }
+    return;
+  }
+  switch(el){
+  case 1:
+    if(encode){DELTAENC(uint8_t,int8_t,8)}else{DELTADEC(uint8_t,int8_t)}
+    break;
+  case 2:
+    if(encode){DELTAENC(uint16_t,int16_t,16)}else{DELTADEC(uint16_t,int16_t)}
+    break;
+  case 4:
+    if(encode){DELTAENC(uint32_t,int32_t,32)}else{DELTADEC(uint32_t,int32_t)}
+    break;
+  case 8:
+    if(encode){DELTAENC(uint64_t,int64_t,64)}else{DELTADEC(uint64_t,int64_t)}
+    break;
+  }
+}
+
+static int codecFits16(int32_t *in,int n){
+  int i;
+  for(i=0;i<n;i++){
+    if(in[i]<-32768 || in[i]>32767)
+      return 0;
+  }
+  return 1;
+}
+
+/*Transpose an 8x8 bit matrix (one byte per row).  Its own inverse.*/
+static inline uint64_t codecTranspose8(uint64_t x){
+  uint64_t t;
+  t=(x^(x>>7))&0x00AA00AA00AA00AAULL;
+  x=x^t^(t<<7);
+  t=(x^(x>>14))&0x0000CCCC0000CCCCULL;
+  x=x^t^(t<<14);
+  t=(x^(x>>28))&0x00000000F0F0F0F0ULL;
+  x=x^t^(t<<28);
+  return x;
+}
+
+/*Bitshuffle n elements of el bytes: for each byte of the element, 8 bit planes of n/8 bytes.  Any remaining (n%8) elements are copied at the end.  dir is 1 to shuffle, -1 to unshuffle.*/
+static void codecShuffle(unsigned char *in,unsigned char *out,int n,int el,int dir){
+  int nb=n/8;
+  int i,j,b,k;
+  uint64_t x;
+  for(j=0;j<nb;j++){
+    for(b=0;b<el;b++){
+      x=0;
+      if(dir>0){
+	for(i=0;i<8;i++)
+	  x|=(uint64_t)in[(j*8+i)*el+b]<<(8*i);
+	x=codecTranspose8(x);
+	for(k=0;k<8;k++)
+	  out[(b*8+k)*nb+j]=(unsigned char)(x>>(8*k));
+      }else{
+	for(k=0;k<8;k++)
+	  x|=(uint64_t)in[(b*8+k)*nb+j]<<(8*k);
+	x=codecTranspose8(x);
+	for(i=0;i<8;i++)
+	  out[(j*8+i)*el+b]=(unsigned char)(x>>(8*i));
+      }
+    }
+  }
+  memcpy(&out[nb*8*el],&in[nb*8*el],(n-nb*8)*el);
+}
+
+/*Zero run length encoding.  Tokens: 0-127: that+1 literal bytes follow.  128-254: a run of (token&127)+1 zeros.  255: a run of zeros, with the int32 length following.*/
+static int codecRle(unsigned char *in,int n,unsigned char *out){
+  int i=0,o=0,run,lit;
+  while(i<n){
+    for(run=0;i+run<n && in[i+run]==0;run++);
+    if(run>=3 || (run>0 && i+run==n)){
+      if(run<=127)
+	out[o++]=0x80|(run-1);
+      else{
+	out[o++]=0xff;
+	memcpy(&out[o],&run,sizeof(int));
+	o+=sizeof(int);
+      }
+      i+=run;
+    }else{
+      for(lit=0;i+lit<n && lit<128;lit++){
+	if(i+lit+2<n && in[i+lit]==0 && in[i+lit+1]==0 && in[i+lit+2]==0)
+	  break;
+      }
+      out[o++]=lit-1;
+      memcpy(&out[o],&in[i],lit);
+      o+=lit;
+      i+=lit;
+    }
+  }
+  return o;
+}
+
+static int codecUnRle(unsigned char *in,int n,unsigned char *out,int outsize){
+  int i=0,o=0,t,c;
+  while(i<n){
+    t=in[i++];
+    if(t<0x80){
+      c=t+1;
+      if(i+c>n || o+c>outsize)
+	return 1;
+      memcpy(&out[o],&in[i],c);
+      i+=c;
+    }else{
+      if(t==0xff){
+	if(i+sizeof(int)>n)
+	  return 1;
+	memcpy(&c,&in[i],sizeof(int));
+	i+=sizeof(int);
+      }else
+	c=(t&0x7f)+1;
+      if(c<0 || o+c>outsize)
+	return 1;
+      memset(&out[o],0,c);
+    }
+    o+=c;
+  }
+  return o!=outsize;
+}
+
+int codecEncode(codecState *cs,int codec,char dtype,char *data,int nbytes,char *out,int *outsize){
+  int el=codecElSize(dtype);
+  int isfloat=codecIsFloat(dtype);
+  int used=0,t=0,n,size=nbytes,i;
+  char *cur=data;
+  if(nbytes%el!=0){
+    el=1;
+    isfloat=0;
+  }
+  n=nbytes/el;
+  if(codecAlloc(cs,nbytes)){//send it raw - and keep it, as the receiver will, so that the next delta matches.
+    codecKeep(cs,data,nbytes);
+    memcpy(out,data,nbytes);
+    *outsize=nbytes;
+    return 0;
+  }
+  if((codec&CODECDELTA) && cs->prevSize==nbytes){
+    codecDelta(cur,cs->prev,cs->tmp[t],n,el,isfloat,1);
+    cur=cs->tmp[t];
+    t=1-t;
+    used|=CODECDELTA;
+  }
+  codecKeep(cs,data,nbytes);
+  if((codec&CODECPACK16) && el==4 && !isfloat && codecFits16((int32_t*)cur,n)){
+    for(i=0;i<n;i++)
+      ((int16_t*)cs->tmp[t])[i]=(int16_t)((int32_t*)cur)[i];
+    cur=cs->tmp[t];
+    t=1-t;
+    el=2;
+    size=n*2;
+    used|=CODECPACK16;
+  }
+  if((codec&CODECSHUFFLE) && n>=8){
+    codecShuffle((unsigned char*)cur,(unsigned char*)cs->tmp[t],n,el,1);
+    cur=cs->tmp[t];
+    t=1-t;
+    used|=CODECSHUFFLE;
+  }
+  if(codec&CODECRLE){
+    *outsize=codecRle((unsigned char*)cur,size,(unsigned char*)out);
+    used|=CODECRLE;
+  }else{
+    memcpy(out,cur,size);
+    *outsize=size;
+  }
+  return used;
+}
+
+int codecDecode(codecState *cs,int codec,char dtype,char *in,int insize,char *data,int nbytes){
+  int el=codecElSize(dtype);
+  int isfloat=codecIsFloat(dtype);
+  int t=0,n,size,i;
+  char *cur=in;
+  if(nbytes%el!=0){
+    el=1;
+    isfloat=0;
+  }
+  n=nbytes/el;
+  if((codec&CODECPACK16) && (el!=4 || isfloat))
+    return 1;
+  if((codec&CODECDELTA) && cs->prevSize!=nbytes)//lost the previous frame
+    return 1;
+  if(codecAlloc(cs,nbytes))
+    return 1;
+  size=(codec&CODECPACK16)?n*2:nbytes;
+  if(codec&CODECRLE){
+    if(codecUnRle((unsigned char*)cur,insize,(unsigned char*)cs->tmp[t],size))
+      return 1;
+    cur=cs->tmp[t];
+    t=1-t;
+  }else if(insize!=size)
+    return 1;
+  if(codec&CODECSHUFFLE){
+    codecShuffle((unsigned char*)cur,(unsigned char*)cs->tmp[t],n,(codec&CODECPACK16)?2:el,-1);
+    cur=cs->tmp[t];
+    t=1-t;
+  }
+  if(codec&CODECPACK16){
+    for(i=0;i<n;i++)
+      ((int32_t*)cs->tmp[t])[i]=((int16_t*)cur)[i];
+    cur=cs->tmp[t];
+    t=1-t;
+  }
+  if(codec&CODECDELTA)
+    codecDelta(cur,cs->prev,data,n,el,isfloat,0);
+  else
+    memcpy(data,cur,nbytes);
+  codecKeep(cs,data,nbytes);
+  return 0;
+}